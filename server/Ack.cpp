@@ -6,13 +6,13 @@
 
 #include "Ack.h"
 #include "HelpFunctions.h"
+#include "Metrics.h"
+#include "Trace.h"
 #include "config.h"
 #include <cstring>
 
-#define htonll(x) ((1==htonl(1)) ? (x) : ((uint64_t)htonl((x) & 0xFFFFFFFF) << 32) | htonl((x) >> 32))
-#define ntohll(x) ((1==ntohl(1)) ? (x) : ((uint64_t)ntohl((x) & 0xFFFFFFFF) << 32) | ntohl((x) >> 32))
-
-Ack::Ack(char *aBuf, PRIntervalTime aRecv, int aLargeAck, uint64_t aRate)
+Ack::Ack(char *aBuf, ClockTime aRecv, int aLargeAck, uint64_t aRate)
+  : mRecv(aRecv)
 {
   if (aLargeAck) {
     if (aLargeAck < 512) {
@@ -32,7 +32,7 @@ Ack::Ack(char *aBuf, PRIntervalTime aRecv, int aLargeAck, uint64_t aRate)
     uint64_t rate = htonll(aRate);
     memcpy(mBuf + RATE_RECEIVING_PKT_START, &rate, RATE_RECEIVING_PKT_LEN);
   }
-  uint32_t usec = htonl(PR_IntervalToMilliseconds(aRecv));
+  uint32_t usec = htonl(ClockToMilliseconds(aRecv));
   memcpy(mBuf + TIMESTAMP_RECEIVED_START, &usec, TIMESTAMP_RECEIVED_LEN);
 }
 
@@ -43,6 +43,7 @@ Ack::~Ack()
 
 Ack::Ack(const Ack &other)
 {
+  mRecv = other.mRecv;
   mBufLen = other.mBufLen;
   mBuf = new char[mBufLen];
   memcpy(mBuf, other.mBuf, mBufLen);
@@ -52,6 +53,7 @@ Ack&
 Ack::operator= (const Ack &other)
 {
   if (this != &other) {
+    mRecv = other.mRecv;
     mBufLen = other.mBufLen;
     delete []mBuf;
     mBuf = new char[mBufLen];
@@ -63,7 +65,8 @@ Ack::operator= (const Ack &other)
 int
 Ack::SendPkt(PRFileDesc *aFd, PRNetAddr *aNetAddr)
 {
-  uint32_t usec = htonl(PR_IntervalToMilliseconds(PR_IntervalNow()));
+  ClockTime now = ClockNow();
+  uint32_t usec = htonl(ClockToMilliseconds(now));
   memcpy(mBuf + TIMESTAMP_ACK_SENT_START, &usec, TIMESTAMP_ACK_SENT_LEN);
   int write = PR_SendTo(aFd, mBuf, mBufLen, 0, aNetAddr,
                         PR_INTERVAL_NO_WAIT);
@@ -74,5 +77,8 @@ Ack::SendPkt(PRFileDesc *aFd, PRNetAddr *aNetAddr)
     }
     return LogErrorWithCode(code, "UDP");
   }
+  METRICS_ADD(mPktsSent, 1);
+  METRICS_ADD(mBytesSent, write);
+  TRACE4(ack_send, aNetAddr, PktId(), now - mRecv, write);
   return 0;
 }
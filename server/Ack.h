@@ -8,6 +8,8 @@
 #define ACK_STRUCTURE_H__
 
 #include "prio.h"
+#include "Clock.h"
+#include <cstring>
 
 
 extern int pktIdStart;
@@ -24,17 +26,27 @@ extern int rateLen;
 class Ack
 {
 public:
-  Ack(char *aBuf, PRIntervalTime aRecv, int aLargeAck, uint64_t aRate);
+  Ack(char *aBuf, ClockTime aRecv, int aLargeAck, uint64_t aRate);
   ~Ack();
   Ack(const Ack &other);
   Ack& operator= (const Ack &other);
   int SendPkt(PRFileDesc *aFd, PRNetAddr *aNetAddr);
 
 private:
+  // As the client wrote it.
+  uint32_t PktId() const
+  {
+    uint32_t pktId;
+    memcpy(&pktId, mBuf, sizeof(pktId));
+    return pktId;
+  }
+
   // Ack pkt structure: 32 bit packet id, copied timestamp, time between
   // receiving a packet and sending the ack in milliseconds.
   char *mBuf;
   int mBufLen;
+  // When the acked packet was received.
+  ClockTime mRecv;
 };
 
 #endif
@@ -0,0 +1,464 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * Microbenchmarks for the per packet paths of the server.
+ *
+ * Run them with bench/run, which compares the results with the stored
+ * baseline (bench/baseline.json) and reports the benchmarks that got slower.
+ */
+
+#include "Ack.h"
+#include "ClientPool.h"
+#include "ClientSocket.h"
+#include "Clock.h"
+#include "CpuCost.h"
+#include "FileWriter.h"
+#include "HelpFunctions.h"
+#include "LossTracker.h"
+#include "ResultsStore.h"
+#include "config.h"
+#include "prlog.h"
+#include "prnetdb.h"
+#include "prinrval.h"
+#include "prrng.h"
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <stdlib.h>
+#include <vector>
+
+PRLogModuleInfo* gServerTestLog = PR_NewLogModule("NetworkTestServer");
+
+#define BENCH_ACK_SIZE (PKT_ID_LEN + TIMESTAMP_LEN + TIMESTAMP_RECEIVED_LEN + \
+                        TIMESTAMP_ACK_SENT_LEN)
+
+class ClientSocketBench
+{
+public:
+  static void FormatDataPkt(ClientSocket *aClient, uint32_t aTS)
+  {
+    aClient->FormatDataPkt(aTS);
+    aClient->mNextPktId++;
+  }
+  static uint32_t ReadACKPktAndLog(ClientSocket *aClient, char *aBuf,
+                                   uint32_t aTS)
+  {
+    return aClient->ReadACKPktAndLog(aBuf, aTS);
+  }
+};
+
+// A UDP socket connected to a bound loopback socket nobody reads from.
+class LoopbackSink
+{
+public:
+  LoopbackSink()
+  {
+    mRecvFd = PR_OpenUDPSocket(PR_AF_INET);
+    PR_SetNetAddr(PR_IpAddrLoopback, PR_AF_INET, 0, &mAddr);
+    PR_Bind(mRecvFd, &mAddr);
+    PR_GetSockName(mRecvFd, &mAddr);
+
+    mFd = PR_OpenUDPSocket(PR_AF_INET);
+    PRSocketOptionData opt;
+    opt.option = PR_SockOpt_Nonblocking;
+    opt.value.non_blocking = true;
+    PR_SetSocketOption(mFd, &opt);
+  }
+  ~LoopbackSink()
+  {
+    PR_Close(mFd);
+    PR_Close(mRecvFd);
+  }
+
+  PRFileDesc *mFd;
+  PRFileDesc *mRecvFd;
+  PRNetAddr mAddr;
+};
+
+static void
+FormatFirstPkt(char *aBuf, uint32_t aPktId, const char *aType, uint64_t aRate,
+               const char *aFileName)
+{
+  memset(aBuf, 0, PAYLOADSIZE);
+  uint32_t id = htonl(aPktId);
+  memcpy(aBuf + PKT_ID_START, &id, PKT_ID_LEN);
+  memcpy(aBuf + TYPE_START, aType, TYPE_LEN);
+  uint64_t rate = htonll(aRate);
+  memcpy(aBuf + RATE_TO_SEND_START, &rate, RATE_TO_SEND_LEN);
+  strncpy(aBuf + FILE_NAME_START, aFileName, FILE_NAME_LEN - 1);
+}
+
+static void
+BM_AckConstruct(benchmark::State &state)
+{
+  char buf[PAYLOADSIZE];
+  memset(buf, 0, sizeof(buf));
+  ClockTime now = ClockNow();
+  for (auto _ : state) {
+    Ack ack(buf, now, 0, state.range(0));
+    benchmark::DoNotOptimize(&ack);
+  }
+}
+BENCHMARK(BM_AckConstruct)->Arg(0)->Arg(1000);
+
+static void
+BM_AckSendPkt(benchmark::State &state)
+{
+  LoopbackSink sink;
+  char buf[PAYLOADSIZE];
+  memset(buf, 0, sizeof(buf));
+  Ack ack(buf, ClockNow(), 0, 0);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ack.SendPkt(sink.mFd, &sink.mAddr));
+  }
+}
+BENCHMARK(BM_AckSendPkt);
+
+static void
+BM_FormatDataPkt(benchmark::State &state)
+{
+  PRNetAddr addr;
+  PR_SetNetAddr(PR_IpAddrLoopback, PR_AF_INET, 1, &addr);
+  ClientPool pool;
+  pool.Init(1);
+  ClientSocket &client = *pool.Get(&addr);
+  uint32_t ts = 0;
+  for (auto _ : state) {
+    ClientSocketBench::FormatDataPkt(&client, ts++);
+  }
+}
+BENCHMARK(BM_FormatDataPkt);
+
+static void
+BM_ReadACKPktAndLog(benchmark::State &state)
+{
+  PRNetAddr addr;
+  PR_SetNetAddr(PR_IpAddrLoopback, PR_AF_INET, 1, &addr);
+  ClientPool pool;
+  pool.Init(1);
+  ClientSocket &client = *pool.Get(&addr);
+  char first[PAYLOADSIZE];
+  FormatFirstPkt(first, 1, UDP_performanceFromServerToClient, 1000,
+                 "bench_readack");
+  client.NewPkt(PAYLOADSIZE, first, -1);
+
+  char ack[BENCH_ACK_SIZE];
+  memset(ack, 0, sizeof(ack));
+  uint32_t ts = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+      ClientSocketBench::ReadACKPktAndLog(&client, ack, ts++));
+  }
+}
+BENCHMARK(BM_ReadACKPktAndLog);
+
+// NewPkt for the packets a test receives after the first one, plus sending
+// the resulting ACKs where the test has any.
+static void
+BM_NewPkt(benchmark::State &state)
+{
+  int testType = state.range(0);
+  LoopbackSink sink;
+  PRNetAddr addr;
+  PR_SetNetAddr(PR_IpAddrLoopback, PR_AF_INET, 1, &addr);
+  ClientPool pool;
+  pool.Init(1);
+  ClientSocket &client = *pool.Get(&addr);
+
+  char first[PAYLOADSIZE];
+  char pkt[PAYLOADSIZE];
+  memset(pkt, 0, sizeof(pkt));
+  int pktLen = PAYLOADSIZE;
+  switch (testType) {
+    case 1:
+      // Every packet is a duplicate of the first packet.
+      FormatFirstPkt(first, 1, UDP_reachability, 0, "");
+      memcpy(pkt, first, sizeof(pkt));
+      pktLen = 512;
+      break;
+    case 5:
+      FormatFirstPkt(first, 1, UDP_performanceFromServerToClient, 1000,
+                     "bench_newpkt5");
+      pktLen = BENCH_ACK_SIZE;
+      break;
+    case 6:
+      FormatFirstPkt(first, 1, UDP_performanceFromClientToServer, 0, "");
+      break;
+  }
+  client.NewPkt(PAYLOADSIZE, first, -1);
+  client.SendAcks(sink.mFd);
+
+  for (auto _ : state) {
+    client.NewPkt(pktLen, pkt, -1);
+    client.SendAcks(sink.mFd);
+  }
+  state.SetLabel(testType == 1 ? "Test_1" : testType == 5 ? "Test_5" : "Test_6");
+}
+BENCHMARK(BM_NewPkt)->Arg(1)->Arg(5)->Arg(6);
+
+static FileWriter *sContendedWriter;
+
+static void
+FileWriterSetup(const benchmark::State &state)
+{
+  ResultsStoreInit(TMP_DIRECTORY, RESULTS_SEGMENT_SIZE);
+  sContendedWriter = new FileWriter();
+  char fileName[FILE_NAME_LEN];
+  memset(fileName, 0, sizeof(fileName));
+  strncpy(fileName, "bench_filewriter", FILE_NAME_LEN - 1);
+  sContendedWriter->Init(fileName);
+}
+
+static void
+FileWriterTeardown(const benchmark::State &state)
+{
+  delete sContendedWriter;
+  sContendedWriter = nullptr;
+}
+
+static void
+BM_FileWriterNonBlocking(benchmark::State &state)
+{
+  char line[] = "123456789 SEND 123456 123456789\n";
+  for (auto _ : state) {
+    sContendedWriter->WriteNonBlocking(line, sizeof(line) - 1);
+  }
+  state.SetBytesProcessed(state.iterations() * (sizeof(line) - 1));
+}
+BENCHMARK(BM_FileWriterNonBlocking)->Setup(FileWriterSetup)
+  ->Teardown(FileWriterTeardown)->ThreadRange(1, 8)->UseRealTime();
+
+static void
+BM_FileWriterBlocking(benchmark::State &state)
+{
+  char line[] = "123456789 ACK 123456 123456789 123456789 123456789\n";
+  for (auto _ : state) {
+    sContendedWriter->WriteBlocking(line, sizeof(line) - 1);
+  }
+  state.SetBytesProcessed(state.iterations() * (sizeof(line) - 1));
+}
+BENCHMARK(BM_FileWriterBlocking)->Setup(FileWriterSetup)
+  ->Teardown(FileWriterTeardown)->ThreadRange(1, 8)->UseRealTime();
+
+// The lookup UDPSocketThread does for every received packet.
+static void
+BM_ClientLookup(benchmark::State &state)
+{
+  int numClients = state.range(0);
+  ClientPool pool;
+  pool.Init(numClients);
+  std::vector<ClientSocket*> clients;
+  for (int inx = 0; inx < numClients; inx++) {
+    PRNetAddr addr;
+    PR_SetNetAddr(PR_IpAddrLoopback, PR_AF_INET, 1024 + inx, &addr);
+    clients.push_back(pool.Get(&addr));
+  }
+
+  int inx = 0;
+  for (auto _ : state) {
+    PRNetAddr addr;
+    PR_SetNetAddr(PR_IpAddrLoopback, PR_AF_INET, 1024 + inx, &addr);
+    std::vector<ClientSocket*>::iterator it = clients.begin();
+    while (it != clients.end() && !(*it)->IsThisSocket(&addr)) {
+      it++;
+    }
+    benchmark::DoNotOptimize(it);
+    inx = (inx + 1) % numClients;
+  }
+
+  for (size_t i = 0; i < clients.size(); i++) {
+    pool.Put(clients[i]);
+  }
+}
+BENCHMARK(BM_ClientLookup)->RangeMultiplier(4)->Range(1, 4096);
+
+// Taking a client for a new peer and giving it back: a slot of the pool
+// against a heap allocated client with its own payload buffer.
+static void
+BM_ClientNewDelete(benchmark::State &state)
+{
+  PRNetAddr addr;
+  PR_SetNetAddr(PR_IpAddrLoopback, PR_AF_INET, 1, &addr);
+  for (auto _ : state) {
+    ClientSocket *client = new ClientSocket();
+    std::vector<char> payload(PAYLOADSIZE_MAX);
+    PR_GetRandomNoise(payload.data(), payload.size());
+    client->Start(&addr, payload.data(), PAYLOADSIZE_MAX);
+    client->Stop();
+    delete client;
+  }
+  state.SetLabel(std::to_string(sizeof(ClientSocket)) + " B/client");
+}
+BENCHMARK(BM_ClientNewDelete);
+
+static void
+BM_ClientPoolGetPut(benchmark::State &state)
+{
+  ClientPool pool;
+  pool.Init(CLIENT_POOL_DEFAULT_SLOTS);
+  PRNetAddr addr;
+  PR_SetNetAddr(PR_IpAddrLoopback, PR_AF_INET, 1, &addr);
+  for (auto _ : state) {
+    pool.Put(pool.Get(&addr));
+  }
+  state.SetLabel(std::to_string(pool.PoolBytes() / pool.Slots()) +
+                 " B/client");
+}
+BENCHMARK(BM_ClientPoolGetPut);
+
+// LossTracker per packet cost. Arg 0 is in order delivery, arg 1 loses one
+// packet in 50 and swaps neighbours every 20 packets.
+static void
+BM_LossTracker(benchmark::State &state)
+{
+  bool impaired = state.range(0);
+  LossTracker tracker;
+  tracker.Reset(1000);
+  uint32_t pktId = 1000;
+  for (auto _ : state) {
+    uint32_t id = pktId++;
+    if (impaired) {
+      if (id % 50 == 0) {
+        continue;
+      }
+      if (id % 20 == 0) {
+        id++;
+      } else if (id % 20 == 1) {
+        id--;
+      }
+    }
+    benchmark::DoNotOptimize(tracker.Received(id));
+  }
+  state.SetLabel(impaired ? "loss+reorder" : "in order");
+}
+BENCHMARK(BM_LossTracker)->Arg(0)->Arg(1);
+
+// The UDP worker switches the CPU cost account around every client it
+// handles: two switches per client and round, and a sample every
+// CPU_COST_SAMPLE_NS.
+static void
+BM_CpuCostCharge(benchmark::State &state)
+{
+  CpuCostThreadInit();
+  CpuCost cost;
+  cost.mTestType = 5;
+  for (auto _ : state) {
+    CpuCostCharge(&cost);
+    CpuCostCharge(nullptr);
+  }
+  CpuCostThreadShutdown();
+  benchmark::DoNotOptimize(cost.mCounters[CPU_COST_WALL_NS]);
+}
+BENCHMARK(BM_CpuCostCharge);
+
+// Cost of one clock read. RunTestSend reads the clock several times per
+// packet.
+static void
+BM_ClockNow(benchmark::State &state)
+{
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ClockNow());
+  }
+  state.SetLabel(ClockSource());
+}
+BENCHMARK(BM_ClockNow);
+
+static void
+BM_ClockMonotonicRaw(benchmark::State &state)
+{
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ClockMonotonicRaw());
+  }
+}
+BENCHMARK(BM_ClockMonotonicRaw);
+
+static void
+BM_PRIntervalNow(benchmark::State &state)
+{
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(PR_IntervalNow());
+  }
+}
+BENCHMARK(BM_PRIntervalNow);
+
+// A clock read plus the conversion to the millisecond timestamps that go
+// into packets and logs.
+static void
+BM_ClockNowToMilliseconds(benchmark::State &state)
+{
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ClockToMilliseconds(ClockNow()));
+  }
+}
+BENCHMARK(BM_ClockNowToMilliseconds);
+
+static void
+BM_PRIntervalNowToMilliseconds(benchmark::State &state)
+{
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(PR_IntervalToMilliseconds(PR_IntervalNow()));
+  }
+}
+BENCHMARK(BM_PRIntervalNowToMilliseconds);
+
+// Pacing jitter: busy wait for the next send time of a packet train with
+// state.range(0) us between packets, the way RunTestSend decides when to
+// send, and measure with CLOCK_MONOTONIC_RAW how far the sends are from
+// their schedule (early or late). Arg 1 paces with ClockNow(), arg 0 with the
+// NSPR interval clock.
+static void
+BM_PacingJitter(benchmark::State &state)
+{
+  uint64_t gapNs = state.range(0) * CLOCK_NS_PER_US;
+  bool useClock = state.range(1);
+  std::vector<int64_t> deviation;
+  deviation.reserve(state.max_iterations);
+
+  ClockTime startRaw = ClockMonotonicRaw();
+  ClockTime start = ClockNow();
+  PRIntervalTime startInterval = PR_IntervalNow();
+  uint64_t pkt = 0;
+  for (auto _ : state) {
+    pkt++;
+    if (useClock) {
+      ClockTime next = start + pkt * gapNs;
+      while (ClockNow() < next) {}
+    } else {
+      PRIntervalTime next = startInterval +
+        PR_MicrosecondsToInterval(pkt * gapNs / CLOCK_NS_PER_US);
+      while ((PRInt32)(PR_IntervalNow() - next) < 0) {}
+    }
+    deviation.push_back(llabs((int64_t)(ClockMonotonicRaw() - startRaw) -
+                             (int64_t)(pkt * gapNs)));
+  }
+
+  if (deviation.empty()) {
+    return;
+  }
+  std::sort(deviation.begin(), deviation.end());
+  size_t n = deviation.size();
+  state.counters["p50_us"] = deviation[n / 2] / 1000.0;
+  state.counters["p99_us"] = deviation[n * 99 / 100] / 1000.0;
+  state.counters["max_us"] = deviation[n - 1] / 1000.0;
+  state.SetLabel(useClock ? ClockSource() : "PR_IntervalNow");
+}
+BENCHMARK(BM_PacingJitter)->Args({100, 0})->Args({100, 1})
+  ->Args({1000, 0})->Args({1000, 1})->Iterations(2000)->UseRealTime();
+
+int
+main(int argc, char **argv)
+{
+  ClockInit();
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
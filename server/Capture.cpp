@@ -0,0 +1,96 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Capture.h"
+#include "HelpFunctions.h"
+#include "prlog.h"
+
+extern PRLogModuleInfo* gServerTestLog;
+#define LOG(args) PR_LOG(gServerTestLog, PR_LOG_DEBUG, args)
+
+CaptureRing::CaptureRing()
+  : mFd(nullptr)
+  , mMap(nullptr)
+  , mBase(nullptr)
+  , mSize(0)
+  , mHeader(nullptr)
+{
+}
+
+CaptureRing::~CaptureRing()
+{
+  if (mBase) {
+    PR_SyncMemMap(mFd, mBase, mSize);
+    PR_MemUnmap(mBase, mSize);
+  }
+  if (mMap) {
+    PR_CloseFileMap(mMap);
+  }
+  if (mFd) {
+    PR_Close(mFd);
+  }
+}
+
+int
+CaptureRing::Init(const char *aFileName, uint16_t aPort, uint64_t aSlots,
+                  bool aWrite)
+{
+  if (aWrite) {
+    mFd = PR_Open(aFileName, PR_CREATE_FILE | PR_RDWR | PR_TRUNCATE, 0644);
+    if (!mFd) {
+      return LogError("Capture");
+    }
+    uint64_t size = CAPTURE_HEADER_SIZE + aSlots * sizeof(CaptureRecord);
+    if (!aSlots || size > PR_UINT32_MAX) {
+      LOG(("NetworkTest capture: Bad number of slots %llu", aSlots));
+      return -1;
+    }
+    mSize = size;
+  } else {
+    mFd = PR_Open(aFileName, PR_RDONLY, 0);
+    if (!mFd) {
+      return LogError("Capture");
+    }
+    PRFileInfo64 info;
+    if (PR_GetOpenFileInfo64(mFd, &info) != PR_SUCCESS) {
+      return LogError("Capture");
+    }
+    if (info.size < CAPTURE_HEADER_SIZE || info.size > PR_UINT32_MAX) {
+      LOG(("NetworkTest capture: %s is not a capture file", aFileName));
+      return -1;
+    }
+    mSize = info.size;
+  }
+
+  mMap = PR_CreateFileMap(mFd, mSize,
+                          aWrite ? PR_PROT_READWRITE : PR_PROT_READONLY);
+  if (!mMap) {
+    return LogError("Capture");
+  }
+  mBase = (char*)PR_MemMap(mMap, 0, mSize);
+  if (!mBase) {
+    return LogError("Capture");
+  }
+  mHeader = (CaptureHeader*)mBase;
+
+  if (aWrite) {
+    memset(mHeader, 0, sizeof(CaptureHeader));
+    memcpy(mHeader->mMagic, CAPTURE_MAGIC, sizeof(mHeader->mMagic));
+    mHeader->mSlotSize = sizeof(CaptureRecord);
+    mHeader->mSnapLen = CAPTURE_SNAP_LEN;
+    mHeader->mSlots = aSlots;
+    mHeader->mPort = aPort;
+    LOG(("NetworkTest capture: Recording port %d into %s, %llu slots.", aPort,
+         aFileName, aSlots));
+  } else if ((memcmp(mHeader->mMagic, CAPTURE_MAGIC, sizeof(mHeader->mMagic))) ||
+             (mHeader->mSlotSize != sizeof(CaptureRecord)) ||
+             (CAPTURE_HEADER_SIZE + mHeader->mSlots * sizeof(CaptureRecord) >
+              mSize)) {
+    LOG(("NetworkTest capture: %s is not a capture file", aFileName));
+    return -1;
+  }
+  return 0;
+}
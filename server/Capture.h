@@ -0,0 +1,97 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NETWORK_TESTS_CAPTURE_H__
+#define NETWORK_TESTS_CAPTURE_H__
+
+#include "prio.h"
+#include "prnetdb.h"
+#include "prtime.h"
+#include <cstring>
+
+/**
+ * Capture of the datagrams a UDP port thread receives.
+ *
+ * The capture file is a memory mapped ring of fixed size slots, so recording a
+ * packet is a memcpy and never a system call. When the ring is full the oldest
+ * records are overwritten. Only the first CAPTURE_SNAP_LEN bytes of a packet
+ * are kept (enough for every header in config.h); the original length is
+ * stored so a replay can send packets of the original size.
+ *
+ * File layout:
+ *  |__ CAPTURE_HEADER_SIZE __|__ slot 0 __|__ slot 1 __| ...
+ *  slot: |___8B___|___4B___|___2B___|___2B___|___ CAPTURE_SNAP_LEN ___|
+ *        |time(us)|  addr  |  port  | length |        data           |
+ */
+
+#define CAPTURE_MAGIC "NTCAPT1"
+#define CAPTURE_HEADER_SIZE 4096
+#define CAPTURE_SNAP_LEN 112
+#define CAPTURE_SLOTS (1 << 18)
+
+struct CaptureHeader
+{
+  char mMagic[8];
+  uint32_t mSlotSize;
+  uint32_t mSnapLen;
+  uint64_t mSlots;
+  // Number of records written since the capture started.
+  uint64_t mHead;
+  uint16_t mPort;
+};
+
+struct CaptureRecord
+{
+  // PR_Now() in microseconds.
+  int64_t mTime;
+  // Address and port in network byte order.
+  uint32_t mAddr;
+  uint16_t mPort;
+  uint16_t mLen;
+  char mData[CAPTURE_SNAP_LEN];
+};
+
+class CaptureRing
+{
+public:
+  CaptureRing();
+  ~CaptureRing();
+  int Init(const char *aFileName, uint16_t aPort, uint64_t aSlots, bool aWrite);
+  void Record(const PRNetAddr *aAddr, const char *aBuf, int32_t aCount)
+  {
+    CaptureRecord *rec = Slot(mHeader->mHead);
+    rec->mTime = PR_Now();
+    rec->mAddr = aAddr->inet.ip;
+    rec->mPort = aAddr->inet.port;
+    rec->mLen = aCount;
+    memcpy(rec->mData, aBuf,
+           aCount < CAPTURE_SNAP_LEN ? aCount : CAPTURE_SNAP_LEN);
+    mHeader->mHead++;
+  }
+
+  // Reading: records First() ... Head() - 1 are valid.
+  uint64_t First()
+  {
+    return (mHeader->mHead > mHeader->mSlots) ?
+           mHeader->mHead - mHeader->mSlots : 0;
+  }
+  uint64_t Head() { return mHeader->mHead; }
+  uint16_t Port() { return mHeader->mPort; }
+  CaptureRecord* Slot(uint64_t aInx)
+  {
+    return (CaptureRecord*)(mBase + CAPTURE_HEADER_SIZE +
+                            (aInx % mHeader->mSlots) * sizeof(CaptureRecord));
+  }
+
+private:
+  PRFileDesc *mFd;
+  PRFileMap *mMap;
+  char *mBase;
+  uint32_t mSize;
+  CaptureHeader *mHeader;
+};
+
+#endif
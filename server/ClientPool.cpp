@@ -0,0 +1,57 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "ClientPool.h"
+#include "prrng.h"
+
+ClientPool::ClientPool()
+  : mClients(nullptr)
+  , mSlots(0)
+  , mMaxPayloadSize(PAYLOADSIZE_MAX)
+{
+}
+
+ClientPool::~ClientPool()
+{
+  delete [] mClients;
+}
+
+int
+ClientPool::Init(uint32_t aSlots)
+{
+  if (mClients || !aSlots) {
+    return -1;
+  }
+  mPayload.resize(PAYLOADSIZE_MAX);
+  PR_GetRandomNoise(mPayload.data(), mPayload.size());
+  mClients = new ClientSocket[aSlots];
+  mSlots = aSlots;
+  // Hand out the first slots first.
+  mFree.reserve(aSlots);
+  for (uint32_t inx = aSlots; inx > 0; inx--) {
+    mFree.push_back(&mClients[inx - 1]);
+  }
+  return 0;
+}
+
+ClientSocket*
+ClientPool::Get(const PRNetAddr *aAddr)
+{
+  if (mFree.empty()) {
+    return nullptr;
+  }
+  ClientSocket *client = mFree.back();
+  mFree.pop_back();
+  client->Start(aAddr, mPayload.data(), mMaxPayloadSize);
+  return client;
+}
+
+void
+ClientPool::Put(ClientSocket *aClient)
+{
+  aClient->Stop();
+  mFree.push_back(aClient);
+}
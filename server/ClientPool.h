@@ -0,0 +1,61 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NETWORK_TESTS_CLIENT_POOL_H__
+#define NETWORK_TESTS_CLIENT_POOL_H__
+
+#include "ClientSocket.h"
+#include "prnetdb.h"
+#include <stddef.h>
+#include <vector>
+
+/**
+ * Fixed capacity slab of ClientSocket slots of a UDP port thread.
+ *
+ * All slots are constructed once by Init() (including their FileWriter lock
+ * and condition variables), so a new peer costs a pop from the free list and
+ * a state reset. The slots share one payload buffer of PAYLOADSIZE_MAX bytes
+ * that is filled with random data once; every client writes its headers into
+ * it right before sending. This works because a port thread sends one packet
+ * at a time.
+ *
+ * When all slots are taken Get() returns nullptr and the caller refuses the
+ * test (see BUSY in config.h).
+ */
+
+#define CLIENT_POOL_DEFAULT_SLOTS 1024
+
+class ClientPool
+{
+public:
+  ClientPool();
+  ~ClientPool();
+  int Init(uint32_t aSlots);
+  // Largest data packet the clients may send (PAYLOADSIZE_MAX by default).
+  void SetMaxPayloadSize(uint32_t aSize) { mMaxPayloadSize = aSize; }
+
+  // A slot serving aAddr, or nullptr if the pool is full.
+  ClientSocket* Get(const PRNetAddr *aAddr);
+  void Put(ClientSocket *aClient);
+
+  uint32_t Slots() const { return mSlots; }
+  uint32_t InUse() const { return mSlots - mFree.size(); }
+  // Fixed memory of one slot and of the whole pool with the payload buffer.
+  static size_t SlotBytes() { return sizeof(ClientSocket); }
+  size_t PoolBytes() const
+  {
+    return mSlots * SlotBytes() + mPayload.size();
+  }
+
+private:
+  ClientSocket *mClients;
+  uint32_t mSlots;
+  uint32_t mMaxPayloadSize;
+  std::vector<ClientSocket*> mFree;
+  std::vector<char> mPayload;
+};
+
+#endif
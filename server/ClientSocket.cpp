@@ -7,14 +7,12 @@
 #include "ClientSocket.h"
 #include "prerror.h"
 #include "HelpFunctions.h"
-#include <math.h>
+#include "Metrics.h"
+#include "Trace.h"
+#include <algorithm>
 #include <cstring>
 #include <stdio.h>
 #include "prlog.h"
-#include "prrng.h"
-
-#define htonll(x) ((1==htonl(1)) ? (x) : ((uint64_t)htonl((x) & 0xFFFFFFFF) << 32) | htonl((x) >> 32))
-#define ntohll(x) ((1==ntohl(1)) ? (x) : ((uint64_t)ntohl((x) & 0xFFFFFFFF) << 32) | ntohl((x) >> 32))
 
 /**
  *  Packet formats are described in the config.h file.
@@ -32,7 +30,10 @@
  *   - receive a packet that start with "pkdID,ts,Test_5" followed by 8 byte
  *     uint64_t rate in packets per second mPktPerSec (NewPkt()). If multiple
  *     packet with the same pktid are received do nothing.
- *   - send max(MAXBYTES, MAXTIME) packets at rate mPktPerSec and receive acks.
+ *   - the first packet can carry the max bytes and max time the client wants
+ *     (default MAXBYTES and MAXTIME, bounded by the server limits).
+ *   - send max(max bytes, max time) packets at rate mPktPerSec and receive
+ *     acks.
  *   - wait SHUTDOWNTIMEOUT time for outstanding acks.
  *     States: got a packet -> RUN_TEST
  *             RUN_TEST -> sending data -> (send enough data) -> FINISH_PACKET
@@ -53,41 +54,237 @@
  *             RUN_TEST -> receiving data and send ack ->(received FINISH) -> ack FINISH packet -> WAIT_FINISH_TIMEOUT -> TEST_FINISHED
  *                      -> no packets for some time-> error
  *
+ *  Test 8:
+ *   - receive a packet that start with "pkdID,ts,Test_8" followed by the rate
+ *     and the train parameters (NewPkt()). The states are the same as in
+ *     Test 5.
+ *   - send the packet trains or chirps of mTrain (RunTrainSend()) and receive
+ *     acks. Packets of a train are sent on time by spinning for the next one
+ *     if it is due in less than TRAIN_SPIN_NS.
+ *   - TRAIN_ACK_WAIT_MS after the last train estimate capacity and available
+ *     bandwidth from the ack times and send them in the finish packet.
+ *   - in path MTU probing mode the packets grow in size and are sent with
+ *     the don't fragment bit; the finish packet carries the largest acked
+ *     one.
+ *
+ *  Test 9:
+ *   - like Test 5, but the rate in the first packet is only the start rate.
+ *     mRc adjusts the rate from the acks (RunControlledSend()) and the log
+ *     records its trajectory (RATE lines).
+ *
+ *  Test 10:
+ *   - receive a packet that start with "pkdID,ts,Test_A" (NewPkt()), with the
+ *     probe rate and limits as in Test 5. It is echoed like every probe.
+ *   - the client sends small probes every few ms. The UDPserver thread hands
+ *     them to EchoProbe() right after reading them, without NewPkt(), and the
+ *     echo is sent from the receive buffer. The echo carries the time the
+ *     probe spent in the server.
+ *   - for every probe the kernel receive time (SO_TIMESTAMPING), the user
+ *     space receive and send times and the kernel send time are kept in
+ *     mProbes and logged (one short line per probe) once the send timestamp
+ *     is in. At the end the log gets percentiles of each delay.
+ *   - the FINISH probe (or the max time) ends the test; later probes are
+ *     echoed for SHUTDOWNTIMEOUT.
+ *     States: got a packet -> RUN_TEST
+ *             RUN_TEST -> (FINISH probe or max time) -> WAIT_FINISH_TIMEOUT
+ *                      -> TEST_FINISHED
+ *                      -> no probes for some time-> error
+ *
+ *  Test 5, 6, 8 and 9 use data packets of the size requested in the first
+ *  packet (mPayloadSize, default PAYLOADSIZE).
+ *
+ *  The UDPserver thread schedules the senders of all its clients: queued
+ *  acks go out first, then every client with due packets gets a slice of
+ *  the transmit budget (StartTxSlice()). The send functions stop when the
+ *  budget is used and continue in the next round, so one sender that is far
+ *  behind does not delay the others.
+ *
+ *  In Test 5, 6, 8, 9 and 10 mLoss tracks loss, reordering and duplicates of
+ *  the data packet IDs (ACKed in Test 5, received in Test 6 and 10). The numbers are
+ *  reported every LOSS_REPORT_INTERVAL ms and summarized when the test
+ *  finishes.
+ *
+ *  Test 5 and 6 can run with ECN (ECN_MODE in the first packet). In Test 5
+ *  the data packets are sent with the requested ECT codepoint and the client
+ *  echoes the codepoint they arrived with in its ACKs; in Test 6 the client
+ *  sends them with it and the server reads it from IP_TOS. mEcn counts the
+ *  codepoints, which are reported next to the loss.
+ *
+ *  Test 5, 6 and 9 can measure one-way delays (SYNC_MODE in the first
+ *  packet). The server sends a burst of clock sync requests when the test
+ *  starts (Test 5 and 9 send their first data packet after it) and another
+ *  one before the client leaves: Test 5 and 9 send the finish packet after
+ *  it, Test 6 only acks the retransmission of the client's finish packet.
+ *  The client puts its clock into its ACKs (Test 5, 9) or data packets
+ *  (Test 6); mOwd keeps the raw clock differences and when the test finishes
+ *  corrects them with the offset and drift from the bursts, then logs the
+ *  delay of every packet and a summary for each direction.
  */
 
 extern PRLogModuleInfo* gServerTestLog;
 #define LOG(args) PR_LOG(gServerTestLog, PR_LOG_DEBUG, args)
 
-ClientSocket::ClientSocket(PRNetAddr *aAddr)
+#define LOSS_REPORT_INTERVAL 1000
+// Test 8 spins for the next packet of a train if it is due in less than this.
+#define TRAIN_SPIN_NS (20 * CLOCK_NS_PER_US)
+// Test 9 logs the rate at most this often, and on every state change.
+#define RATE_LOG_INTERVAL 10
+// Test 10 keeps at most this many probe records; later probes are still
+// echoed and counted in the loss tracking.
+#define PROBE_MAX_RECORDS 262144
+#define PROBE_TX_PENDING 0xFFFFFFFF
+#define PROBE_TX_UNKNOWN 0xFFFFFFFE
+
+static uint32_t
+ReadPayloadSize(int32_t aCount, const char *aBuf)
+{
+  uint16_t size = 0;
+  if (aCount >= PAYLOAD_SIZE_START + PAYLOAD_SIZE_LEN) {
+    memcpy(&size, aBuf + PAYLOAD_SIZE_START, PAYLOAD_SIZE_LEN);
+    size = ntohs(size);
+  }
+  if (!size) {
+    return PAYLOADSIZE;
+  }
+  if (size < PAYLOADSIZE_MIN) {
+    return PAYLOADSIZE_MIN;
+  }
+  return (size > PAYLOADSIZE_MAX) ? PAYLOADSIZE_MAX : size;
+}
+
+static bool
+ReadSyncMode(int32_t aCount, const char *aBuf)
+{
+  return aCount >= SYNC_MODE_START + SYNC_MODE_LEN && aBuf[SYNC_MODE_START];
+}
+
+static uint8_t
+ReadEcnMode(int32_t aCount, const char *aBuf)
+{
+  if (aCount < ECN_MODE_START + ECN_MODE_LEN) {
+    return ECN_NOT_ECT;
+  }
+  uint8_t mode = aBuf[ECN_MODE_START];
+  return (mode == ECN_ECT0 || mode == ECN_ECT1) ? mode : ECN_NOT_ECT;
+}
+
+// Limits requested in the first packet of Test 5, 9 and 10.
+static void
+ReadTestLimits(int32_t aCount, const char *aBuf, TestLimits &aLimits)
+{
+  uint64_t maxBytes = 0;
+  uint32_t maxTimeMs = 0;
+  if (aCount >= MAX_TIME_START + MAX_TIME_LEN) {
+    memcpy(&maxBytes, aBuf + MAX_BYTES_START, MAX_BYTES_LEN);
+    memcpy(&maxTimeMs, aBuf + MAX_TIME_START, MAX_TIME_LEN);
+    maxBytes = ntohll(maxBytes);
+    maxTimeMs = ntohl(maxTimeMs);
+  }
+  NegotiateTestLimits(maxBytes, maxTimeMs, aLimits);
+}
+
+// Percentile of the values from aFirst on, which are partially sorted: the
+// element at the returned index is in place and all after it are not smaller.
+static size_t
+PercentileIndex(std::vector<uint64_t> &aValues, size_t aFirst,
+                double aPercentile)
+{
+  size_t inx = (size_t)(aPercentile / 100.0 * (aValues.size() - 1) + 0.5);
+  if (inx < aFirst) {
+    return aFirst;
+  }
+  std::nth_element(aValues.begin() + aFirst, aValues.begin() + inx,
+                   aValues.end());
+  return inx;
+}
+
+ClientSocket::ClientSocket()
   : mTestType(0)
+  , mSendBuf(nullptr)
+  , mPayloadSize(PAYLOADSIZE)
+  , mMaxPayloadSize(PAYLOADSIZE_MAX)
   , mFirstPktSent(0)
   , mNextTimeToDoSomething(0)
   , mSentBytes(0)
   , mRecvBytes(0)
+  , mRecvPkts(0)
   , mNumberOfRetransFinish(0)
   , mPktPerSec(0)
   , mPktInterval(0)
   , mNextToSendInns(0)
   , mNextPktId(0)
+  , mLastReceivedTimeout(0)
+  , mError(false)
+  , mNextLossReport(0)
+  , mSyncEnd(false)
+  , mSyncSent(0)
+  , mNextSync(0)
+  , mOwdStart(0)
+  , mRcBlocked(false)
+  , mNextRateLog(0)
+  , mLoggedRcState(RateController::STARTUP)
+  , mTxDeficit(0)
+  , mTxSliceEnd(0)
+  , mNextTxStamp(0)
+  , mNextProbeLog(0)
+  , mProbeLogLen(0)
   , mPhase(START_TEST)
 {
-  memcpy(&mNetAddr, aAddr, sizeof(PRNetAddr));
-  mNodataTimeout = PR_MillisecondsToInterval(NOPKTTIMEOUT);
-  PR_GetRandomNoise(&mSendBuf, sizeof(mSendBuf));
+  memset(&mNetAddr, 0, sizeof(PRNetAddr));
+  mNodataTimeout = ClockFromMilliseconds(NOPKTTIMEOUT);
   memset(mPktIdFirstPkt, '\0', PKT_ID_LEN);
+  NegotiateTestLimits(0, 0, mLimits);
 }
 
 ClientSocket::~ClientSocket()
 {
   mLogFile.Done();
 }
+
+void
+ClientSocket::Start(const PRNetAddr *aAddr, char *aSendBuf,
+                    uint32_t aMaxPayloadSize)
+{
+  // Everything else is reset by the first packet of a test.
+  memcpy(&mNetAddr, aAddr, sizeof(PRNetAddr));
+  mSendBuf = aSendBuf;
+  mMaxPayloadSize = aMaxPayloadSize;
+  mPayloadSize = std::min<uint32_t>(PAYLOADSIZE, mMaxPayloadSize);
+  mTestType = 0;
+  mNextTimeToDoSomething = 0;
+  mLastReceivedTimeout = 0;
+  mError = false;
+  mAcksToSend.clear();
+  mTxDeficit = 0;
+  mTxSliceEnd = 0;
+  mCpuCost.Reset(0);
+  memset(mPktIdFirstPkt, '\0', PKT_ID_LEN);
+  NegotiateTestLimits(0, 0, mLimits);
+  mPhase = START_TEST;
+}
+
+void
+ClientSocket::Stop()
+{
+  mLogFile.Done();
+  // A long probe test must not hold its records in a free slot.
+  std::vector<ProbeRecord>().swap(mProbes);
+  mOwd.Release();
+  mSendBuf = nullptr;
+}
 int
 ClientSocket::MaybeSendSomethingOrCheckFinish(PRFileDesc *aFd,
                                               bool &aClientFinished)
 {
   aClientFinished = false;
   int rv = 0;
-  PRIntervalTime now = PR_IntervalNow();
+  ClockTime now = ClockNow();
+  if (mNextSync && mNextSync <= now) {
+    rv = SendSync(aFd, now);
+    if (rv) {
+      return rv;
+    }
+  }
   if (mNextTimeToDoSomething && mNextTimeToDoSomething < now) {
     switch (mPhase) {
       case RUN_TEST:
@@ -113,16 +310,42 @@ ClientSocket::MaybeSendSomethingOrCheckFinish(PRFileDesc *aFd,
   }
 
   if (mPhase == TEST_FINISHED) {
+    FinishProbes();
+    FinishLossTracking();
+    FinishOwd();
+    FinishCpuCost();
     mLogFile.Done();
+    MetricsTestDone(mTestType, mError);
+    TRACE3(test_done, this, mTestType, mError);
     aClientFinished = true;
   }
   return rv;
 }
 
+void
+ClientSocket::StartTxSlice(int64_t aQuantum, ClockTime aSliceEnd)
+{
+  mTxDeficit += aQuantum;
+  mTxSliceEnd = aSliceEnd;
+}
+
+bool
+ClientSocket::EndTxSlice(ClockTime aNow)
+{
+  mTxSliceEnd = 0;
+  bool due = (mPhase == RUN_TEST || mPhase == FINISH_PACKET) &&
+             mNextTimeToDoSomething && mNextTimeToDoSomething < aNow;
+  if (!due && mTxDeficit > 0) {
+    // Nothing left to send: the unused budget is not saved up.
+    mTxDeficit = 0;
+  }
+  return due;
+}
+
 int
 ClientSocket::RunTestSend(PRFileDesc *aFd)
 {
-  PRIntervalTime now;
+  ClockTime now;
   switch (mTestType) {
     case 1:
     case 6:
@@ -131,28 +354,44 @@ ClientSocket::RunTestSend(PRFileDesc *aFd)
     case 5: //Sending from server to the client.
       {
         // Here we are sending data from server to the client until we have sent
-        // MAXBYTES or MAXTIME has expired. When test is finished we wait
-        // SHUTDOWNTIMEOUT for outstanding acks to be received.
+        // mLimits.mMaxBytes and mLimits.mMaxTimeMs has expired. When test is
+        // finished we wait SHUTDOWNTIMEOUT for outstanding acks to be received.
 
-        now = PR_IntervalNow();
+        now = ClockNow();
         while (mNextTimeToDoSomething < now) {
-          now = PR_IntervalNow();
-          FormatDataPkt(PR_IntervalToMilliseconds(now));
-
-          if ((mSentBytes >= MAXBYTES) &&
-              (mFirstPktSent &&
-               PR_IntervalToSeconds(now - mFirstPktSent) >= MAXTIME)) {
-            LOG(("Test 5 finished: current time %lu, first packet sent at %lu, "
-                 "duration %lu, sent %llu bytes, max bytes to send %llu",
-                 now, mFirstPktSent,
-                 PR_IntervalToSeconds(now - mFirstPktSent), mSentBytes,
-                 MAXBYTES));
+          now = ClockNow();
+          if (!TxBudget(mPayloadSize, now)) {
+            return 0;
+          }
+          FormatDataPkt(ClockToMilliseconds(now));
+
+          if (mFirstPktSent &&
+              TestLimitsReached(mLimits, mSentBytes,
+                                ClockToMilliseconds(now - mFirstPktSent))) {
+            LOG(("Test 5 finished: current time %llu, first packet sent at "
+                 "%llu, duration %llu, sent %llu bytes in %lu byte packets, "
+                 "max bytes to send %llu",
+                 (unsigned long long)now, (unsigned long long)mFirstPktSent,
+                 (unsigned long long)ClockToMilliseconds(now - mFirstPktSent),
+                 (unsigned long long)mSentBytes, (unsigned long)mPayloadSize,
+                 (unsigned long long)mLimits.mMaxBytes));
             mLastPktId = mNextPktId;
-            FormatFinishPkt();
             mPhase = FINISH_PACKET;
+            if (mOwd.Enabled()) {
+              // The client leaves with the finish packet, so the clock sync
+              // goes first. SendFinishPacket() sends it after the burst.
+              StartSync(true, now);
+              mNextTimeToDoSomething = now +
+                ClockFromMilliseconds(SYNC_SAMPLES * SYNC_INTERVAL_MS);
+              return 0;
+            }
+            FormatFinishPkt();
           }
-          int count = PR_SendTo(aFd, mSendBuf, PAYLOADSIZE, 0, &mNetAddr,
-                                PR_INTERVAL_NO_WAIT);
+          if (mPhase != FINISH_PACKET) {
+            MetricsPacingLateness(
+              (uint32_t)ClockToMicroseconds(now - mNextTimeToDoSomething));
+          }
+          int count = SendData(aFd, mPayloadSize);
           if (count < 0) {
             PRErrorCode code = PR_GetError();
             if (code == PR_WOULD_BLOCK_ERROR) {
@@ -161,40 +400,53 @@ ClientSocket::RunTestSend(PRFileDesc *aFd)
             return LogErrorWithCode(code, "UDP");
           }
           mSentBytes += count;
+          mTxDeficit -= count;
+          METRICS_ADD(mPktsSent, 1);
+          METRICS_ADD(mBytesSent, count);
+          TRACE5(data_send, this, mTestType, mNextPktId, count,
+                 mFirstPktSent ? now - mNextTimeToDoSomething : 0);
+          if (mFirstPktSent == 0) {
+            // Pacing of the following packets is relative to this one. It
+            // has to be set before the due time of the second packet is
+            // computed below, or that time is relative to 0: the packet goes
+            // out unpaced and its lateness is the whole clock value.
+            mFirstPktSent = now;
+          }
 
           if (mPhase != FINISH_PACKET) {
             // Calculate time to do something.
             mNextToSendInns += mPktInterval;
             mNextTimeToDoSomething = mFirstPktSent +
-              PR_MicrosecondsToInterval(floor(mNextToSendInns / 1000.0));
+                                     (ClockTime)mNextToSendInns;
 
             // Log
             sprintf(mLogstr, "%lu SEND %lu %lu\n",
-                    (unsigned long)PR_IntervalToMilliseconds(now),
+                    (unsigned long)ClockToMilliseconds(now),
                     (unsigned long)mNextPktId,
-                    (unsigned long)PR_IntervalToMilliseconds(mNextTimeToDoSomething));
+                    (unsigned long)ClockToMilliseconds(mNextTimeToDoSomething));
             mLogFile.WriteNonBlocking(mLogstr, strlen(mLogstr));
 
           } else {
             // Calculate time to do something.
             mNextTimeToDoSomething = now +
-              PR_MillisecondsToInterval(RETRANSMISSION_TIMEOUT);
+              ClockFromMilliseconds(RETRANSMISSION_TIMEOUT);
 
             // Log
             sprintf(mLogstr, "%lu FIN %lu %lu\n",
-                    (unsigned long)PR_IntervalToMilliseconds(now),
+                    (unsigned long)ClockToMilliseconds(now),
                     (unsigned long)mNextPktId,
-                    (unsigned long)PR_IntervalToMilliseconds(mNextTimeToDoSomething));
+                    (unsigned long)ClockToMilliseconds(mNextTimeToDoSomething));
           }
           mLogFile.WriteBlocking(mLogstr, strlen(mLogstr));
 
           mNextPktId++;
-          if (mFirstPktSent == 0) {
-            mFirstPktSent = now;
-          }
         }
       }
       break;
+    case 8:
+      return RunTrainSend(aFd);
+    case 9:
+      return RunControlledSend(aFd);
     default:
       return -1;
   }
@@ -202,6 +454,216 @@ ClientSocket::RunTestSend(PRFileDesc *aFd)
   return 0;
 }
 
+int
+ClientSocket::RunTrainSend(PRFileDesc *aFd)
+{
+  ClockTime now = ClockNow();
+  if (mTrain.NextPkt() == mTrain.TotalPkts()) {
+    // TRAIN_ACK_WAIT_MS after the last packet: estimate and finish.
+    mTrain.Estimate();
+    char line[256];
+    for (uint32_t inx = 0; inx < mTrain.Count(); inx++) {
+      int len = snprintf(line, sizeof(line), "%lu ",
+                         (unsigned long)ClockToMilliseconds(now));
+      mTrain.FormatTrain(inx, line + len, sizeof(line) - len - 1);
+      strcat(line, "\n");
+      mLogFile.WriteBlocking(line, strlen(line));
+    }
+    if (mTrain.Mode() == TRAIN_MODE_PMTU) {
+      snprintf(line, sizeof(line), "%lu PMTU %lu LOST %lu\n",
+               (unsigned long)ClockToMilliseconds(now),
+               (unsigned long)mTrain.Pmtu(),
+               (unsigned long)mTrain.PmtuLost());
+    } else {
+      snprintf(line, sizeof(line), "%lu CAPACITY %llu AVAILABLE %llu\n",
+               (unsigned long)ClockToMilliseconds(now),
+               (unsigned long long)mTrain.Capacity(),
+               (unsigned long long)mTrain.AvailableBandwidth());
+    }
+    mLogFile.WriteBlocking(line, strlen(line));
+    LOG(("Test 8 finished: capacity %llu available bandwidth %llu path MTU "
+         "payload %lu.", (unsigned long long)mTrain.Capacity(),
+         (unsigned long long)mTrain.AvailableBandwidth(),
+         (unsigned long)mTrain.Pmtu()));
+
+    mLastPktId = mNextPktId;
+    mPhase = FINISH_PACKET;
+    mNextTimeToDoSomething = now;
+    return 0;
+  }
+
+  while (mTrain.NextPkt() < mTrain.TotalPkts()) {
+    ClockTime due = mFirstPktSent + mTrain.SendOffset(mTrain.NextPkt());
+    if (mFirstPktSent && due > now) {
+      if (due - now > TRAIN_SPIN_NS) {
+        mNextTimeToDoSomething = due - TRAIN_SPIN_NS;
+        return 0;
+      }
+      while ((now = ClockNow()) < due) {
+      }
+    }
+
+    // A train is sent as a whole, so only its first packet needs budget;
+    // the rest is charged and paid back in the following rounds.
+    uint32_t size = mTrain.PktSize(mTrain.NextPkt());
+    if (mTrain.NextPkt() % mTrain.Len() == 0 && !TxBudget(size, now)) {
+      mNextTimeToDoSomething = now;
+      return 0;
+    }
+    FormatDataPkt(ClockToMilliseconds(now));
+    bool probe = (mTrain.Mode() == TRAIN_MODE_PMTU);
+    if (probe && SetDontFragment(aFd, true)) {
+      mError = true;
+      mPhase = TEST_FINISHED;
+      return 0;
+    }
+    int count = PR_SendTo(aFd, mSendBuf, size, 0, &mNetAddr,
+                          PR_INTERVAL_NO_WAIT);
+    PRErrorCode code = (count < 0) ? PR_GetError() : 0;
+    if (probe) {
+      SetDontFragment(aFd, false);
+    }
+    if (count < 0) {
+      if (code == PR_WOULD_BLOCK_ERROR) {
+        mNextTimeToDoSomething = now;
+        return 0;
+      }
+      if (!probe) {
+        return LogErrorWithCode(code, "UDP");
+      }
+      // Larger than the MTU of the local link: the probe is lost.
+      count = 0;
+    }
+    if (mFirstPktSent == 0) {
+      mFirstPktSent = now;
+    } else {
+      MetricsPacingLateness((uint32_t)ClockToMicroseconds(now - due));
+    }
+    mTrain.Sent(now);
+    mTxDeficit -= size;
+    if (count) {
+      mSentBytes += count;
+      METRICS_ADD(mPktsSent, 1);
+      METRICS_ADD(mBytesSent, count);
+    }
+
+    sprintf(mLogstr, "%lu SEND %lu %lu %lu\n",
+            (unsigned long)ClockToMilliseconds(now),
+            (unsigned long)mNextPktId,
+            (unsigned long)((mTrain.NextPkt() - 1) / mTrain.Len()),
+            (unsigned long)count);
+    mLogFile.WriteNonBlocking(mLogstr, strlen(mLogstr));
+    mNextPktId++;
+    now = ClockNow();
+  }
+
+  mNextTimeToDoSomething = now + ClockFromMilliseconds(TRAIN_ACK_WAIT_MS);
+  return 0;
+}
+
+int
+ClientSocket::RunControlledSend(PRFileDesc *aFd)
+{
+  ClockTime now = ClockNow();
+  uint32_t base = mLoss.FirstPktId();
+  while (mNextTimeToDoSomething <= now) {
+    if (mFirstPktSent &&
+        TestLimitsReached(mLimits, mSentBytes,
+                          ClockToMilliseconds(now - mFirstPktSent))) {
+      LogRate(now, 0, true);
+      mLastPktId = mNextPktId;
+      mPhase = FINISH_PACKET;
+      mNextTimeToDoSomething = now;
+      if (mOwd.Enabled()) {
+        // As in Test 5, the clock sync before the finish packet.
+        StartSync(true, now);
+        mNextTimeToDoSomething += ClockFromMilliseconds(SYNC_SAMPLES *
+                                                        SYNC_INTERVAL_MS);
+      }
+      return 0;
+    }
+
+    uint64_t inflight = (uint32_t)(mNextPktId - base) - mLoss.Expected();
+    if (mRc.CwndLimited(inflight, now)) {
+      // The next ack wakes us up.
+      mRcBlocked = true;
+      mNextTimeToDoSomething = now +
+                               ClockFromMilliseconds(RC_PROBE_TIMEOUT_MS);
+      return 0;
+    }
+
+    if (!TxBudget(mPayloadSize, now)) {
+      return 0;
+    }
+    FormatDataPkt(ClockToMilliseconds(now));
+    int count = SendData(aFd, mPayloadSize);
+    if (count < 0) {
+      PRErrorCode code = PR_GetError();
+      if (code == PR_WOULD_BLOCK_ERROR) {
+        return 0;
+      }
+      return LogErrorWithCode(code, "UDP");
+    }
+    mTxDeficit -= count;
+    if (mFirstPktSent == 0) {
+      mFirstPktSent = now;
+    } else if (!mRcBlocked) {
+      MetricsPacingLateness(
+        (uint32_t)ClockToMicroseconds(now - mNextTimeToDoSomething));
+    }
+    mRcBlocked = false;
+    mRc.OnSent(mNextPktId - base, now);
+    mSentBytes += count;
+    METRICS_ADD(mPktsSent, 1);
+    METRICS_ADD(mBytesSent, count);
+
+    // Pace at the current rate. After a pause (full window, socket buffer)
+    // do not send a burst to catch up.
+    ClockTime next = mNextTimeToDoSomething + (ClockTime)mRc.PktInterval();
+    mNextTimeToDoSomething = (next > now) ? next :
+                             now + (ClockTime)mRc.PktInterval();
+
+    sprintf(mLogstr, "%lu SEND %lu %lu\n",
+            (unsigned long)ClockToMilliseconds(now),
+            (unsigned long)mNextPktId,
+            (unsigned long)ClockToMilliseconds(mNextTimeToDoSomething));
+    mLogFile.WriteNonBlocking(mLogstr, strlen(mLogstr));
+    mNextPktId++;
+    now = ClockNow();
+  }
+  return 0;
+}
+
+void
+ClientSocket::LogRate(ClockTime aNow, uint64_t aInflight, bool aSummary)
+{
+  char line[256];
+  if (aSummary) {
+    double seconds = (double)(aNow - mFirstPktSent) / CLOCK_NS_PER_SEC;
+    double goodput = (seconds > 0) ?
+      mLoss.Stats().mReceived * mPayloadSize * 8.0 / seconds : 0;
+    snprintf(line, sizeof(line),
+             "%lu RATE SUMMARY btlbw %.0f minrtt %llu rounds %llu goodput "
+             "%.0f\n",
+             (unsigned long)ClockToMilliseconds(aNow),
+             mRc.BtlBw() * mPayloadSize * 8.0,
+             (unsigned long long)ClockToMicroseconds(mRc.MinRtt()),
+             (unsigned long long)mRc.Rounds(), goodput);
+    LOG(("Test 9 finished: %s", line));
+  } else {
+    snprintf(line, sizeof(line),
+             "%lu RATE %s pacing %.0f btlbw %.0f minrtt %llu cwnd %llu "
+             "inflight %llu\n",
+             (unsigned long)ClockToMilliseconds(aNow), mRc.StateName(),
+             mRc.PacingRate(), mRc.BtlBw(),
+             (unsigned long long)ClockToMicroseconds(mRc.MinRtt()),
+             (unsigned long long)mRc.Cwnd(), (unsigned long long)aInflight);
+    mNextRateLog = aNow + ClockFromMilliseconds(RATE_LOG_INTERVAL);
+    mLoggedRcState = mRc.GetState();
+  }
+  mLogFile.WriteNonBlocking(line, strlen(line));
+}
+
 int
 ClientSocket::SendFinishPacket(PRFileDesc *aFd)
 {
@@ -212,11 +674,10 @@ ClientSocket::SendFinishPacket(PRFileDesc *aFd)
     return 0;
   }
 
-  PRIntervalTime now = PR_IntervalNow();
-  FormatDataPkt(PR_IntervalToMilliseconds(now));
+  ClockTime now = ClockNow();
+  FormatDataPkt(ClockToMilliseconds(now));
   FormatFinishPkt();
-  int count = PR_SendTo(aFd, mSendBuf, PAYLOADSIZE, 0, &mNetAddr,
-                        PR_INTERVAL_NO_WAIT);
+  int count = SendData(aFd, mPayloadSize);
   if (count < 1) {
     PRErrorCode code = PR_GetError();
     if (code == PR_WOULD_BLOCK_ERROR) {
@@ -225,15 +686,19 @@ ClientSocket::SendFinishPacket(PRFileDesc *aFd)
     return LogErrorWithCode(code, "UDP");
   }
   mSentBytes += count;
+  mTxDeficit -= count;
+  METRICS_ADD(mPktsSent, 1);
+  METRICS_ADD(mBytesSent, count);
 
-  sprintf(mLogstr, "%lu FIN\n", (unsigned long)PR_IntervalToMilliseconds(now));
+  sprintf(mLogstr, "%lu FIN\n", (unsigned long)ClockToMilliseconds(now));
   mLogFile.WriteBlocking(mLogstr, strlen(mLogstr));
 
   LOG(("NetworkTest UDP sever side: Sending data for test %d"
-       " - sent %lu bytes - received %lu bytes.",
-       mTestType,  mSentBytes, mRecvBytes));
+       " - sent %llu bytes - received %llu bytes.",
+       mTestType, (unsigned long long)mSentBytes,
+       (unsigned long long)mRecvBytes));
   mNextTimeToDoSomething = now +
-                           PR_MillisecondsToInterval(RETRANSMISSION_TIMEOUT);
+                           ClockFromMilliseconds(RETRANSMISSION_TIMEOUT);
   mNumberOfRetransFinish++;
   return 0;
 }
@@ -284,18 +749,46 @@ ClientSocket::IsThisSocket(const PRNetAddr *aAddr)
   return (memcmp(&mNetAddr, aAddr, sizeof(PRNetAddr)) == 0);
 }
 
+int32_t
+ClientSocket::SendData(PRFileDesc *aFd, uint32_t aSize)
+{
+  if (mOwd.Enabled()) {
+    // As late as possible; the client echoes it in its ACK.
+    uint64_t sent = htonll(ClockNow());
+    memcpy(mSendBuf + DATA_SEND_TIME_START, &sent, DATA_SEND_TIME_LEN);
+  }
+  if (mEcn.Sent() != ECN_NOT_ECT) {
+    bool tosSet;
+    int32_t count = SendToTos(aFd, mSendBuf, aSize, &mNetAddr, mEcn.Sent(),
+                              &tosSet);
+    if (!tosSet) {
+      LOG(("NetworkTest UDP server side: Cannot set ECN on this socket, "
+           "sending Not-ECT."));
+      mEcn.NotSent();
+    }
+    return count;
+  }
+  return PR_SendTo(aFd, mSendBuf, aSize, 0, &mNetAddr, PR_INTERVAL_NO_WAIT);
+}
+
 int
-ClientSocket::NewPkt(int32_t aCount, char *aBuf)
+ClientSocket::NewPkt(int32_t aCount, char *aBuf, int aTos)
 {
-  PRIntervalTime received = PR_IntervalNow();
+  ClockTime received = ClockNow();
+  TRACE4(udp_pkt, this, mTestType, aCount, mPhase);
 
   // if we have not received packet for a long time we can assume a broken
   // connection.
   mLastReceivedTimeout = received + mNodataTimeout;
 
   // We can receive a data packet(test 6) or an ack(test 5) or a
-  // packet describing the start of a new test.
-  if (memcmp(aBuf + TYPE_START, TEST_prefix, 5) == 0) {
+  // packet describing the start of a new test, or the answer to a clock sync
+  // request.
+  if (mOwd.Enabled() && aCount >= SYNC_PKT_LEN &&
+      memcmp(aBuf + SYNC_START, SYNC, SYNC_LEN) == 0) {
+    SyncReply(aBuf, received);
+
+  } else if (memcmp(aBuf + TYPE_START, TEST_prefix, 5) == 0) {
     // We have received a packet that has a format of the first.
     FirstPacket(aCount, aBuf, received);
 
@@ -308,51 +801,136 @@ ClientSocket::NewPkt(int32_t aCount, char *aBuf)
 
     switch (mTestType) {
       case 5:
+      case 8:
+      case 9:
         {
           mRecvBytes +=aCount;
           // Get packet Id.
           uint32_t pktId = ReadACKPktAndLog(aBuf,
-                             PR_IntervalToMilliseconds(received));
+                             ClockToMilliseconds(received));
+
+          // Only data packets, not the finish packet and its retransmissions.
+          uint32_t end = (mPhase == RUN_TEST) ? mNextPktId : mLastPktId;
+          if (pktId - mLoss.FirstPktId() < end - mLoss.FirstPktId()) {
+            if (mEcn.Enabled() && aCount >= ACK_ECN_START + ACK_ECN_LEN &&
+                (aBuf[ACK_ECN_START] & ECN_ECHO_VALID)) {
+              EcnReceived(aBuf[ACK_ECN_START]);
+            }
+            if (mOwd.Enabled() && aCount >= ACK_SYNC_LEN) {
+              uint64_t clientRx;
+              uint64_t clientTx;
+              uint64_t serverTx;
+              memcpy(&clientRx, aBuf + ACK_CLIENT_RX_START, SYNC_TIME_LEN);
+              memcpy(&clientTx, aBuf + ACK_CLIENT_TX_START, SYNC_TIME_LEN);
+              memcpy(&serverTx, aBuf + ACK_SERVER_TX_START, SYNC_TIME_LEN);
+              serverTx = ntohll(serverTx);
+              // The send time comes back from the client; it must be one of
+              // this test.
+              if (serverTx >= mOwdStart && serverTx <= received) {
+                mOwd.Packet(pktId, serverTx,
+                            (int64_t)ntohll(clientRx) * CLOCK_NS_PER_US,
+                            (int64_t)ntohll(clientTx) * CLOCK_NS_PER_US,
+                            received);
+              }
+            }
+            TrackPkt(pktId, received);
+            if (mTestType == 8) {
+              mTrain.Acked(pktId - mLoss.FirstPktId(), received);
+            }
+          }
+          if (mTestType == 9) {
+            uint32_t base = mLoss.FirstPktId();
+            uint64_t inflight = (uint32_t)(mNextPktId - base) -
+                                mLoss.Expected();
+            mRc.OnAck(pktId - base, received, inflight,
+                      mLoss.Expected() - mLoss.Stats().mReceived);
+            if (mRc.TakeLogEvent() &&
+                (received >= mNextRateLog ||
+                 mRc.GetState() != mLoggedRcState)) {
+              LogRate(received, inflight, false);
+            }
+            if (mRcBlocked && mPhase == RUN_TEST) {
+              mRcBlocked = false;
+              mNextTimeToDoSomething = received;
+            }
+          }
 
           if (mPhase == FINISH_PACKET) {
             // Check if we got ACK for the finish packet.
             if (mLastPktId == pktId) {
               mPhase = WAIT_FINISH_TIMEOUT;
               mNextTimeToDoSomething = received +
-                PR_MillisecondsToInterval(SHUTDOWNTIMEOUT);
+                ClockFromMilliseconds(SHUTDOWNTIMEOUT);
             }
           }
         }
         break;
       case 6:
-        mRecvBytes +=aCount;
-
-        if (mPhase == RUN_TEST) {
-          if (memcmp(aBuf + FINISH_START, FINISH, FINISH_LEN) == 0) {
-            mPhase = WAIT_FINISH_TIMEOUT;
-            mNextTimeToDoSomething = received +
-                                     PR_MillisecondsToInterval(SHUTDOWNTIMEOUT);
-            if (!mPktPerSecObserved &&
-                PR_IntervalToSeconds(PR_IntervalNow() - mFirstPktReceived)) {
-              mPktPerSecObserved = (double)mRecvBytes / PAYLOADSIZEF /
-                (double)PR_IntervalToMilliseconds(PR_IntervalNow() - mFirstPktReceived)
-                * 1000.0;
+        {
+          mRecvBytes +=aCount;
+          mRecvPkts++;
+
+          uint32_t pktId;
+          memcpy(&pktId, aBuf + PKT_ID_START, PKT_ID_LEN);
+          bool finish = (memcmp(aBuf + FINISH_START, FINISH, FINISH_LEN) == 0);
+          bool ack = true;
+          if (!finish) {
+            if (mEcn.Enabled() && aTos >= 0) {
+              EcnReceived(aTos);
+            }
+            if (mOwd.Enabled() &&
+                aCount >= DATA_SEND_TIME_START + DATA_SEND_TIME_LEN) {
+              uint64_t clientTx;
+              memcpy(&clientTx, aBuf + DATA_SEND_TIME_START,
+                     DATA_SEND_TIME_LEN);
+              mOwd.Packet(pktId, 0, 0,
+                          (int64_t)ntohll(clientTx) * CLOCK_NS_PER_US,
+                          received);
             }
-            LOG(("NetworkTest UDP client: Closing, observed rate: %llu",
-                  mPktPerSecObserved));
-            LOG(("Test 6 finished: current time %lu, first packet sent %lu, "
-                 "duration %lu, received %llu.",
-                 PR_IntervalNow(),
-                 mFirstPktReceived,
-                 PR_IntervalToMilliseconds(PR_IntervalNow() - mFirstPktReceived),
-                 mRecvBytes));
+            TrackPkt(pktId, received);
           }
-        }
 
-        // Send ack.
-        mAcksToSend.push_back(Ack(aBuf, received, 0,
-                                  mPktPerSecObserved));
-      break;
+          if (mPhase == RUN_TEST) {
+            if (finish) {
+              mLastPktId = pktId;
+              mPhase = WAIT_FINISH_TIMEOUT;
+              mNextTimeToDoSomething = received +
+                                       ClockFromMilliseconds(SHUTDOWNTIMEOUT);
+              if (mOwd.Enabled()) {
+                // The client leaves with the ACK of its finish packet. Only
+                // its retransmission is acked, after the clock sync.
+                StartSync(true, received);
+                ack = false;
+              }
+              if (!mPktPerSecObserved &&
+                  (ClockNow() - mFirstPktReceived >= CLOCK_NS_PER_SEC)) {
+                mPktPerSecObserved = (double)mRecvPkts /
+                  (double)ClockToMilliseconds(ClockNow() - mFirstPktReceived)
+                  * 1000.0;
+              }
+              LOG(("NetworkTest UDP client: Closing, observed rate: %llu "
+                   "pkt/s, %.0f bit/s",
+                   (unsigned long long)mPktPerSecObserved,
+                   (double)mRecvBytes * 8.0 /
+                   (double)ClockToMilliseconds(ClockNow() - mFirstPktReceived)
+                   * 1000.0));
+              LOG(("Test 6 finished: current time %llu, first packet sent "
+                   "%llu, duration %llu, received %llu.",
+                   (unsigned long long)ClockNow(),
+                   (unsigned long long)mFirstPktReceived,
+                   (unsigned long long)
+                   ClockToMilliseconds(ClockNow() - mFirstPktReceived),
+                   (unsigned long long)mRecvBytes));
+            }
+          }
+
+          // Send ack.
+          if (ack) {
+            mAcksToSend.push_back(Ack(aBuf, received, 0,
+                                      mPktPerSecObserved));
+          }
+        }
+        break;
     default:
       return -1;
     }
@@ -362,22 +940,23 @@ ClientSocket::NewPkt(int32_t aCount, char *aBuf)
 
 
 int
-ClientSocket::FirstPacket(int32_t aCount, char *aBuf, PRIntervalTime received)
+ClientSocket::FirstPacket(int32_t aCount, char *aBuf, ClockTime received)
 {
   if (memcmp(mPktIdFirstPkt, aBuf + PKT_ID_START, PKT_ID_LEN) == 0) {
     LOG(("NetworkTest UDP server side: Received a dup of the first "
-         "packet. %lu", mTestType));
+         "packet. %d", mTestType));
 
     if (mTestType == 1) {
       mAcksToSend.push_back(Ack(aBuf, received, aCount, 0));
     } else if (mTestType == 5) {
       mNextTimeToDoSomething = received;
       sprintf(mLogstr, "%lu START TEST 5 DUP\n",
-              (unsigned long)PR_IntervalToMilliseconds(received));
+              (unsigned long)ClockToMilliseconds(received));
       mLogFile.WriteBlocking(mLogstr, strlen(mLogstr));
     } else if (mTestType == 6) {
       mAcksToSend.push_back(Ack(aBuf, received, 0, 0));
     }
+    // Test 10: the UDPserver thread echoes it again.
     return 0;
   }
 
@@ -386,7 +965,17 @@ ClientSocket::FirstPacket(int32_t aCount, char *aBuf, PRIntervalTime received)
   // If the last test is in WAIT_FINISH_TIMEOUT or not finished properly close
   // the report.
   if (mTestType != 0) {
+    if (mPhase != TEST_FINISHED) {
+      FinishProbes();
+      FinishLossTracking();
+      FinishOwd();
+      FinishCpuCost();
+    }
     mLogFile.Done();
+    if (mPhase != TEST_FINISHED) {
+      MetricsTestDone(mTestType, mPhase != WAIT_FINISH_TIMEOUT);
+      TRACE3(test_done, this, mTestType, mPhase != WAIT_FINISH_TIMEOUT);
+    }
   }
 
   // reset
@@ -395,6 +984,7 @@ ClientSocket::FirstPacket(int32_t aCount, char *aBuf, PRIntervalTime received)
   mNextTimeToDoSomething = 0;
   mSentBytes = 0;
   mRecvBytes = 0;
+  mRecvPkts = 0;
   mAcksToSend.clear();
   mNumberOfRetransFinish = 0;
   mPktPerSec = 0;
@@ -402,25 +992,46 @@ ClientSocket::FirstPacket(int32_t aCount, char *aBuf, PRIntervalTime received)
   mNextToSendInns = 0;
   memcpy(mPktIdFirstPkt, aBuf + PKT_ID_START, PKT_ID_LEN);
   mNextPktId = ntohl(*((uint32_t*)mPktIdFirstPkt)) + 1;
+  mLoss.Reset(mNextPktId);
+  mNextLossReport = 0;
+  mEcn.Reset(ECN_NOT_ECT);
+  mOwd.Reset(false, 0);
+  mNextSync = 0;
+  mOwdStart = received;
+  mTrain.Clear();
   mPktPerSecObserved = 0;
   mLastPktId = 0;
+  mProbes.clear();
+  mNextTxStamp = 0;
+  mNextProbeLog = 0;
+  mProbeLogLen = 0;
+  mLogFileName[0] = '\0';
   mPhase = START_TEST;
+  // The fields after FILE_NAME are only read from a versioned first packet.
+  bool versioned = FirstPktVersioned(aCount, aBuf);
+  int32_t fieldsLen = versioned ? aCount :
+                      std::min(aCount, (int32_t)FIRST_PKT_BASE_LEN);
+  mPayloadSize = std::min(ReadPayloadSize(fieldsLen, aBuf), mMaxPayloadSize);
 
   if (memcmp(aBuf + TYPE_START, UDP_reachability, TYPE_LEN) == 0) {
 
     mTestType = 1;
+    MetricsTestStarted(mTestType);
     mPhase = WAIT_FINISH_TIMEOUT;
     // Send a reply.
     mAcksToSend.push_back(Ack(aBuf, received, aCount, 0));
     mNextTimeToDoSomething = received +
-                             PR_MillisecondsToInterval(SHUTDOWNTIMEOUT);
+                             ClockFromMilliseconds(SHUTDOWNTIMEOUT);
     LOG(("NetworkTest UDP server side: Starting test %d.", mTestType));
 
-  } else if (memcmp(aBuf + TYPE_START, UDP_performanceFromServerToClient,
-                    TYPE_LEN) == 0) {
+  } else if ((memcmp(aBuf + TYPE_START, UDP_performanceFromServerToClient,
+                     TYPE_LEN) == 0) ||
+             (memcmp(aBuf + TYPE_START, UDP_congestionControlled,
+                     TYPE_LEN) == 0)) {
 
     mNextTimeToDoSomething = received;
-    mTestType = 5;
+    mTestType = (aBuf[TYPE_START + TYPE_LEN - 1] == '9') ? 9 : 5;
+    MetricsTestStarted(mTestType);
     LOG(("NetworkTest UDP server side: Starting test %d.", mTestType));
     mRecvBytes +=aCount;
 
@@ -428,6 +1039,14 @@ ClientSocket::FirstPacket(int32_t aCount, char *aBuf, PRIntervalTime received)
     uint64_t npktpersec;
     memcpy(&npktpersec, aBuf + RATE_TO_SEND_START, RATE_TO_SEND_LEN);
     mPktPerSec = ntohll(npktpersec);
+    if (mTestType == 9) {
+      // The rate is only where the controller starts.
+      mRc.Init(mPktPerSec);
+      mRcBlocked = false;
+      mNextRateLog = 0;
+      mLoggedRcState = RateController::STARTUP;
+      mPktPerSec = mRc.PacingRate();
+    }
     if (mPktPerSec == 0) {
       mError = true;
       mPhase = TEST_FINISHED;
@@ -435,13 +1054,25 @@ ClientSocket::FirstPacket(int32_t aCount, char *aBuf, PRIntervalTime received)
     }
 
     mPktInterval = 1000000000.0 / mPktPerSec; // the interval in ns.
+    if (mTestType == 5) {
+      mEcn.Reset(ReadEcnMode(fieldsLen, aBuf));
+    }
+
+    // Get requested limits.
+    ReadTestLimits(fieldsLen, aBuf, mLimits);
+    mOwd.Reset(ReadSyncMode(fieldsLen, aBuf),
+               mPktPerSec * std::min(mLimits.mMaxTimeMs, ServerMaxTimeMs()) /
+               1000);
 
     // Get file name.
     memcpy(mLogFileName, aBuf + FILE_NAME_START, FILE_NAME_LEN);
     LOG(("File name: %s", mLogFileName));
     mPhase = RUN_TEST;
-    LOG(("NetworkTest UDP server side: Test %d: rate %d interval %lf.",
-         mTestType, mPktPerSec, mPktInterval));
+    LOG(("NetworkTest UDP server side: Test %d: rate %llu interval %lf, max "
+         "bytes %llu, max time %lu ms.", mTestType,
+         (unsigned long long)mPktPerSec, mPktInterval,
+         (unsigned long long)mLimits.mMaxBytes,
+         (unsigned long)mLimits.mMaxTimeMs));
     if (mLogFile.Init(mLogFileName) < 0) {
       mError = true;
       mPhase = TEST_FINISHED;
@@ -449,10 +1080,21 @@ ClientSocket::FirstPacket(int32_t aCount, char *aBuf, PRIntervalTime received)
     }
     LogLogFormat();
 
-    sprintf(mLogstr, "%lu START TEST 5: rate %lu\n",
-            (unsigned long)PR_IntervalToMilliseconds(received),
-            (unsigned long)ntohl(npktpersec));
+    sprintf(mLogstr,
+            "%lu START TEST %d: rate %lu max bytes %llu max time %lu size "
+            "%lu\n",
+            (unsigned long)ClockToMilliseconds(received), mTestType,
+            (unsigned long)mPktPerSec,
+            (unsigned long long)mLimits.mMaxBytes,
+            (unsigned long)mLimits.mMaxTimeMs,
+            (unsigned long)mPayloadSize);
     mLogFile.WriteBlocking(mLogstr, strlen(mLogstr));
+    if (mOwd.Enabled()) {
+      // The first data packet waits for the clock sync burst.
+      StartSync(false, received);
+      mNextTimeToDoSomething = received +
+        ClockFromMilliseconds(SYNC_SAMPLES * SYNC_INTERVAL_MS);
+    }
 
   } else if (memcmp(aBuf + TYPE_START, UDP_performanceFromClientToServer,
                     TYPE_LEN) == 0) {
@@ -460,16 +1102,358 @@ ClientSocket::FirstPacket(int32_t aCount, char *aBuf, PRIntervalTime received)
     mAcksToSend.push_back(Ack(aBuf, received, 0, 0));
     mFirstPktReceived = received;
     mTestType = 6;
+    MetricsTestStarted(mTestType);
+    mEcn.Reset(ReadEcnMode(fieldsLen, aBuf));
+    mOwd.Reset(ReadSyncMode(fieldsLen, aBuf), 0);
+    StartSync(false, received);
+    LOG(("NetworkTest UDP server side: Starting test %d, packet size %lu, "
+         "ECN %s, one-way delays %s.", mTestType,
+         (unsigned long)mPayloadSize, EcnName(mEcn.Sent()), mOwd.Enabled() ? "on" : "off"));
+
+    // The summaries go to the log the client names, or to one named after
+    // the client and its first packet.
+    if (versioned && aBuf[FILE_NAME_START] != '\0') {
+      memcpy(mLogFileName, aBuf + FILE_NAME_START, FILE_NAME_LEN);
+    } else {
+      char host[64] = {0};
+      PR_NetAddrToString(&mNetAddr, host, sizeof(host));
+      snprintf(mLogFileName, sizeof(mLogFileName), "test6_%.32s_%u_%u", host,
+               (unsigned)PR_ntohs(PR_NetAddrInetPort(&mNetAddr)),
+               (unsigned)(mNextPktId - 1));
+    }
+    LOG(("File name: %s", mLogFileName));
+    // Test 6 runs without a log too; the summaries still go to the debug log.
+    if (mLogFile.Init(mLogFileName) == 0) {
+      LogLogFormat();
+      sprintf(mLogstr, "%lu START TEST 6: size %lu\n",
+              (unsigned long)ClockToMilliseconds(received),
+              (unsigned long)mPayloadSize);
+      mLogFile.WriteBlocking(mLogstr, strlen(mLogstr));
+    }
+
+    mPhase = RUN_TEST;
+  } else if (memcmp(aBuf + TYPE_START, UDP_packetTrain, TYPE_LEN) == 0) {
+
+    mNextTimeToDoSomething = received;
+    mTestType = 8;
+    MetricsTestStarted(mTestType);
     LOG(("NetworkTest UDP server side: Starting test %d.", mTestType));
+    mRecvBytes +=aCount;
 
+    uint64_t npktpersec;
+    memcpy(&npktpersec, aBuf + RATE_TO_SEND_START, RATE_TO_SEND_LEN);
+    mPktPerSec = ntohll(npktpersec);
+    uint8_t mode = TRAIN_MODE_TRAIN;
+    uint16_t len = 0;
+    uint16_t count = 0;
+    if (fieldsLen >= TRAIN_COUNT_START + TRAIN_COUNT_LEN) {
+      memcpy(&mode, aBuf + TRAIN_MODE_START, TRAIN_MODE_LEN);
+      memcpy(&len, aBuf + TRAIN_LEN_START, TRAIN_LEN_LEN);
+      memcpy(&count, aBuf + TRAIN_COUNT_START, TRAIN_COUNT_LEN);
+    }
+    // All trains must fit into the longest test the server allows.
+    if (mTrain.Init(mode, ntohs(len), ntohs(count), mPktPerSec,
+                    mPayloadSize) ||
+        mTrain.Duration() > ClockFromMilliseconds(ServerMaxTimeMs())) {
+      LOG(("NetworkTest UDP server side: Test 8 bad parameters."));
+      mError = true;
+      mPhase = TEST_FINISHED;
+      return 0;
+    }
+
+    memcpy(mLogFileName, aBuf + FILE_NAME_START, FILE_NAME_LEN);
     mPhase = RUN_TEST;
+    if (mLogFile.Init(mLogFileName) < 0) {
+      mError = true;
+      mPhase = TEST_FINISHED;
+      return 0;
+    }
+    LogLogFormat();
+
+    sprintf(mLogstr,
+            "%lu START TEST 8: %s rate %lu len %lu count %lu size %lu\n",
+            (unsigned long)ClockToMilliseconds(received),
+            (mTrain.Mode() == TRAIN_MODE_CHIRP) ? "chirps" :
+            (mTrain.Mode() == TRAIN_MODE_PMTU) ? "pmtu" : "trains",
+            (unsigned long)mPktPerSec, (unsigned long)mTrain.Len(),
+            (unsigned long)mTrain.Count(), (unsigned long)mPayloadSize);
+    mLogFile.WriteBlocking(mLogstr, strlen(mLogstr));
+
+  } else if (memcmp(aBuf + TYPE_START, UDP_latencyProbes, TYPE_LEN) == 0) {
+
+    mFirstPktReceived = received;
+    mTestType = 10;
+    MetricsTestStarted(mTestType);
+    uint64_t probesPerSec;
+    memcpy(&probesPerSec, aBuf + RATE_TO_SEND_START, RATE_TO_SEND_LEN);
+    probesPerSec = ntohll(probesPerSec);
+    ReadTestLimits(fieldsLen, aBuf, mLimits);
+    LOG(("NetworkTest UDP server side: Starting test %d: %llu probes/s, max "
+         "time %lu ms.", mTestType, (unsigned long long)probesPerSec,
+         (unsigned long)mLimits.mMaxTimeMs));
+
+    memcpy(mLogFileName, aBuf + FILE_NAME_START, FILE_NAME_LEN);
+    mPhase = RUN_TEST;
+    if (mLogFile.Init(mLogFileName) < 0) {
+      mError = true;
+      mPhase = TEST_FINISHED;
+      return 0;
+    }
+    LogLogFormat();
+    // No allocation on the echo path for a test that keeps to its rate.
+    uint64_t expected = probesPerSec * mLimits.mMaxTimeMs / 1000 + 1;
+    mProbes.reserve(std::min<uint64_t>(expected, PROBE_MAX_RECORDS));
+
+    sprintf(mLogstr, "%lu START TEST 10: rate %llu max time %lu\n",
+            (unsigned long)ClockToMilliseconds(received),
+            (unsigned long long)probesPerSec,
+            (unsigned long)mLimits.mMaxTimeMs);
+    mLogFile.WriteBlocking(mLogstr, strlen(mLogstr));
+
   } else {
     LOG(("NetworkTest UDP server side: Test not implemented"));
     return -1;
   }
+  mCpuCost.Reset(mTestType);
+  TRACE3(test_start, this, mTestType, mLogFileName);
   return 0;
 }
 
+void
+ClientSocket::TrackPkt(uint32_t aPktId, ClockTime aNow)
+{
+  uint64_t lost = mLoss.Stats().mLost;
+  switch (mLoss.Received(aPktId)) {
+    case LossTracker::PKT_REORDERED:
+      METRICS_ADD(mPktsReordered, 1);
+      break;
+    case LossTracker::PKT_DUPLICATE:
+      METRICS_ADD(mPktsDuplicated, 1);
+      break;
+    default:
+      break;
+  }
+  if (mLoss.Stats().mLost != lost) {
+    METRICS_ADD(mPktsLost, mLoss.Stats().mLost - lost);
+  }
+
+  if (aNow < mNextLossReport) {
+    return;
+  }
+  mNextLossReport = aNow + ClockFromMilliseconds(LOSS_REPORT_INTERVAL);
+  char line[256];
+  int len = snprintf(line, sizeof(line), "%lu LOSS ",
+                     (unsigned long)ClockToMilliseconds(aNow));
+  mLoss.Format(line + len, sizeof(line) - len - 1, false);
+  WriteSummaryLine(line, sizeof(line), false);
+  LogEcn(aNow, false);
+}
+
+void
+ClientSocket::EcnReceived(uint8_t aCodepoint)
+{
+  aCodepoint &= 3;
+  mEcn.Received(aCodepoint);
+  METRICS_ADD(mEcnPkts, 1);
+  if (aCodepoint == ECN_NOT_ECT) {
+    METRICS_ADD(mEcnBleached, 1);
+  } else if (aCodepoint == ECN_CE) {
+    METRICS_ADD(mEcnCe, 1);
+  }
+}
+
+void
+ClientSocket::LogEcn(ClockTime aNow, bool aSummary)
+{
+  if (!mEcn.Enabled()) {
+    return;
+  }
+  char line[256];
+  int len = snprintf(line, sizeof(line), "%lu ECN %s",
+                     (unsigned long)ClockToMilliseconds(aNow),
+                     aSummary ? "SUMMARY " : "");
+  mEcn.Format(line + len, sizeof(line) - len - 1);
+  WriteSummaryLine(line, sizeof(line), aSummary);
+}
+
+void
+ClientSocket::StartSync(bool aEnd, ClockTime aNow)
+{
+  if (!mOwd.Enabled()) {
+    return;
+  }
+  mSyncEnd = aEnd;
+  mSyncSent = 0;
+  mNextSync = aNow;
+}
+
+int
+ClientSocket::SendSync(PRFileDesc *aFd, ClockTime aNow)
+{
+  char pkt[SYNC_PKT_LEN];
+  memset(pkt, 0, sizeof(pkt));
+  // Only this host reads the ID back: the burst and the request in it.
+  uint32_t id = mSyncSent | (mSyncEnd ? 0x80000000 : 0);
+  memcpy(pkt + PKT_ID_START, &id, PKT_ID_LEN);
+  uint32_t ts = ClockToMilliseconds(aNow);
+  memcpy(pkt + TIMESTAMP_START, &ts, TIMESTAMP_LEN);
+  memcpy(pkt + SYNC_START, SYNC, SYNC_LEN);
+  uint64_t sent = htonll(ClockNow());
+  memcpy(pkt + SYNC_SERVER_TX_START, &sent, SYNC_TIME_LEN);
+  int count = PR_SendTo(aFd, pkt, sizeof(pkt), 0, &mNetAddr,
+                        PR_INTERVAL_NO_WAIT);
+  if (count < 0) {
+    PRErrorCode code = PR_GetError();
+    if (code == PR_WOULD_BLOCK_ERROR) {
+      return 0;
+    }
+    return LogErrorWithCode(code, "UDP");
+  }
+  METRICS_ADD(mPktsSent, 1);
+  METRICS_ADD(mBytesSent, count);
+  mNextSync = (++mSyncSent < SYNC_SAMPLES) ?
+              aNow + ClockFromMilliseconds(SYNC_INTERVAL_MS) : 0;
+  return 0;
+}
+
+void
+ClientSocket::SyncReply(const char *aBuf, ClockTime aReceived)
+{
+  uint32_t id;
+  uint64_t serverTx;
+  uint64_t clientRx;
+  uint64_t clientTx;
+  memcpy(&id, aBuf + PKT_ID_START, PKT_ID_LEN);
+  memcpy(&serverTx, aBuf + SYNC_SERVER_TX_START, SYNC_TIME_LEN);
+  memcpy(&clientRx, aBuf + SYNC_CLIENT_RX_START, SYNC_TIME_LEN);
+  memcpy(&clientTx, aBuf + SYNC_CLIENT_TX_START, SYNC_TIME_LEN);
+  serverTx = ntohll(serverTx);
+  if (serverTx < mOwdStart || serverTx > aReceived) {
+    return;
+  }
+  mOwd.SyncSample(id & 0x80000000, serverTx,
+                  (int64_t)ntohll(clientRx) * CLOCK_NS_PER_US,
+                  (int64_t)ntohll(clientTx) * CLOCK_NS_PER_US, aReceived);
+}
+
+void
+ClientSocket::FinishOwd()
+{
+  if (!mOwd.Enabled()) {
+    return;
+  }
+  mNextSync = 0;
+  unsigned long now = ClockToMilliseconds(ClockNow());
+  char line[256];
+  if (!mOwd.Finish()) {
+    snprintf(line, sizeof(line), "%lu OWD SUMMARY no clock sync", now);
+    WriteSummaryLine(line, sizeof(line), true);
+    return;
+  }
+
+  // Test 6 keeps no records, it only gets the summary.
+  const std::vector<OneWayDelay::Record> &records = mOwd.Records();
+  char batch[1024];
+  int batchLen = 0;
+  for (size_t inx = 0; inx < records.size(); inx++) {
+    const OneWayDelay::Record &record = records[inx];
+    int len = snprintf(line, sizeof(line), "%lu OWD %lu ",
+                       (unsigned long)ClockToMilliseconds(record.mServerTime),
+                       (unsigned long)record.mPktId);
+    for (int dir = 0; dir < 2; dir++) {
+      int64_t delay = record.mDelay[dir];
+      if (delay == OWD_UNKNOWN) {
+        len += snprintf(line + len, sizeof(line) - len, "-%s",
+                        dir ? "\n" : " ");
+      } else {
+        len += snprintf(line + len, sizeof(line) - len, "%lld%s",
+                        (long long)(delay / 1000), dir ? "\n" : " ");
+      }
+    }
+    if (batchLen + len > (int)sizeof(batch)) {
+      mLogFile.WriteNonBlocking(batch, batchLen);
+      batchLen = 0;
+    }
+    memcpy(batch + batchLen, line, len);
+    batchLen += len;
+  }
+  if (batchLen) {
+    mLogFile.WriteBlocking(batch, batchLen);
+  }
+
+  int len = snprintf(line, sizeof(line), "%lu OWD SYNC ", now);
+  mOwd.FormatSync(line + len, sizeof(line) - len - 1);
+  WriteSummaryLine(line, sizeof(line), true);
+  for (int dir = 0; dir < 2; dir++) {
+    len = snprintf(line, sizeof(line), "%lu OWD SUMMARY ", now);
+    if (mOwd.FormatSummary((OneWayDelay::Direction)dir, line + len,
+                           sizeof(line) - len - 1) < 0) {
+      continue;
+    }
+    WriteSummaryLine(line, sizeof(line), true);
+  }
+}
+
+void
+ClientSocket::FinishLossTracking()
+{
+  if (mTestType != 5 && mTestType != 6 && mTestType != 8 &&
+      mTestType != 9 && mTestType != 10) {
+    return;
+  }
+  uint64_t lost = mLoss.Stats().mLost;
+  // In Test 5 every packet up to the finish packet has been sent; in Test 6
+  // we only know the end if the finish packet arrived. In Test 10 mNextPktId
+  // follows the highest probe received.
+  if (mTestType != 6 && !mLastPktId) {
+    mLoss.Finish(mNextPktId);
+  } else {
+    mLoss.Finish(mLastPktId);
+  }
+  if (mLoss.Stats().mLost != lost) {
+    METRICS_ADD(mPktsLost, mLoss.Stats().mLost - lost);
+  }
+
+  char line[512];
+  int len = snprintf(line, sizeof(line), "%lu LOSS SUMMARY ",
+                     (unsigned long)ClockToMilliseconds(ClockNow()));
+  mLoss.Format(line + len, sizeof(line) - len - 1, true);
+  WriteSummaryLine(line, sizeof(line), true);
+  LogEcn(ClockNow(), true);
+}
+
+void
+ClientSocket::FinishCpuCost()
+{
+  if (!mTestType) {
+    return;
+  }
+  // Until now; what the worker does for this client after the summary goes
+  // to the metrics only.
+  CpuCostFlush();
+  char line[256];
+  int len = snprintf(line, sizeof(line), "%lu CPU SUMMARY ",
+                     (unsigned long)ClockToMilliseconds(ClockNow()));
+  mCpuCost.Format(line + len, sizeof(line) - len - 1);
+  WriteSummaryLine(line, sizeof(line), true);
+}
+
+void
+ClientSocket::WriteSummaryLine(char *aLine, size_t aSize, bool aBlock)
+{
+  LOG(("NetworkTest UDP server side: Test %d %s", mTestType, aLine));
+  size_t len = strlen(aLine);
+  if (len + 1 < aSize) {
+    aLine[len++] = '\n';
+    aLine[len] = '\0';
+  }
+  if (aBlock) {
+    mLogFile.WriteBlocking(aLine, len);
+  } else {
+    mLogFile.WriteNonBlocking(aLine, len);
+  }
+}
+
 void
 ClientSocket::FormatDataPkt(uint32_t aTS)
 {
@@ -483,14 +1467,30 @@ ClientSocket::FormatDataPkt(uint32_t aTS)
 
   // Add timestamp.
   memcpy(mSendBuf + TIMESTAMP_START, &aTS, TIMESTAMP_LEN);
+
+  // The payload buffer is shared by all clients of the port thread, so the
+  // FINISH mark of another client may still be there.
+  memset(mSendBuf + FINISH_START, 0, FINISH_LEN);
 }
 
 void
 ClientSocket::FormatFinishPkt()
 {
   memcpy(mSendBuf + FINISH_START, FINISH, FINISH_LEN);
+  if (mTestType == 8) {
+    uint64_t capacity = htonll(mTrain.Capacity());
+    memcpy(mSendBuf + TRAIN_CAPACITY_START, &capacity, TRAIN_CAPACITY_LEN);
+    uint64_t availBw = htonll(mTrain.AvailableBandwidth());
+    memcpy(mSendBuf + TRAIN_AVAIL_BW_START, &availBw, TRAIN_AVAIL_BW_LEN);
+    uint32_t pmtu = htonl(mTrain.Pmtu());
+    memcpy(mSendBuf + TRAIN_PMTU_START, &pmtu, TRAIN_PMTU_LEN);
+    uint32_t pmtuLost = htonl(mTrain.PmtuLost());
+    memcpy(mSendBuf + TRAIN_PMTU_LOST_START, &pmtuLost, TRAIN_PMTU_LOST_LEN);
+  }
 }
 
+
+
 uint32_t
 ClientSocket::ReadACKPktAndLog(char *aBuf, uint32_t aTS)
 {
@@ -526,9 +1526,52 @@ ClientSocket::ReadACKPktAndLog(char *aBuf, uint32_t aTS)
   return pktId;
 }
 
+static char sCpuCostFormat[] =
+  "Cost: [timestamp] CPU SUMMARY wall_ns [n] user_us [n] system_us [n]\n"
+  "                          voluntary_csw [n] involuntary_csw [n] (cycles [n]\n"
+  "                          instructions [n] cache_misses [n] with -P)\n";
+
 void
 ClientSocket::LogLogFormat()
 {
+  if (mTestType == 10) {
+    char line[] = "Probe echoed: [us since the first probe] P [pkt id] [kernel receive to\n"
+                  "                          user space ns] [user space to send call ns]\n"
+                  "                          [send call to kernel send ns, -1 if unknown]\n"
+                  "Loss of probes (every second and a SUMMARY at the end):\n"
+                  "                          [timestamp] LOSS (SUMMARY) received [n] lost [n]\n"
+                  "                          ([loss rate]) bursts [n] max burst [n] reordered\n"
+                  "                          [n] max distance [n] duplicates [n] late [n]\n"
+                  "Result: [timestamp] PROBE [recv|proc|send|total] n [n] p50 [ns] p90 [ns]\n"
+                  "                          p99 [ns] p999 [ns] max [ns] (total: kernel\n"
+                  "                          receive to kernel send, or to the send call)\n";
+    mLogFile.WriteBlocking(line, strlen(line));
+    mLogFile.WriteBlocking(sCpuCostFormat, strlen(sCpuCostFormat));
+    return;
+  }
+  if (mTestType == 6) {
+    char line[] = "Loss of received pkts (every second and a SUMMARY at the end):\n"
+                  "                          [timestamp] LOSS (SUMMARY) received [n] lost [n]\n"
+                  "                          ([loss rate]) bursts [n] max burst [n] reordered\n"
+                  "                          [n] max distance [n] duplicates [n] late [n]\n";
+    mLogFile.WriteBlocking(line, strlen(line));
+    if (mEcn.Enabled()) {
+      char lineEcn[] = "ECN of received pkts (with the loss): [timestamp] ECN (SUMMARY) sent\n"
+                       "                          [ect0|ect1] received [n] not_ect [n] ect1 [n]\n"
+                       "                          ect0 [n] ce [n] bleached [ratio] ce [ratio]\n";
+      mLogFile.WriteBlocking(lineEcn, strlen(lineEcn));
+    }
+    if (mOwd.Enabled()) {
+      char lineOwd[] = "Clock sync: [timestamp] OWD SYNC start_rtt_us [n] end_rtt_us [n] drift_ppm\n"
+                       "                          [drift of the client clock or unknown]\n"
+                       "Result: [timestamp] OWD SUMMARY [down|up] n [n] min_us [n] p50_us [n]\n"
+                       "                          p90_us [n] p99_us [n] max_us [n] pdv_us [p99 -\n"
+                       "                          min] ipdv_us [mean change between pkts]\n";
+      mLogFile.WriteBlocking(lineOwd, strlen(lineOwd));
+    }
+    mLogFile.WriteBlocking(sCpuCostFormat, strlen(sCpuCostFormat));
+    return;
+  }
   char line1[] = "Data pkt has been sent: [timestamp pkt sent] SEND [pkt id] [pkt are sent in \n"
                  "                        equal intervals log time when it should have been\n"
                  "                        sent(this is for the analysis whether the gap between\n"
@@ -542,6 +1585,244 @@ ClientSocket::LogLogFormat()
   char line3[] = "An ACK has been received: [timestamp ack was received] ACK [pkt id]\n"
                  "                          [timestamp data pkt was sent by the sender (this\n"
                  "                          host)] [time when data packet was received by the\n"
-                 "                          receiver] [time when ack was sent by the receiver]";
+                 "                          receiver] [time when ack was sent by the receiver]\n";
   mLogFile.WriteBlocking(line3, strlen(line3));
+
+  char line4[] = "Loss of ACKed pkts (every second and a SUMMARY at the end):\n"
+                 "                          [timestamp] LOSS (SUMMARY) received [n] lost [n]\n"
+                 "                          ([loss rate]) bursts [n] max burst [n] reordered\n"
+                 "                          [n] max distance [n] duplicates [n] late [n]\n";
+  mLogFile.WriteBlocking(line4, strlen(line4));
+
+  if (mEcn.Enabled()) {
+    char line7[] = "ECN of the ACKed pkts (with the loss): [timestamp] ECN (SUMMARY) sent\n"
+                   "                          [ect0|ect1|not_ect if the socket cannot set it]\n"
+                   "                          received [n] not_ect [n] ect1 [n]\n"
+                   "                          ect0 [n] ce [n] bleached [ratio] ce [ratio]\n";
+    mLogFile.WriteBlocking(line7, strlen(line7));
+  }
+  if (mOwd.Enabled()) {
+    char line8[] = "One-way delay of the ACKed pkts (at the end): [time data pkt was sent]\n"
+                   "                          OWD [pkt id] [server to client us] [client to\n"
+                   "                          server us] (- if unknown)\n"
+                   "Clock sync: [timestamp] OWD SYNC start_rtt_us [n] end_rtt_us [n] drift_ppm\n"
+                   "                          [drift of the client clock or unknown]\n"
+                   "Result: [timestamp] OWD SUMMARY [down|up] n [n] min_us [n] p50_us [n]\n"
+                   "                          p90_us [n] p99_us [n] max_us [n] pdv_us [p99 -\n"
+                   "                          min] ipdv_us [mean change between pkts]\n";
+    mLogFile.WriteBlocking(line8, strlen(line8));
+  }
+  if (mTestType == 8) {
+    char line5[] = "Test 8 data pkt: [timestamp pkt sent] SEND [pkt id] [train] [size]\n"
+                   "Per train estimate:  [timestamp] TRAIN [train] acked [n] capacity [bit/s]\n"
+                   "                     available [bit/s] queuing from [pkt in train or -1]\n"
+                   "Result: [timestamp] CAPACITY [bit/s] AVAILABLE [bit/s]\n"
+                   "Path MTU probes: [timestamp] TRAIN [sweep] acked [n] largest [bytes]\n"
+                   "Result: [timestamp] PMTU [largest acked payload] LOST [smallest larger\n"
+                   "                     payload never acked or 0]\n";
+    mLogFile.WriteBlocking(line5, strlen(line5));
+  }
+  if (mTestType == 9) {
+    char line6[] = "Controller: [timestamp] RATE [state] pacing [pkt/s] btlbw [pkt/s]\n"
+                   "                          minrtt [us] cwnd [pkts] inflight [pkts]\n"
+                   "Result: [timestamp] RATE SUMMARY btlbw [bit/s] minrtt [us] rounds [n]\n"
+                   "                          goodput [bit/s]\n";
+    mLogFile.WriteBlocking(line6, strlen(line6));
+  }
+  mLogFile.WriteBlocking(sCpuCostFormat, strlen(sCpuCostFormat));
+}
+
+int
+ClientSocket::EchoProbe(PRFileDesc *aFd, int32_t aCount, char *aBuf,
+                        uint64_t aKernelRx, bool aStampTx, bool &aTxStamped)
+{
+  uint64_t userRx = ClockRealtime();
+  aTxStamped = false;
+  if (aCount < PROBE_MIN_SIZE) {
+    return 0;
+  }
+  if (!aKernelRx || aKernelRx > userRx) {
+    aKernelRx = userRx;
+  }
+  bool first = (memcmp(aBuf + TYPE_START, TEST_prefix,
+                       strlen(TEST_prefix)) == 0);
+  bool finish = (memcmp(aBuf + FINISH_START, FINISH, FINISH_LEN) == 0);
+  if (!first && !finish && memcmp(aBuf + PROBE_START, PROBE, PROBE_LEN)) {
+    return 0;
+  }
+  bool record = (mPhase == RUN_TEST) && !first && !finish &&
+                mProbes.size() < PROBE_MAX_RECORDS;
+  aStampTx = aStampTx && record;
+
+  // Echo right away, from the receive buffer.
+  uint64_t userTx = ClockRealtime();
+  uint64_t residence = htonll(userTx - aKernelRx);
+  memcpy(aBuf + PROBE_RESIDENCE_START, &residence, PROBE_RESIDENCE_LEN);
+  int32_t count = aStampTx ?
+                  SendToStamped(aFd, aBuf, aCount, &mNetAddr) :
+                  PR_SendTo(aFd, aBuf, aCount, 0, &mNetAddr,
+                            PR_INTERVAL_NO_WAIT);
+  if (count < 0) {
+    PRErrorCode code = PR_GetError();
+    if (code != PR_WOULD_BLOCK_ERROR) {
+      return LogErrorWithCode(code, "UDP");
+    }
+    // The client sees it as a lost probe.
+    record = false;
+  } else {
+    aTxStamped = aStampTx;
+    mSentBytes += count;
+    METRICS_ADD(mPktsSent, 1);
+    METRICS_ADD(mBytesSent, count);
+  }
+
+  ClockTime now = ClockNow();
+  mLastReceivedTimeout = now + mNodataTimeout;
+  mRecvBytes += aCount;
+  mRecvPkts++;
+  if (first || mPhase != RUN_TEST) {
+    return 0;
+  }
+
+  uint32_t pktId;
+  memcpy(&pktId, aBuf + PKT_ID_START, PKT_ID_LEN);
+  if (finish) {
+    mLastPktId = pktId;
+    mPhase = WAIT_FINISH_TIMEOUT;
+    mNextTimeToDoSomething = now + ClockFromMilliseconds(SHUTDOWNTIMEOUT);
+    return 0;
+  }
+  TrackPkt(pktId, now);
+  if (pktId - mNextPktId < 0x80000000) {
+    mNextPktId = pktId + 1;
+  }
+  if (record) {
+    ProbeRecord probe;
+    probe.mPktId = pktId;
+    probe.mRecvDelay = userRx - aKernelRx;
+    probe.mProcessing = userTx - userRx;
+    probe.mSendDelay = aTxStamped ? PROBE_TX_PENDING : PROBE_TX_UNKNOWN;
+    probe.mKernelRx = aKernelRx;
+    mProbes.push_back(probe);
+    if (!aTxStamped) {
+      LogProbes(false);
+    }
+  }
+
+  uint32_t maxTimeMs = std::min(mLimits.mMaxTimeMs, ServerMaxTimeMs());
+  if (now - mFirstPktReceived > ClockFromMilliseconds(maxTimeMs)) {
+    LOG(("NetworkTest UDP server side: Test 10 max time reached."));
+    mPhase = WAIT_FINISH_TIMEOUT;
+    mNextTimeToDoSomething = now + ClockFromMilliseconds(SHUTDOWNTIMEOUT);
+  }
+  return 0;
+}
+
+void
+ClientSocket::ProbeTxStamp(uint64_t aKernelTx)
+{
+  while (mNextTxStamp < mProbes.size() &&
+         mProbes[mNextTxStamp].mSendDelay != PROBE_TX_PENDING) {
+    mNextTxStamp++;
+  }
+  if (mNextTxStamp == mProbes.size()) {
+    return;
+  }
+  ProbeRecord &probe = mProbes[mNextTxStamp++];
+  uint64_t sent = probe.mKernelRx + probe.mRecvDelay + probe.mProcessing;
+  if (aKernelTx < sent || aKernelTx - sent >= PROBE_TX_UNKNOWN) {
+    probe.mSendDelay = PROBE_TX_UNKNOWN;
+  } else {
+    probe.mSendDelay = aKernelTx - sent;
+  }
+  LogProbes(false);
+}
+
+void
+ClientSocket::LogProbes(bool aFlush)
+{
+  while (mNextProbeLog < mProbes.size() &&
+         mProbes[mNextProbeLog].mSendDelay != PROBE_TX_PENDING) {
+    const ProbeRecord &probe = mProbes[mNextProbeLog++];
+    char line[96];
+    int len = snprintf(line, sizeof(line), "%llu P %lu %lu %lu ",
+                       (unsigned long long)
+                         ((probe.mKernelRx - mProbes[0].mKernelRx) /
+                          CLOCK_NS_PER_US),
+                       (unsigned long)probe.mPktId,
+                       (unsigned long)probe.mRecvDelay,
+                       (unsigned long)probe.mProcessing);
+    if (probe.mSendDelay == PROBE_TX_UNKNOWN) {
+      len += snprintf(line + len, sizeof(line) - len, "-1\n");
+    } else {
+      len += snprintf(line + len, sizeof(line) - len, "%lu\n",
+                      (unsigned long)probe.mSendDelay);
+    }
+    if (mProbeLogLen + len > (int)sizeof(mProbeLog)) {
+      mLogFile.WriteNonBlocking(mProbeLog, mProbeLogLen);
+      mProbeLogLen = 0;
+    }
+    memcpy(mProbeLog + mProbeLogLen, line, len);
+    mProbeLogLen += len;
+  }
+  if (aFlush && mProbeLogLen) {
+    mLogFile.WriteBlocking(mProbeLog, mProbeLogLen);
+    mProbeLogLen = 0;
+  }
+}
+
+void
+ClientSocket::FinishProbes()
+{
+  if (mTestType != 10) {
+    return;
+  }
+  // Send timestamps that have not come by now are lost.
+  for (size_t inx = mNextTxStamp; inx < mProbes.size(); inx++) {
+    if (mProbes[inx].mSendDelay == PROBE_TX_PENDING) {
+      mProbes[inx].mSendDelay = PROBE_TX_UNKNOWN;
+    }
+  }
+  mNextTxStamp = mProbes.size();
+  LogProbes(true);
+
+  std::vector<uint64_t> values[4];
+  static const char *names[4] = { "recv", "proc", "send", "total" };
+  for (int inx = 0; inx < 4; inx++) {
+    values[inx].reserve(mProbes.size());
+  }
+  for (size_t inx = 0; inx < mProbes.size(); inx++) {
+    const ProbeRecord &probe = mProbes[inx];
+    uint64_t total = (uint64_t)probe.mRecvDelay + probe.mProcessing;
+    values[0].push_back(probe.mRecvDelay);
+    values[1].push_back(probe.mProcessing);
+    if (probe.mSendDelay != PROBE_TX_UNKNOWN) {
+      values[2].push_back(probe.mSendDelay);
+      total += probe.mSendDelay;
+    }
+    values[3].push_back(total);
+  }
+
+  unsigned long now = ClockToMilliseconds(ClockNow());
+  for (int inx = 0; inx < 4; inx++) {
+    std::vector<uint64_t> &v = values[inx];
+    if (v.empty()) {
+      continue;
+    }
+    // Each percentile only has to look at the values above the last one.
+    size_t p50 = PercentileIndex(v, 0, 50.0);
+    size_t p90 = PercentileIndex(v, p50, 90.0);
+    size_t p99 = PercentileIndex(v, p90, 99.0);
+    size_t p999 = PercentileIndex(v, p99, 99.9);
+    uint64_t max = *std::max_element(v.begin() + p999, v.end());
+    char line[256];
+    snprintf(line, sizeof(line),
+             "%lu PROBE %s n %lu p50 %llu p90 %llu p99 %llu p999 %llu max "
+             "%llu\n", now, names[inx], (unsigned long)v.size(),
+             (unsigned long long)v[p50], (unsigned long long)v[p90],
+             (unsigned long long)v[p99], (unsigned long long)v[p999],
+             (unsigned long long)max);
+    LOG(("NetworkTest UDP server side: Test 10 %s", line));
+    mLogFile.WriteBlocking(line, strlen(line));
+  }
 }
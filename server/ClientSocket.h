@@ -8,58 +8,179 @@
 #define CLIENTSOCKET_H__
 
 #include "Ack.h"
+#include "Ecn.h"
+#include "OneWayDelay.h"
 #include "config.h"
 #include "FileWriter.h"
+#include "TestLimits.h"
+#include "LossTracker.h"
+#include "PacketTrain.h"
+#include "RateController.h"
+#include "Clock.h"
+#include "CpuCost.h"
 #include "prnetdb.h"
 #include <vector>
 
 class ClientSocket
 {
 public:
-  ClientSocket(PRNetAddr *aAddr);
+  // Slots are constructed once by ClientPool and serve one peer between
+  // Start() and Stop(). aSendBuf is the pool's shared random payload of
+  // PAYLOADSIZE_MAX bytes. Data packets are at most aMaxPayloadSize bytes.
+  ClientSocket();
   ~ClientSocket();
+  void Start(const PRNetAddr *aAddr, char *aSendBuf,
+             uint32_t aMaxPayloadSize);
+  void Stop();
   int MaybeSendSomethingOrCheckFinish(PRFileDesc *aFd,
                                       bool &aClientFinished);
   int SendAcks(PRFileDesc *aFd);
   bool IsThisSocket(const PRNetAddr *aAddr);
-  int NewPkt(int32_t aCount, char *aBuf);
+  // aTos is the IP TOS byte of the datagram, -1 if unknown.
+  int NewPkt(int32_t aCount, char *aBuf, int aTos);
   int NoDataForTooLong();
   int WaitForFinishTimeout();
   int RunTestSend(PRFileDesc *aFd);
+  int RunTrainSend(PRFileDesc *aFd);
+  int RunControlledSend(PRFileDesc *aFd);
   int SendFinishPacket(PRFileDesc *aFd);
+  size_t AcksQueued() { return mAcksToSend.size(); }
+  // Transmit budget given by the UDPserver scheduler (deficit round robin):
+  // a slice adds aQuantum bytes and ends at aSliceEnd. EndTxSlice() returns
+  // true if packets are still due.
+  void StartTxSlice(int64_t aQuantum, ClockTime aSliceEnd);
+  bool EndTxSlice(ClockTime aNow);
+  // Test 10 probes bypass NewPkt(): the UDPserver thread echoes them with
+  // EchoProbe() as soon as they are read. aKernelRx is the kernel receive
+  // time (CLOCK_REALTIME ns, 0 if unknown). If aStampTx the echo may ask for
+  // a kernel send timestamp (aTxStamped), which must then be handed to
+  // ProbeTxStamp() in send order (0 if it never came).
+  bool IsProbing()
+  {
+    return mTestType == 10 &&
+           (mPhase == RUN_TEST || mPhase == WAIT_FINISH_TIMEOUT);
+  }
+  int EchoProbe(PRFileDesc *aFd, int32_t aCount, char *aBuf,
+                uint64_t aKernelRx, bool aStampTx, bool &aTxStamped);
+  void ProbeTxStamp(uint64_t aKernelTx);
+  // The UDPserver thread charges its CPU here while it works for this client
+  // (CpuCostCharge()).
+  CpuCost* Cost() { return &mCpuCost; }
 
 private:
+  // Microbenchmarks of the per packet functions (Benchmarks.cpp).
+  friend class ClientSocketBench;
+
   void FormatStartPkt(uint32_t aTS);
   void FormatDataPkt(uint32_t aTS);
   void FormatFinishPkt();
   uint32_t ReadACKPktAndLog(char *aBuf, uint32_t aTS);
   void LogLogFormat();
-  int FirstPacket(int32_t aCount, char *aBuf, PRIntervalTime received);
+  // A result line without the new line to the debug log and the log of the
+  // test; aLine has aSize bytes of room.
+  void WriteSummaryLine(char *aLine, size_t aSize, bool aBlock);
+  int FirstPacket(int32_t aCount, char *aBuf, ClockTime received);
+  void TrackPkt(uint32_t aPktId, ClockTime aNow);
+  void FinishLossTracking();
+  void LogRate(ClockTime aNow, uint64_t aInflight, bool aSummary);
+  void LogProbes(bool aFlush);
+  void FinishProbes();
+  void FinishCpuCost();
+  void EcnReceived(uint8_t aCodepoint);
+  void LogEcn(ClockTime aNow, bool aSummary);
+  void StartSync(bool aEnd, ClockTime aNow);
+  int SendSync(PRFileDesc *aFd, ClockTime aNow);
+  void SyncReply(const char *aBuf, ClockTime aReceived);
+  void FinishOwd();
+  // A Test 5 or 9 data or finish packet of aSize bytes from mSendBuf.
+  int32_t SendData(PRFileDesc *aFd, uint32_t aSize);
+  bool TxBudget(uint32_t aSize, ClockTime aNow)
+  {
+    return mTxDeficit >= (int64_t)aSize && aNow < mTxSliceEnd;
+  }
 
 private:
   PRNetAddr mNetAddr;
   int mTestType;
-  char mSendBuf[PAYLOADSIZE];
-  char mRecvBuf[PAYLOADSIZE];
+  // Data packets are mPayloadSize bytes (requested in the first packet).
+  char *mSendBuf;
+  uint32_t mPayloadSize;
+  uint32_t mMaxPayloadSize;
   int mReplySize;
-  PRIntervalTime mFirstPktSent;
-  PRIntervalTime mFirstPktReceived;
-  PRIntervalTime mNextTimeToDoSomething;
+  ClockTime mFirstPktSent;
+  ClockTime mFirstPktReceived;
+  ClockTime mNextTimeToDoSomething;
   uint64_t mSentBytes;
   uint64_t mRecvBytes;
+  uint64_t mRecvPkts;
   std::vector<Ack> mAcksToSend;
   int mNumberOfRetransFinish;
   uint64_t mPktPerSec;
+  TestLimits mLimits;
   double mPktInterval;
   double mNextToSendInns;
   char mPktIdFirstPkt[4];
   uint64_t mPktPerSecObserved;
   uint32_t mNextPktId;
   uint32_t mLastPktId;
-  PRIntervalTime mNodataTimeout;
-  PRIntervalTime mLastReceivedTimeout;
+  ClockTime mNodataTimeout;
+  ClockTime mLastReceivedTimeout;
   bool mError;
 
+  // Loss, reordering and duplicates of ACKed (Test 5) or received (Test 6)
+  // data packets.
+  LossTracker mLoss;
+  ClockTime mNextLossReport;
+
+  // ECN codepoints of the data packets (Test 5 and 6), reported with the
+  // loss.
+  EcnTracker mEcn;
+
+  // One-way delays (Test 5, 6 and 9 with SYNC_MODE). mNextSync is the time
+  // of the next clock sync request of the burst in progress, 0 if none.
+  OneWayDelay mOwd;
+  bool mSyncEnd;
+  uint32_t mSyncSent;
+  ClockTime mNextSync;
+  ClockTime mOwdStart;
+
+  // Test 8 schedule and ACK times.
+  PacketTrain mTrain;
+
+  // Test 9 rate controller; mRcBlocked is set while the window is full.
+  RateController mRc;
+  bool mRcBlocked;
+  ClockTime mNextRateLog;
+  RateController::State mLoggedRcState;
+
+  // Bytes this client may still send in the current round; negative after a
+  // packet train that did not fit.
+  int64_t mTxDeficit;
+  ClockTime mTxSliceEnd;
+
+  // Test 10 probes in the order they were echoed. Times are in ns.
+  struct ProbeRecord
+  {
+    uint32_t mPktId;
+    // Kernel receive to user space receive.
+    uint32_t mRecvDelay;
+    // User space receive to the send call of the echo.
+    uint32_t mProcessing;
+    // Send call to kernel send, or PROBE_TX_PENDING / PROBE_TX_UNKNOWN.
+    uint32_t mSendDelay;
+    uint64_t mKernelRx;
+  };
+  std::vector<ProbeRecord> mProbes;
+  // First probe that may still wait for its send timestamp, first probe not
+  // logged yet.
+  size_t mNextTxStamp;
+  size_t mNextProbeLog;
+  // Probe lines are batched before they go to mLogFile.
+  char mProbeLog[512];
+  int mProbeLogLen;
+
+  CpuCost mCpuCost;
+
   FileWriter mLogFile;
   char mLogFileName[FILE_NAME_LEN];
 
@@ -72,7 +193,7 @@ private:
   };
 
   enum PHASE mPhase;
-  char mLogstr[80];
+  char mLogstr[128];
 };
 
 #endif
@@ -0,0 +1,72 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Clock.h"
+#include "prlog.h"
+#include <cstring>
+#include <stdlib.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+extern PRLogModuleInfo* gServerTestLog;
+#define LOG(args) PR_LOG(gServerTestLog, PR_LOG_DEBUG, args)
+
+// The TSC is calibrated against CLOCK_MONOTONIC_RAW over this time.
+#define CLOCK_CALIBRATION_NS (20 * CLOCK_NS_PER_MS)
+
+ClockCalibration gClock = { false, 0, 0, 0 };
+
+#if defined(__x86_64__)
+static bool
+HasInvariantTsc()
+{
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+    return false;
+  }
+  __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+  return edx & (1 << 8);
+}
+#endif
+
+void
+ClockInit()
+{
+  gClock.mUseTsc = false;
+#if defined(__x86_64__)
+  const char *source = getenv("NETWORK_TEST_CLOCK");
+  if ((source && strcmp(source, "monotonic") == 0) || !HasInvariantTsc()) {
+    LOG(("NetworkTest clock: using %s.", ClockSource()));
+    return;
+  }
+
+  ClockTime start = ClockMonotonicRaw();
+  uint64_t tscStart = __rdtsc();
+  ClockTime end;
+  do {
+    end = ClockMonotonicRaw();
+  } while (end - start < CLOCK_CALIBRATION_NS);
+  uint64_t tscEnd = __rdtsc();
+  if (tscEnd <= tscStart) {
+    return;
+  }
+
+  gClock.mTscMult = (uint64_t)((((unsigned __int128)(end - start)) << 32) /
+                               (tscEnd - tscStart));
+  gClock.mTscBase = tscEnd;
+  gClock.mNsBase = end;
+  gClock.mUseTsc = true;
+  LOG(("NetworkTest clock: using tsc, %.3f ticks per ns.",
+       (double)(tscEnd - tscStart) / (double)(end - start)));
+#endif
+}
+
+const char*
+ClockSource()
+{
+  return gClock.mUseTsc ? "tsc" : "clock_gettime(CLOCK_MONOTONIC_RAW)";
+}
@@ -0,0 +1,101 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NETWORK_TESTS_CLOCK_H__
+#define NETWORK_TESTS_CLOCK_H__
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * Monotonic clock with nanosecond resolution used for pacing and timestamps.
+ *
+ * The NSPR interval clock has millisecond ticks on Linux and wraps after
+ * 49 days, which is too coarse for pacing Test 5. ClockNow() reads the TSC
+ * and scales it with a factor calibrated against CLOCK_MONOTONIC_RAW if the
+ * CPU has an invariant TSC; otherwise (or if NETWORK_TEST_CLOCK=monotonic is
+ * set) it calls clock_gettime(CLOCK_MONOTONIC_RAW), which goes through the
+ * vDSO.
+ *
+ * ClockInit() must be called once before any thread uses the clock.
+ */
+
+typedef uint64_t ClockTime;
+
+#define CLOCK_NS_PER_US 1000ULL
+#define CLOCK_NS_PER_MS 1000000ULL
+#define CLOCK_NS_PER_SEC 1000000000ULL
+
+struct ClockCalibration
+{
+  bool mUseTsc;
+  uint64_t mTscBase;
+  ClockTime mNsBase;
+  // Nanoseconds per TSC tick as a 32.32 fixed point number.
+  uint64_t mTscMult;
+};
+
+extern ClockCalibration gClock;
+
+void ClockInit();
+// "tsc" or "clock_gettime(CLOCK_MONOTONIC_RAW)".
+const char* ClockSource();
+
+inline ClockTime
+ClockMonotonicRaw()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (ClockTime)ts.tv_sec * CLOCK_NS_PER_SEC + ts.tv_nsec;
+}
+
+inline ClockTime
+ClockNow()
+{
+#if defined(__x86_64__)
+  if (gClock.mUseTsc) {
+    uint64_t ticks = __rdtsc() - gClock.mTscBase;
+    return gClock.mNsBase +
+           (ClockTime)(((unsigned __int128)ticks * gClock.mTscMult) >> 32);
+  }
+#endif
+  return ClockMonotonicRaw();
+}
+
+// Kernel packet timestamps (SO_TIMESTAMPING) are CLOCK_REALTIME, so the user
+// space times they are compared with must be too. Only for short differences:
+// the clock can be stepped.
+inline uint64_t
+ClockRealtime()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * CLOCK_NS_PER_SEC + ts.tv_nsec;
+}
+
+// Timestamps in packets and logs are in milliseconds and wrap.
+inline uint32_t
+ClockToMilliseconds(ClockTime aTime)
+{
+  return (uint32_t)(aTime / CLOCK_NS_PER_MS);
+}
+
+inline uint64_t
+ClockToMicroseconds(ClockTime aTime)
+{
+  return aTime / CLOCK_NS_PER_US;
+}
+
+inline ClockTime
+ClockFromMilliseconds(uint64_t aMs)
+{
+  return aMs * CLOCK_NS_PER_MS;
+}
+
+#endif
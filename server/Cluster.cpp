@@ -0,0 +1,298 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Cluster.h"
+#include "HelpFunctions.h"
+#include "Metrics.h"
+#include "Placement.h"
+#include "prlog.h"
+#include "prnetdb.h"
+#include "prthread.h"
+#include <atomic>
+#include <cstring>
+#include <stdio.h>
+#include <string>
+
+extern PRLogModuleInfo* gServerTestLog;
+#define LOG(args) PR_LOG(gServerTestLog, PR_LOG_DEBUG, args)
+
+struct ClusterPeer
+{
+  PRNetAddr mAddr;
+  uint32_t mActive;
+  uint32_t mMax;
+  uint32_t mLatenessUs;
+  // When the last summary came, 0 before the first one.
+  PRIntervalTime mHeard;
+};
+
+// Only used by the cluster thread after StartCluster().
+static ClusterPeer sPeers[CLUSTER_MAX_PEERS];
+static int sNumberOfPeers = 0;
+static PRNetAddr sBindAddr;
+static uint32_t sMaxTests = CLUSTER_DEFAULT_MAX_TESTS;
+static bool sLoaded = false;
+static uint64_t sLastLateness[METRICS_LATENESS_BUCKETS];
+// What the gauges were set to last (Metrics.h).
+static uint64_t sLastPeers = 0;
+static uint64_t sLastLoaded = 0;
+
+// The redirect target (0 for none) and how many tests may still go there.
+// Read by the UDP workers, only for the first packet of a new test.
+static std::atomic<uint32_t> sTargetIp(0);
+static std::atomic<int64_t> sBudget(0);
+
+int
+ClusterInit(const char *aPeers, const PRNetAddr *aBind, uint32_t aMaxTests)
+{
+  if (aBind) {
+    sBindAddr = *aBind;
+  } else {
+    PR_SetNetAddr(PR_IpAddrAny, PR_AF_INET, 0, &sBindAddr);
+  }
+  sBindAddr.inet.port = PR_htons(CLUSTER_PORT);
+  sMaxTests = aMaxTests ? aMaxTests : 1;
+
+  std::string peers(aPeers);
+  size_t start = 0;
+  while (start <= peers.size()) {
+    size_t end = peers.find(',', start);
+    if (end == std::string::npos) {
+      end = peers.size();
+    }
+    std::string peer = peers.substr(start, end - start);
+    start = end + 1;
+    if (peer.empty()) {
+      continue;
+    }
+    PRNetAddr addr;
+    if (PR_StringToNetAddr(peer.c_str(), &addr) != PR_SUCCESS ||
+        addr.raw.family != PR_AF_INET) {
+      fprintf(stderr, "Cluster peer %s is not an IPv4 address.\n",
+              peer.c_str());
+      return -1;
+    }
+    if (addr.inet.ip == sBindAddr.inet.ip) {
+      continue;
+    }
+    if (sNumberOfPeers == CLUSTER_MAX_PEERS) {
+      fprintf(stderr, "More than %d cluster peers.\n", CLUSTER_MAX_PEERS);
+      return -1;
+    }
+    ClusterPeer &entry = sPeers[sNumberOfPeers++];
+    memset(&entry, 0, sizeof(entry));
+    entry.mAddr = addr;
+    entry.mAddr.inet.port = PR_htons(CLUSTER_PORT);
+  }
+  return 0;
+}
+
+static void
+ReadValue(const char *aBuf, int aStart, uint32_t *aValue)
+{
+  memcpy(aValue, aBuf + aStart, CLUSTER_VALUE_LEN);
+  *aValue = ntohl(*aValue);
+}
+
+static void
+WriteValue(char *aBuf, int aStart, uint32_t aValue)
+{
+  aValue = htonl(aValue);
+  memcpy(aBuf + aStart, &aValue, CLUSTER_VALUE_LEN);
+}
+
+static void
+ReceiveSummary(const PRNetAddr *aFrom, const char *aBuf, int32_t aCount)
+{
+  if (aCount < CLUSTER_PKT_LEN ||
+      memcmp(aBuf + CLUSTER_LOAD_START, CLUSTER_LOAD, CLUSTER_LOAD_LEN)) {
+    return;
+  }
+  for (int inx = 0; inx < sNumberOfPeers; inx++) {
+    ClusterPeer &peer = sPeers[inx];
+    if (peer.mAddr.inet.ip != aFrom->inet.ip) {
+      continue;
+    }
+    ReadValue(aBuf, CLUSTER_ACTIVE_START, &peer.mActive);
+    ReadValue(aBuf, CLUSTER_MAX_START, &peer.mMax);
+    ReadValue(aBuf, CLUSTER_LATENESS_START, &peer.mLatenessUs);
+    if (!peer.mMax) {
+      peer.mMax = 1;
+    }
+    // 0 means not heard from.
+    peer.mHeard = PR_IntervalNow() | 1;
+    return;
+  }
+}
+
+// The 90th percentile of the pacing lateness since the last call, 0 if
+// there were too few paced packets to tell.
+static uint32_t
+LatenessP90(const uint64_t *aLateness)
+{
+  uint64_t delta[METRICS_LATENESS_BUCKETS];
+  uint64_t total = 0;
+  for (int inx = 0; inx < METRICS_LATENESS_BUCKETS; inx++) {
+    delta[inx] = aLateness[inx] - sLastLateness[inx];
+    sLastLateness[inx] = aLateness[inx];
+    total += delta[inx];
+  }
+  if (total < CLUSTER_MIN_LATENESS_SAMPLES) {
+    return 0;
+  }
+  uint64_t count = 0;
+  for (int inx = 0; inx < METRICS_LATENESS_BUCKETS; inx++) {
+    count += delta[inx];
+    if (count * 10 >= total * 9) {
+      return MetricsLatenessBoundUs(inx);
+    }
+  }
+  return MetricsLatenessBoundUs(METRICS_LATENESS_BUCKETS - 1);
+}
+
+static bool
+IsLoaded(uint32_t aActive, uint32_t aMax, uint32_t aLatenessUs)
+{
+  return aActive >= aMax || aLatenessUs > CLUSTER_MAX_LATENESS_US;
+}
+
+// Send our summary to every peer and pick the redirect target.
+static void
+Update(PRFileDesc *aFd)
+{
+  uint64_t active;
+  uint64_t lateness[METRICS_LATENESS_BUCKETS];
+  MetricsLoad(&active, lateness);
+  uint32_t latenessUs = LatenessP90(lateness);
+  if (active > UINT32_MAX) {
+    active = UINT32_MAX;
+  }
+
+  char buf[CLUSTER_PKT_LEN];
+  memcpy(buf + CLUSTER_LOAD_START, CLUSTER_LOAD, CLUSTER_LOAD_LEN);
+  WriteValue(buf, CLUSTER_ACTIVE_START, active);
+  WriteValue(buf, CLUSTER_MAX_START, sMaxTests);
+  WriteValue(buf, CLUSTER_LATENESS_START, latenessUs);
+
+  PRIntervalTime now = PR_IntervalNow();
+  PRIntervalTime timeout = PR_MillisecondsToInterval(CLUSTER_PEER_TIMEOUT_MS);
+  int fresh = 0;
+  ClusterPeer *target = nullptr;
+  for (int inx = 0; inx < sNumberOfPeers; inx++) {
+    ClusterPeer &peer = sPeers[inx];
+    if (PR_SendTo(aFd, buf, sizeof(buf), 0, &peer.mAddr,
+                  PR_INTERVAL_NO_WAIT) < 0) {
+      // The peer may not be up yet; its address is still valid.
+      LOG(("NetworkTest cluster: Sending the load to a peer failed %d",
+           PR_GetError()));
+    }
+    if (!peer.mHeard || (PRIntervalTime)(now - peer.mHeard) > timeout) {
+      continue;
+    }
+    fresh++;
+    if (IsLoaded(peer.mActive, peer.mMax, peer.mLatenessUs)) {
+      continue;
+    }
+    if (!target ||
+        (uint64_t)peer.mActive * target->mMax <
+        (uint64_t)target->mActive * peer.mMax) {
+      target = &peer;
+    }
+  }
+
+  bool loaded = IsLoaded(active, sMaxTests, latenessUs);
+  if (loaded != sLoaded) {
+    LOG(("NetworkTest cluster: %s, %llu active clients, lateness p90 %u us",
+         loaded ? "loaded" : "no longer loaded", (unsigned long long)active,
+         latenessUs));
+    sLoaded = loaded;
+  }
+  METRICS_SET(mClusterPeers, fresh, sLastPeers);
+  METRICS_SET(mClusterLoaded, loaded ? 1 : 0, sLastLoaded);
+
+  if (!loaded || !target) {
+    sTargetIp.store(0, std::memory_order_relaxed);
+    sBudget.store(0, std::memory_order_relaxed);
+    return;
+  }
+  sBudget.store((target->mMax - target->mActive + 1) / 2,
+                std::memory_order_relaxed);
+  sTargetIp.store(target->mAddr.inet.ip, std::memory_order_relaxed);
+}
+
+static void PR_CALLBACK
+ClusterThread(void *_fd)
+{
+  PRFileDesc *fd = (PRFileDesc*)_fd;
+  PlacementApply(PLACEMENT_IO, 0, "cluster");
+  MetricsRegisterWorker("cluster");
+  uint64_t active;
+  MetricsLoad(&active, sLastLateness);
+
+  PRIntervalTime interval = PR_MillisecondsToInterval(CLUSTER_INTERVAL_MS);
+  PRIntervalTime next = PR_IntervalNow();
+  while (1) {
+    PRIntervalTime now = PR_IntervalNow();
+    if ((int32_t)(now - next) >= 0) {
+      Update(fd);
+      next = now + interval;
+    }
+    char buf[CLUSTER_PKT_LEN];
+    PRNetAddr from;
+    int32_t count = PR_RecvFrom(fd, buf, sizeof(buf), 0, &from,
+                                next - now);
+    if (count > 0) {
+      ReceiveSummary(&from, buf, count);
+    } else if (count < 0 && PR_GetError() != PR_IO_TIMEOUT_ERROR) {
+      LogError("Cluster");
+    }
+  }
+}
+
+int
+StartCluster()
+{
+  PRFileDesc *fd = PR_OpenUDPSocket(PR_AF_INET);
+  if (!fd) {
+    return LogError("Cluster");
+  }
+  if (PR_Bind(fd, &sBindAddr) != PR_SUCCESS) {
+    int rv = LogError("Cluster");
+    PR_Close(fd);
+    return rv;
+  }
+
+  PRThread *thread = PR_CreateThread(PR_USER_THREAD, ClusterThread,
+                                     (void *)fd, PR_PRIORITY_LOW,
+                                     PR_LOCAL_THREAD, PR_UNJOINABLE_THREAD, 0);
+  if (!thread) {
+    LOG(("NetworkTest server side: Error creating cluster thread"));
+    int rv = LogError("Cluster");
+    PR_Close(fd);
+    return rv;
+  }
+  char host[64] = {0};
+  PR_NetAddrToString(&sBindAddr, host, sizeof(host));
+  LOG(("NetworkTest server side: Cluster on %s:%d with %d peers, %u tests "
+       "before redirecting", host, CLUSTER_PORT, sNumberOfPeers, sMaxTests));
+  return 0;
+}
+
+bool
+ClusterRedirect(uint32_t *aIp)
+{
+  uint32_t ip = sTargetIp.load(std::memory_order_relaxed);
+  if (!ip) {
+    return false;
+  }
+  // Only new tests of a loaded server get here, so the locked instruction
+  // is not on the packet path.
+  if (sBudget.fetch_sub(1, std::memory_order_relaxed) <= 0) {
+    return false;
+  }
+  *aIp = ip;
+  return true;
+}
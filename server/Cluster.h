@@ -0,0 +1,67 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NETWORK_TESTS_CLUSTER_H__
+#define NETWORK_TESTS_CLUSTER_H__
+
+#include "prio.h"
+#include <stdint.h>
+
+/**
+ * Cluster mode (ServerSide -K): test servers that know each other's load
+ * send new UDP tests to the least loaded one.
+ *
+ * A cluster thread sends the load of this server to every peer every
+ * CLUSTER_INTERVAL_MS in a datagram to CLUSTER_PORT, and reads theirs. The
+ * load is the number of active clients, the most this server takes before it
+ * redirects (-k) and the 90th percentile of the pacing lateness since the
+ * last summary (0 with fewer than CLUSTER_MIN_LATENESS_SAMPLES packets), all
+ * 4B in network order:
+ *  |_____6B_____|___4B___|___4B___|___4B___|
+ *  |    LOAD    | ACTIVE |  MAX   |LATENESS|
+ *
+ * A server is loaded if it has MAX active clients or its lateness is above
+ * CLUSTER_MAX_LATENESS_US. A loaded server picks the peer with the smallest
+ * share of its MAX in use among the ones that are not loaded and were heard
+ * from in the last CLUSTER_PEER_TIMEOUT_MS, and answers first packets of new
+ * UDP tests with a redirect to it (REDIRECT in config.h). It sends at most
+ * half of the peer's free room there until the peer's next summary, so
+ * several loaded servers do not flood the same peer.
+ *
+ * Summaries are only taken from the configured peer addresses. With -B every
+ * instance binds its own address, so a cluster can run on one machine on
+ * 127.0.0.1, 127.0.0.2, ...
+ */
+
+#define CLUSTER_PORT 61599
+#define CLUSTER_INTERVAL_MS 250
+#define CLUSTER_PEER_TIMEOUT_MS 1000
+#define CLUSTER_DEFAULT_MAX_TESTS 64
+#define CLUSTER_MAX_LATENESS_US 1000
+#define CLUSTER_MIN_LATENESS_SAMPLES 100
+#define CLUSTER_MAX_PEERS 64
+
+#define CLUSTER_LOAD "Load__"
+#define CLUSTER_LOAD_START 0
+#define CLUSTER_LOAD_LEN 6
+#define CLUSTER_ACTIVE_START 6
+#define CLUSTER_MAX_START 10
+#define CLUSTER_LATENESS_START 14
+#define CLUSTER_VALUE_LEN 4
+#define CLUSTER_PKT_LEN 18
+
+// aPeers is a comma separated list of IPv4 addresses; this server's own
+// address (aBind) may be in it. aBind is the address the cluster socket uses,
+// nullptr for any. -1 if a peer is not an IPv4 address.
+int ClusterInit(const char *aPeers, const PRNetAddr *aBind,
+                uint32_t aMaxTests);
+// Start the cluster thread.
+int StartCluster();
+// Whether the first packet of a new test goes to another server; *aIp is its
+// address (network order). Safe from any thread.
+bool ClusterRedirect(uint32_t *aIp);
+
+#endif
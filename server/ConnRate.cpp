@@ -0,0 +1,212 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "ConnRate.h"
+#include "HelpFunctions.h"
+#include "Metrics.h"
+#include "config.h"
+#include "prlog.h"
+#include "prnetdb.h"
+#include <algorithm>
+#include <cstring>
+#include <stdio.h>
+
+extern PRLogModuleInfo* gServerTestLog;
+#define LOG(args) PR_LOG(gServerTestLog, PR_LOG_DEBUG, args)
+
+#define CONN_RATE_TEST_TYPE 11
+
+static char sConnRateFormat[] =
+  "Connection: [timestamp] CONN [connection] [accept to reply us]\n"
+  "Summary: [timestamp] CONN SUMMARY conns [n] of [n] p50_us [n] p90_us [n]\n"
+  "                          p99_us [n] max_us [n] (TIMEOUT if the client\n"
+  "                          went away)\n"
+  "Cost: [timestamp] CPU SUMMARY wall_ns [n] user_us [n] system_us [n]\n"
+  "                          voluntary_csw [n] involuntary_csw [n]\n"
+  "                          (cycles [n] instructions [n] cache_misses [n]\n"
+  "                          with -P)\n";
+
+ConnRateTests::ConnRateTests()
+  : mLock(PR_NewLock())
+{
+}
+
+ConnRateTests::~ConnRateTests()
+{
+  while (!mTests.empty()) {
+    Finish(mTests.begin(), true, nullptr);
+  }
+  PR_DestroyLock(mLock);
+}
+
+ConnRateTests::TestMap::iterator
+ConnRateTests::Lookup(const char *aFirstPkt, uint32_t aIndex,
+                      uint32_t aCount)
+{
+  char name[TCP_FILE_NAME_LEN];
+  memcpy(name, aFirstPkt + TCP_FILE_NAME_START, TCP_FILE_NAME_LEN);
+  std::string key(name, strnlen(name, TCP_FILE_NAME_LEN));
+
+  TestMap::iterator it = mTests.find(key);
+  if (it != mTests.end() && aIndex == 0 && it->second->mNextIndex) {
+    // The client started over.
+    Finish(it, true, nullptr);
+    it = mTests.end();
+  }
+  if (it != mTests.end()) {
+    return it;
+  }
+  if (aIndex != 0 || !aCount || aCount > TCP_CONN_MAX_COUNT ||
+      mTests.size() >= CONN_RATE_MAX_TESTS) {
+    LOG(("NetworkTest TCP server side: Test 11 connection %u of %u not "
+         "recorded.", aIndex, aCount));
+    return mTests.end();
+  }
+
+  Test *test = new Test();
+  if (test->mLog.Init(name) < 0) {
+    delete test;
+    return mTests.end();
+  }
+  test->mCount = aCount;
+  test->mNextIndex = 0;
+  test->mLast = ClockNow();
+  test->mCpuCost.Reset(CONN_RATE_TEST_TYPE);
+  // This runs on the accept thread, which must not wait for the store.
+  test->mLog.WriteNonBlocking(sConnRateFormat, strlen(sConnRateFormat));
+  char line[64];
+  int len = snprintf(line, sizeof(line), "%lu START TEST 11 %u\n",
+                     (unsigned long)ClockToMilliseconds(ClockNow()), aCount);
+  test->mLog.WriteNonBlocking(line, len);
+  MetricsTestStarted(CONN_RATE_TEST_TYPE);
+  LOG(("NetworkTest TCP server side: Starting test 11, %u connections.",
+       aCount));
+  return mTests.insert(std::make_pair(key, test)).first;
+}
+
+void
+ConnRateTests::Connection(const char *aFirstPkt, ClockTime aAccepted,
+                          char *aReply)
+{
+  uint32_t index;
+  uint32_t count;
+  memcpy(&index, aFirstPkt + TCP_CONN_INDEX_START, TCP_CONN_INDEX_LEN);
+  memcpy(&count, aFirstPkt + TCP_CONN_COUNT_START, TCP_CONN_COUNT_LEN);
+  index = ntohl(index);
+  count = ntohl(count);
+
+  memset(aReply, 0, TCP_CONN_REPLY_LEN);
+  memcpy(aReply + TCP_CONN_REPLY_INDEX_START,
+         aFirstPkt + TCP_CONN_INDEX_START, TCP_CONN_INDEX_LEN);
+  PR_Lock(mLock);
+  TestMap::iterator it = Lookup(aFirstPkt, index, count);
+  if (it != mTests.end()) {
+    CpuCostCharge(&it->second->mCpuCost);
+  }
+
+  ClockTime now = ClockNow();
+  uint64_t latency = now - aAccepted;
+  uint64_t value = htonll(latency);
+  memcpy(aReply + TCP_CONN_REPLY_LATENCY_START, &value,
+         TCP_CONN_REPLY_TIME_LEN);
+  if (it == mTests.end()) {
+    PR_Unlock(mLock);
+    return;
+  }
+
+  Test *test = it->second;
+  test->mLatencies.push_back(latency);
+  test->mNextIndex = index + 1;
+  test->mLast = now;
+  char line[64];
+  int len = snprintf(line, sizeof(line), "%lu CONN %u %llu\n",
+                     (unsigned long)ClockToMilliseconds(now), index,
+                     (unsigned long long)(latency / 1000));
+  test->mLog.WriteNonBlocking(line, len);
+
+  if (index + 1 >= test->mCount ||
+      test->mLatencies.size() >= TCP_CONN_MAX_COUNT) {
+    uint64_t percentiles[3];
+    Finish(it, false, percentiles);
+    static const int offsets[3] = {
+      TCP_CONN_REPLY_P50_START, TCP_CONN_REPLY_P90_START,
+      TCP_CONN_REPLY_P99_START
+    };
+    for (int inx = 0; inx < 3; inx++) {
+      value = htonll(percentiles[inx]);
+      memcpy(aReply + offsets[inx], &value, TCP_CONN_REPLY_TIME_LEN);
+    }
+  }
+  PR_Unlock(mLock);
+}
+
+void
+ConnRateTests::Finish(TestMap::iterator aTest, bool aError,
+                      uint64_t *aPercentiles)
+{
+  Test *test = aTest->second;
+  // The test's share of the CPU up to now; nothing may be charged to it
+  // after it is gone.
+  CpuCostCharge(nullptr);
+  CpuCostFlush();
+
+  static const int percents[3] = { 50, 90, 99 };
+  uint64_t values[3] = { 0, 0, 0 };
+  uint64_t max = 0;
+  std::vector<uint64_t> &latencies = test->mLatencies;
+  if (!latencies.empty()) {
+    std::sort(latencies.begin(), latencies.end());
+    for (int inx = 0; inx < 3; inx++) {
+      values[inx] = latencies[(latencies.size() - 1) * percents[inx] / 100];
+    }
+    max = latencies.back();
+  }
+
+  ClockTime now = ClockNow();
+  char line[256];
+  int len = snprintf(line, sizeof(line), "%lu CONN SUMMARY conns %u of %u "
+                     "p50_us %llu p90_us %llu p99_us %llu max_us %llu%s\n",
+                     (unsigned long)ClockToMilliseconds(now),
+                     (unsigned)latencies.size(), test->mCount,
+                     (unsigned long long)(values[0] / 1000),
+                     (unsigned long long)(values[1] / 1000),
+                     (unsigned long long)(values[2] / 1000),
+                     (unsigned long long)(max / 1000),
+                     aError ? " TIMEOUT" : "");
+  LOG(("NetworkTest TCP server side: Test 11 finished: %s", line));
+  test->mLog.WriteNonBlocking(line, len);
+  len = snprintf(line, sizeof(line), "%lu CPU SUMMARY ",
+                 (unsigned long)ClockToMilliseconds(now));
+  test->mCpuCost.Format(line + len, sizeof(line) - len - 1);
+  strcat(line, "\n");
+  test->mLog.WriteNonBlocking(line, strlen(line));
+  test->mLog.DoneNonBlocking();
+  MetricsTestDone(CONN_RATE_TEST_TYPE, aError);
+
+  if (aPercentiles) {
+    memcpy(aPercentiles, values, sizeof(values));
+  }
+  delete test;
+  mTests.erase(aTest);
+}
+
+void
+ConnRateTests::Expire(ClockTime aNow)
+{
+  PR_Lock(mLock);
+  TestMap::iterator it = mTests.begin();
+  while (it != mTests.end()) {
+    TestMap::iterator next = it;
+    ++next;
+    ClockTime last = it->second->mLast;
+    if (aNow > last &&
+        ClockToMilliseconds(aNow - last) > CONN_RATE_TIMEOUT_MS) {
+      Finish(it, true, nullptr);
+    }
+    it = next;
+  }
+  PR_Unlock(mLock);
+}
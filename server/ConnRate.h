@@ -0,0 +1,70 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NETWORK_TESTS_CONN_RATE_H__
+#define NETWORK_TESTS_CONN_RATE_H__
+
+#include "Clock.h"
+#include "CpuCost.h"
+#include "FileWriter.h"
+#include "prlock.h"
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * Test 11 (connection rate, see config.h). The TCP accept loop serves these
+ * connections itself, without a client thread, and hands every first packet
+ * to Connection(). The tests are told apart by their file name; a test ends
+ * with the reply to its last connection, which carries the percentiles of
+ * the accept to reply times, or when no connection of it came for
+ * CONN_RATE_TIMEOUT_MS.
+ *
+ * The log of a test has a line per connection and a summary line. The
+ * accept loop serves plain connections and a client thread the ones on the
+ * TLS port, so the tests are under a lock.
+ */
+
+#define CONN_RATE_TIMEOUT_MS 10000
+// Tests tracked at the same time; connections of more tests are answered
+// without being recorded.
+#define CONN_RATE_MAX_TESTS 1024
+
+class ConnRateTests
+{
+public:
+  ConnRateTests();
+  ~ConnRateTests();
+  // A complete first packet (TCP_CONN_FIRST_PKT_LEN bytes) of a connection
+  // accepted at aAccepted. Fills aReply (TCP_CONN_REPLY_LEN bytes) and
+  // charges the calling thread's CPU to the test; the caller charges it back.
+  void Connection(const char *aFirstPkt, ClockTime aAccepted, char *aReply);
+  // End the tests that timed out.
+  void Expire(ClockTime aNow);
+
+private:
+  struct Test
+  {
+    FileWriter mLog;
+    std::vector<uint64_t> mLatencies;
+    uint32_t mCount;
+    uint32_t mNextIndex;
+    ClockTime mLast;
+    CpuCost mCpuCost;
+  };
+  typedef std::map<std::string, Test*> TestMap;
+
+  // The test of the connection, end() if it is not recorded.
+  TestMap::iterator Lookup(const char *aFirstPkt, uint32_t aIndex,
+                           uint32_t aCount);
+  void Finish(TestMap::iterator aTest, bool aError, uint64_t *aPercentiles);
+
+  PRLock *mLock;
+  TestMap mTests;
+};
+
+#endif
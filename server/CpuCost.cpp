@@ -0,0 +1,290 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "CpuCost.h"
+#include "Clock.h"
+#include "Metrics.h"
+#include "prlog.h"
+#include <atomic>
+#include <cstring>
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+extern PRLogModuleInfo* gServerTestLog;
+#define LOG(args) PR_LOG(gServerTestLog, PR_LOG_DEBUG, args)
+
+#define CPU_COST_HW_EVENTS 3
+
+static const char *sCounterNames[CPU_COST_COUNTERS] = {
+  "wall_ns", "user_us", "system_us", "voluntary_csw", "involuntary_csw",
+  "cycles", "instructions", "cache_misses"
+};
+
+static const uint64_t sHwEvents[CPU_COST_HW_EVENTS] = {
+  PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_MISSES
+};
+
+static std::atomic<bool> sHardware(false);
+
+struct CpuCostCharged
+{
+  CpuCost *mCost;
+  ClockTime mTime;
+};
+
+struct CpuCostThread
+{
+  bool mInit;
+  // Group leader (cycles) and the other events, -1 if not open.
+  int mPerfFds[CPU_COST_HW_EVENTS];
+  uint64_t mLast[CPU_COST_COUNTERS];
+  CpuCost *mCurrent;
+  ClockTime mSwitch;
+  ClockTime mNextSample;
+  std::vector<CpuCostCharged> mPending;
+};
+
+static thread_local CpuCostThread tThread;
+
+void
+CpuCost::Reset(int aTestType)
+{
+  mTestType = aTestType;
+  memset(mCounters, 0, sizeof(mCounters));
+}
+
+int
+CpuCost::Format(char *aBuf, size_t aLen) const
+{
+  int counters = sHardware ? CPU_COST_COUNTERS : CPU_COST_CYCLES;
+  size_t len = 0;
+  for (int inx = 0; inx < counters && len < aLen; inx++) {
+    int rv = snprintf(aBuf + len, aLen - len, "%s%s %llu", inx ? " " : "",
+                      sCounterNames[inx],
+                      (unsigned long long)mCounters[inx]);
+    if (rv < 0) {
+      return rv;
+    }
+    len += rv;
+  }
+  return len;
+}
+
+const char*
+CpuCostCounterName(int aCounter)
+{
+  return sCounterNames[aCounter];
+}
+
+void
+CpuCostEnableHardware()
+{
+  sHardware = true;
+}
+
+bool
+CpuCostHardwareEnabled()
+{
+  return sHardware;
+}
+
+static int
+PerfEventOpen(uint64_t aConfig, int aGroup, bool aKernel)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = aConfig;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.disabled = (aGroup == -1);
+  attr.exclude_kernel = !aKernel;
+  attr.exclude_hv = 1;
+  // This thread on any CPU.
+  return syscall(__NR_perf_event_open, &attr, 0, -1, aGroup, 0);
+}
+
+static void
+OpenHardwareCounters(CpuCostThread &aThread)
+{
+  // Kernel time is only counted if perf_event_paranoid allows it.
+  bool kernel = true;
+  aThread.mPerfFds[0] = PerfEventOpen(sHwEvents[0], -1, kernel);
+  if (aThread.mPerfFds[0] < 0 && (errno == EACCES || errno == EPERM)) {
+    kernel = false;
+    aThread.mPerfFds[0] = PerfEventOpen(sHwEvents[0], -1, kernel);
+  }
+  for (int inx = 1; inx < CPU_COST_HW_EVENTS && aThread.mPerfFds[0] >= 0;
+       inx++) {
+    aThread.mPerfFds[inx] = PerfEventOpen(sHwEvents[inx], aThread.mPerfFds[0],
+                                          kernel);
+    if (aThread.mPerfFds[inx] < 0) {
+      for (int fd = 0; fd < inx; fd++) {
+        close(aThread.mPerfFds[fd]);
+        aThread.mPerfFds[fd] = -1;
+      }
+    }
+  }
+  if (aThread.mPerfFds[0] < 0) {
+    LOG(("NetworkTest server side: no hardware counters (errno %d), CPU "
+         "cost without them.", errno));
+    sHardware = false;
+    return;
+  }
+  ioctl(aThread.mPerfFds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static void
+ReadCounters(CpuCostThread &aThread, uint64_t *aValues)
+{
+  struct rusage usage;
+  if (!getrusage(RUSAGE_THREAD, &usage)) {
+    aValues[CPU_COST_USER_US] = (uint64_t)usage.ru_utime.tv_sec * 1000000 +
+                                usage.ru_utime.tv_usec;
+    aValues[CPU_COST_SYSTEM_US] = (uint64_t)usage.ru_stime.tv_sec * 1000000 +
+                                  usage.ru_stime.tv_usec;
+    aValues[CPU_COST_VOLUNTARY_CSW] = usage.ru_nvcsw;
+    aValues[CPU_COST_INVOLUNTARY_CSW] = usage.ru_nivcsw;
+  }
+  if (aThread.mPerfFds[0] >= 0) {
+    // nr followed by the values in the order the events were opened.
+    uint64_t buf[1 + CPU_COST_HW_EVENTS];
+    if (read(aThread.mPerfFds[0], buf, sizeof(buf)) == sizeof(buf)) {
+      for (int inx = 0; inx < CPU_COST_HW_EVENTS; inx++) {
+        aValues[CPU_COST_CYCLES + inx] = buf[1 + inx];
+      }
+    }
+  }
+}
+
+static void
+ChargeElapsed(CpuCostThread &aThread, ClockTime aNow)
+{
+  ClockTime elapsed = aNow - aThread.mSwitch;
+  aThread.mSwitch = aNow;
+  if (!elapsed) {
+    return;
+  }
+  if (!aThread.mPending.empty() &&
+      aThread.mPending.back().mCost == aThread.mCurrent) {
+    aThread.mPending.back().mTime += elapsed;
+    return;
+  }
+  CpuCostCharged charged = { aThread.mCurrent, elapsed };
+  aThread.mPending.push_back(charged);
+}
+
+static void
+Sample(CpuCostThread &aThread, ClockTime aNow)
+{
+  ChargeElapsed(aThread, aNow);
+  aThread.mNextSample = aNow + CPU_COST_SAMPLE_NS;
+
+  uint64_t values[CPU_COST_COUNTERS];
+  memcpy(values, aThread.mLast, sizeof(values));
+  ReadCounters(aThread, values);
+  uint64_t delta[CPU_COST_COUNTERS];
+  for (int inx = 0; inx < CPU_COST_COUNTERS; inx++) {
+    delta[inx] = values[inx] - aThread.mLast[inx];
+  }
+  memcpy(aThread.mLast, values, sizeof(values));
+
+  ClockTime total = 0;
+  for (size_t inx = 0; inx < aThread.mPending.size(); inx++) {
+    total += aThread.mPending[inx].mTime;
+  }
+  for (size_t inx = 0; total && inx < aThread.mPending.size(); inx++) {
+    const CpuCostCharged &charged = aThread.mPending[inx];
+    int testType = charged.mCost ? charged.mCost->mTestType : 0;
+    if (testType < 0 || testType >= METRICS_MAX_TEST_TYPE) {
+      testType = 0;
+    }
+    double share = (double)charged.mTime / (double)total;
+    for (int counter = 0; counter < CPU_COST_COUNTERS; counter++) {
+      uint64_t cost = (counter == CPU_COST_WALL_NS) ? charged.mTime :
+                      (uint64_t)((double)delta[counter] * share + 0.5);
+      if (!cost) {
+        continue;
+      }
+      if (charged.mCost) {
+        charged.mCost->mCounters[counter] += cost;
+      }
+      METRICS_ADD(mCpuCost[testType][counter], cost);
+    }
+  }
+  aThread.mPending.clear();
+}
+
+void
+CpuCostThreadInit()
+{
+  CpuCostThread &thread = tThread;
+  if (thread.mInit) {
+    return;
+  }
+  for (int inx = 0; inx < CPU_COST_HW_EVENTS; inx++) {
+    thread.mPerfFds[inx] = -1;
+  }
+  if (sHardware) {
+    OpenHardwareCounters(thread);
+  }
+  memset(thread.mLast, 0, sizeof(thread.mLast));
+  ReadCounters(thread, thread.mLast);
+  thread.mCurrent = nullptr;
+  thread.mSwitch = ClockNow();
+  thread.mNextSample = thread.mSwitch + CPU_COST_SAMPLE_NS;
+  thread.mPending.reserve(CPU_COST_MAX_PENDING);
+  thread.mInit = true;
+}
+
+void
+CpuCostThreadShutdown()
+{
+  CpuCostThread &thread = tThread;
+  if (!thread.mInit) {
+    return;
+  }
+  Sample(thread, ClockNow());
+  for (int inx = 0; inx < CPU_COST_HW_EVENTS; inx++) {
+    if (thread.mPerfFds[inx] >= 0) {
+      close(thread.mPerfFds[inx]);
+    }
+  }
+  std::vector<CpuCostCharged>().swap(thread.mPending);
+  thread.mInit = false;
+}
+
+void
+CpuCostCharge(CpuCost *aCost)
+{
+  CpuCostThread &thread = tThread;
+  if (!thread.mInit || thread.mCurrent == aCost) {
+    return;
+  }
+  ClockTime now = ClockNow();
+  ChargeElapsed(thread, now);
+  thread.mCurrent = aCost;
+  if (now >= thread.mNextSample ||
+      thread.mPending.size() >= CPU_COST_MAX_PENDING) {
+    Sample(thread, now);
+  }
+}
+
+void
+CpuCostFlush()
+{
+  CpuCostThread &thread = tThread;
+  if (thread.mInit) {
+    Sample(thread, ClockNow());
+  }
+}
@@ -0,0 +1,78 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NETWORK_TESTS_CPU_COST_H__
+#define NETWORK_TESTS_CPU_COST_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * CPU cost of the tests.
+ *
+ * A worker thread charges its CPU to the test it is working for with
+ * CpuCostCharge(): a ClientSocket while the UDP worker handles it, the
+ * client thread for TCP, nullptr for the worker's own loop. A switch only
+ * reads ClockNow(). Every CPU_COST_SAMPLE_NS (and at CpuCostFlush()) the
+ * thread reads its counters:
+ *  - getrusage(RUSAGE_THREAD): user and system time, voluntary and
+ *    involuntary context switches,
+ *  - if enabled (ServerSide -P), cycles, instructions and cache misses of
+ *    the thread from perf_event_open.
+ * The differences to the last sample are split over the tests in proportion
+ * to the time charged to them since then, so the cost of a test is an
+ * estimate with the sample interval as resolution.
+ *
+ * The cost goes to the CpuCost of the test and to the per test type totals
+ * of the worker's metrics (type 0 is the worker itself).
+ */
+
+enum CpuCostCounter
+{
+  CPU_COST_WALL_NS,
+  CPU_COST_USER_US,
+  CPU_COST_SYSTEM_US,
+  CPU_COST_VOLUNTARY_CSW,
+  CPU_COST_INVOLUNTARY_CSW,
+  CPU_COST_CYCLES,
+  CPU_COST_INSTRUCTIONS,
+  CPU_COST_CACHE_MISSES,
+  CPU_COST_COUNTERS
+};
+
+#define CPU_COST_SAMPLE_NS 10000000ULL
+// Charges kept between samples; a worker with more switches samples early.
+#define CPU_COST_MAX_PENDING 1024
+
+struct CpuCost
+{
+  CpuCost() { Reset(0); }
+  void Reset(int aTestType);
+  // "wall_ns [n] user_us [n] ..." without a new line; the hardware counters
+  // only if they are enabled.
+  int Format(char *aBuf, size_t aLen) const;
+
+  // The totals the cost is added to (METRICS_MAX_TEST_TYPE).
+  int mTestType;
+  uint64_t mCounters[CPU_COST_COUNTERS];
+};
+
+// "wall_ns", "user_us", ...
+const char* CpuCostCounterName(int aCounter);
+
+// Read the hardware counters in the worker threads started after this.
+void CpuCostEnableHardware();
+bool CpuCostHardwareEnabled();
+
+// Start and stop the accounting of the calling thread. Stop flushes.
+void CpuCostThreadInit();
+void CpuCostThreadShutdown();
+// Charge the calling thread from now on to aCost (nullptr for the worker).
+void CpuCostCharge(CpuCost *aCost);
+// Sample now, so every CpuCost has its share up to now.
+void CpuCostFlush();
+
+#endif
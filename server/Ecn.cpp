@@ -0,0 +1,57 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Ecn.h"
+#include <cstring>
+#include <stdio.h>
+
+const char*
+EcnName(uint8_t aCodepoint)
+{
+  static const char *names[4] = { "not_ect", "ect1", "ect0", "ce" };
+  return names[aCodepoint & 3];
+}
+
+EcnTracker::EcnTracker()
+{
+  Reset(ECN_NOT_ECT);
+}
+
+void
+EcnTracker::Reset(uint8_t aSent)
+{
+  mRequested = aSent & 3;
+  mSent = mRequested;
+  memset(mCounts, 0, sizeof(mCounts));
+}
+
+void
+EcnTracker::Received(uint8_t aCodepoint)
+{
+  mCounts[aCodepoint & 3]++;
+}
+
+uint64_t
+EcnTracker::Packets() const
+{
+  return mCounts[0] + mCounts[1] + mCounts[2] + mCounts[3];
+}
+
+int
+EcnTracker::Format(char *aBuf, size_t aLen) const
+{
+  uint64_t packets = Packets();
+  double bleached = packets && mSent != ECN_NOT_ECT ?
+                    (double)mCounts[ECN_NOT_ECT] / packets : 0;
+  double ce = packets ? (double)mCounts[ECN_CE] / packets : 0;
+  return snprintf(aBuf, aLen, "sent %s received %llu not_ect %llu ect1 %llu "
+                  "ect0 %llu ce %llu bleached %.4f ce %.4f", EcnName(mSent),
+                  (unsigned long long)packets,
+                  (unsigned long long)mCounts[ECN_NOT_ECT],
+                  (unsigned long long)mCounts[ECN_ECT1],
+                  (unsigned long long)mCounts[ECN_ECT0],
+                  (unsigned long long)mCounts[ECN_CE], bleached, ce);
+}
@@ -0,0 +1,56 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NETWORK_TESTS_ECN_H__
+#define NETWORK_TESTS_ECN_H__
+
+#include "config.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * ECN codepoints of the data packets of a UDP test (Test 5 and 6 with
+ * ECN_MODE in the first packet). The data is sent with one ECT codepoint;
+ * for every data packet the codepoint it arrived with is counted: Test 5
+ * takes it from the client's ACK (ACK_ECN), Test 6 from the IP_TOS of the
+ * received datagram.
+ *
+ * A packet that arrives Not-ECT was bleached on the path, one with CE was
+ * marked by a congested queue and one with the other ECT codepoint was
+ * remarked.
+ */
+
+class EcnTracker
+{
+public:
+  EcnTracker();
+  // aSent is the codepoint the data is sent with, ECN_NOT_ECT if the test
+  // does not use ECN.
+  void Reset(uint8_t aSent);
+  bool Enabled() const { return mRequested != ECN_NOT_ECT; }
+  // ECN_NOT_ECT after NotSent().
+  uint8_t Sent() const { return mSent; }
+  // The socket could not set the codepoint; the data goes out Not-ECT and
+  // the arriving Not-ECT packets do not count as bleached.
+  void NotSent() { mSent = ECN_NOT_ECT; }
+  void Received(uint8_t aCodepoint);
+
+  uint64_t Packets() const;
+  uint64_t Count(uint8_t aCodepoint) const { return mCounts[aCodepoint & 3]; }
+  // "sent ect0 received [n] not_ect [n] ect1 [n] ect0 [n] ce [n] bleached
+  // [ratio] ce [ratio]" without a new line.
+  int Format(char *aBuf, size_t aLen) const;
+
+private:
+  uint8_t mRequested;
+  uint8_t mSent;
+  uint64_t mCounts[4];
+};
+
+// Name of a codepoint in the logs.
+const char* EcnName(uint8_t aCodepoint);
+
+#endif
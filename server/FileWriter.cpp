@@ -6,6 +6,10 @@
 
 #include "FileWriter.h"
 #include "HelpFunctions.h"
+#include "Metrics.h"
+#include "ResultsStore.h"
+#include "Trace.h"
+#include <algorithm>
 #include <cstring>
 #include <stdio.h>
 
@@ -29,77 +33,32 @@ private:
   PRLock * mLock;
 };
 
-static void PR_CALLBACK
-FileWriteRun(void *_writer)
-{
-  FileWriter *writer = (FileWriter*)_writer;
-  while (true) {
-    AutoLock lock(writer->mLock);
-    while (!writer->Finished() && writer->mToWrite == 0) {
-      PR_WaitCondVar(writer->mBufReadCondVar, PR_INTERVAL_NO_TIMEOUT);
-    }
-
-    // Write into the file what is in the buffer and terminate.
-    if (writer->Finished() && writer->mToWrite == 0) {
-      return;
-    }
-
-    int written = writer->WriteData();
-    if (written < 0) {
-      PRErrorCode code = PR_GetError();
-      if (code == PR_WOULD_BLOCK_ERROR) {
-        continue;
-      }
-      LogErrorWithCode(code, "TCP");
-      PR_Close(writer->mFd);
-      writer->mFd = nullptr;
-      break;
-    }
-    PR_NotifyCondVar(writer->mBufWriteCondVar);
-  }
-}
-
 FileWriter::FileWriter()
-  : mToWrite(0)
-  , mFd(nullptr)
+  : mChunks(0)
   , mIOLimit(false)
-  , mFinished(false)
-  , mFileWriterThread(nullptr)
+  , mFinished(true)
 {
+  memset(mName, 0, sizeof(mName));
   mLock = PR_NewLock();
-  mBufReadCondVar = PR_NewCondVar(mLock);
-  mBufWriteCondVar = PR_NewCondVar(mLock);
 }
 
 int
 FileWriter::Init(char *aFileName)
 {
-  mToWrite = 0;
-  mIOLimit = false;
-  mFinished = false;
-  char fileName[FILE_NAME_LEN + sizeof(TMP_DIRECTORY)];
-  memcpy(fileName, TMP_DIRECTORY, sizeof(TMP_DIRECTORY));
-  memcpy(fileName + sizeof(TMP_DIRECTORY) - 1, aFileName,
-         FILE_NAME_LEN);
-
-  PR_MkDir(TMP_DIRECTORY, 0777);
-  mFd = PR_Open(fileName, PR_CREATE_FILE | PR_WRONLY, 0666);
-
-  LOG(("NetworkTest TCP server side writer - file: %s", fileName));
-  if (!mFd) {
+  Done();
+  if (!ResultsStoreRunning()) {
+    LOG(("NetworkTest server side: results store not running."));
     return -1;
   }
 
-  mFileWriterThread = PR_CreateThread(PR_USER_THREAD, FileWriteRun,
-                                 (void *)this, PR_PRIORITY_NORMAL,
-                                 PR_LOCAL_THREAD,PR_JOINABLE_THREAD, 0);
-  if (!mFileWriterThread) {
-    LOG(("NetworkTest TCP server side: Error creating writer thread"));
-    LogError("TCP");
-    PR_Close(mFd);
-    mFd = nullptr;
-    return -1;
-  }
+  AutoLock lock(mLock);
+  memcpy(mName, aFileName, FILE_NAME_LEN);
+  mChunk.clear();
+  mChunk.reserve(RESULTS_CHUNK_SIZE);
+  mChunks = 0;
+  mIOLimit = false;
+  mFinished = false;
+  LOG(("NetworkTest server side writer - log: %.56s", mName));
   return 0;
 }
 
@@ -108,14 +67,36 @@ FileWriter::~FileWriter()
   LOG(("NetworkTest server side - destroy writer."));
 
   Done();
+  PR_DestroyLock(mLock);
+}
 
-  if (mFd) {
-    PR_Close(mFd);
+int
+FileWriter::Submit(bool aBlock)
+{
+  if (mChunk.empty()) {
+    return 0;
   }
+  // The store takes the data if it accepts the chunk.
+  size_t size = mChunk.size();
+  int rv = ResultsStoreAppend(mName, mChunk, aBlock);
+  TRACE3(log_chunk_full, mName, size, rv != 0);
+  if (rv) {
+    return -1;
+  }
+  mChunks++;
+  mChunk.reserve(RESULTS_CHUNK_SIZE);
+  return 0;
+}
 
-  PR_DestroyCondVar(mBufReadCondVar);
-  PR_DestroyCondVar(mBufWriteCondVar);
-  PR_DestroyLock(mLock);
+void
+FileWriter::Append(const char *aBuf, int aSize)
+{
+  if (mIOLimit) {
+    static const char ioLimit[] = "IO LIMIT\n";
+    mChunk.insert(mChunk.end(), ioLimit, ioLimit + sizeof(ioLimit) - 1);
+    mIOLimit = false;
+  }
+  mChunk.insert(mChunk.end(), aBuf, aBuf + aSize);
 }
 
 void
@@ -123,19 +104,16 @@ FileWriter::WriteNonBlocking(char* buf, int size)
 {
   AutoLock lock(mLock);
 
-  if (!mFd && ! mFinished) {
+  if (mFinished) {
     return;
   }
 
-  if ((mToWrite + size) <= BUF_SIZE) {
-    memcpy(mBuf + mToWrite, buf, size);
-    mToWrite += size;
-    if (mToWrite == size) {
-      PR_NotifyCondVar(mBufReadCondVar);
-    }
-  } else {
+  if (mChunk.size() + size > RESULTS_CHUNK_SIZE && Submit(false)) {
     mIOLimit = true;
+    METRICS_ADD(mFileWriterDrops, 1);
+    return;
   }
+  Append(buf, size);
 }
 
 // This is use for results transfer.
@@ -144,54 +122,48 @@ FileWriter::WriteBlocking(char* buf, int size)
 {
   AutoLock lock(mLock);
 
-  if (!mFd && !mFinished) {
+  if (mFinished) {
     return;
   }
 
-  while ((mToWrite + size) > BUF_SIZE) {
-    PR_WaitCondVar(mBufWriteCondVar, PR_INTERVAL_NO_TIMEOUT);
-  }
-  memcpy(mBuf + mToWrite, buf, size);
-  mToWrite += size;
-  if (mToWrite == size) {
-    PR_NotifyCondVar(mBufReadCondVar);
+  // Fill the chunk and hand it over; a chunk never gets bigger, even if the
+  // store is gone.
+  while (size > 0) {
+    if (mChunk.size() >= RESULTS_CHUNK_SIZE && Submit(true)) {
+      METRICS_ADD(mFileWriterDrops, 1);
+      return;
+    }
+    int len = std::min<int>(size, RESULTS_CHUNK_SIZE - mChunk.size());
+    Append(buf, len);
+    buf += len;
+    size -= len;
   }
 }
 
-int
-FileWriter::WriteData()
+void
+FileWriter::Done()
 {
-  int written = PR_Write(mFd, mBuf, mToWrite);
-  if (written > 0) {
-    memmove(mBuf, mBuf + written, mToWrite - written);
-    mToWrite -= written;
-
-    if (mIOLimit) {
-      memcpy(mBuf + mToWrite, "IO LIMIT\n",
-             ((BUF_SIZE - mToWrite) > sizeof("IO LOMIT\n") ?
-             sizeof("IO LOMIT\n") : (BUF_SIZE - mToWrite)));
-    }
-  }
-  return written;
+  Finish(true);
 }
 
 void
-FileWriter::Done()
+FileWriter::DoneNonBlocking()
 {
-  {
-    AutoLock lock(mLock);
-    if (mFinished) {
-      return;
-    }
+  Finish(false);
+}
 
-    mFinished = true;
-    PR_NotifyCondVar(mBufReadCondVar);
+void
+FileWriter::Finish(bool aBlock)
+{
+  AutoLock lock(mLock);
+  if (mFinished) {
+    return;
   }
-
-  if (mFileWriterThread) {
-    LOG(("NetworkTest client side - destroy writer thread   "));
-    PR_JoinThread(mFileWriterThread);
-
-    mFileWriterThread = nullptr;
+  mFinished = true;
+  // A test without output still shows up in the index.
+  if ((!mChunk.empty() || !mChunks) &&
+      ResultsStoreAppend(mName, mChunk, aBlock)) {
+    METRICS_ADD(mFileWriterDrops, 1);
   }
+  mChunk.clear();
 }
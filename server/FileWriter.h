@@ -11,9 +11,18 @@
 #include "prerror.h"
 #include "config.h"
 #include "nspr.h"
- #include <atomic>
+#include <atomic>
+#include <vector>
 
-#define BUF_SIZE 3000
+/**
+ * The log of one test. The lines are collected in chunks that go to the
+ * results store (ResultsStore.h) when they are full and at Done(), so a
+ * write never waits for the disk. WriteNonBlocking() drops the line if the
+ * store's queue is full and marks the log with "IO LIMIT"; WriteBlocking()
+ * waits for room and splits large writes. Done() waits for room for the
+ * last chunk, DoneNonBlocking() drops it. Either drops what the store no
+ * longer takes after ResultsStoreShutdown().
+ */
 class FileWriter
 {
 public:
@@ -24,18 +33,23 @@ public:
   void WriteBlocking(char* buf, int size);
   bool Finished() {return mFinished;};
   void Done();
+  // Done() that drops the last chunk instead of waiting if the store's
+  // queue is full, for threads that must not stall (the accept thread).
+  void DoneNonBlocking();
 
-  int WriteData();
+private:
+  void Finish(bool aBlock);
+  // Hand the current chunk to the store. Called with mLock held.
+  int Submit(bool aBlock);
+  void Append(const char *aBuf, int aSize);
 
-  char mBuf[BUF_SIZE];
-  int mToWrite;
-  PRFileDesc *mFd;
+  char mName[FILE_NAME_LEN];
+  std::vector<char> mChunk;
+  // Chunks handed to the store, so an empty log still gets one.
+  uint32_t mChunks;
   PRLock* mLock;
-  PRCondVar* mBufReadCondVar;
-  PRCondVar* mBufWriteCondVar;
   bool mIOLimit;
   std::atomic<bool> mFinished;
-  PRThread *mFileWriterThread;
 };
 
 #endif
@@ -8,7 +8,16 @@
 #include "prmem.h"
 #include "prlog.h"
 #include "config.h"
+#include "private/pprio.h"
 #include <cstring>
+#if defined(__linux__)
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#endif
 
 extern PRLogModuleInfo* gServerTestLog;
 #define LOG(args) PR_LOG(gServerTestLog, PR_LOG_DEBUG, args)
@@ -33,3 +42,312 @@ LogError(const char *aType)
   PRErrorCode errCode = PR_GetError();
   return LogErrorWithCode(errCode, aType);
 }
+
+bool
+FirstPktVersioned(int32_t aCount, const char *aBuf)
+{
+  return aCount >= FIRST_PKT_VERSION_START + FIRST_PKT_VERSION_LEN &&
+         aBuf[FIRST_PKT_VERSION_START] == FIRST_PKT_VERSION;
+}
+
+int
+SetDontFragment(PRFileDesc *aFd, bool aOn)
+{
+#if defined(__linux__) && defined(IP_MTU_DISCOVER)
+  int val = aOn ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT;
+  if (setsockopt(PR_FileDesc2NativeHandle(aFd), IPPROTO_IP, IP_MTU_DISCOVER,
+                 &val, sizeof(val)) < 0) {
+    LOG(("NetworkTest UDP server side: setting IP_MTU_DISCOVER failed."));
+    return -1;
+  }
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+int
+SetFastOpen(PRFileDesc *aFd, int aQueue)
+{
+#if defined(__linux__) && defined(TCP_FASTOPEN)
+  if (setsockopt(PR_FileDesc2NativeHandle(aFd), IPPROTO_TCP, TCP_FASTOPEN,
+                 &aQueue, sizeof(aQueue)) < 0) {
+    LOG(("NetworkTest TCP server side: setting TCP_FASTOPEN failed (errno "
+         "%d).", errno));
+    return -1;
+  }
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+#if defined(__linux__)
+static void
+SetErrorFromErrno()
+{
+  if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    PR_SetError(PR_WOULD_BLOCK_ERROR, errno);
+  } else {
+    PR_SetError(PR_UNKNOWN_ERROR, errno);
+  }
+}
+#endif
+
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+static uint64_t
+TimespecToNs(const struct timespec &aTs)
+{
+  return (uint64_t)aTs.tv_sec * 1000000000ULL + aTs.tv_nsec;
+}
+#endif
+
+int
+EnablePacketTimestamps(PRFileDesc *aFd)
+{
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+  if (PR_GetIdentitiesLayer(aFd, PR_NSPR_IO_LAYER) != aFd) {
+    // Another layer on top (AF_XDP) owns the packets.
+    return -1;
+  }
+  // Send timestamps are only asked for per datagram (SendToStamped()).
+  int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+              SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+  if (setsockopt(PR_FileDesc2NativeHandle(aFd), SOL_SOCKET, SO_TIMESTAMPING,
+                 &flags, sizeof(flags)) < 0) {
+    LOG(("NetworkTest UDP server side: setting SO_TIMESTAMPING failed."));
+    return -1;
+  }
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+int32_t
+RecvFromStamped(PRFileDesc *aFd, void *aBuf, int32_t aAmount,
+                PRNetAddr *aAddr, uint64_t *aKernelTime, int *aTos)
+{
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+  struct iovec iov;
+  iov.iov_base = aBuf;
+  iov.iov_len = aAmount;
+  char control[CMSG_SPACE(sizeof(struct scm_timestamping)) +
+               CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  memset(aAddr, 0, sizeof(PRNetAddr));
+  msg.msg_name = aAddr;
+  msg.msg_namelen = sizeof(PRNetAddr);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t count = recvmsg(PR_FileDesc2NativeHandle(aFd), &msg, MSG_DONTWAIT);
+  if (count < 0) {
+    SetErrorFromErrno();
+    return -1;
+  }
+  *aKernelTime = 0;
+  *aTos = -1;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_TIMESTAMPING) {
+      struct scm_timestamping ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      *aKernelTime = TimespecToNs(ts.ts[0]);
+    } else if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_TOS) {
+      // A single byte.
+      *aTos = *(uint8_t*)CMSG_DATA(cmsg);
+    }
+  }
+  return count;
+#else
+  *aKernelTime = 0;
+  *aTos = -1;
+  return PR_RecvFrom(aFd, aBuf, aAmount, 0, aAddr, PR_INTERVAL_NO_WAIT);
+#endif
+}
+
+int32_t
+SendToStamped(PRFileDesc *aFd, const void *aBuf, int32_t aAmount,
+              const PRNetAddr *aAddr)
+{
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+  struct iovec iov;
+  iov.iov_base = (void*)aBuf;
+  iov.iov_len = aAmount;
+  char control[CMSG_SPACE(sizeof(uint32_t))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = (void*)aAddr;
+  msg.msg_namelen = (aAddr->raw.family == PR_AF_INET6) ?
+                    sizeof(aAddr->ipv6) : sizeof(aAddr->inet);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SO_TIMESTAMPING;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+  uint32_t flags = SOF_TIMESTAMPING_TX_SOFTWARE;
+  memcpy(CMSG_DATA(cmsg), &flags, sizeof(flags));
+  ssize_t count = sendmsg(PR_FileDesc2NativeHandle(aFd), &msg, MSG_DONTWAIT);
+  if (count < 0) {
+    SetErrorFromErrno();
+    return -1;
+  }
+  return count;
+#else
+  return PR_SendTo(aFd, aBuf, aAmount, 0, aAddr, PR_INTERVAL_NO_WAIT);
+#endif
+}
+
+int
+ReadTxTimestamp(PRFileDesc *aFd, uint32_t *aKey, uint64_t *aKernelTime)
+{
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+  // The error queue can also hold ICMP errors; those are skipped.
+  for (;;) {
+    char data[64];
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = sizeof(data);
+    char control[CMSG_SPACE(sizeof(struct scm_timestamping)) +
+                 CMSG_SPACE(sizeof(struct sock_extended_err) +
+                            sizeof(struct sockaddr_in))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(PR_FileDesc2NativeHandle(aFd), &msg,
+                MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      return -1;
+    }
+    bool stamped = false;
+    bool keyed = false;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET &&
+          cmsg->cmsg_type == SCM_TIMESTAMPING) {
+        struct scm_timestamping ts;
+        memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+        *aKernelTime = TimespecToNs(ts.ts[0]);
+        stamped = true;
+      } else if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) {
+        struct sock_extended_err err;
+        memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+        if (err.ee_errno == ENOMSG &&
+            err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+          *aKey = err.ee_data;
+          keyed = true;
+        }
+      }
+    }
+    if (stamped && keyed) {
+      return 0;
+    }
+  }
+#else
+  return -1;
+#endif
+}
+
+int
+TakeSocketError(PRFileDesc *aFd)
+{
+#if defined(__linux__) && defined(SO_ERROR)
+  if (PR_GetIdentitiesLayer(aFd, PR_NSPR_IO_LAYER) != aFd) {
+    return -1;
+  }
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(PR_FileDesc2NativeHandle(aFd), SOL_SOCKET, SO_ERROR, &err,
+                 &len) < 0) {
+    return -1;
+  }
+  return err;
+#else
+  return -1;
+#endif
+}
+
+int
+EnableRecvTos(PRFileDesc *aFd)
+{
+#if defined(__linux__) && defined(IP_RECVTOS)
+  if (PR_GetIdentitiesLayer(aFd, PR_NSPR_IO_LAYER) != aFd) {
+    return -1;
+  }
+  int on = 1;
+  if (setsockopt(PR_FileDesc2NativeHandle(aFd), IPPROTO_IP, IP_RECVTOS, &on,
+                 sizeof(on)) < 0) {
+    LOG(("NetworkTest UDP server side: setting IP_RECVTOS failed."));
+    return -1;
+  }
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+int32_t
+SendToTos(PRFileDesc *aFd, const void *aBuf, int32_t aAmount,
+          const PRNetAddr *aAddr, uint8_t aTos, bool *aTosSet)
+{
+  *aTosSet = false;
+#if defined(__linux__) && defined(IP_TOS)
+  if (aAddr->raw.family != PR_AF_INET) {
+    return PR_SendTo(aFd, aBuf, aAmount, 0, aAddr, PR_INTERVAL_NO_WAIT);
+  }
+  if (PR_GetIdentitiesLayer(aFd, PR_NSPR_IO_LAYER) != aFd) {
+    // A layer over the socket; set the TOS for this datagram and back.
+    PRSocketOptionData opt;
+    opt.option = PR_SockOpt_IpTypeOfService;
+    opt.value.tos = aTos;
+    *aTosSet = PR_SetSocketOption(aFd, &opt) == PR_SUCCESS;
+    int32_t count = PR_SendTo(aFd, aBuf, aAmount, 0, aAddr,
+                              PR_INTERVAL_NO_WAIT);
+    if (*aTosSet) {
+      PRErrorCode code = PR_GetError();
+      opt.value.tos = 0;
+      PR_SetSocketOption(aFd, &opt);
+      PR_SetError(code, 0);
+    }
+    return count;
+  }
+  struct iovec iov;
+  iov.iov_base = (void*)aBuf;
+  iov.iov_len = aAmount;
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = (void*)aAddr;
+  msg.msg_namelen = sizeof(aAddr->inet);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = IPPROTO_IP;
+  cmsg->cmsg_type = IP_TOS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  int tos = aTos;
+  memcpy(CMSG_DATA(cmsg), &tos, sizeof(tos));
+  *aTosSet = true;
+  ssize_t count = sendmsg(PR_FileDesc2NativeHandle(aFd), &msg, MSG_DONTWAIT);
+  if (count < 0) {
+    SetErrorFromErrno();
+    return -1;
+  }
+  return count;
+#else
+  return PR_SendTo(aFd, aBuf, aAmount, 0, aAddr, PR_INTERVAL_NO_WAIT);
+#endif
+}
@@ -9,8 +9,59 @@
 
 #include "prerror.h"
 #include "prio.h"
+#include <stdint.h>
+
+// 64 bit values in network byte order.
+#define htonll(x) ((1 == htonl(1)) ? (x) : \
+  ((uint64_t)htonl((x) & 0xFFFFFFFF) << 32) | htonl((x) >> 32))
+#define ntohll(x) ((1 == ntohl(1)) ? (x) : \
+  ((uint64_t)ntohl((x) & 0xFFFFFFFF) << 32) | ntohl((x) >> 32))
 
 int LogErrorWithCode(PRErrorCode errCode, const char *aType);
 int LogError(const char *aType);
 
+// Whether the first packet of a UDP test has the fields after FILE_NAME
+// (FIRST_PKT_VERSION in config.h).
+bool FirstPktVersioned(int32_t aCount, const char *aBuf);
+// Send the following datagrams of a UDP socket with the don't fragment bit
+// and without fragmenting them to the cached path MTU (path MTU probes), or
+// go back to the default. Returns -1 where this is not supported.
+int SetDontFragment(PRFileDesc *aFd, bool aOn);
+// Accept TCP Fast Open (data in the SYN) on a listening socket, with at most
+// aQueue connections waiting for their handshake to complete. Returns -1
+// where this is not supported.
+int SetFastOpen(PRFileDesc *aFd, int aQueue);
+
+// Kernel software timestamps of a UDP socket (Linux SO_TIMESTAMPING), in
+// CLOCK_REALTIME ns. Every received datagram carries its receive time, and
+// datagrams sent with SendToStamped() report their send time on the error
+// queue, numbered from 0 in send order. Returns -1 where this is not
+// supported (e.g. on an AF_XDP socket).
+int EnablePacketTimestamps(PRFileDesc *aFd);
+// PR_RecvFrom without waiting; *aKernelTime is 0 if there is no timestamp.
+// *aTos is the IP TOS byte of the datagram with EnableRecvTos(), otherwise
+// -1.
+int32_t RecvFromStamped(PRFileDesc *aFd, void *aBuf, int32_t aAmount,
+                        PRNetAddr *aAddr, uint64_t *aKernelTime, int *aTos);
+// PR_SendTo without waiting that asks for the send timestamp.
+int32_t SendToStamped(PRFileDesc *aFd, const void *aBuf, int32_t aAmount,
+                      const PRNetAddr *aAddr);
+// Take the next send timestamp off the error queue. Returns -1 if there is
+// none.
+int ReadTxTimestamp(PRFileDesc *aFd, uint32_t *aKey, uint64_t *aKernelTime);
+// Read and clear the pending error of a socket (SO_ERROR), e.g. from an
+// ICMP error for an earlier datagram. Returns the errno, 0 if there is none
+// and -1 where this is not supported (e.g. on an AF_XDP socket).
+int TakeSocketError(PRFileDesc *aFd);
+
+// Deliver the TOS byte (ECN) of received datagrams to RecvFromStamped()
+// (IP_RECVTOS). Returns -1 where this is not supported.
+int EnableRecvTos(PRFileDesc *aFd);
+// PR_SendTo without waiting, with aTos as the IP TOS byte of this datagram
+// only; the socket is shared by many tests. An I/O layer (AF_XDP) gets the
+// TOS through PR_SockOpt_IpTypeOfService. *aTosSet is false if the datagram
+// went out with the socket's TOS instead.
+int32_t SendToTos(PRFileDesc *aFd, const void *aBuf, int32_t aAmount,
+                  const PRNetAddr *aAddr, uint8_t aTos, bool *aTosSet);
+
 #endif
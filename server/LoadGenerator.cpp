@@ -0,0 +1,1480 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * Load generator for the test server.
+ *
+ * It implements the client side of UDP Test 1, 5, 6, 8, 9, 10 and TCP Test 2,
+ * 3, 4, 11 and SndRes as described in config.h. Every thread keeps a number
+ * of clients busy; when a client finishes a test a new client is started
+ * with the next test from the mix. Every client uses its own socket, so the
+ * server sees each of them as a separate peer.
+ *
+ * The run is made of steps. Concurrency starts at -c and is doubled on every
+ * step until -C. For each step the report shows the server side goodput, the
+ * test completion rate and the result quality:
+ *  - Test 5: rate the client received / rate it requested,
+ *  - Test 6: rate the server reports in the last ACK / rate the client sent,
+ *  - Test 1 and Test 2: round trip time,
+ *  - Test 8: the capacity the server estimated (not used for degradation),
+ *  - Test 9: the goodput the client received (not used for degradation),
+ *  - Test 10: median round trip time of the probes (sent every -i ms)
+ *    without the time they spent in the server,
+ *  - Test 11: the median accept to reply time the server reports for the -k
+ *    connections of a test (not used for degradation), next to the
+ *    connections per second.
+ * With -f Test 2 and Test 11 send their first packet in the SYN (TCP Fast
+ * Open, needs net.ipv4.tcp_fastopen 3 and a server with -F).
+ * With -T the TCP tests run inside TLS (OpenSSL, the server certificate is
+ * not checked), Test 11 with a handshake per connection; use -p 443 with a
+ * server started with -T. The report then shows the completed handshakes per
+ * second, and the goodput is the data carried inside TLS.
+ * With -e 0 or -e 1 Test 5 and 6 ask for ECN: the data packets carry ECT(0)
+ * or ECT(1). In Test 5 the client echoes the codepoint each data packet
+ * arrived with in its ACK, and the report shows the share that arrived
+ * bleached (Not-ECT) and CE marked.
+ * With -o Test 5, 6 and 9 ask for one-way delays: the client answers the
+ * clock sync requests of the server and adds its clock (PR_Now()) to its
+ * ACKs and Test 6 data packets. The delays are in the server's logs.
+ * A UDP client that gets a redirect from a server in a cluster (ServerSide
+ * -K) sends its first packet again to the server it names and runs the test
+ * there; the report shows how many tests were redirected.
+ * UDP data packets are -s bytes (Test 5, 6, 8, 9); the report shows the UDP
+ * packet rate next to the goodput, which matters for small packets.
+ * SndRes uploads a generated log of LOAD_SNDRES_SIZE bytes; with -z it is
+ * sent deflate encoded (SndCmp).
+ * The first step where the completion rate or the rate ratio falls under the
+ * threshold (-q) or an RTT grows more than 10 times is reported as the point
+ * where the result quality degrades.
+ */
+
+#include "HelpFunctions.h"
+#include "config.h"
+#include "prerror.h"
+#include "prinit.h"
+#include "prio.h"
+#include "prnetdb.h"
+#include "prrng.h"
+#include "prthread.h"
+#include "plgetopt.h"
+#include "private/pprio.h"
+#include <algorithm>
+#include <cstring>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <zlib.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define LOAD_MAX_TEST_TYPE 12
+#define LOAD_SNDRES_TYPE 7
+#define LOAD_POLL_TIMEOUT PR_MillisecondsToInterval(1)
+// A test is abandoned if it takes this much longer than the requested time.
+#define LOAD_TEST_GRACE_MS 5000
+#define LOAD_TEST1_ACK_SIZE 512
+#define LOAD_ACK_SIZE (PKT_ID_LEN + TIMESTAMP_LEN + TIMESTAMP_RECEIVED_LEN + \
+                       TIMESTAMP_ACK_SENT_LEN)
+#define LOAD_SNDRES_SIZE 65536
+#define LOAD_PROBE_SIZE (PROBE_CLIENT_START + PROBE_CLIENT_LEN)
+
+static const char *sTestNames[LOAD_MAX_TEST_TYPE] = {
+  "none", "Test_1", "Test_2", "Test_3", "Test_4", "Test_5", "Test_6", "SndRes",
+  "Test_8", "Test_9", "Test_A", "Test_B"
+};
+
+struct LoadConfig
+{
+  PRNetAddr mUdpAddr;
+  PRNetAddr mTcpAddr;
+  std::vector<int> mMix;
+  int mThreads;
+  int mMinClients;
+  int mMaxClients;
+  uint32_t mStepMs;
+  uint64_t mRate;
+  uint32_t mPktSize;
+  uint64_t mMaxBytes;
+  uint32_t mMaxTimeMs;
+  uint32_t mProbeIntervalMs;
+  double mThreshold;
+  bool mEncodeUploads;
+  bool mFastOpen;
+  uint32_t mConnCount;
+  // Codepoint of the Test 5 and 6 data packets, ECN_NOT_ECT for none.
+  uint8_t mEcn;
+  // SYNC_MODE for Test 5, 6 and 9.
+  bool mOneWayDelay;
+};
+
+static LoadConfig sConfig;
+// Set with -T.
+static SSL_CTX *sTlsCtx = nullptr;
+// The log SndRes uploads, as is and deflate encoded.
+static std::vector<char> sUploadLog;
+static std::vector<char> sUploadDeflated;
+
+struct LoadStats
+{
+  LoadStats()
+  {
+    memset(this, 0, sizeof(*this));
+  }
+
+  void Add(const LoadStats &aOther)
+  {
+    for (int inx = 0; inx < LOAD_MAX_TEST_TYPE; inx++) {
+      mStarted[inx] += aOther.mStarted[inx];
+      mFinished[inx] += aOther.mFinished[inx];
+      mFailed[inx] += aOther.mFailed[inx];
+      mBusy[inx] += aOther.mBusy[inx];
+      mRedirected[inx] += aOther.mRedirected[inx];
+      mQualitySum[inx] += aOther.mQualitySum[inx];
+      mQualityCount[inx] += aOther.mQualityCount[inx];
+    }
+    mBytesFromServer += aOther.mBytesFromServer;
+    mBytesToServer += aOther.mBytesToServer;
+    mPktsFromServer += aOther.mPktsFromServer;
+    mPktsToServer += aOther.mPktsToServer;
+    mConnections += aOther.mConnections;
+    mTlsHandshakes += aOther.mTlsHandshakes;
+    mEcnPkts += aOther.mEcnPkts;
+    mEcnBleached += aOther.mEcnBleached;
+    mEcnCe += aOther.mEcnCe;
+  }
+
+  uint64_t mStarted[LOAD_MAX_TEST_TYPE];
+  uint64_t mFinished[LOAD_MAX_TEST_TYPE];
+  uint64_t mFailed[LOAD_MAX_TEST_TYPE];
+  // Failed tests the server refused with a busy reply.
+  uint64_t mBusy[LOAD_MAX_TEST_TYPE];
+  // Tests a server redirected to another one (finished or not).
+  uint64_t mRedirected[LOAD_MAX_TEST_TYPE];
+  // Rate ratio for Test 5 and 6, RTT in ms for Test 1, 2 and 10, accept to
+  // reply ms for Test 11.
+  double mQualitySum[LOAD_MAX_TEST_TYPE];
+  uint64_t mQualityCount[LOAD_MAX_TEST_TYPE];
+  // Test data the server sent (Test 3, 5) and accepted (Test 4, 6, SndRes).
+  uint64_t mBytesFromServer;
+  uint64_t mBytesToServer;
+  // UDP data packets of the above.
+  uint64_t mPktsFromServer;
+  uint64_t mPktsToServer;
+  // Test 11 connections that got their reply.
+  uint64_t mConnections;
+  uint64_t mTlsHandshakes;
+  // Test 5 data packets received with ECN, and those Not-ECT or CE.
+  uint64_t mEcnPkts;
+  uint64_t mEcnBleached;
+  uint64_t mEcnCe;
+};
+
+static uint32_t
+NowMs()
+{
+  return PR_IntervalToMilliseconds(PR_IntervalNow());
+}
+
+// A Test 5 style log, so the encoding sees realistic data.
+static int
+MakeUploadLog()
+{
+  uint32_t now = NowMs();
+  uint32_t id = 0;
+  char line[64];
+  while (sUploadLog.size() < LOAD_SNDRES_SIZE) {
+    int len = snprintf(line, sizeof(line), "%lu SEND %lu %lu\n",
+                       (unsigned long)(now + id / 3),
+                       (unsigned long)id, (unsigned long)(now + id / 3));
+    if (id % 2) {
+      len = snprintf(line, sizeof(line), "%lu ACK %lu %lu %lu\n",
+                     (unsigned long)(now + id / 3 + 20),
+                     (unsigned long)(id - 1), (unsigned long)(now + id / 3),
+                     (unsigned long)(now + id / 3 + 11));
+    }
+    sUploadLog.insert(sUploadLog.end(), line, line + len);
+    id++;
+  }
+  sUploadLog.resize(LOAD_SNDRES_SIZE);
+
+  uLongf len = compressBound(sUploadLog.size());
+  sUploadDeflated.resize(len);
+  if (compress2((Bytef*)sUploadDeflated.data(), &len,
+                (const Bytef*)sUploadLog.data(), sUploadLog.size(),
+                Z_DEFAULT_COMPRESSION) != Z_OK) {
+    return -1;
+  }
+  sUploadDeflated.resize(len);
+  return 0;
+}
+
+static void
+FormatFileName(char *aBuf, int aTestType, uint32_t aItr)
+{
+  char rnd[8];
+  PR_GetRandomNoise(rnd, sizeof(rnd));
+  char name[FILE_NAME_LEN];
+  memset(name, 0, sizeof(name));
+  snprintf(name, sizeof(name), "lg%02x%02x%02x%02x%02x%02x%02x%02x_test%d_itr%lu",
+           (uint8_t)rnd[0], (uint8_t)rnd[1], (uint8_t)rnd[2], (uint8_t)rnd[3],
+           (uint8_t)rnd[4], (uint8_t)rnd[5], (uint8_t)rnd[6], (uint8_t)rnd[7],
+           aTestType, (unsigned long)aItr);
+  memcpy(aBuf, name, FILE_NAME_LEN);
+}
+
+class LoadClient
+{
+public:
+  LoadClient(int aTestType, LoadStats &aStats)
+    : mFd(nullptr)
+    , mTestType(aTestType)
+    , mStats(aStats)
+    , mDone(false)
+    , mStartMs(NowMs())
+  {
+    mStats.mStarted[mTestType]++;
+  }
+  virtual ~LoadClient()
+  {
+    if (mFd) {
+      PR_Close(mFd);
+    }
+  }
+
+  virtual int Start() = 0;
+  virtual int16_t PollFlags() = 0;
+  virtual void OnPoll(int16_t aOutFlags, uint32_t aNow) = 0;
+  virtual void OnTimer(uint32_t aNow) = 0;
+
+  PRFileDesc* Fd() { return mFd; }
+  bool Done() { return mDone; }
+  int TestType() { return mTestType; }
+
+protected:
+  void Finish(bool aSuccess)
+  {
+    if (mDone) {
+      return;
+    }
+    mDone = true;
+    if (aSuccess) {
+      mStats.mFinished[mTestType]++;
+    } else {
+      mStats.mFailed[mTestType]++;
+    }
+  }
+  void Quality(double aValue)
+  {
+    mStats.mQualitySum[mTestType] += aValue;
+    mStats.mQualityCount[mTestType]++;
+  }
+  uint32_t Deadline()
+  {
+    return mStartMs + sConfig.mMaxTimeMs + LOAD_TEST_GRACE_MS;
+  }
+
+  PRFileDesc *mFd;
+  int mTestType;
+  LoadStats &mStats;
+  bool mDone;
+  uint32_t mStartMs;
+};
+
+class UdpLoadClient : public LoadClient
+{
+public:
+  UdpLoadClient(int aTestType, LoadStats &aStats, uint32_t aItr)
+    : LoadClient(aTestType, aStats)
+    , mItr(aItr)
+    , mFirstPktAcked(false)
+    , mFinishSent(false)
+    , mRetrans(0)
+    , mNextRetrans(0)
+    , mPktsRecv(0)
+    , mFirstDataMs(0)
+    , mLastDataMs(0)
+    , mNextPktId(0)
+    , mPktsSent(0)
+    , mNextSendNs(0)
+    , mNextProbeMs(0)
+    , mRecvUs(0)
+    , mAddr(sConfig.mUdpAddr)
+    , mRedirected(false)
+    , mBuf((aTestType == 10) ? LOAD_PROBE_SIZE : sConfig.mPktSize)
+  {
+    PR_GetRandomNoise(mBuf.data(), mBuf.size());
+  }
+
+  int Start()
+  {
+    mFd = PR_OpenUDPSocket(PR_AF_INET);
+    if (!mFd) {
+      return -1;
+    }
+    PRSocketOptionData opt;
+    opt.option = PR_SockOpt_Nonblocking;
+    opt.value.non_blocking = true;
+    PR_SetSocketOption(mFd, &opt);
+    if (sConfig.mEcn && mTestType == 6) {
+      int tos = sConfig.mEcn;
+      setsockopt(PR_FileDesc2NativeHandle(mFd), IPPROTO_IP, IP_TOS, &tos,
+                 sizeof(tos));
+    } else if (sConfig.mEcn && mTestType == 5) {
+      int on = 1;
+      setsockopt(PR_FileDesc2NativeHandle(mFd), IPPROTO_IP, IP_RECVTOS, &on,
+                 sizeof(on));
+    }
+
+    PR_GetRandomNoise(&mFirstPktId, sizeof(mFirstPktId));
+    mNextPktId = mFirstPktId + 1;
+    return SendFirstPkt(NowMs());
+  }
+
+  int16_t PollFlags() { return PR_POLL_READ | PR_POLL_EXCEPT; }
+
+  void OnPoll(int16_t aOutFlags, uint32_t aNow)
+  {
+    if (aOutFlags & (PR_POLL_ERR | PR_POLL_HUP | PR_POLL_NVAL)) {
+      Finish(false);
+      return;
+    }
+    if (!(aOutFlags & PR_POLL_READ)) {
+      return;
+    }
+    while (!mDone) {
+      char buf[PAYLOADSIZE_MAX];
+      int tos = -1;
+      int32_t count = Recv(buf, sizeof(buf), &tos);
+      if (count < 0) {
+        if (PR_GetError() != PR_WOULD_BLOCK_ERROR) {
+          Finish(false);
+        }
+        return;
+      }
+      mRecvUs = PR_Now();
+      Received(buf, count, aNow, tos);
+    }
+  }
+
+  void OnTimer(uint32_t aNow)
+  {
+    if (mDone) {
+      return;
+    }
+    if ((int32_t)(aNow - Deadline()) > 0) {
+      Finish(false);
+      return;
+    }
+    if (mTestType == 6 && mFirstPktAcked && !mFinishSent) {
+      SendData(aNow);
+    }
+    if (mTestType == 10 && mFirstPktAcked && !mFinishSent) {
+      SendProbes(aNow);
+    }
+    if (mNextRetrans && (int32_t)(aNow - mNextRetrans) > 0) {
+      if (++mRetrans > MAX_RETRANSMISSIONS) {
+        Finish(false);
+        return;
+      }
+      if (!mFirstPktAcked) {
+        SendFirstPkt(aNow);
+      } else if (mFinishSent) {
+        SendFinishPkt(aNow);
+      }
+    }
+  }
+
+private:
+  // *aTos is the IP TOS byte of the datagram in Test 5 with -e, otherwise -1.
+  int32_t Recv(char *aBuf, int32_t aLen, int *aTos)
+  {
+    if (!sConfig.mEcn || mTestType != 5) {
+      PRNetAddr addr;
+      return PR_RecvFrom(mFd, aBuf, aLen, 0, &addr, PR_INTERVAL_NO_WAIT);
+    }
+    struct iovec iov;
+    iov.iov_base = aBuf;
+    iov.iov_len = aLen;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t count = recvmsg(PR_FileDesc2NativeHandle(mFd), &msg,
+                            MSG_DONTWAIT);
+    if (count < 0) {
+      PR_SetError((errno == EAGAIN || errno == EWOULDBLOCK) ?
+                  PR_WOULD_BLOCK_ERROR : PR_UNKNOWN_ERROR, errno);
+      return -1;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TOS) {
+        *aTos = *(uint8_t*)CMSG_DATA(cmsg);
+      }
+    }
+    return count;
+  }
+
+  int Send(char *aBuf, int aLen)
+  {
+    int count = PR_SendTo(mFd, aBuf, aLen, 0, &mAddr,
+                          PR_INTERVAL_NO_WAIT);
+    if (count < 0 && PR_GetError() != PR_WOULD_BLOCK_ERROR) {
+      Finish(false);
+      return -1;
+    }
+    return count;
+  }
+
+  int SendFirstPkt(uint32_t aNow)
+  {
+    char pkt[PAYLOADSIZE];
+    memset(pkt, 0, sizeof(pkt));
+    uint32_t id = htonl(mFirstPktId);
+    memcpy(pkt + PKT_ID_START, &id, PKT_ID_LEN);
+    memcpy(pkt + TIMESTAMP_START, &aNow, TIMESTAMP_LEN);
+    memcpy(pkt + TYPE_START, sTestNames[mTestType], TYPE_LEN);
+    int len = PAYLOADSIZE;
+    if (mTestType != 1) {
+      uint16_t size = htons(sConfig.mPktSize);
+      memcpy(pkt + PAYLOAD_SIZE_START, &size, PAYLOAD_SIZE_LEN);
+    }
+    if (mTestType == 5 || mTestType == 6) {
+      pkt[ECN_MODE_START] = sConfig.mEcn;
+    }
+    if (mTestType == 6) {
+      FormatFileName(pkt + FILE_NAME_START, mTestType, mItr);
+    }
+    if (mTestType == 5 || mTestType == 6 || mTestType == 9) {
+      pkt[SYNC_MODE_START] = sConfig.mOneWayDelay;
+    }
+    pkt[REDIRECTED_START] = mRedirected;
+    pkt[FIRST_PKT_VERSION_START] = FIRST_PKT_VERSION;
+    if (mTestType == 1) {
+      len = LOAD_TEST1_ACK_SIZE;
+    } else if (mTestType == 8) {
+      // Default train parameters.
+      uint64_t rate = htonll(sConfig.mRate);
+      memcpy(pkt + RATE_TO_SEND_START, &rate, RATE_TO_SEND_LEN);
+      FormatFileName(pkt + FILE_NAME_START, mTestType, mItr);
+    } else if (mTestType == 5 || mTestType == 9 || mTestType == 10) {
+      uint64_t rate = htonll((mTestType == 10) ?
+                             1000 / sConfig.mProbeIntervalMs : sConfig.mRate);
+      memcpy(pkt + RATE_TO_SEND_START, &rate, RATE_TO_SEND_LEN);
+      FormatFileName(pkt + FILE_NAME_START, mTestType, mItr);
+      uint64_t maxBytes = htonll(sConfig.mMaxBytes);
+      memcpy(pkt + MAX_BYTES_START, &maxBytes, MAX_BYTES_LEN);
+      uint32_t maxTime = htonl(sConfig.mMaxTimeMs);
+      memcpy(pkt + MAX_TIME_START, &maxTime, MAX_TIME_LEN);
+    }
+    mNextRetrans = aNow + RETRANSMISSION_TIMEOUT;
+    return (Send(pkt, len) < 0) ? -1 : 0;
+  }
+
+  void SendData(uint32_t aNow)
+  {
+    if (!mNextSendNs) {
+      mFirstDataMs = aNow;
+      mNextSendNs = 1;
+    }
+    uint64_t elapsedNs = (uint64_t)(aNow - mFirstDataMs) * 1000000;
+    while (mNextSendNs <= elapsedNs + 1) {
+      if (aNow - mFirstDataMs >= sConfig.mMaxTimeMs) {
+        mLastDataMs = aNow;
+        SendFinishPkt(aNow);
+        return;
+      }
+      memcpy(&mBuf[PKT_ID_START], &mNextPktId, PKT_ID_LEN);
+      memcpy(&mBuf[TIMESTAMP_START], &aNow, TIMESTAMP_LEN);
+      // Data packets must not look like a first packet or a finish packet.
+      memset(&mBuf[TYPE_START], 0, TYPE_LEN);
+      if (sConfig.mOneWayDelay) {
+        uint64_t sent = htonll(PR_Now());
+        memcpy(&mBuf[DATA_SEND_TIME_START], &sent, DATA_SEND_TIME_LEN);
+      }
+      int count = Send(mBuf.data(), mBuf.size());
+      if (count <= 0) {
+        return;
+      }
+      mStats.mBytesToServer += count;
+      mStats.mPktsToServer++;
+      mNextPktId++;
+      mPktsSent++;
+      mNextSendNs += 1000000000ULL / sConfig.mRate;
+    }
+  }
+
+  void SendProbes(uint32_t aNow)
+  {
+    if ((int32_t)(aNow - mNextProbeMs) < 0) {
+      return;
+    }
+    if (aNow - mFirstDataMs >= sConfig.mMaxTimeMs) {
+      SendFinishPkt(aNow);
+      return;
+    }
+    memcpy(&mBuf[PKT_ID_START], &mNextPktId, PKT_ID_LEN);
+    memcpy(&mBuf[TIMESTAMP_START], &aNow, TIMESTAMP_LEN);
+    memcpy(&mBuf[PROBE_START], PROBE, PROBE_LEN);
+    memset(&mBuf[PROBE_RESIDENCE_START], 0, PROBE_RESIDENCE_LEN);
+    PRTime sent = PR_Now();
+    memcpy(&mBuf[PROBE_CLIENT_START], &sent, PROBE_CLIENT_LEN);
+    int count = Send(mBuf.data(), mBuf.size());
+    if (count <= 0) {
+      return;
+    }
+    mStats.mPktsToServer++;
+    mNextPktId++;
+    mNextProbeMs = aNow + sConfig.mProbeIntervalMs;
+  }
+
+  void SendFinishPkt(uint32_t aNow)
+  {
+    mFinishSent = true;
+    mLastPktId = mNextPktId;
+    memcpy(&mBuf[PKT_ID_START], &mNextPktId, PKT_ID_LEN);
+    memcpy(&mBuf[TIMESTAMP_START], &aNow, TIMESTAMP_LEN);
+    memcpy(&mBuf[FINISH_START], FINISH, FINISH_LEN);
+    Send(mBuf.data(), mBuf.size());
+    mNextRetrans = aNow + RETRANSMISSION_TIMEOUT;
+  }
+
+  void SendAck(char *aBuf, uint32_t aNow, int aTos)
+  {
+    char ack[ACK_SYNC_LEN];
+    memset(ack, 0, sizeof(ack));
+    memcpy(ack, aBuf, PKT_ID_LEN + TIMESTAMP_LEN);
+    uint32_t ts = htonl(aNow);
+    memcpy(ack + TIMESTAMP_RECEIVED_START, &ts, TIMESTAMP_RECEIVED_LEN);
+    memcpy(ack + TIMESTAMP_ACK_SENT_START, &ts, TIMESTAMP_ACK_SENT_LEN);
+    if (aTos >= 0) {
+      ack[ACK_ECN_START] = ECN_ECHO_VALID | (aTos & 3);
+    }
+    if (sConfig.mOneWayDelay && mTestType != 8) {
+      uint64_t received = htonll(mRecvUs);
+      memcpy(ack + ACK_CLIENT_RX_START, &received, SYNC_TIME_LEN);
+      memcpy(ack + ACK_SERVER_TX_START, aBuf + DATA_SEND_TIME_START,
+             SYNC_TIME_LEN);
+      uint64_t sent = htonll(PR_Now());
+      memcpy(ack + ACK_CLIENT_TX_START, &sent, SYNC_TIME_LEN);
+      Send(ack, ACK_SYNC_LEN);
+    } else {
+      Send(ack, (aTos < 0) ? LOAD_ACK_SIZE : LOAD_ACK_SIZE + ACK_ECN_LEN);
+    }
+  }
+
+  // A clock sync request of the server goes back with our times.
+  void SendSyncReply(char *aBuf)
+  {
+    uint64_t received = htonll(mRecvUs);
+    memcpy(aBuf + SYNC_CLIENT_RX_START, &received, SYNC_TIME_LEN);
+    uint64_t sent = htonll(PR_Now());
+    memcpy(aBuf + SYNC_CLIENT_TX_START, &sent, SYNC_TIME_LEN);
+    Send(aBuf, SYNC_PKT_LEN);
+  }
+
+  void Received(char *aBuf, int32_t aCount, uint32_t aNow, int aTos)
+  {
+    if (!mFirstPktAcked && !mRedirected &&
+        aCount >= REDIRECT_ADDR_START + REDIRECT_ADDR_LEN &&
+        memcmp(aBuf + REDIRECT_START, REDIRECT, REDIRECT_LEN) == 0) {
+      memcpy(&mAddr.inet.ip, aBuf + REDIRECT_ADDR_START, REDIRECT_ADDR_LEN);
+      mRedirected = true;
+      mStats.mRedirected[mTestType]++;
+      mRetrans = 0;
+      SendFirstPkt(aNow);
+      return;
+    }
+    if (!mFirstPktAcked && aCount >= BUSY_START + BUSY_LEN &&
+        memcmp(aBuf + BUSY_START, BUSY, BUSY_LEN) == 0) {
+      mStats.mBusy[mTestType]++;
+      Finish(false);
+      return;
+    }
+    if (sConfig.mOneWayDelay && aCount >= SYNC_PKT_LEN &&
+        memcmp(aBuf + SYNC_START, SYNC, SYNC_LEN) == 0) {
+      SendSyncReply(aBuf);
+      return;
+    }
+    switch (mTestType) {
+      case 1:
+        {
+          uint32_t sent;
+          memcpy(&sent, aBuf + TIMESTAMP_START, TIMESTAMP_LEN);
+          Quality(aNow - sent);
+          Finish(true);
+        }
+        break;
+      case 5:
+      case 8:
+      case 9:
+        mFirstPktAcked = true;
+        mNextRetrans = 0;
+        mStats.mBytesFromServer += aCount;
+        SendAck(aBuf, aNow, aTos);
+        if (aCount >= FINISH_START + FINISH_LEN &&
+            memcmp(aBuf + FINISH_START, FINISH, FINISH_LEN) == 0) {
+          if (mTestType == 8 &&
+              aCount >= TRAIN_CAPACITY_START + TRAIN_CAPACITY_LEN) {
+            uint64_t capacity;
+            memcpy(&capacity, aBuf + TRAIN_CAPACITY_START,
+                   TRAIN_CAPACITY_LEN);
+            Quality((double)ntohll(capacity) / 1000000.0);
+          } else if (mTestType == 5 && mPktsRecv > 1 &&
+                     mLastDataMs > mFirstDataMs) {
+            double rate = (double)(mPktsRecv - 1) * 1000.0 /
+                          (double)(mLastDataMs - mFirstDataMs);
+            Quality(rate / (double)sConfig.mRate);
+          } else if (mTestType == 9 && mPktsRecv > 1 &&
+                     mLastDataMs > mFirstDataMs) {
+            Quality((double)(mPktsRecv - 1) * sConfig.mPktSize * 8.0 /
+                    (double)(mLastDataMs - mFirstDataMs) / 1000.0);
+          }
+          Finish(true);
+          return;
+        }
+        if (!mPktsRecv) {
+          mFirstDataMs = aNow;
+        }
+        mLastDataMs = aNow;
+        mPktsRecv++;
+        mStats.mPktsFromServer++;
+        if (aTos >= 0) {
+          mStats.mEcnPkts++;
+          mStats.mEcnBleached += ((aTos & 3) == ECN_NOT_ECT);
+          mStats.mEcnCe += ((aTos & 3) == ECN_CE);
+        }
+        break;
+      case 10:
+        {
+          uint32_t pktId;
+          memcpy(&pktId, aBuf + PKT_ID_START, PKT_ID_LEN);
+          if (aCount < LOAD_PROBE_SIZE) {
+            return;
+          }
+          if (!mFirstPktAcked) {
+            mFirstPktAcked = true;
+            mNextRetrans = 0;
+            mRetrans = 0;
+            mFirstDataMs = aNow;
+            mNextProbeMs = aNow;
+            return;
+          }
+          if (mFinishSent && pktId == mLastPktId) {
+            if (!mRttsUs.empty()) {
+              std::nth_element(mRttsUs.begin(),
+                               mRttsUs.begin() + mRttsUs.size() / 2,
+                               mRttsUs.end());
+              Quality(mRttsUs[mRttsUs.size() / 2] / 1000.0);
+            }
+            Finish(true);
+            return;
+          }
+          if (memcmp(aBuf + PROBE_START, PROBE, PROBE_LEN)) {
+            return;
+          }
+          PRTime sent;
+          uint64_t residence;
+          memcpy(&sent, aBuf + PROBE_CLIENT_START, PROBE_CLIENT_LEN);
+          memcpy(&residence, aBuf + PROBE_RESIDENCE_START,
+                 PROBE_RESIDENCE_LEN);
+          int64_t rtt = (PR_Now() - sent) - (int64_t)(ntohll(residence) / 1000);
+          mRttsUs.push_back(rtt > 0 ? rtt : 0);
+          mStats.mPktsFromServer++;
+        }
+        break;
+      case 6:
+        {
+          uint32_t pktId;
+          memcpy(&pktId, aBuf + PKT_ID_START, PKT_ID_LEN);
+          if (!mFirstPktAcked) {
+            mFirstPktAcked = true;
+            mNextRetrans = 0;
+            mRetrans = 0;
+            return;
+          }
+          if (mFinishSent && pktId == mLastPktId) {
+            if (aCount >= RATE_RECEIVING_PKT_START + RATE_RECEIVING_PKT_LEN &&
+                mLastDataMs > mFirstDataMs) {
+              uint64_t rate;
+              memcpy(&rate, aBuf + RATE_RECEIVING_PKT_START,
+                     RATE_RECEIVING_PKT_LEN);
+              double sentRate = (double)mPktsSent * 1000.0 /
+                                (double)(mLastDataMs - mFirstDataMs);
+              Quality((double)ntohll(rate) / sentRate);
+            }
+            Finish(true);
+          }
+        }
+        break;
+    }
+  }
+
+  uint32_t mItr;
+  uint32_t mFirstPktId;
+  bool mFirstPktAcked;
+  bool mFinishSent;
+  int mRetrans;
+  uint32_t mNextRetrans;
+  uint64_t mPktsRecv;
+  uint32_t mFirstDataMs;
+  uint32_t mLastDataMs;
+  uint32_t mNextPktId;
+  uint32_t mLastPktId;
+  uint64_t mPktsSent;
+  uint64_t mNextSendNs;
+  uint32_t mNextProbeMs;
+  // When the packet being handled was read.
+  PRTime mRecvUs;
+  // The server of this test; a redirect changes it once.
+  PRNetAddr mAddr;
+  bool mRedirected;
+  // Test 10 round trip times without the server residence.
+  std::vector<int64_t> mRttsUs;
+  std::vector<char> mBuf;
+};
+
+class TcpLoadClient : public LoadClient
+{
+public:
+  TcpLoadClient(int aTestType, LoadStats &aStats, uint32_t aItr)
+    : LoadClient(aTestType, aStats)
+    , mItr(aItr)
+    , mConnected(false)
+    , mToWrite(0)
+    , mUpload(nullptr)
+    , mDataStart(0)
+    , mWritten(0)
+    , mRead(0)
+    , mReplyExpected(0)
+    , mConnectMs(0)
+    , mConnIndex(0)
+    , mSsl(nullptr)
+    , mHandshaking(false)
+    , mTlsWant(0)
+  {
+    PR_GetRandomNoise(mBuf, sizeof(mBuf));
+    // Test 11 uses the same name on all its connections.
+    FormatFileName(mFileName, mTestType, mItr);
+  }
+  ~TcpLoadClient()
+  {
+    if (mSsl) {
+      SSL_free(mSsl);
+    }
+  }
+
+  int Start()
+  {
+    mFd = PR_OpenTCPSocket(PR_AF_INET);
+    if (!mFd) {
+      return -1;
+    }
+    PRSocketOptionData opt;
+    opt.option = PR_SockOpt_Nonblocking;
+    opt.value.non_blocking = true;
+    PR_SetSocketOption(mFd, &opt);
+    opt.option = PR_SockOpt_NoDelay;
+    opt.value.no_delay = true;
+    PR_SetSocketOption(mFd, &opt);
+#ifdef TCP_FASTOPEN_CONNECT
+    if (sConfig.mFastOpen && (mTestType == 2 || mTestType == 11)) {
+      // The connect returns at once and the first write goes into the SYN.
+      int on = 1;
+      setsockopt(PR_FileDesc2NativeHandle(mFd), IPPROTO_TCP,
+                 TCP_FASTOPEN_CONNECT, &on, sizeof(on));
+    }
+#endif
+
+    mConnectMs = NowMs();
+    if (PR_Connect(mFd, &sConfig.mTcpAddr, PR_INTERVAL_NO_WAIT) ==
+        PR_SUCCESS) {
+      Connected();
+    } else if (PR_GetError() != PR_IN_PROGRESS_ERROR) {
+      return -1;
+    }
+    return 0;
+  }
+
+  int16_t PollFlags()
+  {
+    if (mHandshaking) {
+      return mTlsWant | PR_POLL_EXCEPT;
+    }
+    if (!mConnected || mWritten < mToWrite || (mTestType == 4 && mRead == 0)) {
+      return PR_POLL_WRITE | PR_POLL_READ | PR_POLL_EXCEPT;
+    }
+    return PR_POLL_READ | PR_POLL_EXCEPT;
+  }
+
+  void OnPoll(int16_t aOutFlags, uint32_t aNow)
+  {
+    if (!mConnected) {
+      if (!(aOutFlags & (PR_POLL_WRITE | PR_POLL_EXCEPT | PR_POLL_ERR |
+                         PR_POLL_HUP))) {
+        return;
+      }
+      PRPollDesc pollDesc;
+      pollDesc.fd = mFd;
+      pollDesc.in_flags = PollFlags();
+      pollDesc.out_flags = aOutFlags;
+      if (PR_GetConnectStatus(&pollDesc) != PR_SUCCESS) {
+        Finish(false);
+        return;
+      }
+      Connected();
+    }
+    if (mHandshaking) {
+      if (aOutFlags & (PR_POLL_ERR | PR_POLL_HUP | PR_POLL_NVAL)) {
+        Finish(false);
+        return;
+      }
+      Handshake();
+      if (mHandshaking || mDone) {
+        return;
+      }
+    }
+    if (aOutFlags & PR_POLL_READ) {
+      Read(aNow);
+    } else if (aOutFlags & (PR_POLL_ERR | PR_POLL_HUP | PR_POLL_NVAL)) {
+      Closed();
+      return;
+    }
+    if (!mDone && (aOutFlags & PR_POLL_WRITE)) {
+      Write();
+    }
+  }
+
+  void OnTimer(uint32_t aNow)
+  {
+    if (!mDone && (int32_t)(aNow - Deadline()) > 0) {
+      // Test 3 is stopped by the client if the server does not close.
+      Finish(mTestType == 3 && mRead > 0);
+    }
+  }
+
+private:
+  void Connected()
+  {
+    mConnected = true;
+    memset(mFirstPkt, 0, sizeof(mFirstPkt));
+    memcpy(mFirstPkt + TCP_TYPE_START, sTestNames[mTestType], TCP_TYPE_LEN);
+    memcpy(mFirstPkt + TCP_FILE_NAME_START, mFileName, TCP_FILE_NAME_LEN);
+    mToWrite = PAYLOADSIZE;
+    switch (mTestType) {
+      case 2:
+        mReplyExpected = PAYLOADSIZE;
+        break;
+      case 11:
+        {
+          uint32_t index = htonl(mConnIndex);
+          memcpy(mFirstPkt + TCP_CONN_INDEX_START, &index, TCP_CONN_INDEX_LEN);
+          uint32_t count = htonl(sConfig.mConnCount);
+          memcpy(mFirstPkt + TCP_CONN_COUNT_START, &count, TCP_CONN_COUNT_LEN);
+          mToWrite = TCP_CONN_FIRST_PKT_LEN;
+          mReplyExpected = TCP_CONN_REPLY_LEN;
+        }
+        break;
+      case 3:
+      case 4:
+        {
+          uint64_t maxBytes = htonll(sConfig.mMaxBytes);
+          memcpy(mFirstPkt + TCP_MAX_BYTES_START, &maxBytes, TCP_MAX_BYTES_LEN);
+          uint32_t maxTime = htonl(sConfig.mMaxTimeMs);
+          memcpy(mFirstPkt + TCP_MAX_TIME_START, &maxTime, TCP_MAX_TIME_LEN);
+          mFirstPkt[TCP_FIRST_PKT_VERSION_START] = TCP_FIRST_PKT_VERSION;
+          mReplyExpected = (mTestType == 4) ? PAYLOADSIZE : 0;
+        }
+        break;
+      case LOAD_SNDRES_TYPE:
+        {
+          mDataStart = TCP_DATA_START;
+          mUpload = &sUploadLog;
+          if (sConfig.mEncodeUploads) {
+            memcpy(mFirstPkt + TCP_TYPE_START, SENDRESULTS_ENCODED,
+                   TCP_TYPE_LEN);
+            mFirstPkt[TCP_ENCODING_START] = UPLOAD_ENCODING_DEFLATE;
+            uint64_t decodedLen = htonll((uint64_t)sUploadLog.size());
+            memcpy(mFirstPkt + TCP_DECODED_LEN_START, &decodedLen,
+                   TCP_DECODED_LEN_LEN);
+            mDataStart = TCP_ENCODED_DATA_START;
+            mUpload = &sUploadDeflated;
+          }
+          uint64_t len = htonll((uint64_t)mUpload->size());
+          memcpy(mFirstPkt + TCP_DATA_LEN_START, &len, TCP_DATA_LEN_LEN);
+          mToWrite = mDataStart + mUpload->size();
+          memcpy(mFirstPkt + mDataStart, mUpload->data(),
+                 std::min((size_t)(PAYLOADSIZE - mDataStart),
+                          mUpload->size()));
+        }
+        break;
+    }
+    if (sTlsCtx) {
+      mSsl = SSL_new(sTlsCtx);
+      if (!mSsl ||
+          SSL_set_fd(mSsl, PR_FileDesc2NativeHandle(mFd)) != 1) {
+        ERR_clear_error();
+        Finish(false);
+        return;
+      }
+      SSL_set_connect_state(mSsl);
+      mHandshaking = true;
+      Handshake();
+    }
+  }
+
+  void Handshake()
+  {
+    int rv = SSL_connect(mSsl);
+    if (rv == 1) {
+      mHandshaking = false;
+      mStats.mTlsHandshakes++;
+      return;
+    }
+    switch (SSL_get_error(mSsl, rv)) {
+      case SSL_ERROR_WANT_READ:
+        mTlsWant = PR_POLL_READ;
+        break;
+      case SSL_ERROR_WANT_WRITE:
+        mTlsWant = PR_POLL_WRITE;
+        break;
+      default:
+        ERR_clear_error();
+        Finish(false);
+        break;
+    }
+  }
+
+  // PR_Read and PR_Write, inside TLS with -T.
+  int32_t TlsError(int aRv)
+  {
+    switch (SSL_get_error(mSsl, aRv)) {
+      case SSL_ERROR_WANT_READ:
+      case SSL_ERROR_WANT_WRITE:
+        PR_SetError(PR_WOULD_BLOCK_ERROR, 0);
+        return -1;
+      case SSL_ERROR_ZERO_RETURN:
+        return 0;
+      default:
+        ERR_clear_error();
+        PR_SetError(PR_IO_ERROR, 0);
+        return -1;
+    }
+  }
+  int32_t IoRead(void *aBuf, int32_t aAmount)
+  {
+    if (!mSsl) {
+      return PR_Read(mFd, aBuf, aAmount);
+    }
+    int rv = SSL_read(mSsl, aBuf, aAmount);
+    return rv > 0 ? rv : TlsError(rv);
+  }
+  int32_t IoWrite(const void *aBuf, int32_t aAmount)
+  {
+    if (!mSsl) {
+      return PR_Write(mFd, aBuf, aAmount);
+    }
+    int rv = SSL_write(mSsl, aBuf, aAmount);
+    return rv > 0 ? rv : TlsError(rv);
+  }
+
+  void Write()
+  {
+    while (mWritten < mToWrite || (mTestType == 4 && mRead == 0)) {
+      int written;
+      if (mWritten < PAYLOADSIZE) {
+        uint64_t end = std::min(mToWrite, (uint64_t)PAYLOADSIZE);
+        written = IoWrite(mFirstPkt + mWritten, end - mWritten);
+      } else if (mUpload) {
+        written = IoWrite(mUpload->data() + (mWritten - mDataStart),
+                          mToWrite - mWritten);
+      } else {
+        // The rest is test data (Test 4).
+        uint64_t left = (mWritten < mToWrite) ? mToWrite - mWritten :
+                                                sizeof(mBuf);
+        written = IoWrite(mBuf, left < sizeof(mBuf) ? left : sizeof(mBuf));
+      }
+      if (written < 0) {
+        // With TCP Fast Open and no cookie yet the data waits for the
+        // handshake.
+        if (PR_GetError() != PR_WOULD_BLOCK_ERROR &&
+            PR_GetError() != PR_IN_PROGRESS_ERROR &&
+            PR_GetOSError() != EINPROGRESS) {
+          Finish(false);
+        }
+        return;
+      }
+      mWritten += written;
+      if (mTestType == 4 || mTestType == LOAD_SNDRES_TYPE) {
+        mStats.mBytesToServer += written;
+      }
+    }
+    if (mTestType == LOAD_SNDRES_TYPE && mWritten >= mToWrite) {
+      Finish(true);
+    }
+  }
+
+  void Read(uint32_t aNow)
+  {
+    char buf[PAYLOADSIZE];
+    while (!mDone) {
+      int read = IoRead(buf, sizeof(buf));
+      if (read == 0) {
+        Closed();
+        return;
+      }
+      if (read < 0) {
+        if (PR_GetError() != PR_WOULD_BLOCK_ERROR) {
+          Closed();
+        }
+        return;
+      }
+      if (mTestType == 11 && mRead < TCP_CONN_REPLY_LEN) {
+        memcpy(mReply + mRead, buf,
+               std::min((uint64_t)read, TCP_CONN_REPLY_LEN - mRead));
+      }
+      mRead += read;
+      if (mTestType == 3) {
+        mStats.mBytesFromServer += read;
+      }
+      if (mReplyExpected && mRead >= mReplyExpected) {
+        if (mTestType == 11) {
+          NextConnection();
+          return;
+        }
+        if (mTestType == 2) {
+          Quality(aNow - mConnectMs);
+        }
+        Finish(true);
+      }
+    }
+  }
+
+  void Closed()
+  {
+    Finish(mTestType == 3 && mRead > 0);
+  }
+
+  // Test 11: close this connection and open the next one.
+  void NextConnection()
+  {
+    mStats.mConnections++;
+    if (++mConnIndex >= sConfig.mConnCount) {
+      uint64_t p50;
+      memcpy(&p50, mReply + TCP_CONN_REPLY_P50_START,
+             TCP_CONN_REPLY_TIME_LEN);
+      Quality((double)ntohll(p50) / 1000000.0);
+      Finish(true);
+      return;
+    }
+    if (mSsl) {
+      SSL_free(mSsl);
+      mSsl = nullptr;
+    }
+    PR_Close(mFd);
+    mFd = nullptr;
+    mConnected = false;
+    mWritten = 0;
+    mRead = 0;
+    if (Start()) {
+      Finish(false);
+    }
+  }
+
+  char mFirstPkt[PAYLOADSIZE];
+  char mBuf[PAYLOADSIZE];
+  uint32_t mItr;
+  bool mConnected;
+  uint64_t mToWrite;
+  // The uploaded log (SndRes) and where it starts in the first packet.
+  const std::vector<char> *mUpload;
+  uint32_t mDataStart;
+  uint64_t mWritten;
+  uint64_t mRead;
+  uint64_t mReplyExpected;
+  uint32_t mConnectMs;
+  char mFileName[FILE_NAME_LEN];
+  // Test 11.
+  uint32_t mConnIndex;
+  char mReply[TCP_CONN_REPLY_LEN];
+  SSL *mSsl;
+  bool mHandshaking;
+  // The poll flag the handshake waits for.
+  int16_t mTlsWant;
+};
+
+struct LoadThreadCtx
+{
+  int mIndex;
+  int mClients;
+  uint32_t mEndMs;
+  LoadStats mStats;
+};
+
+static LoadClient*
+NewLoadClient(int aTestType, LoadStats &aStats, uint32_t aItr)
+{
+  LoadClient *client;
+  if (aTestType == 1 || aTestType == 5 || aTestType == 6 || aTestType == 8 ||
+      aTestType == 9 || aTestType == 10) {
+    client = new UdpLoadClient(aTestType, aStats, aItr);
+  } else {
+    client = new TcpLoadClient(aTestType, aStats, aItr);
+  }
+  if (client->Start()) {
+    delete client;
+    aStats.mStarted[aTestType]--;
+    return nullptr;
+  }
+  return client;
+}
+
+static void PR_CALLBACK
+LoadThread(void *_ctx)
+{
+  LoadThreadCtx *ctx = (LoadThreadCtx*)_ctx;
+  std::vector<LoadClient*> clients(ctx->mClients, nullptr);
+  std::vector<PRPollDesc> polls(ctx->mClients);
+  uint32_t itr = 0;
+
+  while ((int32_t)(NowMs() - ctx->mEndMs) < 0) {
+    int numPolls = 0;
+    for (int inx = 0; inx < ctx->mClients; inx++) {
+      if (clients[inx] && clients[inx]->Done()) {
+        delete clients[inx];
+        clients[inx] = nullptr;
+      }
+      if (!clients[inx]) {
+        int type = sConfig.mMix[(ctx->mIndex + inx + itr) %
+                                sConfig.mMix.size()];
+        clients[inx] = NewLoadClient(type, ctx->mStats, itr++);
+        if (!clients[inx]) {
+          continue;
+        }
+      }
+      polls[numPolls].fd = clients[inx]->Fd();
+      polls[numPolls].in_flags = clients[inx]->PollFlags();
+      polls[numPolls].out_flags = 0;
+      numPolls++;
+    }
+
+    PR_Poll(&polls[0], numPolls, LOAD_POLL_TIMEOUT);
+
+    uint32_t now = NowMs();
+    int pollInx = 0;
+    for (int inx = 0; inx < ctx->mClients; inx++) {
+      LoadClient *client = clients[inx];
+      if (!client) {
+        continue;
+      }
+      PRPollDesc &poll = polls[pollInx++];
+      if (poll.out_flags) {
+        client->OnPoll(poll.out_flags, now);
+      }
+      client->OnTimer(now);
+    }
+  }
+
+  // Tests still running at the end of a step are not counted.
+  for (int inx = 0; inx < ctx->mClients; inx++) {
+    if (clients[inx]) {
+      if (!clients[inx]->Done()) {
+        ctx->mStats.mStarted[clients[inx]->TestType()]--;
+      }
+      delete clients[inx];
+    }
+  }
+}
+
+static LoadStats
+RunStep(int aClients)
+{
+  int threads = sConfig.mThreads < aClients ? sConfig.mThreads : aClients;
+  std::vector<LoadThreadCtx> ctxs(threads);
+  std::vector<PRThread*> prThreads(threads);
+  uint32_t end = NowMs() + sConfig.mStepMs;
+  for (int inx = 0; inx < threads; inx++) {
+    ctxs[inx].mIndex = inx;
+    ctxs[inx].mClients = aClients / threads + (inx < aClients % threads);
+    ctxs[inx].mEndMs = end;
+    prThreads[inx] = PR_CreateThread(PR_USER_THREAD, LoadThread,
+                                     (void *)&ctxs[inx], PR_PRIORITY_NORMAL,
+                                     PR_GLOBAL_THREAD, PR_JOINABLE_THREAD, 0);
+  }
+  LoadStats total;
+  for (int inx = 0; inx < threads; inx++) {
+    if (prThreads[inx]) {
+      PR_JoinThread(prThreads[inx]);
+      total.Add(ctxs[inx].mStats);
+    }
+  }
+  return total;
+}
+
+static double
+Average(const LoadStats &aStats, int aType)
+{
+  return aStats.mQualityCount[aType] ?
+         aStats.mQualitySum[aType] / aStats.mQualityCount[aType] : -1.0;
+}
+
+// Returns true if the quality has degraded compared to the first step.
+static bool
+ReportStep(int aClients, const LoadStats &aStats, const LoadStats &aFirst)
+{
+  uint64_t finished = 0;
+  uint64_t failed = 0;
+  for (int inx = 1; inx < LOAD_MAX_TEST_TYPE; inx++) {
+    finished += aStats.mFinished[inx];
+    failed += aStats.mFailed[inx];
+  }
+  double seconds = sConfig.mStepMs / 1000.0;
+  double completion = (finished + failed) ?
+                      (double)finished / (double)(finished + failed) : 0.0;
+  printf("clients %6d: %8.1f tests/s, completion %.3f, goodput from server "
+         "%.1f Mbit/s (%.0f UDP pkt/s), to server %.1f Mbit/s (%.0f UDP "
+         "pkt/s)",
+         aClients, finished / seconds, completion,
+         aStats.mBytesFromServer * 8.0 / seconds / 1000000.0,
+         aStats.mPktsFromServer / seconds,
+         aStats.mBytesToServer * 8.0 / seconds / 1000000.0,
+         aStats.mPktsToServer / seconds);
+  if (sTlsCtx) {
+    printf(", %.1f TLS handshakes/s", aStats.mTlsHandshakes / seconds);
+  }
+  printf("\n");
+  for (int inx = 1; inx < LOAD_MAX_TEST_TYPE; inx++) {
+    if (!aStats.mFinished[inx] && !aStats.mFailed[inx]) {
+      continue;
+    }
+    printf("    %s: finished %llu failed %llu", sTestNames[inx],
+           (unsigned long long)aStats.mFinished[inx],
+           (unsigned long long)aStats.mFailed[inx]);
+    if (aStats.mBusy[inx]) {
+      printf(" (busy %llu)", (unsigned long long)aStats.mBusy[inx]);
+    }
+    if (aStats.mRedirected[inx]) {
+      printf(" (redirected %llu)",
+             (unsigned long long)aStats.mRedirected[inx]);
+    }
+    double quality = Average(aStats, inx);
+    if (quality >= 0 && (inx == 1 || inx == 2)) {
+      printf(" rtt %.1f ms", quality);
+    } else if (quality >= 0 && inx == 10) {
+      printf(" rtt %.3f ms", quality);
+    } else if (quality >= 0 && inx == 8) {
+      printf(" capacity %.1f Mbit/s", quality);
+    } else if (quality >= 0 && inx == 9) {
+      printf(" goodput %.1f Mbit/s", quality);
+    } else if (quality >= 0 && inx == 11) {
+      printf(" accept to reply %.3f ms, %.0f conn/s", quality,
+             aStats.mConnections / seconds);
+    } else if (quality >= 0) {
+      printf(" rate ratio %.3f", quality);
+    }
+    if (inx == 5 && aStats.mEcnPkts) {
+      printf(" ecn bleached %.4f ce %.4f",
+             (double)aStats.mEcnBleached / aStats.mEcnPkts,
+             (double)aStats.mEcnCe / aStats.mEcnPkts);
+    }
+    printf("\n");
+  }
+
+  bool degraded = completion < sConfig.mThreshold;
+  for (int inx = 5; inx <= 6; inx++) {
+    double quality = Average(aStats, inx);
+    if (quality >= 0 && quality < sConfig.mThreshold) {
+      degraded = true;
+    }
+  }
+  static const int rttTests[] = { 1, 2, 10 };
+  for (size_t test = 0; test < sizeof(rttTests) / sizeof(rttTests[0]);
+       test++) {
+    int inx = rttTests[test];
+    double quality = Average(aStats, inx);
+    double base = Average(aFirst, inx);
+    if (quality >= 0 && base >= 0 && quality > 10.0 * (base + 1.0)) {
+      degraded = true;
+    }
+  }
+  fflush(stdout);
+  return degraded;
+}
+
+static int
+ParseMix(const char *aMix)
+{
+  sConfig.mMix.clear();
+  const char *p = aMix;
+  while (*p) {
+    if (strncmp(p, "SndRes", 6) == 0) {
+      sConfig.mMix.push_back(LOAD_SNDRES_TYPE);
+      p += 6;
+    } else {
+      int type = atoi(p);
+      if ((type < 1 || type > 6) && (type < 8 || type > 11)) {
+        return -1;
+      }
+      sConfig.mMix.push_back(type);
+      while (*p && *p != ',') {
+        p++;
+      }
+    }
+    if (*p == ',') {
+      p++;
+    }
+  }
+  return sConfig.mMix.empty() ? -1 : 0;
+}
+
+static void
+Usage(const char *aName)
+{
+  fprintf(stderr,
+          "Usage: %s [-h server ip] [-u udp port] [-p tcp port]\n"
+          "          [-m test mix, e.g. 1,5,6,8,9,10,2,3,4,11,SndRes]\n"
+          "          [-n threads]\n"
+          "          [-c start clients] [-C max clients] [-d step duration s]\n"
+          "          [-r rate pkt/s for Test 5 and 6] [-s UDP packet size]\n"
+          "          [-b max bytes]\n"
+          "          [-t max time ms] [-q quality threshold]\n"
+          "          [-i probe interval ms for Test 10]\n"
+          "          [-z deflate encode SndRes uploads]\n"
+          "          [-k connections per Test 11] [-f TCP Fast Open]\n"
+          "          [-T TCP tests inside TLS]\n"
+          "          [-e ECN for Test 5 and 6: 0 ECT(0), 1 ECT(1)]\n"
+          "          [-o one-way delays for Test 5, 6 and 9]\n", aName);
+}
+
+int
+main(int32_t argc, char *argv[])
+{
+  const char *host = "127.0.0.1";
+  uint16_t udpPort = 61590;
+  uint16_t tcpPort = 61590;
+  sConfig.mThreads = 4;
+  sConfig.mMinClients = 16;
+  sConfig.mMaxClients = 0;
+  sConfig.mStepMs = 10000;
+  sConfig.mRate = 1000;
+  sConfig.mPktSize = PAYLOADSIZE;
+  sConfig.mMaxBytes = MAXBYTES;
+  sConfig.mMaxTimeMs = MAXTIME * 1000;
+  sConfig.mProbeIntervalMs = 5;
+  sConfig.mThreshold = 0.95;
+  sConfig.mEncodeUploads = false;
+  sConfig.mFastOpen = false;
+  sConfig.mConnCount = 20;
+  sConfig.mEcn = ECN_NOT_ECT;
+  sConfig.mOneWayDelay = false;
+  bool tls = false;
+  ParseMix("1,5,6,2,3,4,SndRes");
+
+  PLOptState *optState = PL_CreateOptState(argc, argv,
+                                           "h:u:p:m:n:c:C:d:r:s:b:t:q:i:zk:fTe:o");
+  PLOptStatus optStatus;
+  while ((optStatus = PL_GetNextOpt(optState)) == PL_OPT_OK) {
+    switch (optState->option) {
+      case 'h': host = optState->value; break;
+      case 'u': udpPort = atoi(optState->value); break;
+      case 'p': tcpPort = atoi(optState->value); break;
+      case 'n': sConfig.mThreads = atoi(optState->value); break;
+      case 'c': sConfig.mMinClients = atoi(optState->value); break;
+      case 'C': sConfig.mMaxClients = atoi(optState->value); break;
+      case 'd': sConfig.mStepMs = atoi(optState->value) * 1000; break;
+      case 'r': sConfig.mRate = strtoull(optState->value, nullptr, 10); break;
+      case 's': sConfig.mPktSize = strtoul(optState->value, nullptr, 10); break;
+      case 'b': sConfig.mMaxBytes = strtoull(optState->value, nullptr, 10); break;
+      case 't': sConfig.mMaxTimeMs = strtoul(optState->value, nullptr, 10); break;
+      case 'q': sConfig.mThreshold = atof(optState->value); break;
+      case 'i': sConfig.mProbeIntervalMs = atoi(optState->value); break;
+      case 'z': sConfig.mEncodeUploads = true; break;
+      case 'k': sConfig.mConnCount = strtoul(optState->value, nullptr, 10); break;
+      case 'f': sConfig.mFastOpen = true; break;
+      case 'T': tls = true; break;
+      case 'o': sConfig.mOneWayDelay = true; break;
+      case 'e':
+        sConfig.mEcn = atoi(optState->value) ? ECN_ECT1 : ECN_ECT0;
+        break;
+      case 'm':
+        if (ParseMix(optState->value)) {
+          Usage(argv[0]);
+          return -1;
+        }
+        break;
+      default:
+        Usage(argv[0]);
+        PL_DestroyOptState(optState);
+        return -1;
+    }
+  }
+  PL_DestroyOptState(optState);
+  if (optStatus == PL_OPT_BAD || sConfig.mThreads < 1 ||
+      sConfig.mMinClients < 1 || !sConfig.mRate ||
+      !sConfig.mProbeIntervalMs || !sConfig.mConnCount ||
+      sConfig.mConnCount > TCP_CONN_MAX_COUNT ||
+      sConfig.mPktSize < PAYLOADSIZE_MIN || sConfig.mPktSize > PAYLOADSIZE_MAX) {
+    Usage(argv[0]);
+    return -1;
+  }
+  if (tls) {
+    sTlsCtx = SSL_CTX_new(TLS_client_method());
+    if (!sTlsCtx) {
+      fprintf(stderr, "Can not set up TLS\n");
+      return -1;
+    }
+    SSL_CTX_set_verify(sTlsCtx, SSL_VERIFY_NONE, nullptr);
+    SSL_CTX_set_mode(sTlsCtx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                              SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  }
+  if (sConfig.mMaxClients < sConfig.mMinClients) {
+    sConfig.mMaxClients = sConfig.mMinClients;
+  }
+
+  if ((PR_StringToNetAddr(host, &sConfig.mUdpAddr) != PR_SUCCESS) ||
+      (PR_StringToNetAddr(host, &sConfig.mTcpAddr) != PR_SUCCESS)) {
+    fprintf(stderr, "Bad server address %s\n", host);
+    return -1;
+  }
+  sConfig.mUdpAddr.inet.port = PR_htons(udpPort);
+  sConfig.mTcpAddr.inet.port = PR_htons(tcpPort);
+  if (MakeUploadLog()) {
+    fprintf(stderr, "Can not encode the upload\n");
+    return -1;
+  }
+
+  printf("Load generator: server %s udp %d tcp %d%s, %d threads, step %lu s\n",
+         host, udpPort, tcpPort, sTlsCtx ? " (TLS)" : "", sConfig.mThreads,
+         (unsigned long)(sConfig.mStepMs / 1000));
+
+  LoadStats first;
+  int degradedAt = 0;
+  for (int clients = sConfig.mMinClients; clients <= sConfig.mMaxClients;
+       clients *= 2) {
+    LoadStats stats = RunStep(clients);
+    if (clients == sConfig.mMinClients) {
+      first = stats;
+    }
+    if (ReportStep(clients, stats, first) && !degradedAt) {
+      degradedAt = clients;
+    }
+  }
+  if (degradedAt) {
+    printf("Result quality degrades at %d concurrent clients.\n", degradedAt);
+  } else {
+    printf("Result quality did not degrade up to %d concurrent clients.\n",
+           sConfig.mMaxClients);
+  }
+  PR_Cleanup();
+  return 0;
+}
@@ -0,0 +1,196 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "LossTracker.h"
+#include <cstring>
+#include <stdio.h>
+
+LossTracker::LossTracker()
+{
+  Reset(0);
+}
+
+void
+LossTracker::Reset(uint32_t aFirstPktId)
+{
+  memset(mBits, 0, sizeof(mBits));
+  memset(&mStats, 0, sizeof(mStats));
+  mFirstPktId = aFirstPktId;
+  mWindowStart = 0;
+  mHighest = 0;
+  mBurst = 0;
+}
+
+LossTracker::Result
+LossTracker::Received(uint32_t aPktId)
+{
+  uint64_t offset = (uint32_t)(aPktId - mFirstPktId);
+
+  if (offset >= mHighest) {
+    if (offset - mHighest > LOSS_MAX_JUMP) {
+      mStats.mIgnored++;
+      return PKT_IGNORED;
+    }
+    if (offset >= mWindowStart + LOSS_WINDOW_PKTS) {
+      MoveWindow(((offset - LOSS_WINDOW_PKTS) / 64 + 1) * 64);
+    }
+    Set(offset);
+    mHighest = offset + 1;
+    mStats.mReceived++;
+    return PKT_NEW;
+  }
+
+  if (offset < mWindowStart) {
+    mStats.mLate++;
+    return PKT_LATE;
+  }
+
+  if (IsSet(offset)) {
+    mStats.mDuplicates++;
+    return PKT_DUPLICATE;
+  }
+
+  Set(offset);
+  mStats.mReceived++;
+  mStats.mReordered++;
+  uint32_t distance = mHighest - 1 - offset;
+  mStats.mReorderDistanceSum += distance;
+  if (distance > mStats.mMaxReorderDistance) {
+    mStats.mMaxReorderDistance = distance;
+  }
+  return PKT_REORDERED;
+}
+
+void
+LossTracker::Finish(uint32_t aEndPktId)
+{
+  uint64_t end = aEndPktId ? (uint32_t)(aEndPktId - mFirstPktId) : mHighest;
+  if (end < mHighest || end - mHighest > LOSS_MAX_JUMP) {
+    end = mHighest;
+  }
+  if (end < mWindowStart) {
+    // Already finished.
+    return;
+  }
+
+  // Move over all complete words and then the part of the last one.
+  uint64_t lastWord = end / 64 * 64;
+  if (lastWord > mWindowStart) {
+    MoveWindow(lastWord);
+  }
+  uint64_t &word = mBits[(mWindowStart / 64) % LOSS_WINDOW_WORDS];
+  for (uint64_t offset = mWindowStart; offset < end; offset++) {
+    if (word & (1ULL << (offset % 64))) {
+      BurstEnd();
+    } else {
+      Lost(1);
+    }
+  }
+  word = 0;
+  BurstEnd();
+  mWindowStart += 64;
+  mHighest = end;
+}
+
+double
+LossTracker::LossRate() const
+{
+  if (!mHighest) {
+    return 0;
+  }
+  return (double)(mHighest - mStats.mReceived) / (double)mHighest;
+}
+
+int
+LossTracker::Format(char *aBuf, size_t aLen, bool aSummary) const
+{
+  int len = snprintf(aBuf, aLen,
+                     "received %llu lost %llu (%.3f%%) bursts %llu max "
+                     "burst %lu reordered %llu max distance %lu duplicates "
+                     "%llu late %llu",
+                     (unsigned long long)mStats.mReceived,
+                     (unsigned long long)(mHighest - mStats.mReceived),
+                     LossRate() * 100.0,
+                     (unsigned long long)mStats.mLossBursts,
+                     (unsigned long)mStats.mMaxLossBurst,
+                     (unsigned long long)mStats.mReordered,
+                     (unsigned long)mStats.mMaxReorderDistance,
+                     (unsigned long long)mStats.mDuplicates,
+                     (unsigned long long)mStats.mLate);
+  if (!aSummary || len < 0 || (size_t)len >= aLen) {
+    return len;
+  }
+  const LossStats &s = mStats;
+  return len + snprintf(aBuf + len, aLen - len,
+                        " burst lengths 1:%llu 2:%llu 3-4:%llu 5-8:%llu "
+                        "9-16:%llu 17-32:%llu 33-64:%llu >64:%llu",
+                        (unsigned long long)s.mLossBurstHist[0],
+                        (unsigned long long)s.mLossBurstHist[1],
+                        (unsigned long long)s.mLossBurstHist[2],
+                        (unsigned long long)s.mLossBurstHist[3],
+                        (unsigned long long)s.mLossBurstHist[4],
+                        (unsigned long long)s.mLossBurstHist[5],
+                        (unsigned long long)s.mLossBurstHist[6],
+                        (unsigned long long)s.mLossBurstHist[7]);
+}
+
+void
+LossTracker::MoveWindow(uint64_t aNewStart)
+{
+  // Words of the current window that leave it, in ID order.
+  uint64_t end = mWindowStart + LOSS_WINDOW_PKTS;
+  if (aNewStart < end) {
+    end = aNewStart;
+  }
+  for (uint64_t offset = mWindowStart; offset < end; offset += 64) {
+    uint64_t &word = mBits[(offset / 64) % LOSS_WINDOW_WORDS];
+    if (word == ~0ULL) {
+      BurstEnd();
+    } else if (word == 0) {
+      Lost(64);
+    } else {
+      for (int bit = 0; bit < 64; bit++) {
+        if (word & (1ULL << bit)) {
+          BurstEnd();
+        } else {
+          Lost(1);
+        }
+      }
+    }
+    word = 0;
+  }
+
+  // A jump of more than the window: nothing in between was received.
+  if (aNewStart > end) {
+    Lost(aNewStart - end);
+  }
+  mWindowStart = aNewStart;
+}
+
+void
+LossTracker::Lost(uint32_t aCount)
+{
+  mStats.mLost += aCount;
+  mBurst += aCount;
+}
+
+void
+LossTracker::BurstEnd()
+{
+  if (!mBurst) {
+    return;
+  }
+  mStats.mLossBursts++;
+  if (mBurst > mStats.mMaxLossBurst) {
+    mStats.mMaxLossBurst = mBurst;
+  }
+  int bucket = 0;
+  while (bucket < LOSS_BURST_BUCKETS - 1 && (1U << bucket) < mBurst) {
+    bucket++;
+  }
+  mStats.mLossBurstHist[bucket]++;
+  mBurst = 0;
+}
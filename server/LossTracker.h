@@ -0,0 +1,106 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NETWORK_TESTS_LOSS_TRACKER_H__
+#define NETWORK_TESTS_LOSS_TRACKER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Online loss, reordering and duplicate tracking for the packet IDs of a
+ * UDP test (ACKed IDs in Test 5, received data IDs in Test 6).
+ *
+ * IDs are taken relative to the first data packet ID of the test (the
+ * mNextPktId base of ClientSocket). A bitmap of LOSS_WINDOW_PKTS bits covers
+ * the IDs just below the highest ID seen. A packet below the highest ID that
+ * is not yet in the bitmap is reordered; one that is, is a duplicate. When the
+ * window moves forward the IDs leaving it without their bit set are counted
+ * as lost, in ID order, so loss bursts are measured exactly. A packet that
+ * arrives after its ID left the window is counted as late (and stays lost).
+ *
+ * Memory use is fixed and every received packet costs O(1), apart from
+ * moving the window, which costs one step per 64 IDs.
+ */
+
+#define LOSS_WINDOW_PKTS 4096
+// IDs further than this ahead of the highest ID seen are ignored as bogus.
+#define LOSS_MAX_JUMP (1 << 20)
+// Loss burst length histogram: 1, 2, 3-4, 5-8, 9-16, 17-32, 33-64, >64.
+#define LOSS_BURST_BUCKETS 8
+
+struct LossStats
+{
+  // Distinct IDs received.
+  uint64_t mReceived;
+  // IDs that left the window (or were flushed by Finish()) unreceived.
+  uint64_t mLost;
+  uint64_t mReordered;
+  uint64_t mDuplicates;
+  uint64_t mLate;
+  uint64_t mIgnored;
+  uint32_t mMaxReorderDistance;
+  uint64_t mReorderDistanceSum;
+  uint64_t mLossBursts;
+  uint32_t mMaxLossBurst;
+  uint64_t mLossBurstHist[LOSS_BURST_BUCKETS];
+};
+
+class LossTracker
+{
+public:
+  enum Result {
+    PKT_NEW,
+    PKT_REORDERED,
+    PKT_DUPLICATE,
+    PKT_LATE,
+    PKT_IGNORED
+  };
+
+  LossTracker();
+  void Reset(uint32_t aFirstPktId);
+  Result Received(uint32_t aPktId);
+  // The test is over and aEndPktId is the first ID that was not sent. All
+  // unreceived IDs before it count as lost. aEndPktId == 0 means the ID after
+  // the highest one seen.
+  void Finish(uint32_t aEndPktId);
+
+  const LossStats& Stats() const { return mStats; }
+  uint32_t FirstPktId() const { return mFirstPktId; }
+  // Packets that are expected by now: every ID up to the highest seen.
+  uint64_t Expected() const { return mHighest; }
+  // Loss rate, counting the IDs still missing in the window as lost.
+  double LossRate() const;
+  // "received R lost L (x%) bursts ..." without a new line. The summary adds
+  // the loss burst length histogram.
+  int Format(char *aBuf, size_t aLen, bool aSummary) const;
+
+private:
+  bool IsSet(uint64_t aOffset) const
+  {
+    return mBits[(aOffset / 64) % LOSS_WINDOW_WORDS] & (1ULL << (aOffset % 64));
+  }
+  void Set(uint64_t aOffset)
+  {
+    mBits[(aOffset / 64) % LOSS_WINDOW_WORDS] |= (1ULL << (aOffset % 64));
+  }
+  void MoveWindow(uint64_t aNewStart);
+  void Lost(uint32_t aCount);
+  void BurstEnd();
+
+  static const int LOSS_WINDOW_WORDS = LOSS_WINDOW_PKTS / 64;
+
+  uint64_t mBits[LOSS_WINDOW_WORDS];
+  uint32_t mFirstPktId;
+  // Offsets (relative to mFirstPktId) of the first ID in the window and of
+  // the ID after the highest one seen. mWindowStart is a multiple of 64.
+  uint64_t mWindowStart;
+  uint64_t mHighest;
+  uint32_t mBurst;
+  LossStats mStats;
+};
+
+#endif
@@ -0,0 +1,613 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Metrics.h"
+#include "HelpFunctions.h"
+#include "Placement.h"
+#include "prio.h"
+#include "prnetdb.h"
+#include "prlog.h"
+#include "prthread.h"
+#include <cstring>
+#include <map>
+#include <stdio.h>
+#include <string>
+
+extern PRLogModuleInfo* gServerTestLog;
+#define LOG(args) PR_LOG(gServerTestLog, PR_LOG_DEBUG, args)
+
+#define METRICS_REQUEST_TIMEOUT PR_SecondsToInterval(1)
+#define METRICS_REQUEST_LEN 2048
+
+static const uint32_t sLatenessBoundsUs[METRICS_LATENESS_BUCKETS - 1] = {
+  10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000
+};
+
+static const char *sTestNames[METRICS_MAX_TEST_TYPE] = {
+  "none", "Test_1", "Test_2", "Test_3", "Test_4", "Test_5", "Test_6", "SndRes",
+  "Test_8", "Test_9", "Test_A", "Test_B"
+};
+
+static WorkerMetrics sWorkers[METRICS_MAX_WORKERS];
+static WorkerMetrics sOverflowWorker;
+
+thread_local WorkerMetrics *tWorkerMetrics = nullptr;
+
+// The name of a slot, nullptr before it has one.
+static const char*
+SlotName(const WorkerMetrics &aSlot)
+{
+  return aSlot.mNamed.load(std::memory_order_acquire) ? aSlot.mName : nullptr;
+}
+
+static void
+PublishName(WorkerMetrics *aSlot, const char *aName)
+{
+  strncpy(aSlot->mName, aName, METRICS_WORKER_NAME_LEN - 1);
+  aSlot->mNamed.store(true, std::memory_order_release);
+}
+
+static bool
+ClaimSlot(WorkerMetrics *aSlot)
+{
+  bool inUse = false;
+  return aSlot->mInUse.compare_exchange_strong(inUse, true,
+                                               std::memory_order_acquire);
+}
+
+WorkerMetrics*
+MetricsRegisterWorker(const char *aName)
+{
+  // Prefer a slot that was used by a worker with the same name so that the
+  // per name totals never go backwards.
+  WorkerMetrics *slot = nullptr;
+  for (int inx = 0; !slot && inx < METRICS_MAX_WORKERS; inx++) {
+    const char *name = SlotName(sWorkers[inx]);
+    if (!sWorkers[inx].mInUse.load(std::memory_order_relaxed) && name &&
+        (strncmp(name, aName, METRICS_WORKER_NAME_LEN) == 0) &&
+        ClaimSlot(&sWorkers[inx])) {
+      slot = &sWorkers[inx];
+    }
+  }
+  // A claimed slot without a name is being named by its owner; the name of
+  // a slot never changes once published.
+  for (int inx = 0; !slot && inx < METRICS_MAX_WORKERS; inx++) {
+    if (!sWorkers[inx].mInUse.load(std::memory_order_relaxed) &&
+        !SlotName(sWorkers[inx]) &&
+        ClaimSlot(&sWorkers[inx])) {
+      slot = &sWorkers[inx];
+      PublishName(slot, aName);
+    }
+  }
+  if (!slot) {
+    slot = &sOverflowWorker;
+    // Before this worker's first update, whoever names the slot.
+    slot->mShared.store(true, std::memory_order_relaxed);
+    if (ClaimSlot(slot)) {
+      PublishName(slot, "overflow");
+    }
+  }
+  tWorkerMetrics = slot;
+  return slot;
+}
+
+void
+MetricsUnregisterWorker()
+{
+  if (tWorkerMetrics && tWorkerMetrics != &sOverflowWorker) {
+    tWorkerMetrics->mInUse.store(false, std::memory_order_release);
+  }
+  tWorkerMetrics = nullptr;
+}
+
+void
+MetricsTestStarted(int aTestType)
+{
+  if (aTestType > 0 && aTestType < METRICS_MAX_TEST_TYPE) {
+    METRICS_ADD(mTestsStarted[aTestType], 1);
+  }
+}
+
+void
+MetricsTestDone(int aTestType, bool aError)
+{
+  if (aTestType > 0 && aTestType < METRICS_MAX_TEST_TYPE) {
+    if (aError) {
+      METRICS_ADD(mTestsErrored[aTestType], 1);
+    } else {
+      METRICS_ADD(mTestsFinished[aTestType], 1);
+    }
+  }
+}
+
+void
+MetricsPacingLateness(uint32_t aLatenessUs)
+{
+  int inx = 0;
+  while (inx < METRICS_LATENESS_BUCKETS - 1 &&
+         aLatenessUs > sLatenessBoundsUs[inx]) {
+    inx++;
+  }
+  METRICS_ADD(mLateness[inx], 1);
+  METRICS_ADD(mLatenessSumUs, aLatenessUs);
+}
+
+void
+MetricsLoad(uint64_t *aActiveClients, uint64_t *aLateness)
+{
+  std::memory_order relaxed = std::memory_order_relaxed;
+  *aActiveClients = 0;
+  memset(aLateness, 0, METRICS_LATENESS_BUCKETS * sizeof(uint64_t));
+  for (int inx = 0; inx <= METRICS_MAX_WORKERS; inx++) {
+    const WorkerMetrics &slot = (inx < METRICS_MAX_WORKERS) ?
+                                sWorkers[inx] : sOverflowWorker;
+    *aActiveClients += slot.mActiveClients.load(relaxed);
+    for (int bucket = 0; bucket < METRICS_LATENESS_BUCKETS; bucket++) {
+      aLateness[bucket] += slot.mLateness[bucket].load(relaxed);
+    }
+  }
+}
+
+uint32_t
+MetricsLatenessBoundUs(int aBucket)
+{
+  if (aBucket < METRICS_LATENESS_BUCKETS - 1) {
+    return sLatenessBoundsUs[aBucket];
+  }
+  return UINT32_MAX;
+}
+
+struct MetricsTotals
+{
+  MetricsTotals()
+  {
+    memset(this, 0, sizeof(*this));
+  }
+
+  uint64_t mActiveClients;
+  uint64_t mAckQueueDepth;
+  uint64_t mClientPoolSlots;
+  uint64_t mClientPoolBytes;
+  uint64_t mPktsReceived;
+  uint64_t mBytesReceived;
+  uint64_t mPktsSent;
+  uint64_t mBytesSent;
+  uint64_t mFileWriterDrops;
+  uint64_t mResultsIoErrors;
+  uint64_t mPktsLost;
+  uint64_t mPktsReordered;
+  uint64_t mPktsDuplicated;
+  uint64_t mTxSlicesExhausted;
+  uint64_t mClientsCreated;
+  uint64_t mClientsRefused;
+  uint64_t mStrayPkts;
+  uint64_t mTcpAccepted;
+  uint64_t mEcnPkts;
+  uint64_t mEcnBleached;
+  uint64_t mEcnCe;
+  uint64_t mTlsHandshakes;
+  uint64_t mTlsHandshakeErrors;
+  uint64_t mTlsHandshakeUs;
+  uint64_t mTlsKtlsSend;
+  uint64_t mTlsKtlsRecv;
+  uint64_t mTlsBytesSent;
+  uint64_t mTlsBytesReceived;
+  uint64_t mUploadEncodedBytes;
+  uint64_t mUploadDecodedBytes;
+  uint64_t mRedirects;
+  uint64_t mClusterPeers;
+  uint64_t mClusterLoaded;
+  uint64_t mTestsStarted[METRICS_MAX_TEST_TYPE];
+  uint64_t mTestsFinished[METRICS_MAX_TEST_TYPE];
+  uint64_t mTestsErrored[METRICS_MAX_TEST_TYPE];
+  uint64_t mLateness[METRICS_LATENESS_BUCKETS];
+  uint64_t mLatenessSumUs;
+  uint64_t mCpuCost[METRICS_MAX_TEST_TYPE][CPU_COST_COUNTERS];
+};
+
+static void
+AddSlot(const WorkerMetrics &aSlot, MetricsTotals &aTotals)
+{
+  std::memory_order relaxed = std::memory_order_relaxed;
+  aTotals.mActiveClients += aSlot.mActiveClients.load(relaxed);
+  aTotals.mAckQueueDepth += aSlot.mAckQueueDepth.load(relaxed);
+  aTotals.mClientPoolSlots += aSlot.mClientPoolSlots.load(relaxed);
+  aTotals.mClientPoolBytes += aSlot.mClientPoolBytes.load(relaxed);
+  aTotals.mPktsReceived += aSlot.mPktsReceived.load(relaxed);
+  aTotals.mBytesReceived += aSlot.mBytesReceived.load(relaxed);
+  aTotals.mPktsSent += aSlot.mPktsSent.load(relaxed);
+  aTotals.mBytesSent += aSlot.mBytesSent.load(relaxed);
+  aTotals.mFileWriterDrops += aSlot.mFileWriterDrops.load(relaxed);
+  aTotals.mResultsIoErrors += aSlot.mResultsIoErrors.load(relaxed);
+  aTotals.mPktsLost += aSlot.mPktsLost.load(relaxed);
+  aTotals.mPktsReordered += aSlot.mPktsReordered.load(relaxed);
+  aTotals.mPktsDuplicated += aSlot.mPktsDuplicated.load(relaxed);
+  aTotals.mTxSlicesExhausted += aSlot.mTxSlicesExhausted.load(relaxed);
+  aTotals.mClientsCreated += aSlot.mClientsCreated.load(relaxed);
+  aTotals.mClientsRefused += aSlot.mClientsRefused.load(relaxed);
+  aTotals.mStrayPkts += aSlot.mStrayPkts.load(relaxed);
+  aTotals.mTcpAccepted += aSlot.mTcpAccepted.load(relaxed);
+  aTotals.mEcnPkts += aSlot.mEcnPkts.load(relaxed);
+  aTotals.mEcnBleached += aSlot.mEcnBleached.load(relaxed);
+  aTotals.mEcnCe += aSlot.mEcnCe.load(relaxed);
+  aTotals.mTlsHandshakes += aSlot.mTlsHandshakes.load(relaxed);
+  aTotals.mTlsHandshakeErrors += aSlot.mTlsHandshakeErrors.load(relaxed);
+  aTotals.mTlsHandshakeUs += aSlot.mTlsHandshakeUs.load(relaxed);
+  aTotals.mTlsKtlsSend += aSlot.mTlsKtlsSend.load(relaxed);
+  aTotals.mTlsKtlsRecv += aSlot.mTlsKtlsRecv.load(relaxed);
+  aTotals.mTlsBytesSent += aSlot.mTlsBytesSent.load(relaxed);
+  aTotals.mTlsBytesReceived += aSlot.mTlsBytesReceived.load(relaxed);
+  aTotals.mUploadEncodedBytes += aSlot.mUploadEncodedBytes.load(relaxed);
+  aTotals.mUploadDecodedBytes += aSlot.mUploadDecodedBytes.load(relaxed);
+  aTotals.mRedirects += aSlot.mRedirects.load(relaxed);
+  aTotals.mClusterPeers += aSlot.mClusterPeers.load(relaxed);
+  aTotals.mClusterLoaded += aSlot.mClusterLoaded.load(relaxed);
+  for (int inx = 0; inx < METRICS_MAX_TEST_TYPE; inx++) {
+    aTotals.mTestsStarted[inx] += aSlot.mTestsStarted[inx].load(relaxed);
+    aTotals.mTestsFinished[inx] += aSlot.mTestsFinished[inx].load(relaxed);
+    aTotals.mTestsErrored[inx] += aSlot.mTestsErrored[inx].load(relaxed);
+  }
+  for (int inx = 0; inx < METRICS_LATENESS_BUCKETS; inx++) {
+    aTotals.mLateness[inx] += aSlot.mLateness[inx].load(relaxed);
+  }
+  aTotals.mLatenessSumUs += aSlot.mLatenessSumUs.load(relaxed);
+  for (int inx = 0; inx < METRICS_MAX_TEST_TYPE; inx++) {
+    for (int counter = 0; counter < CPU_COST_COUNTERS; counter++) {
+      aTotals.mCpuCost[inx][counter] +=
+        aSlot.mCpuCost[inx][counter].load(relaxed);
+    }
+  }
+}
+
+static void
+AppendMetric(std::string &aOut, const char *aName, const char *aType,
+             const char *aHelp)
+{
+  char line[256];
+  snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", aName, aHelp,
+           aName, aType);
+  aOut += line;
+}
+
+static void
+AppendValue(std::string &aOut, const char *aName, const std::string &aWorker,
+            const char *aExtraLabel, uint64_t aValue)
+{
+  char line[256];
+  snprintf(line, sizeof(line), "%s{worker=\"%s\"%s} %llu\n", aName,
+           aWorker.c_str(), aExtraLabel ? aExtraLabel : "",
+           (unsigned long long)aValue);
+  aOut += line;
+}
+
+typedef std::map<std::string, MetricsTotals> TotalsMap;
+
+static void
+AppendSimple(std::string &aOut, const TotalsMap &aTotals, const char *aName,
+             const char *aType, const char *aHelp,
+             uint64_t MetricsTotals::*aField)
+{
+  AppendMetric(aOut, aName, aType, aHelp);
+  for (TotalsMap::const_iterator it = aTotals.begin(); it != aTotals.end();
+       it++) {
+    AppendValue(aOut, aName, it->first, nullptr, it->second.*aField);
+  }
+}
+
+static void
+AppendPerTest(std::string &aOut, const TotalsMap &aTotals, const char *aName,
+              const char *aHelp,
+              uint64_t (MetricsTotals::*aField)[METRICS_MAX_TEST_TYPE])
+{
+  AppendMetric(aOut, aName, "counter", aHelp);
+  for (TotalsMap::const_iterator it = aTotals.begin(); it != aTotals.end();
+       it++) {
+    for (int inx = 1; inx < METRICS_MAX_TEST_TYPE; inx++) {
+      uint64_t value = (it->second.*aField)[inx];
+      if (!value) {
+        continue;
+      }
+      char label[32];
+      snprintf(label, sizeof(label), ",test=\"%s\"", sTestNames[inx]);
+      AppendValue(aOut, aName, it->first, label, value);
+    }
+  }
+}
+
+static const char *sCpuCostHelp[CPU_COST_COUNTERS] = {
+  "Wall time charged to the test type (for TCP the whole connection), in "
+  "nanoseconds.",
+  "User CPU time charged to the test type, in microseconds.",
+  "System CPU time charged to the test type, in microseconds.",
+  "Voluntary context switches charged to the test type.",
+  "Involuntary context switches charged to the test type.",
+  "CPU cycles charged to the test type.",
+  "Instructions charged to the test type.",
+  "Cache misses charged to the test type."
+};
+
+// Unlike the test counters this has the worker's own cost as test="none".
+static void
+AppendCpuCost(std::string &aOut, const TotalsMap &aTotals, int aCounter)
+{
+  char name[64];
+  snprintf(name, sizeof(name), "network_test_cpu_%s_total",
+           CpuCostCounterName(aCounter));
+  AppendMetric(aOut, name, "counter", sCpuCostHelp[aCounter]);
+  for (TotalsMap::const_iterator it = aTotals.begin(); it != aTotals.end();
+       it++) {
+    for (int inx = 0; inx < METRICS_MAX_TEST_TYPE; inx++) {
+      uint64_t value = it->second.mCpuCost[inx][aCounter];
+      if (!value) {
+        continue;
+      }
+      char label[32];
+      snprintf(label, sizeof(label), ",test=\"%s\"", sTestNames[inx]);
+      AppendValue(aOut, name, it->first, label, value);
+    }
+  }
+}
+
+static std::string
+FormatMetrics()
+{
+  TotalsMap totals;
+  for (int inx = 0; inx < METRICS_MAX_WORKERS; inx++) {
+    const char *name = SlotName(sWorkers[inx]);
+    if (name) {
+      AddSlot(sWorkers[inx], totals[name]);
+    }
+  }
+  const char *overflow = SlotName(sOverflowWorker);
+  if (overflow) {
+    AddSlot(sOverflowWorker, totals[overflow]);
+  }
+
+  std::string out;
+  AppendSimple(out, totals, "network_test_active_clients", "gauge",
+               "Clients with a running test.",
+               &MetricsTotals::mActiveClients);
+  AppendSimple(out, totals, "network_test_ack_queue_depth", "gauge",
+               "ACKs waiting to be sent.", &MetricsTotals::mAckQueueDepth);
+  AppendSimple(out, totals, "network_test_client_pool_slots", "gauge",
+               "Preallocated UDP client slots.",
+               &MetricsTotals::mClientPoolSlots);
+  AppendSimple(out, totals, "network_test_client_pool_bytes", "gauge",
+               "Memory of the UDP client slots and payload buffers.",
+               &MetricsTotals::mClientPoolBytes);
+  AppendSimple(out, totals, "network_test_packets_received_total", "counter",
+               "Packets (UDP) or reads (TCP) received.",
+               &MetricsTotals::mPktsReceived);
+  AppendSimple(out, totals, "network_test_bytes_received_total", "counter",
+               "Bytes received.", &MetricsTotals::mBytesReceived);
+  AppendSimple(out, totals, "network_test_packets_sent_total", "counter",
+               "Packets (UDP) or writes (TCP) sent.",
+               &MetricsTotals::mPktsSent);
+  AppendSimple(out, totals, "network_test_bytes_sent_total", "counter",
+               "Bytes sent.", &MetricsTotals::mBytesSent);
+  AppendSimple(out, totals, "network_test_file_writer_drops_total", "counter",
+               "Log lines dropped because the FileWriter buffer was full.",
+               &MetricsTotals::mFileWriterDrops);
+  AppendSimple(out, totals, "network_test_results_io_errors_total", "counter",
+               "Log chunks the results store failed to write or index.",
+               &MetricsTotals::mResultsIoErrors);
+  AppendSimple(out, totals, "network_test_packets_lost_total", "counter",
+               "Test 5 and 6 data packets lost (never ACKed or received).",
+               &MetricsTotals::mPktsLost);
+  AppendSimple(out, totals, "network_test_packets_reordered_total", "counter",
+               "Test 5 and 6 data packets ACKed or received out of order.",
+               &MetricsTotals::mPktsReordered);
+  AppendSimple(out, totals, "network_test_packets_duplicated_total",
+               "counter", "Test 5 and 6 data packets ACKed or received twice.",
+               &MetricsTotals::mPktsDuplicated);
+  AppendSimple(out, totals, "network_test_tx_slices_exhausted_total",
+               "counter", "Transmit rounds a UDP client ended with packets "
+               "still due.", &MetricsTotals::mTxSlicesExhausted);
+  AppendSimple(out, totals, "network_test_clients_created_total", "counter",
+               "UDP clients given a slot.", &MetricsTotals::mClientsCreated);
+  AppendSimple(out, totals, "network_test_clients_refused_total", "counter",
+               "New UDP tests refused with a busy reply.",
+               &MetricsTotals::mClientsRefused);
+  AppendSimple(out, totals, "network_test_stray_packets_total", "counter",
+               "UDP packets from unknown peers that do not start a test.",
+               &MetricsTotals::mStrayPkts);
+  AppendSimple(out, totals, "network_test_tcp_connections_accepted_total",
+               "counter", "TCP connections accepted.",
+               &MetricsTotals::mTcpAccepted);
+  AppendSimple(out, totals, "network_test_ecn_pkts_total", "counter",
+               "Data packets of ECN tests whose codepoint was seen.",
+               &MetricsTotals::mEcnPkts);
+  AppendSimple(out, totals, "network_test_ecn_bleached_total", "counter",
+               "ECN test data packets that arrived Not-ECT.",
+               &MetricsTotals::mEcnBleached);
+  AppendSimple(out, totals, "network_test_ecn_ce_total", "counter",
+               "ECN test data packets that arrived CE marked.",
+               &MetricsTotals::mEcnCe);
+  AppendSimple(out, totals, "network_test_tls_handshakes_total", "counter",
+               "Completed TLS handshakes.", &MetricsTotals::mTlsHandshakes);
+  AppendSimple(out, totals, "network_test_tls_handshake_errors_total",
+               "counter", "TLS handshakes that failed or timed out.",
+               &MetricsTotals::mTlsHandshakeErrors);
+  AppendSimple(out, totals, "network_test_tls_handshake_us_total",
+               "counter", "Time of the completed TLS handshakes.",
+               &MetricsTotals::mTlsHandshakeUs);
+  AppendSimple(out, totals, "network_test_tls_ktls_send_total", "counter",
+               "TLS connections with the send side in the kernel (kTLS).",
+               &MetricsTotals::mTlsKtlsSend);
+  AppendSimple(out, totals, "network_test_tls_ktls_receive_total", "counter",
+               "TLS connections with the receive side in the kernel (kTLS).",
+               &MetricsTotals::mTlsKtlsRecv);
+  AppendSimple(out, totals, "network_test_tls_bytes_sent_total", "counter",
+               "Test data sent encrypted.", &MetricsTotals::mTlsBytesSent);
+  AppendSimple(out, totals, "network_test_tls_bytes_received_total",
+               "counter", "Test data received encrypted.",
+               &MetricsTotals::mTlsBytesReceived);
+  AppendSimple(out, totals, "network_test_upload_encoded_bytes_total",
+               "counter", "Bytes of uploaded logs as received.",
+               &MetricsTotals::mUploadEncodedBytes);
+  AppendSimple(out, totals, "network_test_upload_decoded_bytes_total",
+               "counter", "Bytes of uploaded logs after decoding; minus the "
+               "encoded bytes this is what the encoding saved.",
+               &MetricsTotals::mUploadDecodedBytes);
+  AppendSimple(out, totals, "network_test_redirects_total", "counter",
+               "New UDP tests redirected to a less loaded cluster peer.",
+               &MetricsTotals::mRedirects);
+  AppendSimple(out, totals, "network_test_cluster_peers", "gauge",
+               "Cluster peers heard from recently.",
+               &MetricsTotals::mClusterPeers);
+  AppendSimple(out, totals, "network_test_cluster_loaded", "gauge",
+               "1 if this server redirects new tests because it is loaded.",
+               &MetricsTotals::mClusterLoaded);
+  AppendPerTest(out, totals, "network_test_tests_started_total",
+                "Tests started.", &MetricsTotals::mTestsStarted);
+  AppendPerTest(out, totals, "network_test_tests_finished_total",
+                "Tests finished successfully.",
+                &MetricsTotals::mTestsFinished);
+  AppendPerTest(out, totals, "network_test_tests_errored_total",
+                "Tests finished with an error.",
+                &MetricsTotals::mTestsErrored);
+  int cpuCounters = CpuCostHardwareEnabled() ? CPU_COST_COUNTERS :
+                                               CPU_COST_CYCLES;
+  for (int counter = 0; counter < cpuCounters; counter++) {
+    AppendCpuCost(out, totals, counter);
+  }
+
+  const char *lateness = "network_test_pacing_lateness_us";
+  AppendMetric(out, lateness, "histogram",
+               "How late a paced packet was sent, in microseconds.");
+  for (TotalsMap::const_iterator it = totals.begin(); it != totals.end();
+       it++) {
+    std::string bucket = std::string(lateness) + "_bucket";
+    uint64_t count = 0;
+    for (int inx = 0; inx < METRICS_LATENESS_BUCKETS; inx++) {
+      count += it->second.mLateness[inx];
+      char label[32];
+      if (inx < METRICS_LATENESS_BUCKETS - 1) {
+        snprintf(label, sizeof(label), ",le=\"%lu\"",
+                 (unsigned long)sLatenessBoundsUs[inx]);
+      } else {
+        snprintf(label, sizeof(label), ",le=\"+Inf\"");
+      }
+      AppendValue(out, bucket.c_str(), it->first, label, count);
+    }
+    AppendValue(out, (std::string(lateness) + "_sum").c_str(), it->first,
+                nullptr, it->second.mLatenessSumUs);
+    AppendValue(out, (std::string(lateness) + "_count").c_str(), it->first,
+                nullptr, count);
+  }
+  return out;
+}
+
+static int
+SendAll(PRFileDesc *aFd, const char *aBuf, int aLen)
+{
+  while (aLen > 0) {
+    int written = PR_Send(aFd, aBuf, aLen, 0, METRICS_REQUEST_TIMEOUT);
+    if (written < 1) {
+      return LogError("Metrics");
+    }
+    aBuf += written;
+    aLen -= written;
+  }
+  return 0;
+}
+
+static void
+HandleMetricsRequest(PRFileDesc *aFd)
+{
+  char request[METRICS_REQUEST_LEN];
+  int readBytes = 0;
+  while (readBytes < METRICS_REQUEST_LEN - 1) {
+    int read = PR_Recv(aFd, request + readBytes,
+                       METRICS_REQUEST_LEN - 1 - readBytes, 0,
+                       METRICS_REQUEST_TIMEOUT);
+    if (read < 1) {
+      return;
+    }
+    readBytes += read;
+    request[readBytes] = '\0';
+    if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+      break;
+    }
+  }
+
+  std::string body;
+  const char *status;
+  if ((strncmp(request, "GET /metrics ", 13) == 0) ||
+      (strncmp(request, "GET / ", 6) == 0)) {
+    status = "200 OK";
+    body = FormatMetrics();
+  } else {
+    status = "404 Not Found";
+    body = "Not found\n";
+  }
+
+  char header[256];
+  int headerLen = snprintf(header, sizeof(header),
+                           "HTTP/1.0 %s\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: %lu\r\n"
+                           "Connection: close\r\n\r\n",
+                           status, (unsigned long)body.size());
+  if (SendAll(aFd, header, headerLen) == 0) {
+    SendAll(aFd, body.c_str(), body.size());
+  }
+}
+
+static void PR_CALLBACK
+MetricsThread(void *_fd)
+{
+  PRFileDesc *fd = (PRFileDesc*)_fd;
+  PlacementApply(PLACEMENT_IO, 0, "metrics");
+  while (1) {
+    PRNetAddr clientAddr;
+    PRFileDesc *client = PR_Accept(fd, &clientAddr, PR_INTERVAL_NO_TIMEOUT);
+    if (!client) {
+      LogError("Metrics");
+      continue;
+    }
+    HandleMetricsRequest(client);
+    PR_Close(client);
+  }
+}
+
+int
+StartMetricsServer(uint16_t aPort)
+{
+  PRNetAddr addr;
+  PRStatus status = PR_SetNetAddr(PR_IpAddrLoopback, PR_AF_INET, aPort, &addr);
+  if (status != PR_SUCCESS) {
+    return LogError("Metrics");
+  }
+
+  PRFileDesc *fd = PR_OpenTCPSocket(addr.raw.family);
+  if (!fd) {
+    return LogError("Metrics");
+  }
+
+  PRSocketOptionData opt;
+  opt.option = PR_SockOpt_Reuseaddr;
+  opt.value.reuse_addr = true;
+  PR_SetSocketOption(fd, &opt);
+
+  if ((PR_Bind(fd, &addr) != PR_SUCCESS) || (PR_Listen(fd, 10) != PR_SUCCESS)) {
+    int rv = LogError("Metrics");
+    PR_Close(fd);
+    return rv;
+  }
+
+  PRThread *thread = PR_CreateThread(PR_USER_THREAD, MetricsThread,
+                                     (void *)fd, PR_PRIORITY_LOW,
+                                     PR_LOCAL_THREAD, PR_UNJOINABLE_THREAD, 0);
+  if (!thread) {
+    LOG(("NetworkTest server side: Error creating metrics thread"));
+    int rv = LogError("Metrics");
+    PR_Close(fd);
+    return rv;
+  }
+  LOG(("NetworkTest server side: Metrics on 127.0.0.1:%d/metrics", aPort));
+  return 0;
+}
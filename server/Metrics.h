@@ -0,0 +1,157 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NETWORK_TESTS_METRICS_H__
+#define NETWORK_TESTS_METRICS_H__
+
+#include "CpuCost.h"
+#include <atomic>
+#include <stdint.h>
+
+/**
+ * Live server metrics.
+ *
+ * Every worker thread (a UDP port thread or a TCP client thread) owns a
+ * cache-line aligned WorkerMetrics slot. Only the owner writes to a slot, so
+ * counters are updated with relaxed loads and stores and the packet path never
+ * takes a lock or a locked instruction. The metrics thread reads all slots
+ * with relaxed loads, sums them per worker name and serves the result in the
+ * Prometheus text format on a local HTTP port.
+ *
+ * If all slots are taken, workers share an overflow slot that is updated with
+ * atomic adds; a gauge there is the sum of what the workers set, each adding
+ * the change from the value it set last.
+ *
+ * A slot's name is written once, before mNamed is set, and never changes.
+ */
+
+#define METRICS_MAX_WORKERS 256
+#define METRICS_WORKER_NAME_LEN 32
+// Test types are numbered as in ClientSocket and ClientThread (1 - 11).
+#define METRICS_MAX_TEST_TYPE 12
+// Pacing lateness histogram upper bounds in microseconds, the last bucket is
+// +Inf.
+#define METRICS_LATENESS_BUCKETS 10
+#define METRICS_PORT 9190
+
+struct alignas(64) WorkerMetrics
+{
+  void Add(std::atomic<uint64_t> &aCounter, uint64_t aValue)
+  {
+    if (mShared.load(std::memory_order_relaxed)) {
+      aCounter.fetch_add(aValue, std::memory_order_relaxed);
+    } else {
+      aCounter.store(aCounter.load(std::memory_order_relaxed) + aValue,
+                     std::memory_order_relaxed);
+    }
+  }
+  // aLast is the value the calling worker set last, kept by the worker.
+  void Set(std::atomic<uint64_t> &aGauge, uint64_t aValue, uint64_t &aLast)
+  {
+    if (mShared.load(std::memory_order_relaxed)) {
+      aGauge.fetch_add(aValue - aLast, std::memory_order_relaxed);
+    } else {
+      aGauge.store(aValue, std::memory_order_relaxed);
+    }
+    aLast = aValue;
+  }
+
+  std::atomic<bool> mInUse;
+  std::atomic<bool> mShared;
+  std::atomic<bool> mNamed;
+  char mName[METRICS_WORKER_NAME_LEN];
+
+  // Gauges. mActiveClients is changed by +1/-1 so the sum over workers is
+  // correct even if single values wrap.
+  std::atomic<uint64_t> mActiveClients;
+  std::atomic<uint64_t> mAckQueueDepth;
+  // Client slots preallocated by UDP workers and their memory (+/- too).
+  std::atomic<uint64_t> mClientPoolSlots;
+  std::atomic<uint64_t> mClientPoolBytes;
+
+  std::atomic<uint64_t> mPktsReceived;
+  std::atomic<uint64_t> mBytesReceived;
+  std::atomic<uint64_t> mPktsSent;
+  std::atomic<uint64_t> mBytesSent;
+  std::atomic<uint64_t> mFileWriterDrops;
+  // Chunks the results store could not write (ResultsStore.h).
+  std::atomic<uint64_t> mResultsIoErrors;
+  std::atomic<uint64_t> mPktsLost;
+  std::atomic<uint64_t> mPktsReordered;
+  std::atomic<uint64_t> mPktsDuplicated;
+  std::atomic<uint64_t> mTxSlicesExhausted;
+  std::atomic<uint64_t> mClientsCreated;
+  std::atomic<uint64_t> mClientsRefused;
+  std::atomic<uint64_t> mStrayPkts;
+  std::atomic<uint64_t> mTcpAccepted;
+  // Data packets of ECN tests by the codepoint they arrived with (Ecn.h).
+  std::atomic<uint64_t> mEcnPkts;
+  std::atomic<uint64_t> mEcnBleached;
+  std::atomic<uint64_t> mEcnCe;
+  // TLS connections (Tls.h).
+  std::atomic<uint64_t> mTlsHandshakes;
+  std::atomic<uint64_t> mTlsHandshakeErrors;
+  std::atomic<uint64_t> mTlsHandshakeUs;
+  std::atomic<uint64_t> mTlsKtlsSend;
+  std::atomic<uint64_t> mTlsKtlsRecv;
+  std::atomic<uint64_t> mTlsBytesSent;
+  std::atomic<uint64_t> mTlsBytesReceived;
+  // Uploaded logs as received and after decoding.
+  std::atomic<uint64_t> mUploadEncodedBytes;
+  std::atomic<uint64_t> mUploadDecodedBytes;
+  // Cluster mode (Cluster.h): new UDP tests sent to a peer, peers heard from
+  // and whether this server counts as loaded (gauges of the cluster thread).
+  std::atomic<uint64_t> mRedirects;
+  std::atomic<uint64_t> mClusterPeers;
+  std::atomic<uint64_t> mClusterLoaded;
+
+  std::atomic<uint64_t> mTestsStarted[METRICS_MAX_TEST_TYPE];
+  std::atomic<uint64_t> mTestsFinished[METRICS_MAX_TEST_TYPE];
+  std::atomic<uint64_t> mTestsErrored[METRICS_MAX_TEST_TYPE];
+
+  std::atomic<uint64_t> mLateness[METRICS_LATENESS_BUCKETS];
+  std::atomic<uint64_t> mLatenessSumUs;
+
+  // CPU cost per test type (see CpuCost.h), type 0 is the worker itself.
+  std::atomic<uint64_t> mCpuCost[METRICS_MAX_TEST_TYPE][CPU_COST_COUNTERS];
+};
+
+// Get a slot for the calling thread and make it the thread's current slot.
+WorkerMetrics* MetricsRegisterWorker(const char *aName);
+// Give the slot back; the counters are kept so the totals stay monotonic.
+void MetricsUnregisterWorker();
+
+// The slot of the calling thread or nullptr.
+extern thread_local WorkerMetrics *tWorkerMetrics;
+
+#define METRICS_ADD(field, value)                                              \
+  do {                                                                         \
+    if (tWorkerMetrics) {                                                      \
+      tWorkerMetrics->Add(tWorkerMetrics->field, (value));                     \
+    }                                                                          \
+  } while (0)
+
+#define METRICS_SET(field, value, last)                                        \
+  do {                                                                         \
+    if (tWorkerMetrics) {                                                      \
+      tWorkerMetrics->Set(tWorkerMetrics->field, (value), (last));             \
+    }                                                                          \
+  } while (0)
+
+void MetricsTestStarted(int aTestType);
+void MetricsTestDone(int aTestType, bool aError);
+void MetricsPacingLateness(uint32_t aLatenessUs);
+
+// The current sum of mActiveClients over all workers and the pacing lateness
+// histogram (METRICS_LATENESS_BUCKETS counts, not cumulative).
+void MetricsLoad(uint64_t *aActiveClients, uint64_t *aLateness);
+// Upper bound of a lateness bucket, UINT32_MAX for the last one.
+uint32_t MetricsLatenessBoundUs(int aBucket);
+
+// Start the thread serving /metrics on 127.0.0.1:aPort.
+int StartMetricsServer(uint16_t aPort);
+
+#endif
@@ -0,0 +1,180 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "OneWayDelay.h"
+#include <algorithm>
+#include <cstring>
+#include <stdio.h>
+
+OneWayDelay::OneWayDelay()
+{
+  Reset(false, 0);
+}
+
+void
+OneWayDelay::Reset(bool aEnabled, uint64_t aExpectedPkts)
+{
+  mEnabled = aEnabled;
+  memset(mSync, 0, sizeof(mSync));
+  mDriftKnown = false;
+  mDrift = 0;
+  mRecords.clear();
+  memset(mSummary, 0, sizeof(mSummary));
+  if (mEnabled) {
+    mRecords.reserve(std::min<uint64_t>(aExpectedPkts, OWD_MAX_RECORDS));
+  }
+}
+
+void
+OneWayDelay::Release()
+{
+  std::vector<Record>().swap(mRecords);
+}
+
+void
+OneWayDelay::SyncSample(bool aEnd, ClockTime aServerTx, int64_t aClientRx,
+                        int64_t aClientTx, ClockTime aServerRx)
+{
+  int64_t rtt = (int64_t)(aServerRx - aServerTx) - (aClientTx - aClientRx);
+  if (aServerRx < aServerTx || aClientTx < aClientRx || rtt < 0) {
+    return;
+  }
+  Sync &sync = mSync[aEnd ? 1 : 0];
+  if (sync.mSamples && rtt >= sync.mRtt) {
+    sync.mSamples++;
+    return;
+  }
+  sync.mSamples++;
+  sync.mRtt = rtt;
+  sync.mOffset = ((aClientRx - (int64_t)aServerTx) +
+                  (aClientTx - (int64_t)aServerRx)) / 2;
+  sync.mTime = aServerTx + (aServerRx - aServerTx) / 2;
+}
+
+void
+OneWayDelay::Packet(uint32_t aPktId, ClockTime aServerTx, int64_t aClientRx,
+                    int64_t aClientTx, ClockTime aServerRx)
+{
+  if (mRecords.size() >= OWD_MAX_RECORDS) {
+    return;
+  }
+  Record record;
+  record.mPktId = aPktId;
+  record.mServerTime = aServerTx ? aServerTx : aServerRx;
+  record.mDelay[DOWN] = (aServerTx && aClientRx) ?
+                        aClientRx - (int64_t)aServerTx : OWD_UNKNOWN;
+  record.mDelay[UP] = (aClientTx && aServerRx) ?
+                      (int64_t)aServerRx - aClientTx : OWD_UNKNOWN;
+  mRecords.push_back(record);
+}
+
+int64_t
+OneWayDelay::Offset(ClockTime aTime) const
+{
+  if (!mSync[0].mSamples) {
+    return mSync[1].mOffset;
+  }
+  if (!mDriftKnown) {
+    return mSync[0].mOffset;
+  }
+  return mSync[0].mOffset +
+         (int64_t)(mDrift * ((double)aTime - (double)mSync[0].mTime));
+}
+
+bool
+OneWayDelay::Finish()
+{
+  if (!mSync[0].mSamples && !mSync[1].mSamples) {
+    return false;
+  }
+  if (mSync[0].mSamples && mSync[1].mSamples &&
+      mSync[1].mTime > mSync[0].mTime) {
+    mDriftKnown = true;
+    mDrift = (double)(mSync[1].mOffset - mSync[0].mOffset) /
+             (double)(mSync[1].mTime - mSync[0].mTime);
+  }
+  for (size_t inx = 0; inx < mRecords.size(); inx++) {
+    Record &record = mRecords[inx];
+    int64_t offset = Offset(record.mServerTime);
+    if (record.mDelay[DOWN] != OWD_UNKNOWN) {
+      record.mDelay[DOWN] -= offset;
+    }
+    if (record.mDelay[UP] != OWD_UNKNOWN) {
+      record.mDelay[UP] += offset;
+    }
+  }
+  Summarize(DOWN);
+  Summarize(UP);
+  return true;
+}
+
+void
+OneWayDelay::Summarize(Direction aDir)
+{
+  std::vector<int64_t> values;
+  values.reserve(mRecords.size());
+  int64_t last = OWD_UNKNOWN;
+  uint64_t ipdvSum = 0;
+  for (size_t inx = 0; inx < mRecords.size(); inx++) {
+    int64_t delay = mRecords[inx].mDelay[aDir];
+    if (delay == OWD_UNKNOWN) {
+      continue;
+    }
+    if (last != OWD_UNKNOWN) {
+      ipdvSum += (delay > last) ? delay - last : last - delay;
+    }
+    last = delay;
+    values.push_back(delay);
+  }
+  Summary &summary = mSummary[aDir];
+  summary.mCount = values.size();
+  if (values.empty()) {
+    return;
+  }
+  std::sort(values.begin(), values.end());
+  size_t maxInx = values.size() - 1;
+  summary.mMin = values[0];
+  summary.mP50 = values[maxInx * 50 / 100];
+  summary.mP90 = values[maxInx * 90 / 100];
+  summary.mP99 = values[maxInx * 99 / 100];
+  summary.mMax = values[maxInx];
+  summary.mIpdv = maxInx ? ipdvSum / maxInx : 0;
+}
+
+int
+OneWayDelay::FormatSync(char *aBuf, size_t aLen) const
+{
+  char drift[32];
+  if (mDriftKnown) {
+    snprintf(drift, sizeof(drift), "%.3f", mDrift * 1000000.0);
+  } else {
+    strcpy(drift, "unknown");
+  }
+  return snprintf(aBuf, aLen, "start_rtt_us %lld end_rtt_us %lld drift_ppm %s",
+                  mSync[0].mSamples ? (long long)(mSync[0].mRtt / 1000) : -1LL,
+                  mSync[1].mSamples ? (long long)(mSync[1].mRtt / 1000) : -1LL,
+                  drift);
+}
+
+int
+OneWayDelay::FormatSummary(Direction aDir, char *aBuf, size_t aLen) const
+{
+  const Summary &summary = mSummary[aDir];
+  if (!summary.mCount) {
+    return -1;
+  }
+  return snprintf(aBuf, aLen, "%s n %llu min_us %lld p50_us %lld p90_us %lld "
+                  "p99_us %lld max_us %lld pdv_us %lld ipdv_us %lld",
+                  (aDir == DOWN) ? "down" : "up",
+                  (unsigned long long)summary.mCount,
+                  (long long)(summary.mMin / 1000),
+                  (long long)(summary.mP50 / 1000),
+                  (long long)(summary.mP90 / 1000),
+                  (long long)(summary.mP99 / 1000),
+                  (long long)(summary.mMax / 1000),
+                  (long long)((summary.mP99 - summary.mMin) / 1000),
+                  (long long)(summary.mIpdv / 1000));
+}
@@ -0,0 +1,118 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NETWORK_TESTS_ONE_WAY_DELAY_H__
+#define NETWORK_TESTS_ONE_WAY_DELAY_H__
+
+#include "Clock.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * One-way delays of a UDP test with SYNC_MODE in the first packet (Test 5, 6
+ * and 9, see config.h).
+ *
+ * The clocks of the server and the client are compared NTP style. The server
+ * sends SYNC_SAMPLES sync requests at the start and at the end of the test;
+ * every reply gives
+ *   offset = ((client rx - server tx) + (client tx - server rx)) / 2
+ *   delay  = (server rx - server tx) - (client tx - client rx)
+ * and of each burst the sample with the smallest delay is kept, because
+ * queuing on the way only makes the offset worse. The change of the offset
+ * between the two bursts is the drift of the client clock against the
+ * server clock, so the offset at the time of a packet is interpolated.
+ *
+ * The offset is only known at the end, so a packet first records the raw
+ * difference of the clocks. Finish() takes the offset off and computes the
+ * down (server to client: Test 5 and 9 data) and up (client to server: their
+ * ACKs, Test 6 data) delays with their variation. A test without the end
+ * burst is corrected with the start offset only.
+ */
+
+#define SYNC_SAMPLES 8
+#define SYNC_INTERVAL_MS 2
+// Packets recorded per test; the delays of later ones are not known.
+#define OWD_MAX_RECORDS 131072
+#define OWD_UNKNOWN INT64_MIN
+
+class OneWayDelay
+{
+public:
+  enum Direction {
+    DOWN,
+    UP
+  };
+
+  struct Record
+  {
+    uint32_t mPktId;
+    // Server send time of a down packet, receive time of an up one.
+    ClockTime mServerTime;
+    // Before Finish() client clock minus server clock (down) and the other
+    // way around (up), after it the delays; ns, OWD_UNKNOWN if the packet
+    // did not go that way.
+    int64_t mDelay[2];
+  };
+
+  OneWayDelay();
+  void Reset(bool aEnabled, uint64_t aExpectedPkts);
+  // Frees the records of a long test.
+  void Release();
+  bool Enabled() const { return mEnabled; }
+
+  // A sync reply. Client times are its clock in ns, server times ClockNow().
+  void SyncSample(bool aEnd, ClockTime aServerTx, int64_t aClientRx,
+                  int64_t aClientTx, ClockTime aServerRx);
+  // A data packet; a time that is not known is 0. Down needs aServerTx and
+  // aClientRx, up aClientTx and aServerRx.
+  void Packet(uint32_t aPktId, ClockTime aServerTx, int64_t aClientRx,
+              int64_t aClientTx, ClockTime aServerRx);
+  // Take the clock offset off the records. false without a clock sample.
+  bool Finish();
+
+  const std::vector<Record>& Records() const { return mRecords; }
+  // "start_rtt_us [n] end_rtt_us [n] drift_ppm [x]" (-1 and unknown for what
+  // is missing) without a new line.
+  int FormatSync(char *aBuf, size_t aLen) const;
+  // "[down|up] n [n] min_us [n] p50_us [n] p90_us [n] p99_us [n] max_us [n]
+  // pdv_us [n] ipdv_us [n]" without a new line, after Finish(). -1 if no
+  // packet went that way.
+  int FormatSummary(Direction aDir, char *aBuf, size_t aLen) const;
+
+private:
+  struct Sync
+  {
+    uint32_t mSamples;
+    int64_t mOffset;
+    int64_t mRtt;
+    // Server time in the middle of the exchange.
+    ClockTime mTime;
+  };
+  struct Summary
+  {
+    uint64_t mCount;
+    int64_t mMin;
+    int64_t mP50;
+    int64_t mP90;
+    int64_t mP99;
+    int64_t mMax;
+    // Mean difference of consecutive packets (RFC 3393 IPDV).
+    int64_t mIpdv;
+  };
+
+  int64_t Offset(ClockTime aTime) const;
+  void Summarize(Direction aDir);
+
+  bool mEnabled;
+  Sync mSync[2];
+  bool mDriftKnown;
+  double mDrift;
+  std::vector<Record> mRecords;
+  Summary mSummary[2];
+};
+
+#endif
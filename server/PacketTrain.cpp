@@ -0,0 +1,269 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "PacketTrain.h"
+#include "config.h"
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+
+// Link MTUs of RFC 1191 plus common tunnel and jumbo sizes, in bytes.
+static const uint32_t sPmtuProbes[] = {
+  576, 1006, 1280, 1400, 1420, 1440, 1460, 1480, 1492, 1500, 2002, 4352,
+  8166, 9000
+};
+static const uint32_t sPmtuProbesLen =
+  sizeof(sPmtuProbes) / sizeof(sPmtuProbes[0]);
+
+static uint64_t
+Median(std::vector<uint64_t> aValues)
+{
+  std::vector<uint64_t>::iterator end =
+    std::remove(aValues.begin(), aValues.end(), 0);
+  size_t n = end - aValues.begin();
+  if (!n) {
+    return 0;
+  }
+  std::sort(aValues.begin(), end);
+  return aValues[n / 2];
+}
+
+PacketTrain::PacketTrain()
+{
+  Clear();
+}
+
+void
+PacketTrain::Clear()
+{
+  mMode = TRAIN_MODE_TRAIN;
+  mLen = 0;
+  mCount = 0;
+  mPktSize = 0;
+  mPktBits = 0;
+  mSizes.clear();
+  mNextPkt = 0;
+  mOffsets.clear();
+  mSent.clear();
+  mAcked.clear();
+  mTrainCapacity.clear();
+  mTrainAvailBw.clear();
+  mTrainExcursion.clear();
+  mCapacity = 0;
+  mAvailBw = 0;
+  mPmtu = 0;
+  mPmtuLost = 0;
+}
+
+int
+PacketTrain::Init(int aMode, uint32_t aLen, uint32_t aCount,
+                  uint64_t aPktPerSec, uint32_t aPktSize)
+{
+  Clear();
+  if (aMode == TRAIN_MODE_PMTU) {
+    for (uint32_t inx = 0; inx < sPmtuProbesLen; inx++) {
+      uint32_t size = sPmtuProbes[inx] - UDP_IP_HEADER_SIZE;
+      if (size <= PAYLOADSIZE_MAX) {
+        mSizes.push_back(size);
+      }
+    }
+    aLen = mSizes.size();
+    if (!aCount) {
+      aCount = TRAIN_PMTU_DEFAULT_COUNT;
+    }
+  }
+  if (!aLen) {
+    aLen = TRAIN_DEFAULT_LEN;
+  }
+  if (!aCount) {
+    aCount = TRAIN_DEFAULT_COUNT;
+  }
+  if ((aMode != TRAIN_MODE_TRAIN && aMode != TRAIN_MODE_CHIRP &&
+       aMode != TRAIN_MODE_PMTU) ||
+      aLen < 2 || aLen > TRAIN_MAX_LEN || aCount > TRAIN_MAX_COUNT ||
+      aPktPerSec > CLOCK_NS_PER_SEC ||
+      (aMode == TRAIN_MODE_CHIRP && !aPktPerSec)) {
+    return -1;
+  }
+  mMode = aMode;
+  mLen = aLen;
+  mCount = aCount;
+  mPktSize = aPktSize;
+  mPktBits = aPktSize * 8.0;
+
+  // Spacing after every packet of a train in ns.
+  std::vector<double> spacing(mLen - 1);
+  double minSpacing = aPktPerSec ? 1000000000.0 / aPktPerSec : 0;
+  double trainDuration = 0;
+  for (uint32_t inx = 0; inx < mLen - 1; inx++) {
+    spacing[inx] = minSpacing;
+    if (mMode == TRAIN_MODE_CHIRP) {
+      spacing[inx] *= pow(TRAIN_CHIRP_SPREAD, mLen - 2 - inx);
+    }
+    trainDuration += spacing[inx];
+  }
+  double gap = std::max((double)ClockFromMilliseconds(TRAIN_GAP_MS),
+                        trainDuration);
+
+  mOffsets.resize(mLen * mCount);
+  double offset = 0;
+  for (uint32_t train = 0; train < mCount; train++) {
+    double pktOffset = offset;
+    for (uint32_t inx = 0; inx < mLen; inx++) {
+      mOffsets[train * mLen + inx] = (ClockTime)pktOffset;
+      if (inx < mLen - 1) {
+        pktOffset += spacing[inx];
+      }
+    }
+    offset += trainDuration + gap;
+  }
+  mSent.assign(mOffsets.size(), 0);
+  mAcked.assign(mOffsets.size(), 0);
+  return 0;
+}
+
+void
+PacketTrain::Estimate()
+{
+  mTrainCapacity.assign(mCount, 0);
+  mTrainAvailBw.assign(mCount, 0);
+  mTrainExcursion.assign(mCount, -1);
+  if (mMode == TRAIN_MODE_PMTU) {
+    EstimatePmtu();
+    return;
+  }
+  for (uint32_t train = 0; train < mCount; train++) {
+    if (mMode == TRAIN_MODE_TRAIN) {
+      EstimateTrain(train);
+    } else {
+      EstimateChirp(train);
+    }
+  }
+  mCapacity = Median(mTrainCapacity);
+  mAvailBw = Median(mTrainAvailBw);
+}
+
+void
+PacketTrain::EstimateTrain(uint32_t aTrain)
+{
+  uint32_t acked = 0;
+  ClockTime first = 0;
+  ClockTime last = 0;
+  for (uint32_t inx = aTrain * mLen; inx < (aTrain + 1) * mLen; inx++) {
+    if (!mAcked[inx] || !mSent[inx]) {
+      continue;
+    }
+    if (!acked || mAcked[inx] < first) {
+      first = mAcked[inx];
+    }
+    if (mAcked[inx] > last) {
+      last = mAcked[inx];
+    }
+    acked++;
+  }
+  if (acked > 1 && last > first) {
+    mTrainCapacity[aTrain] = (uint64_t)((acked - 1) * mPktBits *
+                                        CLOCK_NS_PER_SEC / (last - first));
+  }
+}
+
+void
+PacketTrain::EstimateChirp(uint32_t aTrain)
+{
+  // Delays of the ACKed packets in send order.
+  std::vector<uint32_t> pkts;
+  std::vector<int64_t> delays;
+  for (uint32_t inx = aTrain * mLen; inx < (aTrain + 1) * mLen; inx++) {
+    if (!mAcked[inx] || !mSent[inx]) {
+      continue;
+    }
+    pkts.push_back(inx);
+    delays.push_back((int64_t)(mAcked[inx] - mSent[inx]));
+  }
+  if (pkts.size() < 2) {
+    return;
+  }
+
+  // Walk back from the last packet while the delay keeps growing.
+  size_t start = pkts.size() - 1;
+  while (start > 0 &&
+         delays[start - 1] <= delays[start] + (int64_t)TRAIN_DELAY_NOISE_NS) {
+    start--;
+  }
+  uint32_t first = pkts[start];
+  uint32_t last = pkts.back();
+  if (start < pkts.size() - 1 &&
+      delays.back() - delays[start] > (int64_t)TRAIN_QUEUING_NS &&
+      first < last) {
+    mTrainExcursion[aTrain] = first - aTrain * mLen;
+    mTrainAvailBw[aTrain] = (uint64_t)(mPktBits * CLOCK_NS_PER_SEC /
+                                       (mOffsets[first + 1] -
+                                        mOffsets[first]));
+    if (pkts.size() - start > 2 && mAcked[last] > mAcked[first]) {
+      mTrainCapacity[aTrain] =
+        (uint64_t)((pkts.size() - start - 1) * mPktBits * CLOCK_NS_PER_SEC /
+                   (mAcked[last] - mAcked[first]));
+    }
+  } else {
+    // No queuing: the highest rate of the chirp is a lower bound.
+    uint32_t end = (aTrain + 1) * mLen - 1;
+    mTrainAvailBw[aTrain] = (uint64_t)(mPktBits * CLOCK_NS_PER_SEC /
+                                       (mOffsets[end] - mOffsets[end - 1]));
+  }
+}
+
+void
+PacketTrain::EstimatePmtu()
+{
+  // A size counts as passed if any sweep got it through.
+  for (uint32_t inx = 0; inx < mLen; inx++) {
+    for (uint32_t train = 0; train < mCount; train++) {
+      if (mAcked[train * mLen + inx] && mSizes[inx] > mPmtu) {
+        mPmtu = mSizes[inx];
+      }
+    }
+  }
+  for (uint32_t inx = 0; inx < mLen; inx++) {
+    if (mSizes[inx] <= mPmtu) {
+      continue;
+    }
+    bool acked = false;
+    for (uint32_t train = 0; train < mCount; train++) {
+      acked = acked || mAcked[train * mLen + inx];
+    }
+    if (!acked) {
+      mPmtuLost = mSizes[inx];
+      break;
+    }
+  }
+}
+
+int
+PacketTrain::FormatTrain(uint32_t aTrain, char *aBuf, size_t aLen) const
+{
+  uint32_t acked = 0;
+  uint32_t largest = 0;
+  for (uint32_t inx = aTrain * mLen; inx < (aTrain + 1) * mLen; inx++) {
+    if (mAcked[inx]) {
+      acked++;
+      if (PktSize(inx) > largest) {
+        largest = PktSize(inx);
+      }
+    }
+  }
+  if (mMode == TRAIN_MODE_PMTU) {
+    return snprintf(aBuf, aLen, "TRAIN %lu acked %lu largest %lu",
+                    (unsigned long)aTrain, (unsigned long)acked,
+                    (unsigned long)largest);
+  }
+  return snprintf(aBuf, aLen,
+                  "TRAIN %lu acked %lu capacity %llu available %llu "
+                  "queuing from %d",
+                  (unsigned long)aTrain, (unsigned long)acked,
+                  (unsigned long long)mTrainCapacity[aTrain],
+                  (unsigned long long)mTrainAvailBw[aTrain],
+                  mTrainExcursion[aTrain]);
+}
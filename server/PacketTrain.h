@@ -0,0 +1,133 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NETWORK_TESTS_PACKET_TRAIN_H__
+#define NETWORK_TESTS_PACKET_TRAIN_H__
+
+#include "Clock.h"
+#include <stddef.h>
+#include <vector>
+
+/**
+ * Send schedule and estimation for Test 8 (packet trains and chirps).
+ *
+ * Trains: every train is aLen packets with equal spacing (1 / rate, or back
+ * to back if the rate is 0). The capacity of a train is estimated from the
+ * dispersion of its ACKs: (ACKed packets - 1) * packet bits / (last ACK -
+ * first ACK). The test reports the median over all trains.
+ *
+ * Chirps: the spacing inside a chirp shrinks by TRAIN_CHIRP_SPREAD for every
+ * packet, so the rate grows from rate / SPREAD^(len - 2) to rate. As long as
+ * the rate is below the available bandwidth the delay (ACK received - packet
+ * sent) stays flat; the packet from which the delay keeps growing until the
+ * end of the chirp marks the available bandwidth (its send rate). While the
+ * queue builds up the ACKs leave the bottleneck at its capacity, so the ACK
+ * dispersion of these packets estimates the capacity. If the delay never
+ * grows the highest rate of the chirp is a lower bound for the available
+ * bandwidth. The test reports the median over all chirps.
+ *
+ * Path MTU probes: every train is a sweep over sPmtuProbes (common link
+ * MTUs minus the IP and UDP headers), smallest first, sent with the don't
+ * fragment bit. The largest acked probe is the path MTU (minus headers); the
+ * smallest larger probe that was never acked bounds it from above. Sweeps
+ * are repeated so a single loss does not lower the result.
+ *
+ * Trains are separated by at least TRAIN_GAP_MS, so queues drain between
+ * them.
+ */
+
+#define TRAIN_MODE_TRAIN 0
+#define TRAIN_MODE_CHIRP 1
+#define TRAIN_MODE_PMTU 2
+#define TRAIN_DEFAULT_LEN 32
+#define TRAIN_DEFAULT_COUNT 8
+#define TRAIN_MAX_LEN 256
+#define TRAIN_MAX_COUNT 64
+#define TRAIN_PMTU_DEFAULT_COUNT 3
+#define TRAIN_CHIRP_SPREAD 1.2
+#define TRAIN_GAP_MS 20
+// After the last train ACKs are awaited this long before estimating.
+#define TRAIN_ACK_WAIT_MS 200
+// Delay growth that counts as queuing, and delay noise that is ignored while
+// looking for it.
+#define TRAIN_QUEUING_NS (100 * CLOCK_NS_PER_US)
+#define TRAIN_DELAY_NOISE_NS (10 * CLOCK_NS_PER_US)
+
+class PacketTrain
+{
+public:
+  PacketTrain();
+  // Returns -1 if the parameters are not valid. 0 for aLen and aCount means
+  // the default. aPktSize is the payload of every packet, except for path
+  // MTU probes where aLen is not used either.
+  int Init(int aMode, uint32_t aLen, uint32_t aCount, uint64_t aPktPerSec,
+           uint32_t aPktSize);
+  void Clear();
+
+  int Mode() const { return mMode; }
+  uint32_t Len() const { return mLen; }
+  uint32_t Count() const { return mCount; }
+  uint32_t TotalPkts() const { return mOffsets.size(); }
+  // Time from the first packet to the last one.
+  ClockTime Duration() const
+  {
+    return mOffsets.empty() ? 0 : mOffsets.back();
+  }
+
+  // Index of the next packet to send and its send time relative to the first
+  // packet.
+  uint32_t NextPkt() const { return mNextPkt; }
+  ClockTime SendOffset(uint32_t aInx) const { return mOffsets[aInx]; }
+  uint32_t PktSize(uint32_t aInx) const
+  {
+    return mSizes.empty() ? mPktSize : mSizes[aInx % mLen];
+  }
+  void Sent(ClockTime aTime) { mSent[mNextPkt++] = aTime; }
+  void Acked(uint32_t aInx, ClockTime aTime)
+  {
+    if (aInx < mAcked.size() && !mAcked[aInx]) {
+      mAcked[aInx] = aTime;
+    }
+  }
+
+  void Estimate();
+  // In bits per second, 0 if not measured.
+  uint64_t Capacity() const { return mCapacity; }
+  uint64_t AvailableBandwidth() const { return mAvailBw; }
+  // Path MTU probes: the largest acked payload and the smallest larger one
+  // that never was (0 if there is none).
+  uint32_t Pmtu() const { return mPmtu; }
+  uint32_t PmtuLost() const { return mPmtuLost; }
+  // "TRAIN n acked n capacity n ..." of one train, without a new line.
+  int FormatTrain(uint32_t aTrain, char *aBuf, size_t aLen) const;
+
+private:
+  void EstimateTrain(uint32_t aTrain);
+  void EstimateChirp(uint32_t aTrain);
+  void EstimatePmtu();
+
+  int mMode;
+  uint32_t mLen;
+  uint32_t mCount;
+  uint32_t mPktSize;
+  double mPktBits;
+  // Path MTU probes: the payload of every packet of a train.
+  std::vector<uint32_t> mSizes;
+  uint32_t mNextPkt;
+  std::vector<ClockTime> mOffsets;
+  std::vector<ClockTime> mSent;
+  std::vector<ClockTime> mAcked;
+  // Per train: estimates and the packet where queuing started (chirps).
+  std::vector<uint64_t> mTrainCapacity;
+  std::vector<uint64_t> mTrainAvailBw;
+  std::vector<int> mTrainExcursion;
+  uint64_t mCapacity;
+  uint64_t mAvailBw;
+  uint32_t mPmtu;
+  uint32_t mPmtuLost;
+};
+
+#endif
@@ -0,0 +1,356 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Placement.h"
+#include "prio.h"
+#include "prlog.h"
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+extern PRLogModuleInfo* gServerTestLog;
+#define LOG(args) PR_LOG(gServerTestLog, PR_LOG_DEBUG, args)
+
+#define PLACEMENT_MAX_CPUS 1024
+#define PLACEMENT_LIST_LEN 256
+
+typedef std::vector<int> CpuList;
+
+// Requested with -a, then resolved by PlacementInit.
+static CpuList sUdpCpus;
+static CpuList sTcpCpus;
+static CpuList sIoCpus;
+static bool sUdpSet = false;
+static bool sTcpSet = false;
+static bool sIoSet = false;
+static std::string sNic;
+
+// Placement is only done if any -a option was given.
+static bool sActive = false;
+static CpuList sAllowed;
+// NUMA node of every core, -1 if unknown.
+static std::vector<int> sCpuNode;
+
+static int
+ParseCpuList(const char *aList, CpuList &aCpus)
+{
+  aCpus.clear();
+  const char *pos = aList;
+  while (*pos && *pos != '\n') {
+    char *end;
+    long first = strtol(pos, &end, 10);
+    if (end == pos || first < 0) {
+      return -1;
+    }
+    long last = first;
+    pos = end;
+    if (*pos == '-') {
+      pos++;
+      last = strtol(pos, &end, 10);
+      if (end == pos || last < first) {
+        return -1;
+      }
+      pos = end;
+    }
+    if (last >= PLACEMENT_MAX_CPUS) {
+      return -1;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      if (std::find(aCpus.begin(), aCpus.end(), cpu) == aCpus.end()) {
+        aCpus.push_back(cpu);
+      }
+    }
+    if (*pos == ',') {
+      pos++;
+    } else if (*pos && *pos != '\n') {
+      return -1;
+    }
+  }
+  return aCpus.empty() ? -1 : 0;
+}
+
+static std::string
+FormatCpuList(const CpuList &aCpus)
+{
+  if (aCpus.empty()) {
+    return "any";
+  }
+  std::string out;
+  char range[32];
+  size_t inx = 0;
+  while (inx < aCpus.size()) {
+    size_t last = inx;
+    while (last + 1 < aCpus.size() && aCpus[last + 1] == aCpus[last] + 1) {
+      last++;
+    }
+    if (last == inx) {
+      snprintf(range, sizeof(range), "%s%d", out.empty() ? "" : ",",
+               aCpus[inx]);
+    } else {
+      snprintf(range, sizeof(range), "%s%d-%d", out.empty() ? "" : ",",
+               aCpus[inx], aCpus[last]);
+    }
+    out += range;
+    inx = last + 1;
+  }
+  return out;
+}
+
+int
+PlacementAddOption(const char *aOption)
+{
+  const char *value = strchr(aOption, '=');
+  if (!value) {
+    return -1;
+  }
+  std::string name(aOption, value - aOption);
+  value++;
+  sActive = true;
+  if (name == "nic") {
+    sNic = value;
+    return sNic.empty() ? -1 : 0;
+  }
+  if (name == "udp") {
+    sUdpSet = true;
+    return ParseCpuList(value, sUdpCpus);
+  }
+  if (name == "tcp") {
+    sTcpSet = true;
+    return ParseCpuList(value, sTcpCpus);
+  }
+  if (name == "io") {
+    sIoSet = true;
+    return ParseCpuList(value, sIoCpus);
+  }
+  return -1;
+}
+
+#ifdef __linux__
+static int
+ReadSysFile(const char *aFileName, char *aBuf, size_t aLen)
+{
+  PRFileDesc *fd = PR_Open(aFileName, PR_RDONLY, 0);
+  if (!fd) {
+    return -1;
+  }
+  int read = PR_Read(fd, aBuf, aLen - 1);
+  PR_Close(fd);
+  if (read <= 0) {
+    return -1;
+  }
+  aBuf[read] = '\0';
+  return 0;
+}
+
+static void
+ReadCpuNodes()
+{
+  sCpuNode.assign(PLACEMENT_MAX_CPUS, -1);
+  char buf[PLACEMENT_LIST_LEN];
+  CpuList nodes;
+  if (ReadSysFile("/sys/devices/system/node/online", buf, sizeof(buf)) ||
+      ParseCpuList(buf, nodes)) {
+    return;
+  }
+  for (size_t inx = 0; inx < nodes.size(); inx++) {
+    char fileName[64];
+    snprintf(fileName, sizeof(fileName),
+             "/sys/devices/system/node/node%d/cpulist", nodes[inx]);
+    CpuList cpus;
+    if (ReadSysFile(fileName, buf, sizeof(buf)) || ParseCpuList(buf, cpus)) {
+      continue;
+    }
+    for (size_t cpu = 0; cpu < cpus.size(); cpu++) {
+      sCpuNode[cpus[cpu]] = nodes[inx];
+    }
+  }
+}
+
+static int
+NicNode(const std::string &aNic)
+{
+  char fileName[128];
+  snprintf(fileName, sizeof(fileName), "/sys/class/net/%s/device/numa_node",
+           aNic.c_str());
+  char buf[16];
+  if (ReadSysFile(fileName, buf, sizeof(buf))) {
+    return -1;
+  }
+  return atoi(buf);
+}
+
+static bool
+Contains(const CpuList &aCpus, int aCpu)
+{
+  return std::find(aCpus.begin(), aCpus.end(), aCpu) != aCpus.end();
+}
+
+// The cores of aCpus the process may use.
+static CpuList
+Allowed(const CpuList &aCpus)
+{
+  CpuList cpus;
+  for (size_t inx = 0; inx < aCpus.size(); inx++) {
+    if (Contains(sAllowed, aCpus[inx])) {
+      cpus.push_back(aCpus[inx]);
+    }
+  }
+  return cpus;
+}
+
+static CpuList
+Without(const CpuList &aCpus, const CpuList &aRemove)
+{
+  CpuList cpus;
+  for (size_t inx = 0; inx < aCpus.size(); inx++) {
+    if (!Contains(aRemove, aCpus[inx])) {
+      cpus.push_back(aCpus[inx]);
+    }
+  }
+  return cpus;
+}
+
+static CpuList
+GetAffinity()
+{
+  CpuList cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set)) {
+    return cpus;
+  }
+  for (int cpu = 0; cpu < CPU_SETSIZE && cpu < PLACEMENT_MAX_CPUS; cpu++) {
+    if (CPU_ISSET(cpu, &set)) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+static void
+PrintRole(const char *aRole, const CpuList &aCpus, bool aRequested,
+          const CpuList &aResolved)
+{
+  printf("placement: %s cores %s", aRole, FormatCpuList(aResolved).c_str());
+  if (aRequested && aResolved.size() < aCpus.size()) {
+    printf(" (requested %s)", FormatCpuList(aCpus).c_str());
+  }
+  printf("\n");
+}
+#endif
+
+int
+PlacementInit(int aUdpThreads)
+{
+  if (!sActive) {
+    return 0;
+  }
+#ifdef __linux__
+  sAllowed = GetAffinity();
+  ReadCpuNodes();
+
+  int nicNode = -1;
+  if (!sNic.empty()) {
+    nicNode = NicNode(sNic);
+    if (nicNode < 0) {
+      printf("placement: NUMA node of %s unknown\n", sNic.c_str());
+    }
+  }
+  CpuList nodeCpus;
+  for (size_t inx = 0; inx < sAllowed.size(); inx++) {
+    if (nicNode < 0 || sCpuNode[sAllowed[inx]] == nicNode) {
+      nodeCpus.push_back(sAllowed[inx]);
+    }
+  }
+
+  CpuList udp;
+  if (sUdpSet) {
+    udp = Allowed(sUdpCpus);
+  } else if (!sNic.empty()) {
+    for (int inx = 0; inx < aUdpThreads && inx < (int)nodeCpus.size();
+         inx++) {
+      udp.push_back(nodeCpus[inx]);
+    }
+  }
+  CpuList others = Without(sAllowed, udp);
+  CpuList io;
+  if (sIoSet) {
+    io = Allowed(sIoCpus);
+  } else if (!udp.empty()) {
+    io = others;
+  }
+  CpuList tcp;
+  if (sTcpSet) {
+    tcp = Allowed(sTcpCpus);
+  } else if (!udp.empty()) {
+    tcp = Without(nodeCpus, udp);
+    if (tcp.empty()) {
+      tcp = others;
+    }
+  }
+
+  if (!sNic.empty()) {
+    printf("placement: nic %s on node %d\n", sNic.c_str(), nicNode);
+  }
+  PrintRole("udp", sUdpCpus, sUdpSet, udp);
+  PrintRole("tcp", sTcpCpus, sTcpSet, tcp);
+  PrintRole("io", sIoCpus, sIoSet, io);
+  fflush(stdout);
+  sUdpCpus = udp;
+  sTcpCpus = tcp;
+  sIoCpus = io;
+#else
+  printf("placement: not supported on this system\n");
+  fflush(stdout);
+  sActive = false;
+#endif
+  return 0;
+}
+
+void
+PlacementApply(PlacementRole aRole, int aInx, const char *aName)
+{
+#ifdef __linux__
+  if (!sActive) {
+    return;
+  }
+  const CpuList *cpus = &sIoCpus;
+  if (aRole == PLACEMENT_UDP) {
+    cpus = &sUdpCpus;
+  } else if (aRole == PLACEMENT_TCP) {
+    cpus = &sTcpCpus;
+  }
+  // Threads inherit the cores of the thread that creates them, so a thread
+  // without cores of its own goes back to all allowed cores.
+  CpuList mine = cpus->empty() ? sAllowed : *cpus;
+  if (aRole == PLACEMENT_UDP && !cpus->empty()) {
+    mine.assign(1, (*cpus)[aInx % cpus->size()]);
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (size_t inx = 0; inx < mine.size(); inx++) {
+    CPU_SET(mine[inx], &set);
+  }
+  if (sched_setaffinity(0, sizeof(set), &set)) {
+    LOG(("NetworkTest server side: Placement of %s failed: %d", aName,
+         errno));
+  }
+  if (aRole == PLACEMENT_UDP) {
+    CpuList got = GetAffinity();
+    int node = got.empty() ? -1 : sCpuNode[got[0]];
+    printf("placement: %s on cores %s node %d\n", aName,
+           FormatCpuList(got).c_str(), node);
+    fflush(stdout);
+  }
+#endif
+}
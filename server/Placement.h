@@ -0,0 +1,57 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NETWORK_TESTS_PLACEMENT_H__
+#define NETWORK_TESTS_PLACEMENT_H__
+
+/**
+ * CPU placement of the server threads.
+ *
+ * There are three kinds of threads:
+ *  PLACEMENT_UDP: the UDP port threads, which pace packets. Every one gets a
+ *                 core of its own (the cores are reused round robin if there
+ *                 are fewer cores than ports).
+ *  PLACEMENT_TCP: the TCP accept loop and the TCP connection threads. They
+ *                 share their cores.
+ *  PLACEMENT_IO:  FileWriter threads, the metrics, the limits watcher and
+ *                 the cluster threads. They share their cores.
+ *
+ * The layout is given with -a options of the server:
+ *  -a udp=<cpu list>   e.g. udp=2-6 or udp=2,4,6
+ *  -a tcp=<cpu list>
+ *  -a io=<cpu list>
+ *  -a nic=<interface>  place the UDP threads on the NUMA node of the NIC.
+ * Without udp= but with nic= the UDP threads get the cores of the NIC's node
+ * in order. Without io= the I/O threads get the allowed cores that are not
+ * UDP cores, without tcp= the TCP threads get the non UDP cores of the NIC's
+ * node (or all non UDP cores). Cores the process may not use are dropped.
+ * A kind of thread without cores is left to the scheduler.
+ *
+ * Memory is node local through first touch: a UDP thread moves to its core
+ * before it allocates its client pool and capture ring, and only that thread
+ * writes them.
+ *
+ * Only Linux is supported; elsewhere the options are accepted and ignored.
+ */
+
+enum PlacementRole {
+  PLACEMENT_UDP,
+  PLACEMENT_TCP,
+  PLACEMENT_IO
+};
+
+// Add one -a option. Returns -1 if it can not be parsed.
+int PlacementAddOption(const char *aOption);
+
+// Resolve the layout for aUdpThreads UDP threads and print it. Must be called
+// before any thread is created.
+int PlacementInit(int aUdpThreads);
+
+// Move the calling thread to its cores; aInx is the index of a UDP thread.
+// UDP threads print the placement they got, named aName.
+void PlacementApply(PlacementRole aRole, int aInx, const char *aName);
+
+#endif
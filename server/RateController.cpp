@@ -0,0 +1,231 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "RateController.h"
+#include <cstring>
+
+static const double sCycleGains[] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+static const int sCycleLen = sizeof(sCycleGains) / sizeof(sCycleGains[0]);
+
+RateController::RateController()
+{
+  Clear();
+}
+
+void
+RateController::Clear()
+{
+  mRing.clear();
+  mState = STARTUP;
+  mStartRate = RC_DEFAULT_START_RATE;
+  mDelivered = 0;
+  mDeliveredTime = 0;
+  mFirstSent = 0;
+  mLastSent = 0;
+  mMinRtt = 0;
+  mRounds = 0;
+  mNextRoundDelivered = 0;
+  memset(mRoundMax, 0, sizeof(mRoundMax));
+  mRoundStartLost = 0;
+  mRoundStartDelivered = 0;
+  mFullBw = 0;
+  mFullBwCount = 0;
+  mBwLimit = 0;
+  mCycleInx = 0;
+  mCycleStart = 0;
+  mLogEvent = false;
+}
+
+void
+RateController::Init(uint64_t aStartRate)
+{
+  Clear();
+  if (aStartRate) {
+    mStartRate = (aStartRate < RC_MAX_RATE) ? aStartRate : RC_MAX_RATE;
+  }
+  PktState empty = { UINT32_MAX, 0, 0, 0 };
+  mRing.assign(RC_RING_PKTS, empty);
+}
+
+void
+RateController::OnSent(uint32_t aOffset, ClockTime aNow)
+{
+  if (!mFirstSent) {
+    mFirstSent = aNow;
+  }
+  mLastSent = aNow;
+  PktState &pkt = mRing[aOffset % RC_RING_PKTS];
+  pkt.mOffset = aOffset;
+  pkt.mSent = aNow;
+  pkt.mDelivered = mDelivered;
+  pkt.mDeliveredTime = mDeliveredTime ? mDeliveredTime : mFirstSent;
+}
+
+void
+RateController::OnAck(uint32_t aOffset, ClockTime aNow, uint64_t aInflight,
+                      uint64_t aLost)
+{
+  PktState &pkt = mRing[aOffset % RC_RING_PKTS];
+  if (pkt.mOffset != aOffset || !pkt.mSent) {
+    // Too old or a duplicate.
+    return;
+  }
+  ClockTime rtt = aNow - pkt.mSent;
+  pkt.mSent = 0;
+  if (!mMinRtt || rtt < mMinRtt) {
+    mMinRtt = rtt;
+  }
+  mDelivered++;
+  mDeliveredTime = aNow;
+
+  // Delivery rate sample.
+  if (aNow > pkt.mDeliveredTime) {
+    double rate = (double)(mDelivered - pkt.mDelivered) * CLOCK_NS_PER_SEC /
+                  (double)(aNow - pkt.mDeliveredTime);
+    double &roundMax = mRoundMax[mRounds % RC_BW_ROUNDS];
+    if (rate > roundMax) {
+      roundMax = rate;
+    }
+  }
+
+  if (pkt.mDelivered >= mNextRoundDelivered) {
+    mNextRoundDelivered = mDelivered;
+    RoundEnd(aLost, aNow);
+  }
+
+  if (mState == DRAIN && aInflight <= Bdp()) {
+    SetState(PROBE_BW, aNow);
+  }
+  if (mState == PROBE_BW && mMinRtt && aNow - mCycleStart > mMinRtt) {
+    mCycleInx = (mCycleInx + 1) % sCycleLen;
+    mCycleStart = aNow;
+    if (mCycleInx == 0) {
+      // Probe for more bandwidth even if the last loss capped it.
+      mBwLimit = 0;
+    }
+  }
+}
+
+void
+RateController::RoundEnd(uint64_t aLost, ClockTime aNow)
+{
+  uint64_t delivered = mDelivered - mRoundStartDelivered;
+  uint64_t lost = aLost - mRoundStartLost;
+  double roundMax = mRoundMax[mRounds % RC_BW_ROUNDS];
+  bool lossy = delivered + lost > 0 &&
+               (double)lost / (double)(delivered + lost) > RC_LOSS_THRESHOLD;
+  mRoundStartDelivered = mDelivered;
+  mRoundStartLost = aLost;
+  mRounds++;
+  mRoundMax[mRounds % RC_BW_ROUNDS] = 0;
+  mLogEvent = true;
+
+  if (mState == STARTUP) {
+    double bw = BtlBw();
+    if (bw >= mFullBw * 1.25) {
+      mFullBw = bw;
+      mFullBwCount = 0;
+    } else {
+      mFullBwCount++;
+    }
+    if (mFullBwCount >= 3 || lossy) {
+      SetState(DRAIN, aNow);
+    }
+  } else if (lossy && roundMax > 0) {
+    mBwLimit = roundMax;
+  }
+}
+
+void
+RateController::SetState(State aState, ClockTime aNow)
+{
+  mState = aState;
+  mCycleInx = 0;
+  mCycleStart = aNow;
+  mLogEvent = true;
+}
+
+double
+RateController::BtlBw() const
+{
+  double bw = 0;
+  for (int inx = 0; inx < RC_BW_ROUNDS; inx++) {
+    if (mRoundMax[inx] > bw) {
+      bw = mRoundMax[inx];
+    }
+  }
+  if (mBwLimit > 0 && mBwLimit < bw) {
+    bw = mBwLimit;
+  }
+  return bw;
+}
+
+double
+RateController::PacingRate() const
+{
+  double bw = BtlBw();
+  if (mState == STARTUP && bw < mStartRate) {
+    bw = mStartRate;
+  }
+  double gain = 1;
+  switch (mState) {
+    case STARTUP:
+      gain = RC_STARTUP_GAIN;
+      break;
+    case DRAIN:
+      gain = 1 / RC_STARTUP_GAIN;
+      break;
+    case PROBE_BW:
+      gain = sCycleGains[mCycleInx];
+      break;
+  }
+  double rate = gain * bw;
+  if (rate > RC_MAX_RATE) {
+    rate = RC_MAX_RATE;
+  }
+  return (rate < 1) ? 1 : rate;
+}
+
+double
+RateController::Bdp() const
+{
+  return BtlBw() * mMinRtt / CLOCK_NS_PER_SEC;
+}
+
+uint64_t
+RateController::Cwnd() const
+{
+  if (!mMinRtt) {
+    return UINT64_MAX;
+  }
+  double gain = (mState == STARTUP) ? RC_STARTUP_GAIN : RC_CWND_GAIN;
+  uint64_t cwnd = (uint64_t)(gain * Bdp());
+  return (cwnd < RC_MIN_CWND) ? RC_MIN_CWND : cwnd;
+}
+
+bool
+RateController::CwndLimited(uint64_t aInflight, ClockTime aNow) const
+{
+  if (aInflight < Cwnd()) {
+    return false;
+  }
+  ClockTime last = (mDeliveredTime > mLastSent) ? mDeliveredTime : mLastSent;
+  return aNow - last < ClockFromMilliseconds(RC_PROBE_TIMEOUT_MS);
+}
+
+const char*
+RateController::StateName() const
+{
+  switch (mState) {
+    case STARTUP:
+      return "STARTUP";
+    case DRAIN:
+      return "DRAIN";
+    case PROBE_BW:
+      return "PROBE_BW";
+  }
+  return "";
+}
@@ -0,0 +1,126 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NETWORK_TESTS_RATE_CONTROLLER_H__
+#define NETWORK_TESTS_RATE_CONTROLLER_H__
+
+#include "Clock.h"
+#include <stddef.h>
+#include <vector>
+
+/**
+ * Sending rate controller for Test 9, modeled on BBR.
+ *
+ * Every ACK gives a delivery rate sample: packets ACKed since the ACKed
+ * packet was sent / time since then. The bottleneck bandwidth (btlbw) is the
+ * maximum sample of the last RC_BW_ROUNDS round trips, the RTT the minimum
+ * seen. Packets are paced at gain * btlbw and the packets in flight (sent
+ * after the highest ACKed packet) are capped at RC_CWND_GAIN * BDP
+ * (RC_STARTUP_GAIN * BDP in STARTUP).
+ *
+ *  STARTUP:  gain RC_STARTUP_GAIN until btlbw has not grown by 25% for 3
+ *            rounds or a round loses more than RC_LOSS_THRESHOLD.
+ *  DRAIN:    gain 1 / RC_STARTUP_GAIN until the queue made in STARTUP is
+ *            gone (in flight <= BDP).
+ *  PROBE_BW: gain cycles through 1.25, 0.75, 1, 1, 1, 1, 1, 1, one min RTT
+ *            each. A round that loses more than RC_LOSS_THRESHOLD caps the
+ *            bandwidth at the highest delivery rate of that round until the
+ *            next 1.25 phase.
+ *
+ * State is per packet ID offset (relative to the first data packet) in a
+ * ring of RC_RING_PKTS slots, so memory use is fixed.
+ */
+
+#define RC_RING_PKTS 4096
+#define RC_BW_ROUNDS 10
+#define RC_STARTUP_GAIN 2.885
+#define RC_CWND_GAIN 2.0
+#define RC_MIN_CWND 4
+#define RC_LOSS_THRESHOLD 0.02
+#define RC_DEFAULT_START_RATE 1000
+#define RC_MAX_RATE 1000000
+// If the window is full and nothing was sent or ACKed for this long one
+// packet may be sent.
+#define RC_PROBE_TIMEOUT_MS 200
+
+class RateController
+{
+public:
+  enum State {
+    STARTUP,
+    DRAIN,
+    PROBE_BW
+  };
+
+  RateController();
+  // aStartRate in packets per second, 0 means RC_DEFAULT_START_RATE.
+  void Init(uint64_t aStartRate);
+  void Clear();
+
+  void OnSent(uint32_t aOffset, ClockTime aNow);
+  // aInflight: packets sent after the highest ACKed one. aLost: packets
+  // missing below the highest ACKed one so far.
+  void OnAck(uint32_t aOffset, ClockTime aNow, uint64_t aInflight,
+             uint64_t aLost);
+
+  // Time between two packets at the current pacing rate.
+  double PktInterval() const { return 1000000000.0 / PacingRate(); }
+  double PacingRate() const;
+  bool CwndLimited(uint64_t aInflight, ClockTime aNow) const;
+  uint64_t Cwnd() const;
+
+  State GetState() const { return mState; }
+  const char* StateName() const;
+  double BtlBw() const;
+  ClockTime MinRtt() const { return mMinRtt; }
+  uint64_t Rounds() const { return mRounds; }
+  // True once per round trip and on state changes, for logging.
+  bool TakeLogEvent()
+  {
+    bool event = mLogEvent;
+    mLogEvent = false;
+    return event;
+  }
+
+private:
+  struct PktState
+  {
+    uint32_t mOffset;
+    ClockTime mSent;
+    uint64_t mDelivered;
+    ClockTime mDeliveredTime;
+  };
+
+  void RoundEnd(uint64_t aLost, ClockTime aNow);
+  double Bdp() const;
+  void SetState(State aState, ClockTime aNow);
+
+  std::vector<PktState> mRing;
+  State mState;
+  double mStartRate;
+  uint64_t mDelivered;
+  ClockTime mDeliveredTime;
+  ClockTime mFirstSent;
+  ClockTime mLastSent;
+  ClockTime mMinRtt;
+
+  // Round trip counting: a round ends when a packet sent after the previous
+  // round end is ACKed.
+  uint64_t mRounds;
+  uint64_t mNextRoundDelivered;
+  double mRoundMax[RC_BW_ROUNDS];
+  uint64_t mRoundStartLost;
+  uint64_t mRoundStartDelivered;
+
+  double mFullBw;
+  int mFullBwCount;
+  double mBwLimit;
+  int mCycleInx;
+  ClockTime mCycleStart;
+  bool mLogEvent;
+};
+
+#endif
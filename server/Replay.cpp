@@ -0,0 +1,264 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * Replays a capture made with ServerSide -r into a server.
+ *
+ * Every peer of the capture gets its own UDP socket, so the server sees the
+ * same number of clients as during the capture. Packets are sent with the
+ * recorded spacing divided by the time scale (-s 2 replays twice as fast) and
+ * padded to their original length. Replies of the server are drained and
+ * their latency (time since the last packet sent on that socket) is measured.
+ *
+ * At the end it reports how exactly the arrivals were reproduced (send
+ * lateness), the reply latency percentiles and, with -P, the CPU time the
+ * server process used during the replay.
+ */
+
+#include "Capture.h"
+#include "prlog.h"
+#include "prnetdb.h"
+#include "prinit.h"
+#include "plgetopt.h"
+#include <algorithm>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+PRLogModuleInfo* gServerTestLog;
+
+#define REPLAY_DRAIN_TIME_US 2000000
+#define REPLAY_MAX_PKT 65507
+
+struct ReplayPeer
+{
+  PRFileDesc *mFd;
+  PRTime mLastSent;
+};
+
+static int
+ReadServerCpu(int aPid, double &aSeconds)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/stat", aPid);
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return -1;
+  }
+  char buf[1024];
+  size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[len] = '\0';
+  // Fields after the command name, which is in parentheses.
+  char *p = strrchr(buf, ')');
+  unsigned long utime, stime;
+  if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                   &utime, &stime) != 2) {
+    return -1;
+  }
+  aSeconds = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+  return 0;
+}
+
+static void
+PrintPercentiles(const char *aName, std::vector<PRTime> &aSamples)
+{
+  if (aSamples.empty()) {
+    printf("%s: no samples\n", aName);
+    return;
+  }
+  std::sort(aSamples.begin(), aSamples.end());
+  size_t n = aSamples.size();
+  printf("%s (us): p50 %lld p90 %lld p99 %lld max %lld (%lu samples)\n", aName,
+         (long long)aSamples[n / 2], (long long)aSamples[n * 90 / 100],
+         (long long)aSamples[n * 99 / 100], (long long)aSamples[n - 1],
+         (unsigned long)n);
+}
+
+static void
+DrainReplies(std::vector<PRPollDesc> &aPolls, std::vector<ReplayPeer*> &aPeers,
+             PRIntervalTime aTimeout, std::vector<PRTime> &aLatency)
+{
+  if (aPolls.empty()) {
+    PR_Sleep(aTimeout);
+    return;
+  }
+  for (size_t inx = 0; inx < aPolls.size(); inx++) {
+    aPolls[inx].out_flags = 0;
+  }
+  if (PR_Poll(&aPolls[0], aPolls.size(), aTimeout) < 1) {
+    return;
+  }
+  PRTime now = PR_Now();
+  char buf[REPLAY_MAX_PKT];
+  for (size_t inx = 0; inx < aPolls.size(); inx++) {
+    if (!(aPolls[inx].out_flags & PR_POLL_READ)) {
+      continue;
+    }
+    PRNetAddr addr;
+    while (PR_RecvFrom(aPolls[inx].fd, buf, sizeof(buf), 0, &addr,
+                       PR_INTERVAL_NO_WAIT) >= 0) {
+      aLatency.push_back(now - aPeers[inx]->mLastSent);
+    }
+  }
+}
+
+static void
+Usage(const char *aName)
+{
+  fprintf(stderr, "Usage: %s -f capture file [-h server ip] [-p port]\n"
+                  "          [-s time scale] [-P server pid]\n", aName);
+}
+
+int
+main(int32_t argc, char *argv[])
+{
+  gServerTestLog = PR_NewLogModule("NetworkTestServer");
+
+  const char *fileName = nullptr;
+  const char *host = "127.0.0.1";
+  int port = 0;
+  double scale = 1.0;
+  int serverPid = 0;
+
+  PLOptState *optState = PL_CreateOptState(argc, argv, "f:h:p:s:P:");
+  PLOptStatus optStatus;
+  while ((optStatus = PL_GetNextOpt(optState)) == PL_OPT_OK) {
+    switch (optState->option) {
+      case 'f': fileName = optState->value; break;
+      case 'h': host = optState->value; break;
+      case 'p': port = atoi(optState->value); break;
+      case 's': scale = atof(optState->value); break;
+      case 'P': serverPid = atoi(optState->value); break;
+      default:
+        Usage(argv[0]);
+        PL_DestroyOptState(optState);
+        return -1;
+    }
+  }
+  PL_DestroyOptState(optState);
+  if (optStatus == PL_OPT_BAD || !fileName || scale <= 0) {
+    Usage(argv[0]);
+    return -1;
+  }
+
+  CaptureRing capture;
+  if (capture.Init(fileName, 0, 0, false)) {
+    fprintf(stderr, "Can not read capture %s\n", fileName);
+    return -1;
+  }
+
+  PRNetAddr serverAddr;
+  if (PR_StringToNetAddr(host, &serverAddr) != PR_SUCCESS) {
+    fprintf(stderr, "Bad server address %s\n", host);
+    return -1;
+  }
+  serverAddr.inet.port = PR_htons(port ? port : capture.Port());
+
+  uint64_t first = capture.First();
+  uint64_t head = capture.Head();
+  printf("Replaying %llu packets recorded on port %d to %s:%d, time scale "
+         "%.2f\n", (unsigned long long)(head - first), capture.Port(), host,
+         PR_ntohs(serverAddr.inet.port), scale);
+  if (first == head) {
+    return 0;
+  }
+
+  std::map<uint64_t, ReplayPeer*> peerMap;
+  std::vector<ReplayPeer*> peers;
+  std::vector<PRPollDesc> polls;
+  std::vector<PRTime> lateness;
+  std::vector<PRTime> latency;
+  lateness.reserve(head - first);
+
+  double cpuStart = 0;
+  if (serverPid && ReadServerCpu(serverPid, cpuStart)) {
+    fprintf(stderr, "Can not read the CPU time of process %d\n", serverPid);
+    serverPid = 0;
+  }
+
+  char buf[REPLAY_MAX_PKT];
+  memset(buf, 0, sizeof(buf));
+  PRTime recordStart = capture.Slot(first)->mTime;
+  PRTime replayStart = PR_Now();
+  for (uint64_t inx = first; inx < head; inx++) {
+    CaptureRecord *rec = capture.Slot(inx);
+    PRTime target = replayStart +
+                    (PRTime)((rec->mTime - recordStart) / scale);
+
+    PRTime now;
+    while ((now = PR_Now()) < target) {
+      PRTime wait = target - now;
+      DrainReplies(polls, peers,
+                   PR_MicrosecondsToInterval(wait < 1000 ? 0 : 1000), latency);
+    }
+
+    uint64_t key = ((uint64_t)rec->mAddr << 16) | rec->mPort;
+    std::map<uint64_t, ReplayPeer*>::iterator it = peerMap.find(key);
+    ReplayPeer *peer;
+    if (it == peerMap.end()) {
+      peer = new ReplayPeer;
+      peer->mFd = PR_OpenUDPSocket(PR_AF_INET);
+      if (!peer->mFd) {
+        fprintf(stderr, "Can not open a socket for peer %llu\n",
+                (unsigned long long)peers.size());
+        return -1;
+      }
+      PRSocketOptionData opt;
+      opt.option = PR_SockOpt_Nonblocking;
+      opt.value.non_blocking = true;
+      PR_SetSocketOption(peer->mFd, &opt);
+      peerMap[key] = peer;
+      peers.push_back(peer);
+      PRPollDesc poll;
+      poll.fd = peer->mFd;
+      poll.in_flags = PR_POLL_READ;
+      poll.out_flags = 0;
+      polls.push_back(poll);
+    } else {
+      peer = it->second;
+    }
+
+    int len = rec->mLen;
+    memcpy(buf, rec->mData, len < CAPTURE_SNAP_LEN ? len : CAPTURE_SNAP_LEN);
+    if (len > CAPTURE_SNAP_LEN) {
+      memset(buf + CAPTURE_SNAP_LEN, 0, len - CAPTURE_SNAP_LEN);
+    }
+    PR_SendTo(peer->mFd, buf, len, 0, &serverAddr, PR_INTERVAL_NO_WAIT);
+    peer->mLastSent = PR_Now();
+    lateness.push_back(peer->mLastSent - target);
+  }
+  PRTime replayEnd = PR_Now();
+
+  while (PR_Now() < replayEnd + REPLAY_DRAIN_TIME_US) {
+    DrainReplies(polls, peers, PR_MillisecondsToInterval(10), latency);
+  }
+
+  double seconds = (replayEnd - replayStart) / 1000000.0;
+  printf("Replayed %llu packets from %lu peers in %.3f s (recorded in %.3f s)\n",
+         (unsigned long long)(head - first), (unsigned long)peers.size(),
+         seconds,
+         (capture.Slot(head - 1)->mTime - recordStart) / 1000000.0);
+  PrintPercentiles("Send lateness", lateness);
+  PrintPercentiles("Reply latency", latency);
+  if (serverPid) {
+    double cpuEnd;
+    if (ReadServerCpu(serverPid, cpuEnd) == 0) {
+      double elapsed = (PR_Now() - replayStart) / 1000000.0;
+      printf("Server CPU: %.2f s (%.1f%% of %.3f s replay and drain time)\n",
+             cpuEnd - cpuStart, (cpuEnd - cpuStart) / elapsed * 100.0, elapsed);
+    }
+  }
+
+  for (size_t inx = 0; inx < peers.size(); inx++) {
+    PR_Close(peers[inx]->mFd);
+    delete peers[inx];
+  }
+  PR_Cleanup();
+  return 0;
+}
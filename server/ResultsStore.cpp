@@ -0,0 +1,282 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "ResultsStore.h"
+#include "Clock.h"
+#include "HelpFunctions.h"
+#include "Metrics.h"
+#include "Placement.h"
+#include "Trace.h"
+#include "prio.h"
+#include "prlock.h"
+#include "prcvar.h"
+#include "prlog.h"
+#include "prnetdb.h"
+#include "prthread.h"
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+extern PRLogModuleInfo* gServerTestLog;
+#define LOG(args) PR_LOG(gServerTestLog, PR_LOG_DEBUG, args)
+
+struct ResultsChunk
+{
+  char mName[FILE_NAME_LEN];
+  std::vector<char> mData;
+  ClockTime mQueued;
+};
+
+static PRLock *sLock = nullptr;
+static PRCondVar *sQueued = nullptr;
+static PRCondVar *sWritten = nullptr;
+static std::deque<ResultsChunk*> sQueue;
+static uint64_t sQueuedBytes = 0;
+static PRThread *sWriter = nullptr;
+// Set by ResultsStoreShutdown(); changed with sLock held.
+static std::atomic<bool> sStopping(false);
+
+// Only used by the writer thread.
+static std::string sDirectory;
+static uint64_t sSegmentSize = RESULTS_SEGMENT_SIZE;
+static uint32_t sSegment = 0;
+static uint64_t sSegmentOffset = 0;
+static PRFileDesc *sSegmentFd = nullptr;
+static PRFileDesc *sIndexFd = nullptr;
+
+// The highest segment number in the directory, 0 if there is none.
+static uint32_t
+LastSegment()
+{
+  uint32_t last = 0;
+  PRDir *dir = PR_OpenDir(sDirectory.c_str());
+  if (!dir) {
+    return 0;
+  }
+  PRDirEntry *entry;
+  size_t prefixLen = strlen(RESULTS_SEGMENT_PREFIX);
+  while ((entry = PR_ReadDir(dir, PR_SKIP_BOTH))) {
+    if (strncmp(entry->name, RESULTS_SEGMENT_PREFIX, prefixLen) ||
+        !strstr(entry->name, RESULTS_SEGMENT_SUFFIX)) {
+      continue;
+    }
+    uint32_t segment = strtoul(entry->name + prefixLen, nullptr, 10);
+    if (segment > last) {
+      last = segment;
+    }
+  }
+  PR_CloseDir(dir);
+  return last;
+}
+
+static void
+CloseSegment()
+{
+  if (sSegmentFd) {
+    PR_Close(sSegmentFd);
+    sSegmentFd = nullptr;
+  }
+  if (sIndexFd) {
+    PR_Close(sIndexFd);
+    sIndexFd = nullptr;
+  }
+}
+
+// A segment and its index file.
+static int
+OpenSegment(uint32_t aSegment)
+{
+  CloseSegment();
+  char name[64];
+  ResultsSegmentName(name, sizeof(name), aSegment);
+  std::string path = sDirectory + name;
+  sSegmentFd = PR_Open(path.c_str(), PR_CREATE_FILE | PR_WRONLY |
+                                     PR_TRUNCATE, 0666);
+  ResultsIndexName(name, sizeof(name), aSegment);
+  std::string index = sDirectory + name;
+  sIndexFd = PR_Open(index.c_str(), PR_CREATE_FILE | PR_WRONLY |
+                                    PR_TRUNCATE, 0666);
+  if (!sSegmentFd || !sIndexFd) {
+    LogError("Results");
+    CloseSegment();
+    return -1;
+  }
+  sSegment = aSegment;
+  sSegmentOffset = 0;
+  LOG(("NetworkTest server side: results segment %s", path.c_str()));
+  return 0;
+}
+
+static int
+WriteAll(PRFileDesc *aFd, const char *aBuf, int32_t aLen)
+{
+  while (aLen > 0) {
+    int32_t written = PR_Write(aFd, aBuf, aLen);
+    if (written <= 0) {
+      LogError("Results");
+      return -1;
+    }
+    aBuf += written;
+    aLen -= written;
+  }
+  return 0;
+}
+
+static void
+WriteChunk(ResultsChunk *aChunk)
+{
+  uint32_t len = aChunk->mData.size();
+  if (!sSegmentFd ||
+      (sSegmentOffset && sSegmentOffset + len > sSegmentSize)) {
+    if (OpenSegment(sSegment + 1)) {
+      METRICS_ADD(mResultsIoErrors, 1);
+      return;
+    }
+  }
+  if (WriteAll(sSegmentFd, aChunk->mData.data(), len)) {
+    // Start a new segment, so nothing points at the partial write.
+    CloseSegment();
+    METRICS_ADD(mResultsIoErrors, 1);
+    return;
+  }
+
+  char entry[RESULTS_INDEX_ENTRY_SIZE];
+  memcpy(entry + RESULTS_INDEX_NAME_START, aChunk->mName, FILE_NAME_LEN);
+  uint32_t segment = htonl(sSegment);
+  uint64_t offset = htonll(sSegmentOffset);
+  uint32_t length = htonl(len);
+  memcpy(entry + RESULTS_INDEX_SEGMENT_START, &segment,
+         RESULTS_INDEX_SEGMENT_LEN);
+  memcpy(entry + RESULTS_INDEX_OFFSET_START, &offset,
+         RESULTS_INDEX_OFFSET_LEN);
+  memcpy(entry + RESULTS_INDEX_LENGTH_START, &length,
+         RESULTS_INDEX_LENGTH_LEN);
+  sSegmentOffset += len;
+  if (WriteAll(sIndexFd, entry, sizeof(entry))) {
+    // The index may end in a partial entry; the next chunk goes to a new
+    // segment.
+    CloseSegment();
+    METRICS_ADD(mResultsIoErrors, 1);
+  }
+}
+
+static void PR_CALLBACK
+ResultsWriterThread(void *)
+{
+  PlacementApply(PLACEMENT_IO, 0, "results_writer");
+  MetricsRegisterWorker("results_writer");
+  while (true) {
+    PR_Lock(sLock);
+    while (sQueue.empty() && !sStopping) {
+      PR_WaitCondVar(sQueued, PR_INTERVAL_NO_TIMEOUT);
+    }
+    if (sQueue.empty()) {
+      PR_Unlock(sLock);
+      break;
+    }
+    ResultsChunk *chunk = sQueue.front();
+    sQueue.pop_front();
+    PR_Unlock(sLock);
+
+    WriteChunk(chunk);
+    TRACE3(log_chunk_written, chunk->mName, chunk->mData.size(),
+           ClockNow() - chunk->mQueued);
+
+    PR_Lock(sLock);
+    sQueuedBytes -= chunk->mData.size();
+    PR_NotifyAllCondVar(sWritten);
+    PR_Unlock(sLock);
+    delete chunk;
+  }
+  CloseSegment();
+  MetricsUnregisterWorker();
+}
+
+int
+ResultsStoreInit(const char *aDirectory, uint64_t aSegmentSize)
+{
+  if (sLock) {
+    return 0;
+  }
+  sDirectory = aDirectory;
+  if (sDirectory.empty() || sDirectory[sDirectory.size() - 1] != '/') {
+    sDirectory += '/';
+  }
+  sSegmentSize = aSegmentSize;
+  if (PR_Access(sDirectory.c_str(), PR_ACCESS_EXISTS) != PR_SUCCESS &&
+      PR_MkDir(sDirectory.c_str(), 0777) != PR_SUCCESS) {
+    LogError("Results");
+    return -1;
+  }
+  // The first chunk opens the segment after the last one.
+  sSegment = LastSegment();
+
+  sLock = PR_NewLock();
+  sQueued = PR_NewCondVar(sLock);
+  sWritten = PR_NewCondVar(sLock);
+  sWriter = PR_CreateThread(PR_USER_THREAD, ResultsWriterThread, nullptr,
+                            PR_PRIORITY_NORMAL, PR_GLOBAL_THREAD,
+                            PR_JOINABLE_THREAD, 0);
+  if (!sWriter) {
+    LogError("Results");
+    sStopping = true;
+    return -1;
+  }
+  return 0;
+}
+
+bool
+ResultsStoreRunning()
+{
+  return sLock != nullptr && !sStopping;
+}
+
+void
+ResultsStoreShutdown()
+{
+  if (!sWriter) {
+    return;
+  }
+  PR_Lock(sLock);
+  sStopping = true;
+  PR_NotifyAllCondVar(sQueued);
+  // Appends waiting for room give up.
+  PR_NotifyAllCondVar(sWritten);
+  PR_Unlock(sLock);
+  PR_JoinThread(sWriter);
+  sWriter = nullptr;
+  LOG(("NetworkTest server side: results store closed."));
+}
+
+int
+ResultsStoreAppend(const char *aName, std::vector<char> &aData, bool aBlock)
+{
+  if (!sLock) {
+    return -1;
+  }
+  ResultsChunk *chunk = new ResultsChunk();
+  memcpy(chunk->mName, aName, FILE_NAME_LEN);
+  PR_Lock(sLock);
+  while (sStopping ||
+         (sQueuedBytes && sQueuedBytes + aData.size() > RESULTS_QUEUE_LIMIT)) {
+    if (!aBlock || sStopping) {
+      PR_Unlock(sLock);
+      delete chunk;
+      return -1;
+    }
+    PR_WaitCondVar(sWritten, PR_INTERVAL_NO_TIMEOUT);
+  }
+  chunk->mData.swap(aData);
+  chunk->mQueued = ClockNow();
+  sQueuedBytes += chunk->mData.size();
+  sQueue.push_back(chunk);
+  PR_NotifyCondVar(sQueued);
+  PR_Unlock(sLock);
+  return 0;
+}
@@ -0,0 +1,90 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NETWORK_TESTS_RESULTS_STORE_H__
+#define NETWORK_TESTS_RESULTS_STORE_H__
+
+#include "config.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+/**
+ * Append-only store for the test logs.
+ *
+ * The logs of all tests go into shared segment files in TMP_DIRECTORY
+ * instead of a file per test. One writer thread appends to the current
+ * segment; when the next chunk would take it over the segment size, the
+ * segment is closed and the next one is started. A restarted server starts
+ * a new segment after the last one it finds.
+ *
+ * A FileWriter hands its log over in chunks of at most RESULTS_CHUNK_SIZE
+ * bytes, and every chunk gets an entry in the index file of its segment,
+ * "results-00000001.idx" next to "results-00000001.seg" (network order):
+ *  |___ max 56B ___|___4B___|_______8B_______|___4B___|
+ *  |   FILE_NAME   |SEGMENT |     OFFSET     | LENGTH |
+ *  |               |        |                RESULTS_INDEX_LENGTH_START = 68
+ *  |               |        RESULTS_INDEX_OFFSET_START = 60
+ *  |               RESULTS_INDEX_SEGMENT_START = 56
+ *  RESULTS_INDEX_NAME_START = 0
+ * The entry is written after its chunk, so it never points at missing data.
+ * The log of a test is its chunks in the order of the index files and their
+ * entries (see ResultsTool). A test without any output has one empty chunk.
+ * A segment and its index are removed together; RESULTS_INDEX_FILE is the
+ * single index of older stores.
+ *
+ * ResultsStoreShutdown() writes the queued chunks and stops the writer.
+ */
+
+#define RESULTS_INDEX_FILE "results.idx"
+#define RESULTS_SEGMENT_PREFIX "results-"
+#define RESULTS_SEGMENT_SUFFIX ".seg"
+#define RESULTS_INDEX_SUFFIX ".idx"
+
+#define RESULTS_INDEX_NAME_START 0
+#define RESULTS_INDEX_SEGMENT_START 56
+#define RESULTS_INDEX_OFFSET_START 60
+#define RESULTS_INDEX_LENGTH_START 68
+#define RESULTS_INDEX_SEGMENT_LEN 4
+#define RESULTS_INDEX_OFFSET_LEN 8
+#define RESULTS_INDEX_LENGTH_LEN 4
+#define RESULTS_INDEX_ENTRY_SIZE 72
+
+#define RESULTS_CHUNK_SIZE 65536
+#define RESULTS_SEGMENT_SIZE 268435456ULL
+// Chunks waiting for the writer thread; non blocking writes are dropped
+// above this.
+#define RESULTS_QUEUE_LIMIT 33554432
+
+// Start the writer thread. A second call does nothing.
+int ResultsStoreInit(const char *aDirectory, uint64_t aSegmentSize);
+bool ResultsStoreRunning();
+// Write everything queued, close the files and join the writer thread.
+// Appends fail from then on.
+void ResultsStoreShutdown();
+// Queue aData as the next chunk of the log aName (FILE_NAME_LEN bytes) and
+// leave aData empty. If the queue is full, wait if aBlock is set, otherwise
+// return -1 and keep aData.
+int ResultsStoreAppend(const char *aName, std::vector<char> &aData,
+                       bool aBlock);
+
+// "results-00000001.seg" in aBuf.
+inline void
+ResultsSegmentName(char *aBuf, size_t aLen, uint32_t aSegment)
+{
+  snprintf(aBuf, aLen, RESULTS_SEGMENT_PREFIX "%08u" RESULTS_SEGMENT_SUFFIX,
+           aSegment);
+}
+
+// "results-00000001.idx" in aBuf.
+inline void
+ResultsIndexName(char *aBuf, size_t aLen, uint32_t aSegment)
+{
+  snprintf(aBuf, aLen, RESULTS_SEGMENT_PREFIX "%08u" RESULTS_INDEX_SUFFIX,
+           aSegment);
+}
+
+#endif
@@ -0,0 +1,319 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * Reads the test logs out of a results store (see ResultsStore.h).
+ *
+ *  ResultsTool [-d store directory] -l
+ *      lists the tests: name, number of chunks and bytes.
+ *  ResultsTool [-d store directory] [-o output file] test name
+ *      writes the log of one test (stdout without -o).
+ *  ResultsTool [-d store directory] -x output directory
+ *      writes every log into a file named after its test, as the server
+ *      did before it had the store.
+ *
+ * The store directory is TMP_DIRECTORY by default. The index files are read
+ * once, so a running server can keep appending.
+ */
+
+#include "HelpFunctions.h"
+#include "ResultsStore.h"
+#include "prio.h"
+#include "prlog.h"
+#include "prnetdb.h"
+#include "plgetopt.h"
+#include <algorithm>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <cstring>
+#include <vector>
+
+PRLogModuleInfo* gServerTestLog;
+
+struct ResultsEntry
+{
+  std::string mName;
+  uint32_t mSegment;
+  uint64_t mOffset;
+  uint32_t mLength;
+};
+
+static void
+ReadIndexFile(FILE *aIndex, std::vector<ResultsEntry> &aEntries)
+{
+  char buf[RESULTS_INDEX_ENTRY_SIZE];
+  while (fread(buf, sizeof(buf), 1, aIndex) == 1) {
+    ResultsEntry entry;
+    entry.mName.assign(buf + RESULTS_INDEX_NAME_START,
+                       strnlen(buf + RESULTS_INDEX_NAME_START,
+                               FILE_NAME_LEN));
+    uint32_t segment;
+    uint64_t offset;
+    uint32_t length;
+    memcpy(&segment, buf + RESULTS_INDEX_SEGMENT_START,
+           RESULTS_INDEX_SEGMENT_LEN);
+    memcpy(&offset, buf + RESULTS_INDEX_OFFSET_START,
+           RESULTS_INDEX_OFFSET_LEN);
+    memcpy(&length, buf + RESULTS_INDEX_LENGTH_START,
+           RESULTS_INDEX_LENGTH_LEN);
+    entry.mSegment = ntohl(segment);
+    entry.mOffset = ntohll(offset);
+    entry.mLength = ntohl(length);
+    aEntries.push_back(entry);
+  }
+}
+
+// The single index of an older store first, then the index of every
+// segment in segment order.
+static int
+ReadIndex(const std::string &aDirectory, std::vector<ResultsEntry> &aEntries)
+{
+  std::vector<uint32_t> segments;
+  PRDir *dir = PR_OpenDir(aDirectory.c_str());
+  if (!dir) {
+    fprintf(stderr, "Can not open %s\n", aDirectory.c_str());
+    return -1;
+  }
+  PRDirEntry *dirEntry;
+  size_t prefixLen = strlen(RESULTS_SEGMENT_PREFIX);
+  while ((dirEntry = PR_ReadDir(dir, PR_SKIP_BOTH))) {
+    if (!strncmp(dirEntry->name, RESULTS_SEGMENT_PREFIX, prefixLen) &&
+        strstr(dirEntry->name, RESULTS_INDEX_SUFFIX)) {
+      segments.push_back(strtoul(dirEntry->name + prefixLen, nullptr, 10));
+    }
+  }
+  PR_CloseDir(dir);
+  std::sort(segments.begin(), segments.end());
+
+  std::vector<std::string> paths;
+  paths.push_back(aDirectory + RESULTS_INDEX_FILE);
+  for (size_t inx = 0; inx < segments.size(); inx++) {
+    char name[64];
+    ResultsIndexName(name, sizeof(name), segments[inx]);
+    paths.push_back(aDirectory + name);
+  }
+  bool found = false;
+  for (size_t inx = 0; inx < paths.size(); inx++) {
+    FILE *index = fopen(paths[inx].c_str(), "rb");
+    if (!index) {
+      continue;
+    }
+    found = true;
+    ReadIndexFile(index, aEntries);
+    fclose(index);
+  }
+  if (!found) {
+    fprintf(stderr, "No index in %s\n", aDirectory.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+// Reads the chunks from their segments, keeping the last segment open.
+class SegmentReader
+{
+public:
+  explicit SegmentReader(const std::string &aDirectory)
+    : mDirectory(aDirectory)
+    , mFd(nullptr)
+    , mSegment(0)
+  {
+  }
+  ~SegmentReader()
+  {
+    if (mFd) {
+      PR_Close(mFd);
+    }
+  }
+
+  int Copy(const ResultsEntry &aEntry, FILE *aOut)
+  {
+    if (!mFd || mSegment != aEntry.mSegment) {
+      if (mFd) {
+        PR_Close(mFd);
+      }
+      char name[64];
+      ResultsSegmentName(name, sizeof(name), aEntry.mSegment);
+      std::string path = mDirectory + name;
+      mFd = PR_Open(path.c_str(), PR_RDONLY, 0);
+      if (!mFd) {
+        fprintf(stderr, "Can not open %s\n", path.c_str());
+        return -1;
+      }
+      mSegment = aEntry.mSegment;
+    }
+    if (PR_Seek64(mFd, aEntry.mOffset, PR_SEEK_SET) < 0) {
+      return -1;
+    }
+    char buf[RESULTS_CHUNK_SIZE];
+    uint32_t left = aEntry.mLength;
+    while (left) {
+      int32_t read = PR_Read(mFd, buf, left < sizeof(buf) ? left : sizeof(buf));
+      if (read <= 0) {
+        fprintf(stderr, "Segment %u is shorter than its index\n", mSegment);
+        return -1;
+      }
+      fwrite(buf, 1, read, aOut);
+      left -= read;
+    }
+    return 0;
+  }
+
+private:
+  std::string mDirectory;
+  PRFileDesc *mFd;
+  uint32_t mSegment;
+};
+
+static void
+List(const std::vector<ResultsEntry> &aEntries)
+{
+  // In the order the tests first wrote.
+  std::vector<std::string> names;
+  std::map<std::string, std::pair<uint64_t, uint64_t> > sizes;
+  for (size_t inx = 0; inx < aEntries.size(); inx++) {
+    const ResultsEntry &entry = aEntries[inx];
+    if (!sizes.count(entry.mName)) {
+      names.push_back(entry.mName);
+    }
+    sizes[entry.mName].first++;
+    sizes[entry.mName].second += entry.mLength;
+  }
+  for (size_t inx = 0; inx < names.size(); inx++) {
+    printf("%s %llu chunks %llu bytes\n", names[inx].c_str(),
+           (unsigned long long)sizes[names[inx]].first,
+           (unsigned long long)sizes[names[inx]].second);
+  }
+}
+
+static int
+Extract(const std::vector<ResultsEntry> &aEntries, SegmentReader &aReader,
+        const std::string &aName, FILE *aOut)
+{
+  bool found = false;
+  for (size_t inx = 0; inx < aEntries.size(); inx++) {
+    if (aEntries[inx].mName != aName) {
+      continue;
+    }
+    found = true;
+    if (aReader.Copy(aEntries[inx], aOut)) {
+      return -1;
+    }
+  }
+  if (!found) {
+    fprintf(stderr, "No test %s\n", aName.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+static int
+ExtractAll(const std::vector<ResultsEntry> &aEntries, SegmentReader &aReader,
+           const char *aOutDirectory)
+{
+  PR_MkDir(aOutDirectory, 0777);
+  std::map<std::string, FILE*> files;
+  int rv = 0;
+  for (size_t inx = 0; !rv && inx < aEntries.size(); inx++) {
+    const ResultsEntry &entry = aEntries[inx];
+    FILE *&out = files[entry.mName];
+    if (!out) {
+      std::string path = std::string(aOutDirectory) + "/" + entry.mName;
+      out = fopen(path.c_str(), "wb");
+      if (!out) {
+        fprintf(stderr, "Can not create %s\n", path.c_str());
+        rv = -1;
+        break;
+      }
+    }
+    rv = aReader.Copy(entry, out);
+  }
+  for (std::map<std::string, FILE*>::iterator it = files.begin();
+       it != files.end(); it++) {
+    if (it->second) {
+      fclose(it->second);
+    }
+  }
+  if (!rv) {
+    printf("%lu tests written to %s\n", (unsigned long)files.size(),
+           aOutDirectory);
+  }
+  return rv;
+}
+
+static void
+Usage(const char *aName)
+{
+  fprintf(stderr, "Usage: %s [-d store directory] -l\n"
+                  "       %s [-d store directory] [-o output file] test name\n"
+                  "       %s [-d store directory] -x output directory\n",
+          aName, aName, aName);
+}
+
+int
+main(int32_t argc, char *argv[])
+{
+  gServerTestLog = PR_NewLogModule("NetworkTestServer");
+
+  std::string directory = TMP_DIRECTORY;
+  const char *outFile = nullptr;
+  const char *outDirectory = nullptr;
+  const char *name = nullptr;
+  bool list = false;
+
+  PLOptState *optState = PL_CreateOptState(argc, argv, "d:o:x:l");
+  PLOptStatus optStatus;
+  while ((optStatus = PL_GetNextOpt(optState)) == PL_OPT_OK) {
+    switch (optState->option) {
+      case 'd': directory = optState->value; break;
+      case 'o': outFile = optState->value; break;
+      case 'x': outDirectory = optState->value; break;
+      case 'l': list = true; break;
+      case 0: name = optState->value; break;
+      default:
+        Usage(argv[0]);
+        PL_DestroyOptState(optState);
+        return -1;
+    }
+  }
+  PL_DestroyOptState(optState);
+  if (optStatus == PL_OPT_BAD || (list + !!name + !!outDirectory) != 1) {
+    Usage(argv[0]);
+    return -1;
+  }
+  if (directory[directory.size() - 1] != '/') {
+    directory += '/';
+  }
+
+  std::vector<ResultsEntry> entries;
+  if (ReadIndex(directory, entries)) {
+    return -1;
+  }
+  if (list) {
+    List(entries);
+    return 0;
+  }
+
+  SegmentReader reader(directory);
+  if (outDirectory) {
+    return ExtractAll(entries, reader, outDirectory) ? -1 : 0;
+  }
+  FILE *out = stdout;
+  if (outFile) {
+    out = fopen(outFile, "wb");
+    if (!out) {
+      fprintf(stderr, "Can not create %s\n", outFile);
+      return -1;
+    }
+  }
+  int rv = Extract(entries, reader, name, out);
+  if (outFile) {
+    fclose(out);
+  }
+  return rv ? -1 : 0;
+}
@@ -6,32 +6,254 @@
 
 #include "TCPserver.h"
 #include "UDPserver.h"
+#include "ClientPool.h"
+#include "TestLimits.h"
+#include "Metrics.h"
+#include "CpuCost.h"
+#include "Placement.h"
+#include "ResultsStore.h"
+#include "XdpSocket.h"
+#include "Clock.h"
+#include "Tls.h"
+#include "Cluster.h"
+#include "HelpFunctions.h"
+#include "config.h"
 #include "prlog.h"
+#include "plgetopt.h"
+#include "prnetdb.h"
+#include <cstring>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef __linux__
+#include <signal.h>
+#include <unistd.h>
+#endif
 
 PRLogModuleInfo* gServerTestLog;
 #define LOG(args) PR_LOG(gServerTestLog, PR_LOG_DEBUG, args)
 
-uint64_t maxBytes = (1<<21);
-uint32_t maxTime = 4; //TODO:chnge tthis to the 12s
+static void
+Usage(const char *aName)
+{
+  fprintf(stderr, "Usage: %s [-b max bytes] [-t max time in ms] "
+                  "[-l limits file] [-m metrics port, 0 to disable] "
+                  "[-r capture file] [-c max UDP clients per port] "
+                  "[-a udp|tcp|io=cpu list, -a nic=interface ...] "
+                  "[-x AF_XDP interface[:queue[:native|generic]]] "
+                  "[-S results segment size in MB] "
+                  "[-P count cycles, instructions and cache misses] "
+                  "[-F TCP Fast Open queue, 0 to disable] "
+                  "[-T TLS on port 443: certificate.pem:key.pem] "
+                  "[-B bind address] [-d results directory] "
+                  "[-K cluster peers: ip,ip,...] "
+                  "[-k active clients before redirecting to a peer]\n",
+          aName);
+}
+
+#ifdef __linux__
+// SIGINT and SIGTERM are blocked in every thread and taken here, so the
+// queued logs are written before the server exits.
+static sigset_t sShutdownSignals;
+
+static void PR_CALLBACK
+ShutdownThread(void *)
+{
+  int sig = 0;
+  sigwait(&sShutdownSignals, &sig);
+  LOG(("NetworkTest server side: Signal %d, shutting down.", sig));
+  ResultsStoreShutdown();
+  PR_LogFlush();
+  // The workers are still running; no static destructors under them.
+  _exit(0);
+}
+#endif
 
 int
 main(int32_t argc, char *argv[])
 {
   gServerTestLog = PR_NewLogModule("NetworkTestServer");
 
+  uint64_t maxBytes = SERVER_MAXBYTES;
+  uint32_t maxTimeMs = SERVER_MAXTIME_MS;
+  const char *limitsFile = nullptr;
+  uint16_t metricsPort = METRICS_PORT;
+  const char *captureFile = nullptr;
+  uint32_t maxClients = CLIENT_POOL_DEFAULT_SLOTS;
+  char *xdpIfName = nullptr;
+  uint32_t xdpQueue = 0;
+  int xdpMode = XDP_MODE_AUTO;
+  uint64_t segmentSize = RESULTS_SEGMENT_SIZE;
+  int fastOpenQueue = TCP_FASTOPEN_QUEUE;
+  char *tlsCertFile = nullptr;
+  const char *bindAddress = nullptr;
+  const char *resultsDirectory = TMP_DIRECTORY;
+  const char *clusterPeers = nullptr;
+  uint32_t clusterMaxTests = CLUSTER_DEFAULT_MAX_TESTS;
+
+  PLOptState *optState = PL_CreateOptState(argc, argv,
+                                           "b:t:l:m:r:c:a:x:S:PF:T:B:d:K:k:");
+  PLOptStatus optStatus;
+  while ((optStatus = PL_GetNextOpt(optState)) == PL_OPT_OK) {
+    switch (optState->option) {
+      case 'b':
+        maxBytes = strtoull(optState->value, nullptr, 10);
+        break;
+      case 't':
+        maxTimeMs = strtoul(optState->value, nullptr, 10);
+        break;
+      case 'l':
+        limitsFile = optState->value;
+        break;
+      case 'm':
+        metricsPort = atoi(optState->value);
+        break;
+      case 'r':
+        captureFile = optState->value;
+        break;
+      case 'c':
+        maxClients = strtoul(optState->value, nullptr, 10);
+        break;
+      case 'x':
+        {
+          xdpIfName = strdup(optState->value);
+          char *queue = strchr(xdpIfName, ':');
+          if (queue) {
+            *queue++ = '\0';
+            xdpQueue = strtoul(queue, nullptr, 10);
+            char *mode = strchr(queue, ':');
+            if (mode && !strcmp(mode + 1, "native")) {
+              xdpMode = XDP_MODE_NATIVE;
+            } else if (mode && !strcmp(mode + 1, "generic")) {
+              xdpMode = XDP_MODE_GENERIC;
+            }
+          }
+        }
+        break;
+      case 'S':
+        segmentSize = strtoull(optState->value, nullptr, 10) << 20;
+        break;
+      case 'P':
+        CpuCostEnableHardware();
+        break;
+      case 'F':
+        fastOpenQueue = atoi(optState->value);
+        break;
+      case 'T':
+        tlsCertFile = strdup(optState->value);
+        break;
+      case 'B':
+        bindAddress = optState->value;
+        break;
+      case 'd':
+        resultsDirectory = optState->value;
+        break;
+      case 'K':
+        clusterPeers = optState->value;
+        break;
+      case 'k':
+        clusterMaxTests = strtoul(optState->value, nullptr, 10);
+        break;
+      case 'a':
+        if (PlacementAddOption(optState->value)) {
+          Usage(argv[0]);
+          PL_DestroyOptState(optState);
+          return -1;
+        }
+        break;
+      default:
+        Usage(argv[0]);
+        PL_DestroyOptState(optState);
+        return -1;
+    }
+  }
+  PL_DestroyOptState(optState);
+  if (optStatus == PL_OPT_BAD || !segmentSize) {
+    Usage(argv[0]);
+    return -1;
+  }
+  // The key is in the certificate file if there is no ":key.pem".
+  const char *tlsKeyFile = tlsCertFile;
+  if (tlsCertFile) {
+    char *key = strchr(tlsCertFile, ':');
+    if (key) {
+      *key++ = '\0';
+      tlsKeyFile = key;
+    }
+    if (TlsInit(tlsCertFile, tlsKeyFile)) {
+      fprintf(stderr, "Cannot load the TLS certificate or key.\n");
+      return -1;
+    }
+  }
+
+  // Several servers can run on one machine on 127.0.0.1, 127.0.0.2, ...
+  PRNetAddr bindAddr;
+  PR_SetNetAddr(PR_IpAddrAny, PR_AF_INET, 0, &bindAddr);
+  if (bindAddress &&
+      (PR_StringToNetAddr(bindAddress, &bindAddr) != PR_SUCCESS ||
+       bindAddr.raw.family != PR_AF_INET)) {
+    fprintf(stderr, "Bind address %s is not an IPv4 address.\n",
+            bindAddress);
+    return -1;
+  }
+  if (clusterPeers &&
+      ClusterInit(clusterPeers, bindAddress ? &bindAddr : nullptr,
+                  clusterMaxTests)) {
+    return -1;
+  }
+
+#ifdef __linux__
+  // Before the first thread, which inherits the mask.
+  sigemptyset(&sShutdownSignals);
+  sigaddset(&sShutdownSignals, SIGINT);
+  sigaddset(&sShutdownSignals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &sShutdownSignals, nullptr);
+#endif
+
+  ClockInit();
   // todo this list ought to live in one place
   uint16_t ports[] = { 61590, 2708, 891, 443, 80 };
   const int numPorts = sizeof(ports) / sizeof(uint16_t);
 
+  PlacementInit(numPorts);
+  if (ResultsStoreInit(resultsDirectory, segmentSize)) {
+    return -1;
+  }
+#ifdef __linux__
+  if (!PR_CreateThread(PR_USER_THREAD, ShutdownThread, nullptr,
+                       PR_PRIORITY_NORMAL, PR_GLOBAL_THREAD,
+                       PR_UNJOINABLE_THREAD, 0)) {
+    LogError("Shutdown");
+  }
+#endif
+  SetServerLimits(maxBytes, maxTimeMs);
+  if (limitsFile && StartServerLimitsWatcher(limitsFile)) {
+    return -1;
+  }
+  if (metricsPort && StartMetricsServer(metricsPort)) {
+    return -1;
+  }
+  if (clusterPeers && StartCluster()) {
+    return -1;
+  }
+
   int rv;
   UDPserver udp;
+  udp.SetCaptureFile(captureFile);
+  udp.SetMaxClients(maxClients);
+  udp.SetBindAddress(&bindAddr);
+  if (xdpIfName) {
+    udp.SetXdp(xdpIfName, xdpQueue, xdpMode);
+  }
   rv = udp.Start(ports, numPorts);
   if (rv) {
     return rv;
   }
+  // This thread runs the TCP accept loop.
+  PlacementApply(PLACEMENT_TCP, 0, "tcp_accept");
   TCPserver tcp;
+  tcp.SetFastOpen(fastOpenQueue);
+  tcp.SetBindAddress(&bindAddr);
   rv = tcp.Start(ports, numPorts);
-  if (rv) {
-    return rv;
-  }
+  ResultsStoreShutdown();
+  return rv;
 }
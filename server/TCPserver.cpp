@@ -9,6 +9,14 @@
 #include "TCPserver.h"
 #include "HelpFunctions.h"
 #include "FileWriter.h"
+#include "UploadDecoder.h"
+#include "TestLimits.h"
+#include "Metrics.h"
+#include "CpuCost.h"
+#include "Placement.h"
+#include "Clock.h"
+#include "Trace.h"
+#include "Tls.h"
 #include "prlog.h"
 #include "prthread.h"
 #include "prmem.h"
@@ -23,9 +31,6 @@ extern PRLogModuleInfo* gServerTestLog;
 #define NS_SOCKET_CONNECT_TIMEOUT PR_MillisecondsToInterval(20)
 #define SERVERSNDBUFFERSIZE 12582912
 
-#define htonll(x) ((1==htonl(1)) ? (x) : ((uint64_t)htonl((x) & 0xFFFFFFFF) << 32) | htonl((x) >> 32))
-#define ntohll(x) ((1==ntohl(1)) ? (x) : ((uint64_t)ntohl((x) & 0xFFFFFFFF) << 32) | ntohl((x) >> 32))
-
 void
 LogLogFormat(FileWriter *aFile)
 {
@@ -34,49 +39,206 @@ LogLogFormat(FileWriter *aFile)
 
   char line2[] = "The last packet has been sent: [timestamp pkt sent] RECV [bytes sent]\n";
   aFile->WriteBlocking(line2, strlen(line2));
+
+  char line3[] = "Cost: [timestamp] CPU SUMMARY wall_ns [n] user_us [n] system_us [n]\n"
+                 "                          voluntary_csw [n] involuntary_csw [n] (cycles [n]\n"
+                 "                          instructions [n] cache_misses [n] with -P)\n";
+  aFile->WriteBlocking(line3, strlen(line3));
+}
+
+// The rate for test 4 is calculated after this warm up period.
+#define RATE_CALC_WARMUP_MS 2000
+
+// The limits of a versioned first packet of Test 3 and 4, the defaults for
+// an older client.
+static void
+ReadRequestedLimits(char *aBuf, TestLimits &aLimits)
+{
+  uint64_t maxBytes = 0;
+  uint32_t maxTimeMs = 0;
+  if (aBuf[TCP_FIRST_PKT_VERSION_START] == TCP_FIRST_PKT_VERSION) {
+    memcpy(&maxBytes, aBuf + TCP_MAX_BYTES_START, TCP_MAX_BYTES_LEN);
+    memcpy(&maxTimeMs, aBuf + TCP_MAX_TIME_START, TCP_MAX_TIME_LEN);
+  }
+  NegotiateTestLimits(ntohll(maxBytes), ntohl(maxTimeMs), aLimits);
+  LOG(("NetworkTest TCP server side: max bytes %llu, max time %lu ms.",
+       (unsigned long long)aLimits.mMaxBytes,
+       (unsigned long)aLimits.mMaxTimeMs));
+}
+
+// Whether aBuf holds the whole first packet of a results upload, which can
+// be shorter than PAYLOADSIZE.
+static bool
+UploadFirstPacketComplete(char *aBuf, uint64_t aRead)
+{
+  if (aRead < TCP_TYPE_START + TCP_TYPE_LEN) {
+    return false;
+  }
+  if (memcmp(aBuf + TCP_TYPE_START, SENDRESULTS, TCP_TYPE_LEN) == 0) {
+    return aRead >= TCP_DATA_START;
+  }
+  if (memcmp(aBuf + TCP_TYPE_START, SENDRESULTS_ENCODED, TCP_TYPE_LEN) == 0) {
+    return aRead >= TCP_ENCODED_DATA_START;
+  }
+  return false;
 }
 
+// Whether aBuf holds the whole first packet of a Test 11 connection.
+static bool
+ConnRateFirstPacketComplete(char *aBuf, uint64_t aRead)
+{
+  return aRead >= TCP_CONN_FIRST_PKT_LEN &&
+         memcmp(aBuf + TCP_TYPE_START, TCP_connectionRate, TCP_TYPE_LEN) == 0;
+}
+
+// Registers the client thread as a metrics worker. The test is counted as
+// finished or errored when the thread exits.
+class AutoClientMetrics
+{
+public:
+  explicit AutoClientMetrics(PRFileDesc *aFd)
+    : mFd(aFd)
+    , mTestType(0)
+    , mFinished(false)
+  {
+    TRACE3(tcp_state, mFd, 0, TRACE_TCP_CONNECTED);
+    MetricsRegisterWorker("tcp");
+    METRICS_ADD(mActiveClients, 1);
+    // The whole thread works for its test.
+    CpuCostThreadInit();
+    CpuCostCharge(&mCpuCost);
+  }
+  ~AutoClientMetrics()
+  {
+    if (mTestType) {
+      MetricsTestDone(mTestType, !mFinished);
+    }
+    METRICS_ADD(mActiveClients, (uint64_t)-1);
+    CpuCostThreadShutdown();
+    MetricsUnregisterWorker();
+    TRACE3(tcp_state, mFd, mTestType, TRACE_TCP_CLOSED);
+  }
+  void Started(int aTestType)
+  {
+    mTestType = aTestType;
+    mCpuCost.mTestType = aTestType;
+    MetricsTestStarted(aTestType);
+    TRACE3(tcp_state, mFd, mTestType, TRACE_TCP_TEST_STARTED);
+  }
+  // Charge the thread's CPU to its own test again.
+  void Charge() { CpuCostCharge(&mCpuCost); }
+  // The thread polls for write from now on.
+  void Sending() { TRACE3(tcp_state, mFd, mTestType, TRACE_TCP_SENDING); }
+  void Finished()
+  {
+    if (!mFinished) {
+      TRACE3(tcp_state, mFd, mTestType, TRACE_TCP_FINISHED);
+    }
+    mFinished = true;
+  }
+  // "[timestamp] CPU SUMMARY ..." of the thread so far.
+  void LogCpuCost(FileWriter *aFile)
+  {
+    CpuCostFlush();
+    char line[256];
+    int len = snprintf(line, sizeof(line), "%lu CPU SUMMARY ",
+                       (unsigned long)ClockToMilliseconds(ClockNow()));
+    mCpuCost.Format(line + len, sizeof(line) - len - 1);
+    LOG(("NetworkTest TCP server side: Test %d %s", mTestType, line));
+    strcat(line, "\n");
+    aFile->WriteBlocking(line, strlen(line));
+  }
+
+private:
+  PRFileDesc *mFd;
+  int mTestType;
+  bool mFinished;
+  CpuCost mCpuCost;
+};
+
+// A connection handed from the accept loop to its client thread.
+struct ClientThreadStart
+{
+  PRFileDesc *mFd;
+  // The start of the first packet the accept loop has read.
+  uint32_t mRead;
+  char mBuf[TCP_TYPE_LEN];
+  // Start with a TLS handshake; mRead is 0 then.
+  bool mTls;
+  ClockTime mAccepted;
+  // Test 11 on the TLS port.
+  ConnRateTests *mConnRate;
+};
+
 static void PR_CALLBACK
-ClientThread(void *_fd)
+ClientThread(void *_start)
 {
   LOG(("NetworkTest TCP server side: Client thread created."));
-  PRFileDesc *fd = (PRFileDesc*)_fd;
+  PlacementApply(PLACEMENT_TCP, 0, "tcp_client");
+  ClientThreadStart *start = (ClientThreadStart*)_start;
+  PRFileDesc *fd = start->mFd;
+  AutoClientMetrics metrics(fd);
 
   PRPollDesc pollElem;
   pollElem.fd = fd;
   pollElem.in_flags = PR_POLL_READ | PR_POLL_EXCEPT;
   uint64_t writtenBytes = 0;
   int testType = 0;
-  uint64_t readBytes = 0;
+  uint64_t readBytes = start->mRead;
   uint64_t recvBytesForRate = 0;
   uint32_t  bufLen = PAYLOADSIZE;
   char buf[bufLen];
+  // What the write side sends: buf, or the Test 11 reply at its start.
+  uint32_t writeLen = bufLen;
   PR_GetRandomNoise(&buf, sizeof(buf));
-  PRIntervalTime timeFirstPktReceived = 0;
-  PRIntervalTime startRateCalc = 0;
+  memcpy(buf, start->mBuf, start->mRead);
+  bool useTls = start->mTls;
+  ClockTime accepted = start->mAccepted;
+  ConnRateTests *connRate = start->mConnRate;
+  delete start;
+  TlsSession tls;
+  if (useTls && tls.Accept(fd)) {
+    PR_Close(fd);
+    return;
+  }
+  ClockTime timeFirstPktReceived = 0;
+  ClockTime startRateCalc = 0;
   uint64_t pktPerSec = 0;
+  TestLimits limits;
+  NegotiateTestLimits(0, 0, limits);
+  uint32_t rateCalcWarmupMs = RATE_CALC_WARMUP_MS;
   FileWriter logFile;
-  int64_t fileLen;
+  UploadDecoder upload;
   char logstr[80];
 
   while (1) {
     pollElem.out_flags = 0;
-    int rv = PR_Poll(&pollElem, 1, 10000);
+    int rv;
+    if ((pollElem.in_flags & PR_POLL_READ) && tls.Pending()) {
+      // OpenSSL has already read and decrypted the data.
+      pollElem.out_flags = PR_POLL_READ;
+      rv = 1;
+    } else {
+      rv = PR_Poll(&pollElem, 1, 10000);
+    }
     if (rv < 0) {
       LogError("TCP");
       LOG(("NetworkTest TCP server side: Poll error [fd=%p]. Sent %lu bytes, "
-           "received %lu bytes", fd, writtenBytes, readBytes));
+           "received %lu bytes", fd, (unsigned long)writtenBytes,
+           (unsigned long)readBytes));
       break;
     } else  if (rv == 0) {
       LOG(("NetworkTest TCP server side: Poll timeout [fd=%p]. Sent %lu bytes, "
-           "received %lu bytes", fd, writtenBytes, readBytes));
+           "received %lu bytes", fd, (unsigned long)writtenBytes,
+           (unsigned long)readBytes));
       break;
     }
     if (pollElem.out_flags & (PR_POLL_ERR | PR_POLL_HUP | PR_POLL_NVAL)) {
       PRErrorCode errCode = PR_GetError();
       LogErrorWithCode(errCode, "TCP");
       LOG(("NetworkTest TCP server side: Connection error [fd=%p]. Sent %lu "
-           "bytes, received %lu bytes", fd, writtenBytes, readBytes));
+           "bytes, received %lu bytes", fd, (unsigned long)writtenBytes,
+           (unsigned long)readBytes));
       break;
     }
 
@@ -84,11 +246,15 @@ ClientThread(void *_fd)
       int read;
       if (readBytes < bufLen) {
         // We are reading the whole first packet.
-        read = PR_Read(fd, buf + readBytes, bufLen - readBytes);
+        read = tls.Read(fd, buf + readBytes, bufLen - readBytes);
       } else {
-        read = PR_Read(fd, buf, bufLen);
+        read = tls.Read(fd, buf, bufLen);
       }
 
+      if (read == 0 && testType == 11) {
+        // The client closed after the reply.
+        break;
+      }
       if (read < 1) {
         PRErrorCode errCode = PR_GetError();
         if (errCode == PR_WOULD_BLOCK_ERROR) {
@@ -99,14 +265,16 @@ ClientThread(void *_fd)
       }
 
       readBytes += read;
+      METRICS_ADD(mPktsReceived, 1);
+      METRICS_ADD(mBytesReceived, read);
 //      LOG(("NetworkTest TCP client: time %lu Test %d - received %lu bytes.",
-//           PR_IntervalNow() - timeFirstPktReceived, testType, readBytes));
+//           ClockNow() - timeFirstPktReceived, testType, readBytes));
 
       // Wait to get the complete first packet.
       if (testType == 0) {
         if ((readBytes < bufLen) &&
-            !((readBytes >= TCP_DATA_START) &&
-             (memcmp(buf + TCP_TYPE_START, SENDRESULTS, TCP_TYPE_LEN) == 0))) {
+            !UploadFirstPacketComplete(buf, readBytes) &&
+            !ConnRateFirstPacketComplete(buf, readBytes)) {
           continue;
         }
       }
@@ -115,17 +283,27 @@ ClientThread(void *_fd)
           if (memcmp(buf + TCP_TYPE_START, TCP_reachability,
                      TCP_TYPE_LEN) == 0) {
             testType = 2;
+            metrics.Started(testType);
             pollElem.in_flags = PR_POLL_WRITE | PR_POLL_EXCEPT;
+            metrics.Sending();
           } else if (memcmp(buf + TCP_TYPE_START,
                             TCP_performanceFromServerToClient,
                             TCP_TYPE_LEN) == 0) {
             testType = 3;
+            metrics.Started(testType);
+            ReadRequestedLimits(buf, limits);
             // Sending data.
             pollElem.in_flags = PR_POLL_WRITE | PR_POLL_EXCEPT;
+            metrics.Sending();
           }  else if (memcmp(buf + TCP_TYPE_START,
                              TCP_performanceFromClientToServer,
                              TCP_TYPE_LEN) == 0) {
             testType = 4;
+            metrics.Started(testType);
+            ReadRequestedLimits(buf, limits);
+            if (rateCalcWarmupMs > limits.mMaxTimeMs / 2) {
+              rateCalcWarmupMs = limits.mMaxTimeMs / 2;
+            }
 
             // Get file name.
             char fileName[TCP_FILE_NAME_LEN];
@@ -135,43 +313,62 @@ ClientThread(void *_fd)
 
             LogLogFormat(&logFile);
             sprintf(logstr, "%lu START TEST 4 %lu\n",
-                    (unsigned long)PR_IntervalToMilliseconds(PR_IntervalNow()),
+                    (unsigned long)ClockToMilliseconds(ClockNow()),
                     (unsigned long)readBytes);
             logFile.WriteNonBlocking(logstr, strlen(logstr));
 
             // Receive data.
             pollElem.in_flags = PR_POLL_READ | PR_POLL_EXCEPT;
 
-          } else if (memcmp(buf + TCP_TYPE_START,
-                            SENDRESULTS,
-                            TCP_TYPE_LEN) == 0) {
+          } else if (UploadFirstPacketComplete(buf, readBytes)) {
             testType = 7;
+            metrics.Started(testType);
             char fileName[TCP_FILE_NAME_LEN];
             memcpy(fileName, buf + TCP_FILE_NAME_START, TCP_FILE_NAME_LEN);
             uint64_t size;
             memcpy(&size, buf + TCP_DATA_LEN_START, TCP_DATA_LEN_LEN);
-            fileLen = ntohll(size);
-            LOG(("File name: %s, size: %lu", fileName, fileLen));
-            logFile.Init(fileName);
+            uint64_t fileLen = ntohll(size);
+            uint8_t encoding = UPLOAD_ENCODING_IDENTITY;
+            uint64_t decodedLen = 0;
+            uint32_t dataStart = TCP_DATA_START;
+            if (memcmp(buf + TCP_TYPE_START, SENDRESULTS_ENCODED,
+                       TCP_TYPE_LEN) == 0) {
+              encoding = buf[TCP_ENCODING_START];
+              memcpy(&size, buf + TCP_DECODED_LEN_START, TCP_DECODED_LEN_LEN);
+              decodedLen = ntohll(size);
+              dataStart = TCP_ENCODED_DATA_START;
+            }
+            LOG(("File name: %s, size: %lu", fileName,
+                 (unsigned long)fileLen));
+            if (upload.Init(fileName, encoding, fileLen, decodedLen)) {
+              break;
+            }
 
             // Receive data.
             pollElem.in_flags = PR_POLL_READ | PR_POLL_EXCEPT;
-            if (fileLen < (read - TCP_DATA_START)) {
-              logFile.WriteBlocking(buf + TCP_DATA_START,
-                                    fileLen);
-              logFile.Done();
-              return;
-            }  else {
-              logFile.WriteBlocking(buf + TCP_DATA_START,
-                                     read - TCP_DATA_START);
+            if (upload.Write(buf + dataStart, readBytes - dataStart) ||
+                !upload.Remaining()) {
+              if (!upload.Done()) {
+                metrics.Finished();
+              }
+              break;
             }
 
+          } else if (ConnRateFirstPacketComplete(buf, readBytes)) {
+            // The test is counted by ConnRateTests, not by this thread.
+            testType = 11;
+            char reply[TCP_CONN_REPLY_LEN];
+            connRate->Connection(buf, accepted, reply);
+            metrics.Charge();
+            memcpy(buf, reply, sizeof(reply));
+            writeLen = sizeof(reply);
+            pollElem.in_flags = PR_POLL_WRITE | PR_POLL_EXCEPT;
           } else {
             LOG(("NetworkTest TCP server side: Test not implemented"));
             break;
           }
           if (!timeFirstPktReceived) {
-            timeFirstPktReceived = PR_IntervalNow();
+            timeFirstPktReceived = ClockNow();
           }
           LOG(("NetworkTest TCP server side: Starting test %d.", testType));
           break;
@@ -184,51 +381,59 @@ ClientThread(void *_fd)
         case 4:
           // Log data.
           sprintf(logstr, "%lu RECV %lu\n",
-                  (unsigned long)PR_IntervalToMilliseconds(PR_IntervalNow()),
+                  (unsigned long)ClockToMilliseconds(ClockNow()),
                   (unsigned long)read);
           logFile.WriteNonBlocking(logstr, strlen(logstr));
 
-          if (PR_IntervalToSeconds(PR_IntervalNow() - timeFirstPktReceived) >=
-              2) {
+          if (ClockToMilliseconds(ClockNow() - timeFirstPktReceived) >=
+              rateCalcWarmupMs) {
             recvBytesForRate += read;
             if (!startRateCalc) {
-              startRateCalc = PR_IntervalNow();
+              startRateCalc = ClockNow();
             }
           }
-          if ((readBytes >= MAXBYTES) &&
-              (PR_IntervalToSeconds(PR_IntervalNow() - timeFirstPktReceived) >=
-               4)) {
-            uint64_t rate;
-            if (PR_IntervalToSeconds(PR_IntervalNow() - startRateCalc)) {
+          if (TestLimitsReached(limits, readBytes,
+                                ClockToMilliseconds(ClockNow() -
+                                                    timeFirstPktReceived))) {
+            uint64_t rate = 0;
+            if (ClockNow() - startRateCalc >= CLOCK_NS_PER_SEC) {
               rate = (double)recvBytesForRate / PAYLOADSIZEF /
-                (double)PR_IntervalToMilliseconds(PR_IntervalNow() - startRateCalc) *
+                (double)ClockToMilliseconds(ClockNow() - startRateCalc) *
                 1000.0;
             }
-            LOG(("NetworkTest TCP server side: Test 4 should treminate - "
-                 "we have received enough data. Rate: %lu", rate));
+            LOG(("NetworkTest TCP server side: Test 4 should terminate - "
+                 "we have received enough data. Rate: %lu",
+                 (unsigned long)rate));
             pktPerSec = htonll(rate);
             pollElem.in_flags = PR_POLL_WRITE | PR_POLL_EXCEPT;
+            metrics.Sending();
             LOG(("Test 4 finished: time %lu, first packet sent %lu, "
                  "duration %lu, received %llu max to received %llu, received "
                  "bytes for rate calc %llu, duration for calc %lu",
-                 PR_IntervalNow(),
-                 timeFirstPktReceived,
-                 PR_IntervalToMilliseconds(PR_IntervalNow() - timeFirstPktReceived),
-                 readBytes, MAXBYTES, recvBytesForRate,
-                 PR_IntervalNow() - startRateCalc));
+                 (unsigned long)ClockNow(),
+                 (unsigned long)timeFirstPktReceived,
+                 (unsigned long)ClockToMilliseconds(ClockNow() -
+                                                    timeFirstPktReceived),
+                 (unsigned long long)readBytes,
+                 (unsigned long long)limits.mMaxBytes,
+                 (unsigned long long)recvBytesForRate,
+                 (unsigned long)(ClockNow() - startRateCalc)));
           }
           break;
         case 7:
-          logFile.WriteBlocking(buf, read);
-          fileLen -= read;
-          if (fileLen <= 0) {
-            logFile.Done();
-            return;
+          if (upload.Write(buf, read) || !upload.Remaining()) {
+            if (!upload.Done()) {
+              metrics.Finished();
+            }
           }
           break;
         default:
           break;
       }
+      if (testType == 7 && upload.Finished()) {
+        // The upload is complete or not valid.
+        break;
+      }
     } else  if (pollElem.out_flags & PR_POLL_WRITE) {
 
       if (testType == 4) {
@@ -238,10 +443,10 @@ ClientThread(void *_fd)
 
       int written;
       if (testType == 3) {
-        written = PR_Write(fd, buf, bufLen);
+        written = tls.Write(fd, buf, bufLen);
       } else {
-        written = PR_Write(fd, buf + writtenBytes,
-                           bufLen -writtenBytes);
+        written = tls.Write(fd, buf + writtenBytes,
+                            writeLen - writtenBytes);
       }
       if (written < 0) {
         PRErrorCode errCode = PR_GetError();
@@ -252,13 +457,41 @@ ClientThread(void *_fd)
         break;
       }
       writtenBytes += written;
+      METRICS_ADD(mPktsSent, 1);
+      METRICS_ADD(mBytesSent, written);
       if ((testType == 2 || testType == 4) && (writtenBytes >= bufLen)) {
         pollElem.in_flags = PR_POLL_EXCEPT;
+        metrics.Finished();
+      }
+      if (testType == 11 && writtenBytes >= writeLen) {
+        // Wait for the client to close.
+        pollElem.in_flags = PR_POLL_READ | PR_POLL_EXCEPT;
+      }
+      if ((testType == 3) &&
+          TestLimitsReached(limits, writtenBytes,
+                            ClockToMilliseconds(ClockNow() -
+                                                timeFirstPktReceived))) {
+        LOG(("Test 3 finished: duration %llu, sent %llu bytes, max bytes to "
+             "send %llu", (unsigned long long)
+             ClockToMilliseconds(ClockNow() - timeFirstPktReceived),
+             (unsigned long long)writtenBytes,
+             (unsigned long long)limits.mMaxBytes));
+        metrics.Finished();
+        break;
       }
     }
   }
 
+  // Test 3 runs until either side stops it.
+  if (testType == 3 && writtenBytes) {
+    metrics.Finished();
+  }
+  if (testType == 4) {
+    metrics.LogCpuCost(&logFile);
+  }
+
   if (fd) {
+    tls.Shutdown();
     PR_Close(fd);
   }
 }
@@ -266,11 +499,17 @@ ClientThread(void *_fd)
 TCPserver::TCPserver()
   : mFds(NULL)
   , mNumberOfPorts(0)
+  , mFastOpenQueue(TCP_FASTOPEN_QUEUE)
+  , mTlsIndex(-1)
 {
+  PR_SetNetAddr(PR_IpAddrAny, PR_AF_INET, 0, &mBindAddr);
 }
 
 TCPserver::~TCPserver()
 {
+  for (size_t inx = 0; inx < mConns.size(); inx++) {
+    PR_Close(mConns[inx].mFd);
+  }
   for (int inx = 0; inx < mNumberOfPorts; inx++) {
     if (mFds[inx]) {
       PR_Close(mFds[inx]);
@@ -294,6 +533,9 @@ TCPserver::Start(uint16_t *aPort, int aNumberOfPorts)
     if (rv != 0 ) {
       return rv;
     }
+    if (aPort[inx] == TLS_PORT && TlsEnabled()) {
+      mTlsIndex = inx;
+    }
   }
   return Run();
 }
@@ -302,13 +544,8 @@ int
 TCPserver::Init(uint16_t aPort, int aInx)
 {
   LOG(("NetworkTest TCP server side: Init socket: port %d", aPort));
-  PRNetAddr addr;
-  PRNetAddrValue val = PR_IpAddrAny;
-  PRStatus status = PR_SetNetAddr(val, PR_AF_INET, aPort, &addr);
-  if (status != PR_SUCCESS) {
-    LogError("TCP");
-    return -1;
-  }
+  PRNetAddr addr = mBindAddr;
+  addr.inet.port = PR_htons(aPort);
 
   char host[164] = {0};
   PR_NetAddrToString(&addr, host, sizeof(host));
@@ -324,7 +561,7 @@ TCPserver::Init(uint16_t aPort, int aInx)
   PRSocketOptionData opt;
   opt.option = PR_SockOpt_Nonblocking;
   opt.value.non_blocking = true;
-  status = PR_SetSocketOption(mFds[aInx], &opt);
+  PRStatus status = PR_SetSocketOption(mFds[aInx], &opt);
   if (status != PR_SUCCESS) {
     LogError("TCP");
     return -1;
@@ -364,6 +601,13 @@ TCPserver::Init(uint16_t aPort, int aInx)
 
   LOG(("NetworkTest TCP server side: Socket bind."));
 
+  // Before listen, so the first SYN can already carry data. A failure only
+  // means that the handshake takes a round trip.
+  if (mFastOpenQueue > 0 && !::SetFastOpen(mFds[aInx], mFastOpenQueue)) {
+    LOG(("NetworkTest TCP server side: TCP Fast Open, queue %d.",
+         mFastOpenQueue));
+  }
+
   status = PR_Listen(mFds[aInx], 10);
   if (status != PR_SUCCESS) {
     LogError("TCP");
@@ -377,34 +621,191 @@ TCPserver::Init(uint16_t aPort, int aInx)
 int
 TCPserver::Run()
 {
-  PRNetAddr clientNetAddr;
-  PRFileDesc *fdClient = NULL;
+  MetricsRegisterWorker("tcp_accept");
+  CpuCostThreadInit();
+  std::vector<PRPollDesc> polls;
   while (1) {
-    for (int inx =0; inx < mNumberOfPorts; inx++) {
-      fdClient = PR_Accept(mFds[inx], &clientNetAddr, PR_INTERVAL_NO_WAIT);
-      if (fdClient) {
-        LOG(("NetworkTest TCP server side: Client accepted [fd=%p].", fdClient));
-        int rv = StartClientThread(fdClient);
-        if (rv != 0) {
-          PR_Close(fdClient);
-        }
-        fdClient = NULL;
+    polls.resize(mNumberOfPorts + mConns.size());
+    for (int inx = 0; inx < mNumberOfPorts; inx++) {
+      polls[inx].fd = mFds[inx];
+      polls[inx].in_flags = Accepting(inx) ? PR_POLL_READ : 0;
+      polls[inx].out_flags = 0;
+    }
+    for (size_t inx = 0; inx < mConns.size(); inx++) {
+      PRPollDesc &poll = polls[mNumberOfPorts + inx];
+      HeldConn &conn = mConns[inx];
+      poll.fd = conn.mFd;
+      poll.in_flags = (conn.mReplied && conn.mWritten < TCP_CONN_REPLY_LEN) ?
+                      PR_POLL_WRITE | PR_POLL_EXCEPT :
+                      PR_POLL_READ | PR_POLL_EXCEPT;
+      poll.out_flags = 0;
+    }
+    if (PR_Poll(&polls[0], polls.size(),
+                PR_MillisecondsToInterval(TCP_ACCEPT_POLL_MS)) < 0) {
+      LogError("TCP");
+      continue;
+    }
+
+    ClockTime now = ClockNow();
+    size_t kept = 0;
+    for (size_t inx = 0; inx < mConns.size(); inx++) {
+      if (Serve(mConns[inx], polls[mNumberOfPorts + inx].out_flags, now)) {
+        mConns[kept++] = mConns[inx];
+      }
+    }
+    mConns.resize(kept);
+    for (int inx = 0; inx < mNumberOfPorts; inx++) {
+      if (polls[inx].out_flags & PR_POLL_READ) {
+        Accept(inx);
       }
     }
+    mConnRate.Expire(now);
   }
   return 0;
 }
 
+void
+TCPserver::Accept(int aInx)
+{
+  PRNetAddr clientNetAddr;
+  PRFileDesc *fdClient;
+  while (Accepting(aInx) &&
+         (fdClient = PR_Accept(mFds[aInx], &clientNetAddr,
+                               PR_INTERVAL_NO_WAIT))) {
+    LOG(("NetworkTest TCP server side: Client accepted [fd=%p].", fdClient));
+    TRACE2(tcp_accept, fdClient, aInx);
+    METRICS_ADD(mTcpAccepted, 1);
+    // Accepted sockets block at the NSPR level otherwise.
+    PRSocketOptionData opt;
+    opt.option = PR_SockOpt_Nonblocking;
+    opt.value.non_blocking = true;
+    if (PR_SetSocketOption(fdClient, &opt) != PR_SUCCESS) {
+      LogError("TCP");
+      PR_Close(fdClient);
+      continue;
+    }
+    if (aInx == mTlsIndex) {
+      // The client thread finds out the test type itself.
+      if (StartClientThread(fdClient, nullptr, 0, true)) {
+        PR_Close(fdClient);
+      }
+      continue;
+    }
+    HeldConn conn;
+    conn.mFd = fdClient;
+    conn.mTime = ClockNow();
+    conn.mRead = 0;
+    conn.mReplied = false;
+    conn.mWritten = 0;
+    mConns.push_back(conn);
+  }
+}
+
+bool
+TCPserver::Serve(HeldConn &aConn, int16_t aOutFlags, ClockTime aNow)
+{
+  if (!aOutFlags) {
+    if (ClockToMilliseconds(aNow - aConn.mTime) < TCP_HOLD_TIMEOUT_MS) {
+      return true;
+    }
+    LOG(("NetworkTest TCP server side: Timeout [fd=%p].", aConn.mFd));
+    PR_Close(aConn.mFd);
+    return false;
+  }
+
+  if (aConn.mReplied && aConn.mWritten < TCP_CONN_REPLY_LEN) {
+    return WriteReply(aConn);
+  }
+  if (aConn.mReplied) {
+    // Test 11: wait for the client to close.
+    char buf[TCP_CONN_FIRST_PKT_LEN];
+    int read = PR_Read(aConn.mFd, buf, sizeof(buf));
+    if (read > 0 || (read < 0 && PR_GetError() == PR_WOULD_BLOCK_ERROR)) {
+      return true;
+    }
+    TRACE3(tcp_state, aConn.mFd, 11, TRACE_TCP_CLOSED);
+    PR_Close(aConn.mFd);
+    return false;
+  }
+
+  // Read the test type and, for Test 11, the rest of the first packet; a
+  // client thread reads everything else. One read per wakeup.
+  uint32_t want = (aConn.mRead < TCP_TYPE_LEN) ? TCP_TYPE_LEN :
+                                                 TCP_CONN_FIRST_PKT_LEN;
+  int read = PR_Read(aConn.mFd, aConn.mBuf + aConn.mRead,
+                     want - aConn.mRead);
+  if (read < 0 && PR_GetError() == PR_WOULD_BLOCK_ERROR) {
+    return true;
+  }
+  if (read < 1) {
+    PR_Close(aConn.mFd);
+    return false;
+  }
+  aConn.mRead += read;
+  METRICS_ADD(mPktsReceived, 1);
+  METRICS_ADD(mBytesReceived, read);
+  if (aConn.mRead == TCP_TYPE_LEN &&
+      memcmp(aConn.mBuf + TCP_TYPE_START, TCP_connectionRate, TCP_TYPE_LEN)) {
+    if (StartClientThread(aConn.mFd, aConn.mBuf, aConn.mRead, false)) {
+      PR_Close(aConn.mFd);
+    }
+    return false;
+  }
+  if (aConn.mRead < TCP_CONN_FIRST_PKT_LEN) {
+    return true;
+  }
+
+  mConnRate.Connection(aConn.mBuf, aConn.mTime, aConn.mReply);
+  CpuCostCharge(nullptr);
+  aConn.mReplied = true;
+  aConn.mWritten = 0;
+  return WriteReply(aConn);
+}
+
+bool
+TCPserver::WriteReply(HeldConn &aConn)
+{
+  int written = PR_Write(aConn.mFd, aConn.mReply + aConn.mWritten,
+                         TCP_CONN_REPLY_LEN - aConn.mWritten);
+  if (written < 0 && PR_GetError() == PR_WOULD_BLOCK_ERROR) {
+    return true;
+  }
+  if (written < 1) {
+    LogError("TCP");
+    PR_Close(aConn.mFd);
+    return false;
+  }
+  aConn.mWritten += written;
+  METRICS_ADD(mPktsSent, 1);
+  METRICS_ADD(mBytesSent, written);
+  if (aConn.mWritten == TCP_CONN_REPLY_LEN) {
+    TRACE3(tcp_state, aConn.mFd, 11, TRACE_TCP_FINISHED);
+    aConn.mTime = ClockNow();
+  }
+  return true;
+}
+
 int
-TCPserver::StartClientThread(PRFileDesc *fdClient)
+TCPserver::StartClientThread(PRFileDesc *fdClient, const char *aRead,
+                             uint32_t aReadLen, bool aTls)
 {
+  ClientThreadStart *start = new ClientThreadStart();
+  start->mFd = fdClient;
+  start->mRead = aReadLen;
+  start->mTls = aTls;
+  start->mAccepted = ClockNow();
+  start->mConnRate = &mConnRate;
+  if (aReadLen) {
+    memcpy(start->mBuf, aRead, aReadLen);
+  }
   PRThread *clientThread;
   clientThread = PR_CreateThread(PR_USER_THREAD, ClientThread,
-                                 (void *)fdClient, PR_PRIORITY_NORMAL,
+                                 (void *)start, PR_PRIORITY_NORMAL,
                                  PR_LOCAL_THREAD,PR_UNJOINABLE_THREAD, 0);
   if (!clientThread) {
     LOG(("NetworkTest TCP server side: Error creating client thread"));
     LogError("TCP");
+    delete start;
     return -1;
   }
   return 0;
@@ -9,21 +9,80 @@
 
 #include "prio.h"
 #include "prerror.h"
+#include "Clock.h"
+#include "ConnRate.h"
+#include "config.h"
+#include <vector>
 
+// 0 disables TCP Fast Open on the listening sockets.
+#define TCP_FASTOPEN_QUEUE 256
+// Connections the accept loop holds before it starts their client thread.
+#define TCP_MAX_HELD_CONNS 4096
+#define TCP_ACCEPT_POLL_MS 100
+// Same as the poll timeout of a client thread.
+#define TCP_HOLD_TIMEOUT_MS 10000
+
+/**
+ * The accept loop polls the listening sockets and holds every new connection
+ * until it has the test type. Test 11 connections (ConnRate.h) are served
+ * by the loop itself until the client closes them; every other test gets a
+ * client thread, which continues with the bytes the loop has read. Accepted
+ * sockets are non-blocking, and the loop reads and writes once per poll
+ * wakeup, so a client that stalls in the middle of its first packet holds
+ * only its own connection. With TCP_MAX_HELD_CONNS connections held the
+ * loop stops accepting on the plain ports; new connections wait in the
+ * listen backlog.
+ *
+ * With TLS enabled (Tls.h) connections to TLS_PORT go to a client thread
+ * right away; it does the handshake and runs the test inside TLS, Test 11
+ * too.
+ */
 class TCPserver
 {
 public:
   TCPserver();
   ~TCPserver();
+  void SetFastOpen(int aQueue) { mFastOpenQueue = aQueue; }
+  // Listen on this address instead of any (IPv4).
+  void SetBindAddress(const PRNetAddr *aAddr) { mBindAddr = *aAddr; }
   int Start(uint16_t *aPort, int aNumberOfPorts);
 
 private:
+  struct HeldConn
+  {
+    PRFileDesc *mFd;
+    // When it was accepted, or replied to for Test 11.
+    ClockTime mTime;
+    uint32_t mRead;
+    // Test 11: the reply is ready, and how much of it went out.
+    bool mReplied;
+    uint32_t mWritten;
+    char mBuf[TCP_CONN_FIRST_PKT_LEN];
+    char mReply[TCP_CONN_REPLY_LEN];
+  };
+
   int Init(uint16_t aPort, int aInx);
   int Run();
-  int StartClientThread(PRFileDesc *fdClient);
+  void Accept(int aInx);
+  // false if the connection is closed or handed to a client thread.
+  bool Serve(HeldConn &aConn, int16_t aOutFlags, ClockTime aNow);
+  // false if the connection is closed.
+  bool WriteReply(HeldConn &aConn);
+  bool Accepting(int aInx)
+  {
+    return aInx == mTlsIndex || mConns.size() < TCP_MAX_HELD_CONNS;
+  }
+  int StartClientThread(PRFileDesc *fdClient, const char *aRead,
+                        uint32_t aReadLen, bool aTls);
 
   PRFileDesc **mFds;
+  PRNetAddr mBindAddr;
   int mNumberOfPorts;
+  int mFastOpenQueue;
+  // The listening socket of TLS_PORT if TLS is enabled, otherwise -1.
+  int mTlsIndex;
+  std::vector<HeldConn> mConns;
+  ConnRateTests mConnRate;
 };
 
 #endif
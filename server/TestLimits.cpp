@@ -0,0 +1,143 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "TestLimits.h"
+#include "HelpFunctions.h"
+#include "Placement.h"
+#include "config.h"
+#include "prio.h"
+#include "prlog.h"
+#include "prthread.h"
+#include "plstr.h"
+#include <atomic>
+#include <cstring>
+#include <stdio.h>
+
+extern PRLogModuleInfo* gServerTestLog;
+#define LOG(args) PR_LOG(gServerTestLog, PR_LOG_DEBUG, args)
+
+#define LIMITS_CHECK_INTERVAL PR_SecondsToInterval(1)
+
+static std::atomic<uint64_t> sServerMaxBytes(SERVER_MAXBYTES);
+static std::atomic<uint32_t> sServerMaxTimeMs(SERVER_MAXTIME_MS);
+
+void
+SetServerLimits(uint64_t aMaxBytes, uint32_t aMaxTimeMs)
+{
+  sServerMaxBytes.store(aMaxBytes, std::memory_order_relaxed);
+  sServerMaxTimeMs.store(aMaxTimeMs, std::memory_order_relaxed);
+  LOG(("NetworkTest server side: Server limits: max bytes %llu, max time "
+       "%lu ms.", (unsigned long long)aMaxBytes, (unsigned long)aMaxTimeMs));
+}
+
+uint64_t
+ServerMaxBytes()
+{
+  return sServerMaxBytes.load(std::memory_order_relaxed);
+}
+
+uint32_t
+ServerMaxTimeMs()
+{
+  return sServerMaxTimeMs.load(std::memory_order_relaxed);
+}
+
+static int
+ReadServerLimits(const char *aFileName)
+{
+  PRFileDesc *fd = PR_Open(aFileName, PR_RDONLY, 0);
+  if (!fd) {
+    return LogError("Limits");
+  }
+  char buf[256];
+  int read = PR_Read(fd, buf, sizeof(buf) - 1);
+  PR_Close(fd);
+  if (read < 0) {
+    return LogError("Limits");
+  }
+  buf[read] = '\0';
+
+  uint64_t maxBytes = ServerMaxBytes();
+  uint32_t maxTimeMs = ServerMaxTimeMs();
+  char *line = buf;
+  while (line && *line) {
+    char *next = strchr(line, '\n');
+    if (next) {
+      *next++ = '\0';
+    }
+    unsigned long long value;
+    if (sscanf(line, "max_bytes %llu", &value) == 1) {
+      maxBytes = value;
+    } else if (sscanf(line, "max_time %llu", &value) == 1) {
+      maxTimeMs = (uint32_t)value;
+    }
+    line = next;
+  }
+  SetServerLimits(maxBytes, maxTimeMs);
+  return 0;
+}
+
+static void PR_CALLBACK
+ServerLimitsWatcherThread(void *_fileName)
+{
+  char *fileName = (char*)_fileName;
+  PlacementApply(PLACEMENT_IO, 0, "limits");
+  PRTime lastModified = 0;
+  while (1) {
+    PRFileInfo64 info;
+    if ((PR_GetFileInfo64(fileName, &info) == PR_SUCCESS) &&
+        (info.modifyTime != lastModified)) {
+      lastModified = info.modifyTime;
+      ReadServerLimits(fileName);
+    }
+    PR_Sleep(LIMITS_CHECK_INTERVAL);
+  }
+}
+
+int
+StartServerLimitsWatcher(const char *aFileName)
+{
+  if (ReadServerLimits(aFileName)) {
+    return -1;
+  }
+  PRThread *thread = PR_CreateThread(PR_USER_THREAD, ServerLimitsWatcherThread,
+                                     (void *)PL_strdup(aFileName),
+                                     PR_PRIORITY_LOW, PR_LOCAL_THREAD,
+                                     PR_UNJOINABLE_THREAD, 0);
+  if (!thread) {
+    LOG(("NetworkTest server side: Error creating limits watcher thread"));
+    return LogError("Limits");
+  }
+  return 0;
+}
+
+void
+NegotiateTestLimits(uint64_t aRequestedBytes, uint32_t aRequestedTimeMs,
+                    TestLimits &aLimits)
+{
+  aLimits.mMaxBytes = aRequestedBytes ? aRequestedBytes : MAXBYTES;
+  aLimits.mMaxTimeMs = aRequestedTimeMs ? aRequestedTimeMs : MAXTIME * 1000;
+
+  uint64_t maxBytes = ServerMaxBytes();
+  uint32_t maxTimeMs = ServerMaxTimeMs();
+  if (aLimits.mMaxBytes > maxBytes) {
+    aLimits.mMaxBytes = maxBytes;
+  }
+  if (aLimits.mMaxTimeMs > maxTimeMs) {
+    aLimits.mMaxTimeMs = maxTimeMs;
+  }
+}
+
+bool
+TestLimitsReached(const TestLimits &aLimits, uint64_t aBytes,
+                  uint32_t aElapsedMs)
+{
+  if ((aBytes >= aLimits.mMaxBytes) && (aElapsedMs >= aLimits.mMaxTimeMs)) {
+    return true;
+  }
+  // The server maximums could have been lowered after the test has started.
+  return (aBytes >= ServerMaxBytes()) || (aElapsedMs >= ServerMaxTimeMs());
+}
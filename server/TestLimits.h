@@ -0,0 +1,42 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NETWORK_TESTS_TEST_LIMITS_H__
+#define NETWORK_TESTS_TEST_LIMITS_H__
+
+#include <stdint.h>
+
+// Limits of a single test, negotiated from the values requested in the first
+// packet and the server side maximums.
+struct TestLimits
+{
+  uint64_t mMaxBytes;
+  uint32_t mMaxTimeMs;
+};
+
+// Server side maximums. They can be changed while the server is running, e.g.
+// to shorten tests when the server is under load; running tests see the new
+// values immediately.
+void SetServerLimits(uint64_t aMaxBytes, uint32_t aMaxTimeMs);
+uint64_t ServerMaxBytes();
+uint32_t ServerMaxTimeMs();
+
+// Start a thread that reloads the server maximums from aFileName every time
+// the file changes. The file has the format:
+//   max_bytes [bytes]
+//   max_time [milliseconds]
+int StartServerLimitsWatcher(const char *aFileName);
+
+// A requested value of 0 means the default (MAXBYTES, MAXTIME).
+void NegotiateTestLimits(uint64_t aRequestedBytes, uint32_t aRequestedTimeMs,
+                         TestLimits &aLimits);
+
+// A test is finished when it has transferred aLimits.mMaxBytes and
+// aLimits.mMaxTimeMs has expired, or when it hits the current server maximums.
+bool TestLimitsReached(const TestLimits &aLimits, uint64_t aBytes,
+                       uint32_t aElapsedMs);
+
+#endif
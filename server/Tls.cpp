@@ -0,0 +1,207 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Tls.h"
+#include "Clock.h"
+#include "Metrics.h"
+#include "prerror.h"
+#include "prlog.h"
+#include "private/pprio.h"
+#include <openssl/err.h>
+
+extern PRLogModuleInfo* gServerTestLog;
+#define LOG(args) PR_LOG(gServerTestLog, PR_LOG_DEBUG, args)
+
+static SSL_CTX *sCtx = nullptr;
+
+static void
+LogSslError(const char *aWhat)
+{
+  char buf[256];
+  ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+  LOG(("NetworkTest TLS: %s: %s", aWhat, buf));
+  ERR_clear_error();
+}
+
+int
+TlsInit(const char *aCertFile, const char *aKeyFile)
+{
+  sCtx = SSL_CTX_new(TLS_server_method());
+  if (!sCtx) {
+    LogSslError("no context");
+    return -1;
+  }
+  SSL_CTX_set_min_proto_version(sCtx, TLS1_2_VERSION);
+#ifdef SSL_OP_ENABLE_KTLS
+  SSL_CTX_set_options(sCtx, SSL_OP_ENABLE_KTLS);
+#endif
+  // Writes behave like write(2): partial, and the rest from a new position.
+  SSL_CTX_set_mode(sCtx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                         SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  if (SSL_CTX_use_certificate_chain_file(sCtx, aCertFile) != 1 ||
+      SSL_CTX_use_PrivateKey_file(sCtx, aKeyFile, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(sCtx) != 1) {
+    LogSslError("bad certificate or key");
+    SSL_CTX_free(sCtx);
+    sCtx = nullptr;
+    return -1;
+  }
+  LOG(("NetworkTest TLS: enabled on port %d.", TLS_PORT));
+  return 0;
+}
+
+bool
+TlsEnabled()
+{
+  return sCtx != nullptr;
+}
+
+TlsSession::TlsSession()
+  : mSsl(nullptr)
+  , mKtlsSend(false)
+  , mKtlsRecv(false)
+{
+}
+
+TlsSession::~TlsSession()
+{
+  if (mSsl) {
+    SSL_free(mSsl);
+  }
+}
+
+int
+TlsSession::HandshakeError(const char *aReason)
+{
+  LogSslError(aReason);
+  METRICS_ADD(mTlsHandshakeErrors, 1);
+  SSL_free(mSsl);
+  mSsl = nullptr;
+  return -1;
+}
+
+int
+TlsSession::Accept(PRFileDesc *aFd)
+{
+  ClockTime start = ClockNow();
+  mSsl = SSL_new(sCtx);
+  if (!mSsl) {
+    METRICS_ADD(mTlsHandshakeErrors, 1);
+    return -1;
+  }
+  if (SSL_set_fd(mSsl, PR_FileDesc2NativeHandle(aFd)) != 1) {
+    return HandshakeError("set fd");
+  }
+
+  int rv;
+  while ((rv = SSL_accept(mSsl)) != 1) {
+    PRPollDesc pollElem;
+    pollElem.fd = aFd;
+    switch (SSL_get_error(mSsl, rv)) {
+      case SSL_ERROR_WANT_READ:
+        pollElem.in_flags = PR_POLL_READ | PR_POLL_EXCEPT;
+        break;
+      case SSL_ERROR_WANT_WRITE:
+        pollElem.in_flags = PR_POLL_WRITE | PR_POLL_EXCEPT;
+        break;
+      default:
+        return HandshakeError("handshake failed");
+    }
+    uint32_t elapsedMs = ClockToMilliseconds(ClockNow() - start);
+    if (elapsedMs >= TLS_HANDSHAKE_TIMEOUT_MS ||
+        PR_Poll(&pollElem, 1, PR_MillisecondsToInterval(
+                  TLS_HANDSHAKE_TIMEOUT_MS - elapsedMs)) < 1) {
+      return HandshakeError("handshake timeout");
+    }
+  }
+
+#ifdef BIO_get_ktls_send
+  mKtlsSend = BIO_get_ktls_send(SSL_get_wbio(mSsl));
+  mKtlsRecv = BIO_get_ktls_recv(SSL_get_rbio(mSsl));
+#endif
+  ClockTime duration = ClockNow() - start;
+  METRICS_ADD(mTlsHandshakes, 1);
+  METRICS_ADD(mTlsHandshakeUs, duration / 1000);
+  if (mKtlsSend) {
+    METRICS_ADD(mTlsKtlsSend, 1);
+  }
+  if (mKtlsRecv) {
+    METRICS_ADD(mTlsKtlsRecv, 1);
+  }
+  LOG(("NetworkTest TLS: %s %s handshake %llu us, kTLS send %d receive %d.",
+       SSL_get_version(mSsl), SSL_get_cipher_name(mSsl),
+       (unsigned long long)(duration / 1000), mKtlsSend, mKtlsRecv));
+  return 0;
+}
+
+int32_t
+TlsSession::Error(int32_t aRv)
+{
+  switch (SSL_get_error(mSsl, aRv)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      PR_SetError(PR_WOULD_BLOCK_ERROR, 0);
+      return -1;
+    case SSL_ERROR_ZERO_RETURN:
+      // close_notify
+      return 0;
+    default:
+      ERR_clear_error();
+      PR_SetError(PR_IO_ERROR, 0);
+      return -1;
+  }
+}
+
+int32_t
+TlsSession::Read(PRFileDesc *aFd, void *aBuf, int32_t aAmount)
+{
+  if (!mSsl) {
+    return PR_Read(aFd, aBuf, aAmount);
+  }
+  int rv = SSL_read(mSsl, aBuf, aAmount);
+  if (rv <= 0) {
+    return Error(rv);
+  }
+  METRICS_ADD(mTlsBytesReceived, rv);
+  return rv;
+}
+
+int32_t
+TlsSession::Write(PRFileDesc *aFd, const void *aBuf, int32_t aAmount)
+{
+  if (!mSsl) {
+    return PR_Write(aFd, aBuf, aAmount);
+  }
+  int32_t rv;
+  if (mKtlsSend) {
+    // The kernel builds the records.
+    rv = PR_Write(aFd, aBuf, aAmount);
+  } else {
+    rv = SSL_write(mSsl, aBuf, aAmount);
+    if (rv <= 0) {
+      return Error(rv);
+    }
+  }
+  if (rv > 0) {
+    METRICS_ADD(mTlsBytesSent, rv);
+  }
+  return rv;
+}
+
+bool
+TlsSession::Pending()
+{
+  return mSsl && SSL_pending(mSsl) > 0;
+}
+
+void
+TlsSession::Shutdown()
+{
+  if (mSsl) {
+    SSL_shutdown(mSsl);
+    ERR_clear_error();
+  }
+}
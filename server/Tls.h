@@ -0,0 +1,64 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NETWORK_TESTS_TLS_H__
+#define NETWORK_TESTS_TLS_H__
+
+#include "prio.h"
+#include <openssl/ssl.h>
+#include <stdint.h>
+
+/**
+ * Optional TLS for the TCP tests (ServerSide -T). Connections to TLS_PORT
+ * start with a TLS handshake (OpenSSL) in their client thread; the tests
+ * then run unchanged inside the TLS connection.
+ *
+ * OpenSSL is asked to hand the record layer to the kernel (kTLS) after the
+ * handshake. If the kernel takes the send side, writes go straight to the
+ * socket with PR_Write, so the Test 3 bulk path is the plaintext one. Reads
+ * go through SSL_read, which reads from the kernel if it has the receive
+ * side too and handles the records that are not data. Without kTLS OpenSSL
+ * does the record layer itself.
+ *
+ * The metrics count handshakes, their time, the connections with kTLS and
+ * the application bytes sent and received inside TLS.
+ */
+
+#define TLS_PORT 443
+#define TLS_HANDSHAKE_TIMEOUT_MS 10000
+
+// Load the certificate chain and key (PEM). -1 on error.
+int TlsInit(const char *aCertFile, const char *aKeyFile);
+bool TlsEnabled();
+
+class TlsSession
+{
+public:
+  TlsSession();
+  ~TlsSession();
+  // Server handshake on a connected non-blocking socket. -1 if it fails or
+  // takes longer than TLS_HANDSHAKE_TIMEOUT_MS.
+  int Accept(PRFileDesc *aFd);
+  bool Active() { return mSsl != nullptr; }
+  // PR_Read and PR_Write inside the TLS connection if there is one, with
+  // the same return values and PR errors.
+  int32_t Read(PRFileDesc *aFd, void *aBuf, int32_t aAmount);
+  int32_t Write(PRFileDesc *aFd, const void *aBuf, int32_t aAmount);
+  // Decrypted data OpenSSL holds; a poll on the socket does not see it.
+  bool Pending();
+  // Send close_notify.
+  void Shutdown();
+
+private:
+  int HandshakeError(const char *aReason);
+  int32_t Error(int32_t aRv);
+
+  SSL *mSsl;
+  bool mKtlsSend;
+  bool mKtlsRecv;
+};
+
+#endif
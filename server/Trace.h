@@ -0,0 +1,75 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NETWORK_TESTS_TRACE_H__
+#define NETWORK_TESTS_TRACE_H__
+
+#include <stdint.h>
+
+/**
+ * USDT tracepoints (provider network_test) for bpftrace, perf or SystemTap.
+ *
+ * They are built in if <sys/sdt.h> (systemtap-sdt-dev) is found and
+ * NETWORK_TEST_NO_USDT is not defined. A tracepoint that nobody attached to
+ * is a nop instruction; without <sys/sdt.h> the macros are empty. The
+ * scripts in trace/ turn them into latency histograms.
+ *
+ * "client" is the ClientSocket (UDP) and "fd" the PRFileDesc (TCP) of a
+ * test; both stay the same for the whole test. Times are ClockNow() ns.
+ *
+ *  udp_recv(port, bytes, kernel rx ns or 0)    UDP worker read a packet
+ *  udp_pkt(client, test type, bytes, phase)    ClientSocket::NewPkt()
+ *  test_start(client, test type, log name)     first packet accepted
+ *  test_done(client, test type, error)         UDP test finished
+ *  data_send(client, test type, pkt id, bytes, late ns)
+ *                                              Test 5 data packet sent
+ *  ack_send(peer, pkt id, residence ns, bytes) ACK sent; peer is the
+ *                                              PRNetAddr of the client
+ *  log_chunk_full(log name, bytes, dropped)    FileWriter chunk handed to
+ *                                              the results store (dropped if
+ *                                              the store queue was full)
+ *  log_chunk_written(log name, bytes, queued ns)
+ *                                              results store wrote a chunk
+ *  tcp_accept(fd, listen socket index)         TCP connection accepted
+ *  tcp_state(fd, test type, TRACE_TCP_*)       TCP client thread state
+ */
+
+#if !defined(NETWORK_TEST_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define NETWORK_TEST_USDT 1
+#endif
+#endif
+
+#ifdef NETWORK_TEST_USDT
+#define TRACE2(name, a1, a2) DTRACE_PROBE2(network_test, name, a1, a2)
+#define TRACE3(name, a1, a2, a3)                                               \
+  DTRACE_PROBE3(network_test, name, a1, a2, a3)
+#define TRACE4(name, a1, a2, a3, a4)                                           \
+  DTRACE_PROBE4(network_test, name, a1, a2, a3, a4)
+#define TRACE5(name, a1, a2, a3, a4, a5)                                       \
+  DTRACE_PROBE5(network_test, name, a1, a2, a3, a4, a5)
+#else
+// The arguments are not evaluated, only used.
+#define TRACE2(name, a1, a2)                                                   \
+  do { if (0) { (void)(a1); (void)(a2); } } while (0)
+#define TRACE3(name, a1, a2, a3)                                               \
+  do { if (0) { (void)(a1); (void)(a2); (void)(a3); } } while (0)
+#define TRACE4(name, a1, a2, a3, a4)                                           \
+  do { if (0) { (void)(a1); (void)(a2); (void)(a3); (void)(a4); } } while (0)
+#define TRACE5(name, a1, a2, a3, a4, a5)                                       \
+  do {                                                                         \
+    if (0) { (void)(a1); (void)(a2); (void)(a3); (void)(a4); (void)(a5); }     \
+  } while (0)
+#endif
+
+#define TRACE_TCP_CONNECTED 0
+#define TRACE_TCP_TEST_STARTED 1
+#define TRACE_TCP_SENDING 2
+#define TRACE_TCP_FINISHED 3
+#define TRACE_TCP_CLOSED 4
+
+#endif
@@ -9,145 +9,485 @@
 #include "UDPserver.h"
 #include "prlog.h"
 #include "HelpFunctions.h"
-#include "ClientSocket.h"
+#include "ClientPool.h"
+#include "Metrics.h"
+#include "CpuCost.h"
+#include "Trace.h"
+#include "Capture.h"
+#include "Placement.h"
+#include "XdpSocket.h"
+#include "Cluster.h"
+#include <algorithm>
 #include <cstring>
+#include <deque>
+#include <stdio.h>
 
 extern PRLogModuleInfo* gServerTestLog;
 #define LOG(args) PR_LOG(gServerTestLog, PR_LOG_DEBUG, args)
 // after this short interval, we will return to PR_Poll
 #define NS_SOCKET_CONNECT_TIMEOUT PR_MillisecondsToInterval(20)
 #define SERVERSNDBUFFERSIZE 12582912
+// Room for bursts of jumbo packets (capped by net.core.rmem_max).
+#define SERVERRCVBUFFERSIZE 4194304
+// Transmit scheduling: every client with due packets gets UDP_TX_QUANTUM
+// bytes per round (deficit round robin) and at most UDP_TX_SLICE_NS.
+#define UDP_TX_QUANTUM 65536
+#define UDP_TX_SLICE_NS (500 * CLOCK_NS_PER_US)
+// Packets read per round, so client ACKs do not wait behind a full round.
+#define UDP_RECV_BATCH 64
 
-static void PR_CALLBACK
-UDPSocketThread(void *_port)
+struct UDPSocketThreadArgs
 {
-  LOG(("NetworkTest UDP server side: A thread created."));
-  uint16_t *portp = (uint16_t*)_port;
-  uint16_t port = *portp;
-  delete portp;
-  LOG(("NetworkTest UDP server side: Init socket: port %d", port));
-  PRNetAddr addr;
-  PRNetAddrValue val = PR_IpAddrAny;
-  PRStatus status = PR_SetNetAddr(val, PR_AF_INET, port, &addr);
-  if (status != PR_SUCCESS) {
-    LogError("UDP");
-    return;
+  PRNetAddr mAddr;
+  uint16_t mPort;
+  int mInx;
+  const char *mCaptureFile;
+  uint32_t mMaxClients;
+};
+
+struct XdpThreadArgs
+{
+  int mInx;
+  const char *mIfName;
+  uint32_t mQueue;
+  int mMode;
+  uint16_t *mPorts;
+  int mNumberOfPorts;
+  const char *mCaptureFile;
+  uint32_t mMaxClients;
+};
+
+// A Test 10 echo waiting for its kernel send timestamp. mClient is null once
+// the client is gone.
+struct TxStampWait
+{
+  uint32_t mKey;
+  ClientSocket *mClient;
+};
+
+// Hand the send timestamps on the error queue to the probes they belong to.
+// Returns true if anything was read.
+static bool
+DrainTxStamps(PRFileDesc *aFd, std::deque<TxStampWait> &aWaits)
+{
+  bool read = false;
+  uint32_t key;
+  uint64_t kernelTx;
+  while (!ReadTxTimestamp(aFd, &key, &kernelTx)) {
+    read = true;
+    // Timestamps that did not come before this one are lost.
+    while (!aWaits.empty() && (int32_t)(aWaits.front().mKey - key) <= 0) {
+      TxStampWait wait = aWaits.front();
+      aWaits.pop_front();
+      if (wait.mClient) {
+        wait.mClient->ProbeTxStamp((wait.mKey == key) ? kernelTx : 0);
+      }
+    }
   }
+  return read;
+}
 
-  char host[164] = {0};
-  PR_NetAddrToString(&addr, host, sizeof(host));
-  LOG(("NetworkTest UDP server side: host %s", host));
+static void
+ForgetTxStamps(std::deque<TxStampWait> &aWaits, ClientSocket *aClient)
+{
+  for (size_t inx = 0; inx < aWaits.size(); inx++) {
+    if (aWaits[inx].mClient == aClient) {
+      aWaits[inx].mClient = nullptr;
+    }
+  }
+}
 
-  PRFileDesc *fd = PR_OpenUDPSocket(addr.raw.family);
-  if (!fd) {
-    LogError("UDP");
-    return;
+// Tell a new client that there is no room for its test.
+static int
+SendBusy(PRFileDesc *aFd, const PRNetAddr *aAddr, const char *aPkt)
+{
+  char buf[BUSY_RETRY_START + BUSY_RETRY_LEN];
+  memcpy(buf + PKT_ID_START, aPkt + PKT_ID_START, PKT_ID_LEN);
+  memcpy(buf + TIMESTAMP_START, aPkt + TIMESTAMP_START, TIMESTAMP_LEN);
+  memcpy(buf + BUSY_START, BUSY, BUSY_LEN);
+  uint32_t retry = htonl(BUSY_RETRY_MS);
+  memcpy(buf + BUSY_RETRY_START, &retry, BUSY_RETRY_LEN);
+  int count = PR_SendTo(aFd, buf, sizeof(buf), 0, aAddr,
+                        PR_INTERVAL_NO_WAIT);
+  if (count < 0) {
+    PRErrorCode code = PR_GetError();
+    if (code == PR_WOULD_BLOCK_ERROR) {
+      // The client retransmits its first packet.
+      return 0;
+    }
+    return LogErrorWithCode(code, "UDP");
   }
-  LOG(("NetworkTest UDP server side: Socket opened."));
+  METRICS_ADD(mPktsSent, 1);
+  METRICS_ADD(mBytesSent, count);
+  return 0;
+}
 
-  PRSocketOptionData opt;
-  opt.option = PR_SockOpt_Nonblocking;
-  opt.value.non_blocking = true;
-  status = PR_SetSocketOption(fd, &opt);
-  if (status != PR_SUCCESS) {
-    LogError("UDP");
-    return;
+// Send a new client to the cluster peer at aIp (see REDIRECT in config.h).
+static int
+SendRedirect(PRFileDesc *aFd, const PRNetAddr *aAddr, const char *aPkt,
+             uint32_t aIp)
+{
+  char buf[REDIRECT_ADDR_START + REDIRECT_ADDR_LEN];
+  memcpy(buf + PKT_ID_START, aPkt + PKT_ID_START, PKT_ID_LEN);
+  memcpy(buf + TIMESTAMP_START, aPkt + TIMESTAMP_START, TIMESTAMP_LEN);
+  memcpy(buf + REDIRECT_START, REDIRECT, REDIRECT_LEN);
+  memcpy(buf + REDIRECT_ADDR_START, &aIp, REDIRECT_ADDR_LEN);
+  int count = PR_SendTo(aFd, buf, sizeof(buf), 0, aAddr,
+                        PR_INTERVAL_NO_WAIT);
+  if (count < 0) {
+    PRErrorCode code = PR_GetError();
+    if (code == PR_WOULD_BLOCK_ERROR) {
+      // The client retransmits its first packet.
+      return 0;
+    }
+    return LogErrorWithCode(code, "UDP");
   }
+  METRICS_ADD(mPktsSent, 1);
+  METRICS_ADD(mBytesSent, count);
+  return 0;
+}
 
-  opt.option = PR_SockOpt_Reuseaddr;
-  opt.value.reuse_addr = true;
-  status = PR_SetSocketOption(fd, &opt);
-  if (status != PR_SUCCESS) {
-    LogError("UDP");
-    return;
+// The packet loop of a UDP socket (or of an AF_XDP socket, see XdpSocket.h).
+// Closes aFd.
+static void
+RunUDPWorker(PRFileDesc *fd, const char *aWorkerName,
+             const char *aCaptureFile, uint16_t aPort, uint32_t aMaxClients,
+             uint32_t aMaxPayloadSize)
+{
+  MetricsRegisterWorker(aWorkerName);
+  CpuCostThreadInit();
+
+  CaptureRing *capture = nullptr;
+  if (aCaptureFile) {
+    capture = new CaptureRing();
+    if (capture->Init(aCaptureFile, aPort, CAPTURE_SLOTS, true)) {
+      delete capture;
+      capture = nullptr;
+    }
   }
-  LOG(("NetworkTest UDP server side: Socket options set."));
 
-  status = PR_Bind(fd, &addr);
-  if (status != PR_SUCCESS) {
-    LogError("UDP");
+  ClientPool pool;
+  pool.SetMaxPayloadSize(aMaxPayloadSize);
+  if (pool.Init(aMaxClients)) {
+    LOG(("NetworkTest UDP server side: Bad number of clients %u",
+         aMaxClients));
+    delete capture;
+    CpuCostThreadShutdown();
+    MetricsUnregisterWorker();
+    PR_Close(fd);
     return;
   }
+  LOG(("NetworkTest UDP server side: %u client slots of %lu bytes, %lu "
+       "bytes in total", pool.Slots(), (unsigned long)ClientPool::SlotBytes(),
+       (unsigned long)pool.PoolBytes()));
+  METRICS_ADD(mClientPoolSlots, pool.Slots());
+  METRICS_ADD(mClientPoolBytes, pool.PoolBytes());
 
   std::vector<ClientSocket*> clients;
+  clients.reserve(pool.Slots());
+
+  // Kernel receive and send times for Test 10. Send timestamps are numbered
+  // by the kernel in the order of the stamped sends.
+  bool stamped = !EnablePacketTimestamps(fd);
+  // ECN codepoints of Test 6 data, delivered with the timestamps.
+  if (stamped) {
+    EnableRecvTos(fd);
+  }
+  std::deque<TxStampWait> txWaits;
+  uint32_t nextTxKey = 0;
 
   PRPollDesc pollElem;
   pollElem.fd = fd;
   pollElem.in_flags = PR_POLL_READ | PR_POLL_EXCEPT;
-  char buf[PAYLOADSIZE];
+  // Large enough for any packet size a client can request.
+  char buf[PAYLOADSIZE_MAX];
+
+  // First client of the next transmit round.
+  size_t nextClient = 0;
+  // What this worker set its gauges to last (Metrics.h).
+  uint64_t lastAcksQueued = 0;
+  uint64_t lastActiveClients = 0;
 
   int rv = 0;
   while (!rv) {
-    // See if we need to send something.
-    std::vector<ClientSocket*>::iterator it = clients.begin();
-    while(!rv && it != clients.end()) {
-      rv = (*it)->SendAcks(fd);
-      if (rv < 0) {
-        continue;
-      }
+    // ACKs first: they carry the timing of the other side's measurement.
+    uint64_t acksQueued = 0;
+    for (size_t inx = 0; !rv && inx < clients.size(); inx++) {
+      CpuCostCharge(clients[inx]->Cost());
+      rv = clients[inx]->SendAcks(fd);
+      acksQueued += clients[inx]->AcksQueued();
+    }
+    CpuCostCharge(nullptr);
+    METRICS_SET(mAckQueueDepth, acksQueued, lastAcksQueued);
+    if (rv) {
+      continue;
+    }
+
+    // Then data, round robin with a budget per client, starting with a
+    // different client every round.
+    size_t numClients = clients.size();
+    for (size_t visited = 0; !rv && visited < numClients; visited++) {
+      ClientSocket *&client = clients[(nextClient + visited) % numClients];
+      CpuCostCharge(client->Cost());
+      ClockTime now = ClockNow();
+      client->StartTxSlice(UDP_TX_QUANTUM, now + UDP_TX_SLICE_NS);
       bool finish = false;
-      rv = (*it)->MaybeSendSomethingOrCheckFinish(fd, finish);
-      if (rv < 0) {
-        continue;
+      rv = client->MaybeSendSomethingOrCheckFinish(fd, finish);
+      if (client->EndTxSlice(ClockNow())) {
+        METRICS_ADD(mTxSlicesExhausted, 1);
       }
+      CpuCostCharge(nullptr);
       if (finish) {
-        delete (*it);
-        it = clients.erase(it);
-      } else {
-        it++;
+        ForgetTxStamps(txWaits, client);
+        pool.Put(client);
+        client = nullptr;
       }
     }
+    clients.erase(std::remove(clients.begin(), clients.end(),
+                              (ClientSocket*)nullptr),
+                  clients.end());
+    nextClient = clients.empty() ? 0 : (nextClient + 1) % clients.size();
+    METRICS_SET(mActiveClients, clients.size(), lastActiveClients);
     if (rv) {
       continue;
     }
-    // See if we got something.
-    pollElem.out_flags = 0;
-    PR_Poll(&pollElem, 1, PR_INTERVAL_NO_WAIT);
-    if (pollElem.out_flags & (PR_POLL_ERR | PR_POLL_HUP | PR_POLL_NVAL))
-    {
-      LOG(("NetworkTest UDP client: Closing."));
-      rv = -1;
-      return;
+
+    if (!txWaits.empty()) {
+      DrainTxStamps(fd, txWaits);
     }
 
-    if (pollElem.out_flags & PR_POLL_READ) {
+    // See if we got something.
+    for (int received = 0; !rv && received < UDP_RECV_BATCH; received++) {
+      CpuCostCharge(nullptr);
+      pollElem.out_flags = 0;
+      PR_Poll(&pollElem, 1, PR_INTERVAL_NO_WAIT);
+      // Send timestamps on the error queue also make the socket poll ERR.
+      if ((pollElem.out_flags & PR_POLL_ERR) && stamped &&
+          DrainTxStamps(fd, txWaits)) {
+        pollElem.out_flags &= ~PR_POLL_ERR;
+      }
+      if (pollElem.out_flags & PR_POLL_ERR) {
+        // An ICMP error for a datagram to one client; the socket is not
+        // connected and still serves the others. With timestamps the error
+        // queue was drained above.
+        int err = TakeSocketError(fd);
+        if (err > 0 || stamped) {
+          LOG(("NetworkTest UDP server side: Socket error %d on port %u.",
+               err, aPort));
+          pollElem.out_flags &= ~PR_POLL_ERR;
+        }
+      }
+      if (pollElem.out_flags & (PR_POLL_ERR | PR_POLL_HUP | PR_POLL_NVAL))
+      {
+        LOG(("NetworkTest UDP client: Closing."));
+        // Ends the loop; the clients and the socket are released below.
+        rv = -1;
+        break;
+      }
+      if (!(pollElem.out_flags & PR_POLL_READ)) {
+        break;
+      }
+
       PRNetAddr prAddr;
       int32_t count;
-      count = PR_RecvFrom(fd, buf, PAYLOADSIZE, 0, &prAddr,
-                          PR_INTERVAL_NO_WAIT);
+      uint64_t kernelRx = 0;
+      int tos = -1;
+      if (stamped) {
+        count = RecvFromStamped(fd, buf, sizeof(buf), &prAddr, &kernelRx,
+                                &tos);
+      } else {
+        count = PR_RecvFrom(fd, buf, sizeof(buf), 0, &prAddr,
+                            PR_INTERVAL_NO_WAIT);
+      }
       if (count < 0) {
         PRErrorCode code = PR_GetError();
         if (code == PR_WOULD_BLOCK_ERROR) {
-          continue;
+          break;
         }
         rv = LogErrorWithCode(code, "UDP");
         continue;
       }
+      METRICS_ADD(mPktsReceived, 1);
+      METRICS_ADD(mBytesReceived, count);
+      TRACE3(udp_recv, aPort, count, kernelRx);
+      if (capture) {
+        capture->Record(&prAddr, buf, count);
+      }
 
       std::vector<ClientSocket*>::iterator it = clients.begin();
       while (it != clients.end() && !(*it)->IsThisSocket(&prAddr)) {
         it++;
       }
       if (it == clients.end()) {
-        clients.push_back(new ClientSocket(&prAddr));
+        // Only the first packet of a test may take a slot; anything else
+        // (late packets of a finished test, strays) is dropped.
+        if (count < TYPE_START + TYPE_LEN ||
+            memcmp(buf + TYPE_START, TEST_prefix, strlen(TEST_prefix))) {
+          METRICS_ADD(mStrayPkts, 1);
+          continue;
+        }
+        // A loaded server in a cluster sends new tests elsewhere, but only
+        // once.
+        uint32_t redirectIp;
+        if ((!FirstPktVersioned(count, buf) || !buf[REDIRECTED_START]) &&
+            ClusterRedirect(&redirectIp)) {
+          METRICS_ADD(mRedirects, 1);
+          rv = SendRedirect(fd, &prAddr, buf, redirectIp);
+          continue;
+        }
+        ClientSocket *client = pool.Get(&prAddr);
+        if (!client) {
+          METRICS_ADD(mClientsRefused, 1);
+          rv = SendBusy(fd, &prAddr, buf);
+          continue;
+        }
+        METRICS_ADD(mClientsCreated, 1);
+        clients.push_back(client);
         it = clients.end() - 1;
       }
-      (*it)->NewPkt(count, buf);
+      ClientSocket *client = *it;
+      CpuCostCharge(client->Cost());
+      // Test 10 probes take the short way; a new test goes to NewPkt().
+      if (!client->IsProbing() ||
+          memcmp(buf + TYPE_START, TEST_prefix, strlen(TEST_prefix)) == 0) {
+        client->NewPkt(count, buf, tos);
+      }
+      if (client->IsProbing()) {
+        bool txStamped;
+        rv = client->EchoProbe(fd, count, buf, kernelRx, stamped, txStamped);
+        if (txStamped) {
+          TxStampWait wait = { nextTxKey++, client };
+          txWaits.push_back(wait);
+        }
+      }
     }
   }
 
+  CpuCostCharge(nullptr);
+  for (size_t inx = 0; inx < clients.size(); inx++) {
+    pool.Put(clients[inx]);
+  }
+  METRICS_SET(mAckQueueDepth, 0, lastAcksQueued);
+  METRICS_SET(mActiveClients, 0, lastActiveClients);
+  METRICS_ADD(mClientPoolSlots, -(int64_t)pool.Slots());
+  METRICS_ADD(mClientPoolBytes, -(int64_t)pool.PoolBytes());
+  delete capture;
+  CpuCostThreadShutdown();
+  MetricsUnregisterWorker();
   PR_Close(fd);
 }
 
+static void PR_CALLBACK
+UDPSocketThread(void *_args)
+{
+  LOG(("NetworkTest UDP server side: A thread created."));
+  UDPSocketThreadArgs *args = (UDPSocketThreadArgs*)_args;
+  PRNetAddr addr = args->mAddr;
+  uint16_t port = args->mPort;
+  int inx = args->mInx;
+  const char *captureFile = args->mCaptureFile;
+  uint32_t maxClients = args->mMaxClients;
+  delete args;
+
+  // Before anything is allocated, so the client pool and the capture ring
+  // are on the NUMA node of the thread's core.
+  char workerName[METRICS_WORKER_NAME_LEN];
+  snprintf(workerName, sizeof(workerName), "udp_%d", port);
+  PlacementApply(PLACEMENT_UDP, inx, workerName);
+
+  LOG(("NetworkTest UDP server side: Init socket: port %d", port));
+  addr.inet.port = PR_htons(port);
+
+  char host[164] = {0};
+  PR_NetAddrToString(&addr, host, sizeof(host));
+  LOG(("NetworkTest UDP server side: host %s", host));
+
+  PRFileDesc *fd = PR_OpenUDPSocket(addr.raw.family);
+  if (!fd) {
+    LogError("UDP");
+    return;
+  }
+  LOG(("NetworkTest UDP server side: Socket opened."));
+
+  PRSocketOptionData opt;
+  opt.option = PR_SockOpt_Nonblocking;
+  opt.value.non_blocking = true;
+  PRStatus status = PR_SetSocketOption(fd, &opt);
+  if (status != PR_SUCCESS) {
+    LogError("UDP");
+    return;
+  }
+
+  opt.option = PR_SockOpt_Reuseaddr;
+  opt.value.reuse_addr = true;
+  status = PR_SetSocketOption(fd, &opt);
+  if (status != PR_SUCCESS) {
+    LogError("UDP");
+    return;
+  }
+  opt.option = PR_SockOpt_RecvBufferSize;
+  opt.value.recv_buffer_size = SERVERRCVBUFFERSIZE;
+  status = PR_SetSocketOption(fd, &opt);
+  if (status != PR_SUCCESS) {
+    LogError("UDP");
+  }
+  LOG(("NetworkTest UDP server side: Socket options set."));
+
+  status = PR_Bind(fd, &addr);
+  if (status != PR_SUCCESS) {
+    LogError("UDP");
+    return;
+  }
+
+  char captureName[1024];
+  snprintf(captureName, sizeof(captureName), "%s.%d",
+           captureFile ? captureFile : "", port);
+  RunUDPWorker(fd, workerName, captureFile ? captureName : nullptr, port,
+               maxClients, PAYLOADSIZE_MAX);
+}
+
+static void PR_CALLBACK
+XdpThread(void *_args)
+{
+  XdpThreadArgs *args = (XdpThreadArgs*)_args;
+  char workerName[METRICS_WORKER_NAME_LEN];
+  snprintf(workerName, sizeof(workerName), "xdp_%s", args->mIfName);
+  PlacementApply(PLACEMENT_UDP, args->mInx, workerName);
+
+  PRFileDesc *fd = XdpOpen(args->mIfName, args->mQueue, args->mMode,
+                           args->mPorts, args->mNumberOfPorts);
+  if (!fd) {
+    fprintf(stderr, "AF_XDP on %s queue %u failed, the UDP sockets get all "
+                    "packets\n", args->mIfName, args->mQueue);
+    delete args;
+    return;
+  }
+  char captureName[1024];
+  snprintf(captureName, sizeof(captureName), "%s.xdp",
+           args->mCaptureFile ? args->mCaptureFile : "");
+  const char *captureFile = args->mCaptureFile ? captureName : nullptr;
+  uint32_t maxClients = args->mMaxClients;
+  delete args;
+  RunUDPWorker(fd, workerName, captureFile, 0, maxClients,
+               XdpMaxPayloadSize(fd));
+}
+
 UDPserver::UDPserver()
   : mThreads(NULL)
+  , mNumberOfThreads(0)
   , mNumberOfPorts(0)
+  , mCaptureFile(nullptr)
+  , mMaxClients(CLIENT_POOL_DEFAULT_SLOTS)
+  , mXdpIfName(nullptr)
+  , mXdpQueue(0)
+  , mXdpMode(XDP_MODE_AUTO)
 {
+  PR_SetNetAddr(PR_IpAddrAny, PR_AF_INET, 0, &mBindAddr);
 }
 
 UDPserver::~UDPserver()
 {
-  for (int inx = 0; inx < mNumberOfPorts; inx++) {
+  for (int inx = 0; inx < mNumberOfThreads; inx++) {
     if (mThreads[inx]) {
       PR_JoinThread(mThreads[inx]);
     }
@@ -160,8 +500,10 @@ UDPserver::Start(uint16_t *aPort, int aNumberOfPorts)
   if (!(aNumberOfPorts > 0)) {
     return -1;
   }
-  mThreads = new PRThread*[aNumberOfPorts];
-  for (int inx = 0; inx < aNumberOfPorts; inx++) {
+  // One thread per port and one for the AF_XDP socket.
+  mNumberOfThreads = aNumberOfPorts + (mXdpIfName ? 1 : 0);
+  mThreads = new PRThread*[mNumberOfThreads];
+  for (int inx = 0; inx < mNumberOfThreads; inx++) {
     mThreads[inx] = NULL;
   }
   mNumberOfPorts = aNumberOfPorts;
@@ -171,15 +513,40 @@ UDPserver::Start(uint16_t *aPort, int aNumberOfPorts)
       LOG(("NetworkTest server side: Error creating a thread"));
     }
   }
+  if (mXdpIfName) {
+    XdpThreadArgs *args = new XdpThreadArgs;
+    args->mInx = aNumberOfPorts;
+    args->mIfName = mXdpIfName;
+    args->mQueue = mXdpQueue;
+    args->mMode = mXdpMode;
+    args->mPorts = aPort;
+    args->mNumberOfPorts = aNumberOfPorts;
+    args->mCaptureFile = mCaptureFile;
+    args->mMaxClients = mMaxClients;
+    mThreads[aNumberOfPorts] = PR_CreateThread(PR_USER_THREAD, XdpThread,
+                                               (void *)args,
+                                               PR_PRIORITY_NORMAL,
+                                               PR_LOCAL_THREAD,
+                                               PR_JOINABLE_THREAD, 0);
+    if (!mThreads[aNumberOfPorts]) {
+      LOG(("NetworkTest server side: Error creating the XDP thread"));
+      delete args;
+    }
+  }
   return 0;
 }
 
 int
 UDPserver::Init(uint16_t aPort, int aInx)
 {
-  uint16_t *port = new uint16_t(aPort);
+  UDPSocketThreadArgs *args = new UDPSocketThreadArgs;
+  args->mAddr = mBindAddr;
+  args->mPort = aPort;
+  args->mInx = aInx;
+  args->mCaptureFile = mCaptureFile;
+  args->mMaxClients = mMaxClients;
   mThreads[aInx] = PR_CreateThread(PR_USER_THREAD, UDPSocketThread,
-                                   (void *)port, PR_PRIORITY_NORMAL,
+                                   (void *)args, PR_PRIORITY_NORMAL,
                                    PR_LOCAL_THREAD,PR_JOINABLE_THREAD, 0);
   if (!mThreads[aInx]) {
     LOG(("NetworkTest server side: Error creating a thread"));
@@ -17,12 +17,33 @@ public:
   UDPserver();
   ~UDPserver();
   int Start(uint16_t *aPort, int aNumberOfPorts);
+  // Record received packets into [aFileName].[port] (see Capture.h).
+  void SetCaptureFile(const char *aFileName) { mCaptureFile = aFileName; }
+  // Bind the test ports to this address instead of any (IPv4).
+  void SetBindAddress(const PRNetAddr *aAddr) { mBindAddr = *aAddr; }
+  // Concurrent clients per port; more are refused (see BUSY in config.h).
+  void SetMaxClients(uint32_t aMaxClients) { mMaxClients = aMaxClients; }
+  // Also serve the UDP test ports on queue aQueue of aIfName with an AF_XDP
+  // socket (see XdpSocket.h). aMode is one of XDP_MODE_*.
+  void SetXdp(const char *aIfName, uint32_t aQueue, int aMode)
+  {
+    mXdpIfName = aIfName;
+    mXdpQueue = aQueue;
+    mXdpMode = aMode;
+  }
 
 private:
   int Init(uint16_t aPort, int aInx);
 
   PRThread **mThreads;
+  PRNetAddr mBindAddr;
+  int mNumberOfThreads;
   int mNumberOfPorts;
+  const char *mCaptureFile;
+  uint32_t mMaxClients;
+  const char *mXdpIfName;
+  uint32_t mXdpQueue;
+  int mXdpMode;
 };
 
 #endif
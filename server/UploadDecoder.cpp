@@ -0,0 +1,235 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "UploadDecoder.h"
+#include "Metrics.h"
+#include "config.h"
+#include "prlog.h"
+#include <cstring>
+#include <stdio.h>
+
+extern PRLogModuleInfo* gServerTestLog;
+#define LOG(args) PR_LOG(gServerTestLog, PR_LOG_DEBUG, args)
+
+#define UPLOAD_DECODE_BUF_SIZE 16384
+// zlib window bits: 15 and autodetect a zlib or gzip header.
+#define UPLOAD_INFLATE_WINDOW (15 + 32)
+
+UploadDecoder::UploadDecoder()
+  : mEncoding(UPLOAD_ENCODING_IDENTITY)
+  , mEncodedLen(0)
+  , mDecodedLen(0)
+  , mEncodedBytes(0)
+  , mDecodedBytes(0)
+  , mStreamEnd(false)
+  , mError(false)
+  , mDone(true)
+  , mStreamInit(false)
+#ifdef HAVE_ZSTD
+  , mZstdStream(nullptr)
+#endif
+{
+  memset(&mZStream, 0, sizeof(mZStream));
+}
+
+UploadDecoder::~UploadDecoder()
+{
+  Done();
+}
+
+int
+UploadDecoder::Init(char *aFileName, uint8_t aEncoding, uint64_t aEncodedLen,
+                    uint64_t aDecodedLen)
+{
+  if (aDecodedLen > UPLOAD_MAX_DECODED_LEN) {
+    LOG(("NetworkTest upload: declared length %llu is too large.",
+         (unsigned long long)aDecodedLen));
+    return -1;
+  }
+  switch (aEncoding) {
+    case UPLOAD_ENCODING_IDENTITY:
+      if (aDecodedLen && aDecodedLen != aEncodedLen) {
+        LOG(("NetworkTest upload: identity encoding with a different decoded "
+             "length."));
+        return -1;
+      }
+      aDecodedLen = aEncodedLen;
+      break;
+    case UPLOAD_ENCODING_DEFLATE:
+      memset(&mZStream, 0, sizeof(mZStream));
+      if (inflateInit2(&mZStream, UPLOAD_INFLATE_WINDOW) != Z_OK) {
+        return -1;
+      }
+      mStreamInit = true;
+      break;
+    case UPLOAD_ENCODING_ZSTD:
+#ifdef HAVE_ZSTD
+      mZstdStream = ZSTD_createDStream();
+      if (!mZstdStream) {
+        return -1;
+      }
+      if (ZSTD_isError(ZSTD_initDStream(mZstdStream))) {
+        ZSTD_freeDStream(mZstdStream);
+        mZstdStream = nullptr;
+        return -1;
+      }
+      mStreamInit = true;
+      break;
+#else
+      // Storing it still encoded would leave a log nothing here can read.
+      LOG(("NetworkTest upload: zstd upload, the server is built without "
+           "zstd (HAVE_ZSTD)."));
+      return -1;
+#endif
+    default:
+      LOG(("NetworkTest upload: unknown encoding %u.", aEncoding));
+      return -1;
+  }
+
+  mEncoding = aEncoding;
+  mEncodedLen = aEncodedLen;
+  mDecodedLen = aDecodedLen;
+  mEncodedBytes = 0;
+  mDecodedBytes = 0;
+  mStreamEnd = false;
+  mError = false;
+  mDone = false;
+  LOG(("NetworkTest upload: %.56s encoding %u, %llu bytes, decoded %llu.",
+       aFileName, aEncoding, (unsigned long long)aEncodedLen,
+       (unsigned long long)aDecodedLen));
+  return mFile.Init(aFileName);
+}
+
+void
+UploadDecoder::Error(const char *aReason)
+{
+  if (mError) {
+    return;
+  }
+  mError = true;
+  LOG(("NetworkTest upload: %s after %llu of %llu bytes.", aReason,
+       (unsigned long long)mEncodedBytes, (unsigned long long)mEncodedLen));
+  char line[128];
+  int len = snprintf(line, sizeof(line), "UPLOAD ERROR %s\n", aReason);
+  mFile.WriteBlocking(line, len);
+}
+
+int
+UploadDecoder::Decoded(const char *aBuf, uint32_t aLen)
+{
+  mDecodedBytes += aLen;
+  uint64_t limit = mDecodedLen ? mDecodedLen : UPLOAD_MAX_DECODED_LEN;
+  if (mDecodedBytes > limit) {
+    Error("decoded data longer than declared");
+    return -1;
+  }
+  mFile.WriteBlocking(const_cast<char*>(aBuf), aLen);
+  return 0;
+}
+
+int
+UploadDecoder::Write(const char *aBuf, uint32_t aLen)
+{
+  if (mError || mDone) {
+    return -1;
+  }
+  if (aLen > Remaining()) {
+    aLen = Remaining();
+  }
+  mEncodedBytes += aLen;
+
+  if (mEncoding == UPLOAD_ENCODING_IDENTITY) {
+    return Decoded(aBuf, aLen);
+  }
+
+  char out[UPLOAD_DECODE_BUF_SIZE];
+  if (mEncoding == UPLOAD_ENCODING_DEFLATE) {
+    if (mStreamEnd && aLen) {
+      Error("data after the end of the stream");
+      return -1;
+    }
+    mZStream.next_in = (Bytef*)aBuf;
+    mZStream.avail_in = aLen;
+    do {
+      mZStream.next_out = (Bytef*)out;
+      mZStream.avail_out = sizeof(out);
+      int rv = inflate(&mZStream, Z_NO_FLUSH);
+      if (rv == Z_STREAM_END) {
+        mStreamEnd = true;
+      } else if (rv != Z_OK && rv != Z_BUF_ERROR) {
+        Error(mZStream.msg ? mZStream.msg : "corrupt deflate stream");
+        return -1;
+      }
+      if (Decoded(out, sizeof(out) - mZStream.avail_out)) {
+        return -1;
+      }
+    } while (!mStreamEnd &&
+             (mZStream.avail_in || !mZStream.avail_out));
+    if (mStreamEnd && mZStream.avail_in) {
+      Error("data after the end of the stream");
+      return -1;
+    }
+    return 0;
+  }
+
+#ifdef HAVE_ZSTD
+  ZSTD_inBuffer in = { aBuf, aLen, 0 };
+  ZSTD_outBuffer output = { out, sizeof(out), 0 };
+  do {
+    output.pos = 0;
+    size_t rv = ZSTD_decompressStream(mZstdStream, &output, &in);
+    if (ZSTD_isError(rv)) {
+      Error(ZSTD_getErrorName(rv));
+      return -1;
+    }
+    // 0 at the end of a frame; more frames may follow.
+    mStreamEnd = (rv == 0);
+    if (Decoded(out, output.pos)) {
+      return -1;
+    }
+  } while (in.pos < in.size || output.pos == output.size);
+#endif
+  return 0;
+}
+
+int
+UploadDecoder::Done()
+{
+  if (mDone) {
+    return mError ? -1 : 0;
+  }
+  if (mEncodedBytes < mEncodedLen) {
+    Error("upload shorter than the data length");
+  } else if (mEncoding != UPLOAD_ENCODING_IDENTITY && !mStreamEnd) {
+    Error("stream does not end at the data length");
+  } else if (mDecodedLen && mDecodedBytes != mDecodedLen) {
+    Error("decoded data shorter than declared");
+  }
+  mDone = true;
+
+  if (mStreamInit) {
+    if (mEncoding == UPLOAD_ENCODING_DEFLATE) {
+      inflateEnd(&mZStream);
+    }
+#ifdef HAVE_ZSTD
+    if (mEncoding == UPLOAD_ENCODING_ZSTD) {
+      ZSTD_freeDStream(mZstdStream);
+      mZstdStream = nullptr;
+    }
+#endif
+    mStreamInit = false;
+  }
+
+  METRICS_ADD(mUploadEncodedBytes, mEncodedBytes);
+  METRICS_ADD(mUploadDecodedBytes, mDecodedBytes);
+  LOG(("NetworkTest upload: done, %llu bytes received, %llu decoded, %lld "
+       "saved%s.", (unsigned long long)mEncodedBytes,
+       (unsigned long long)mDecodedBytes,
+       (long long)(mDecodedBytes - mEncodedBytes),
+       mError ? ", not valid" : ""));
+  mFile.Done();
+  return mError ? -1 : 0;
+}
@@ -0,0 +1,64 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NETWORK_TESTS_UPLOAD_DECODER_H__
+#define NETWORK_TESTS_UPLOAD_DECODER_H__
+
+#include "FileWriter.h"
+#include <stdint.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/**
+ * Writes an uploaded log (SndRes or SndCmp, see config.h) to its FileWriter,
+ * decoding it on the way. The upload is checked against the lengths from the
+ * first packet: the encoded stream has to end with the last byte of the data
+ * length and decode to the declared length. If it does not, the log ends with
+ * an "UPLOAD ERROR" line.
+ *
+ * Done() adds the encoded and decoded sizes to the upload metrics.
+ */
+class UploadDecoder
+{
+public:
+  UploadDecoder();
+  ~UploadDecoder();
+  // -1 if the encoding is not known or the declared lengths are not valid.
+  int Init(char *aFileName, uint8_t aEncoding, uint64_t aEncodedLen,
+           uint64_t aDecodedLen);
+  // Encoded bytes, at most the data length in total. -1 if the stream is not
+  // valid; the rest of the upload is then ignored.
+  int Write(const char *aBuf, uint32_t aLen);
+  // The encoded data left to receive.
+  uint64_t Remaining() { return mEncodedLen - mEncodedBytes; }
+  bool Finished() { return mDone; }
+  // The whole data length has been received or the connection closed.
+  // -1 if the upload is not complete and valid.
+  int Done();
+
+private:
+  int Decoded(const char *aBuf, uint32_t aLen);
+  void Error(const char *aReason);
+
+  FileWriter mFile;
+  uint8_t mEncoding;
+  uint64_t mEncodedLen;
+  uint64_t mDecodedLen;
+  uint64_t mEncodedBytes;
+  uint64_t mDecodedBytes;
+  bool mStreamEnd;
+  bool mError;
+  bool mDone;
+  bool mStreamInit;
+  z_stream mZStream;
+#ifdef HAVE_ZSTD
+  ZSTD_DStream *mZstdStream;
+#endif
+};
+
+#endif
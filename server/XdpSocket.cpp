@@ -0,0 +1,742 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "XdpSocket.h"
+#include "config.h"
+#include "prerror.h"
+#include "prlog.h"
+#include "private/pprio.h"
+#include <cstring>
+#include <errno.h>
+
+extern PRLogModuleInfo* gServerTestLog;
+#define LOG(args) PR_LOG(gServerTestLog, PR_LOG_DEBUG, args)
+
+#ifdef __linux__
+
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define XDP_HEADERS_SIZE (ETH_HLEN + sizeof(struct iphdr) + \
+                          sizeof(struct udphdr))
+#define XDP_IP_DF 0x4000
+#define XDP_XSKMAP_ENTRIES 64
+#define XDP_VERIFIER_LOG_SIZE 65536
+// Bound of the MAC and IP address table of the peers.
+#define XDP_MAX_PEERS 65536
+
+struct XdpRing
+{
+  uint32_t *mProducer;
+  uint32_t *mConsumer;
+  uint32_t *mFlags;
+  void *mDescs;
+  void *mMap;
+  size_t mMapLen;
+  // Our copy of the index we move.
+  uint32_t mIndex;
+};
+
+// Addresses to answer a peer with, from the last packet it sent.
+struct XdpPeer
+{
+  uint8_t mPeerMac[ETH_ALEN];
+  uint8_t mLocalMac[ETH_ALEN];
+  uint32_t mLocalIp;
+  uint16_t mLocalPort;
+};
+
+struct XdpSocket
+{
+  int mPortsMapFd;
+  int mXsksMapFd;
+  int mProgFd;
+  int mLinkFd;
+  char *mUmem;
+  XdpRing mFill;
+  XdpRing mComp;
+  XdpRing mRx;
+  XdpRing mTx;
+  std::vector<uint64_t> mFreeFrames;
+  bool mTxPending;
+  uint16_t mIpId;
+  // TOS byte of the IPv4 header of sent packets (PR_SockOpt_IpTypeOfService).
+  uint8_t mTos;
+  uint32_t mMaxPayloadSize;
+  std::unordered_map<uint64_t, XdpPeer> mPeers;
+};
+
+static PRDescIdentity sXdpIdentity = PR_INVALID_IO_LAYER;
+static PRIOMethods sXdpMethods;
+
+static int
+Bpf(int aCmd, union bpf_attr *aAttr)
+{
+  return syscall(__NR_bpf, aCmd, aAttr, sizeof(*aAttr));
+}
+
+static struct bpf_insn
+Insn(uint8_t aCode, uint8_t aDst, uint8_t aSrc, int16_t aOff, int32_t aImm)
+{
+  struct bpf_insn insn;
+  memset(&insn, 0, sizeof(insn));
+  insn.code = aCode;
+  insn.dst_reg = aDst;
+  insn.src_reg = aSrc;
+  insn.off = aOff;
+  insn.imm = aImm;
+  return insn;
+}
+
+// A small assembler for the redirect program.
+class BpfProgram
+{
+public:
+  void Ldx(uint8_t aSize, uint8_t aDst, uint8_t aSrc, int16_t aOff)
+  {
+    mInsns.push_back(Insn(BPF_LDX | BPF_MEM | aSize, aDst, aSrc, aOff, 0));
+  }
+  void Stx(uint8_t aSize, uint8_t aDst, uint8_t aSrc, int16_t aOff)
+  {
+    mInsns.push_back(Insn(BPF_STX | BPF_MEM | aSize, aDst, aSrc, aOff, 0));
+  }
+  void MovReg(uint8_t aDst, uint8_t aSrc)
+  {
+    mInsns.push_back(Insn(BPF_ALU64 | BPF_MOV | BPF_X, aDst, aSrc, 0, 0));
+  }
+  void AluImm(uint8_t aOp, uint8_t aDst, int32_t aImm)
+  {
+    mInsns.push_back(Insn(BPF_ALU64 | aOp | BPF_K, aDst, 0, 0, aImm));
+  }
+  void LdMapFd(uint8_t aDst, int aFd)
+  {
+    mInsns.push_back(Insn(BPF_LD | BPF_DW | BPF_IMM, aDst, BPF_PSEUDO_MAP_FD,
+                          0, aFd));
+    mInsns.push_back(Insn(0, 0, 0, 0, 0));
+  }
+  void Call(int32_t aHelper)
+  {
+    mInsns.push_back(Insn(BPF_JMP | BPF_CALL, 0, 0, 0, aHelper));
+  }
+  void Exit()
+  {
+    mInsns.push_back(Insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+  }
+  // Jumps to the PASS label.
+  void JmpRegToPass(uint8_t aOp, uint8_t aDst, uint8_t aSrc)
+  {
+    mToPass.push_back(mInsns.size());
+    mInsns.push_back(Insn(BPF_JMP | aOp | BPF_X, aDst, aSrc, 0, 0));
+  }
+  void JmpImmToPass(uint8_t aOp, uint8_t aDst, int32_t aImm)
+  {
+    mToPass.push_back(mInsns.size());
+    mInsns.push_back(Insn(BPF_JMP | aOp | BPF_K, aDst, 0, 0, aImm));
+  }
+  void Pass()
+  {
+    for (size_t inx = 0; inx < mToPass.size(); inx++) {
+      mInsns[mToPass[inx]].off = mInsns.size() - mToPass[inx] - 1;
+    }
+    AluImm(BPF_MOV, BPF_REG_0, XDP_PASS);
+    Exit();
+  }
+
+  std::vector<struct bpf_insn> mInsns;
+  std::vector<size_t> mToPass;
+};
+
+static int
+LoadProgram(XdpSocket *aXsk)
+{
+  // r6: ctx, r2: data, r3: data_end.
+  BpfProgram prog;
+  prog.MovReg(BPF_REG_6, BPF_REG_1);
+  prog.Ldx(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data));
+  prog.Ldx(BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data_end));
+  prog.MovReg(BPF_REG_4, BPF_REG_2);
+  prog.AluImm(BPF_ADD, BPF_REG_4, XDP_HEADERS_SIZE);
+  prog.JmpRegToPass(BPF_JGT, BPF_REG_4, BPF_REG_3);
+  // IPv4 without options, UDP, not a fragment. Loads keep network order,
+  // so the constants are converted with htons.
+  prog.Ldx(BPF_H, BPF_REG_5, BPF_REG_2, offsetof(struct ethhdr, h_proto));
+  prog.JmpImmToPass(BPF_JNE, BPF_REG_5, htons(ETH_P_IP));
+  prog.Ldx(BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN);
+  prog.JmpImmToPass(BPF_JNE, BPF_REG_5, 0x45);
+  prog.Ldx(BPF_B, BPF_REG_5, BPF_REG_2,
+           ETH_HLEN + offsetof(struct iphdr, protocol));
+  prog.JmpImmToPass(BPF_JNE, BPF_REG_5, IPPROTO_UDP);
+  prog.Ldx(BPF_H, BPF_REG_5, BPF_REG_2,
+           ETH_HLEN + offsetof(struct iphdr, frag_off));
+  prog.AluImm(BPF_AND, BPF_REG_5, htons(0x3fff));
+  prog.JmpImmToPass(BPF_JNE, BPF_REG_5, 0);
+  // Is the destination port a test port?
+  prog.Ldx(BPF_H, BPF_REG_5, BPF_REG_2,
+           ETH_HLEN + sizeof(struct iphdr) + offsetof(struct udphdr, dest));
+  prog.Stx(BPF_W, BPF_REG_10, BPF_REG_5, -4);
+  prog.LdMapFd(BPF_REG_1, aXsk->mPortsMapFd);
+  prog.MovReg(BPF_REG_2, BPF_REG_10);
+  prog.AluImm(BPF_ADD, BPF_REG_2, -4);
+  prog.Call(BPF_FUNC_map_lookup_elem);
+  prog.JmpImmToPass(BPF_JEQ, BPF_REG_0, 0);
+  prog.Ldx(BPF_W, BPF_REG_5, BPF_REG_0, 0);
+  prog.JmpImmToPass(BPF_JEQ, BPF_REG_5, 0);
+  // To the socket of this queue; XDP_PASS if there is none.
+  prog.Ldx(BPF_W, BPF_REG_2, BPF_REG_6,
+           offsetof(struct xdp_md, rx_queue_index));
+  prog.LdMapFd(BPF_REG_1, aXsk->mXsksMapFd);
+  prog.AluImm(BPF_MOV, BPF_REG_3, XDP_PASS);
+  prog.Call(BPF_FUNC_redirect_map);
+  prog.Exit();
+  prog.Pass();
+
+  std::vector<char> log(XDP_VERIFIER_LOG_SIZE);
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insns = (uint64_t)(uintptr_t)prog.mInsns.data();
+  attr.insn_cnt = prog.mInsns.size();
+  attr.license = (uint64_t)(uintptr_t)"Dual MPL/GPL";
+  attr.log_buf = (uint64_t)(uintptr_t)log.data();
+  attr.log_size = log.size();
+  attr.log_level = 1;
+  aXsk->mProgFd = Bpf(BPF_PROG_LOAD, &attr);
+  if (aXsk->mProgFd < 0) {
+    LOG(("NetworkTest XDP: Program rejected: %d %s", errno, log.data()));
+    return -1;
+  }
+  return 0;
+}
+
+static int
+CreateMap(uint32_t aType, uint32_t aEntries)
+{
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = aType;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = aEntries;
+  return Bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int
+UpdateMap(int aFd, uint32_t aKey, uint32_t aValue)
+{
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = aFd;
+  attr.key = (uint64_t)(uintptr_t)&aKey;
+  attr.value = (uint64_t)(uintptr_t)&aValue;
+  attr.flags = BPF_ANY;
+  return Bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static int
+Attach(XdpSocket *aXsk, int aIfIndex, int aMode)
+{
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.link_create.prog_fd = aXsk->mProgFd;
+  attr.link_create.target_ifindex = aIfIndex;
+  attr.link_create.attach_type = BPF_XDP;
+  if (aMode != XDP_MODE_GENERIC) {
+    attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+    aXsk->mLinkFd = Bpf(BPF_LINK_CREATE, &attr);
+    if (aXsk->mLinkFd >= 0 || aMode == XDP_MODE_NATIVE) {
+      return aXsk->mLinkFd;
+    }
+    LOG(("NetworkTest XDP: No native XDP (%d), using generic XDP", errno));
+  }
+  attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+  aXsk->mLinkFd = Bpf(BPF_LINK_CREATE, &attr);
+  return aXsk->mLinkFd;
+}
+
+static int
+MapRing(int aFd, XdpRing &aRing, const struct xdp_ring_offset &aOff,
+        size_t aDescSize, off_t aPgOff)
+{
+  aRing.mMapLen = aOff.desc + XDP_RING_SIZE * aDescSize;
+  aRing.mMap = mmap(nullptr, aRing.mMapLen, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, aFd, aPgOff);
+  if (aRing.mMap == MAP_FAILED) {
+    aRing.mMap = nullptr;
+    return -1;
+  }
+  char *base = (char*)aRing.mMap;
+  aRing.mProducer = (uint32_t*)(base + aOff.producer);
+  aRing.mConsumer = (uint32_t*)(base + aOff.consumer);
+  aRing.mFlags = (uint32_t*)(base + aOff.flags);
+  aRing.mDescs = base + aOff.desc;
+  aRing.mIndex = 0;
+  return 0;
+}
+
+static void
+DestroyXdpSocket(XdpSocket *aXsk)
+{
+  // The AF_XDP socket itself is closed by the layer below.
+  XdpRing *rings[] = { &aXsk->mFill, &aXsk->mComp, &aXsk->mRx, &aXsk->mTx };
+  for (size_t inx = 0; inx < sizeof(rings) / sizeof(rings[0]); inx++) {
+    if (rings[inx]->mMap) {
+      munmap(rings[inx]->mMap, rings[inx]->mMapLen);
+    }
+  }
+  if (aXsk->mUmem) {
+    munmap(aXsk->mUmem, (size_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE);
+  }
+  int fds[] = { aXsk->mLinkFd, aXsk->mProgFd, aXsk->mXsksMapFd,
+                aXsk->mPortsMapFd };
+  for (size_t inx = 0; inx < sizeof(fds) / sizeof(fds[0]); inx++) {
+    if (fds[inx] >= 0) {
+      close(fds[inx]);
+    }
+  }
+  delete aXsk;
+}
+
+static int
+SetupUmem(XdpSocket *aXsk, int aFd)
+{
+  size_t len = (size_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE;
+  void *umem = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (umem == MAP_FAILED) {
+    return -1;
+  }
+  aXsk->mUmem = (char*)umem;
+
+  struct xdp_umem_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.addr = (uint64_t)(uintptr_t)umem;
+  reg.len = len;
+  reg.chunk_size = XDP_FRAME_SIZE;
+  int ringSize = XDP_RING_SIZE;
+  if (setsockopt(aFd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) ||
+      setsockopt(aFd, SOL_XDP, XDP_UMEM_FILL_RING, &ringSize,
+                 sizeof(ringSize)) ||
+      setsockopt(aFd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ringSize,
+                 sizeof(ringSize)) ||
+      setsockopt(aFd, SOL_XDP, XDP_RX_RING, &ringSize, sizeof(ringSize)) ||
+      setsockopt(aFd, SOL_XDP, XDP_TX_RING, &ringSize, sizeof(ringSize))) {
+    return -1;
+  }
+
+  struct xdp_mmap_offsets off;
+  socklen_t optLen = sizeof(off);
+  if (getsockopt(aFd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optLen) ||
+      MapRing(aFd, aXsk->mFill, off.fr, sizeof(uint64_t),
+              XDP_UMEM_PGOFF_FILL_RING) ||
+      MapRing(aFd, aXsk->mComp, off.cr, sizeof(uint64_t),
+              XDP_UMEM_PGOFF_COMPLETION_RING) ||
+      MapRing(aFd, aXsk->mRx, off.rx, sizeof(struct xdp_desc),
+              XDP_PGOFF_RX_RING) ||
+      MapRing(aFd, aXsk->mTx, off.tx, sizeof(struct xdp_desc),
+              XDP_PGOFF_TX_RING)) {
+    return -1;
+  }
+
+  // The first half of the frames is for receiving, the rest for sending.
+  uint64_t *fill = (uint64_t*)aXsk->mFill.mDescs;
+  for (uint32_t inx = 0; inx < XDP_RING_SIZE; inx++) {
+    fill[inx] = (uint64_t)inx * XDP_FRAME_SIZE;
+  }
+  aXsk->mFill.mIndex = XDP_RING_SIZE;
+  __atomic_store_n(aXsk->mFill.mProducer, aXsk->mFill.mIndex,
+                   __ATOMIC_RELEASE);
+  for (uint32_t inx = XDP_RING_SIZE; inx < XDP_NUM_FRAMES; inx++) {
+    aXsk->mFreeFrames.push_back((uint64_t)inx * XDP_FRAME_SIZE);
+  }
+  return 0;
+}
+
+static uint64_t
+PeerKey(uint32_t aIp, uint16_t aPort)
+{
+  return ((uint64_t)aIp << 16) | aPort;
+}
+
+static void
+KickTx(XdpSocket *aXsk, int aFd)
+{
+  if (!aXsk->mTxPending) {
+    return;
+  }
+  aXsk->mTxPending = false;
+  if (__atomic_load_n(aXsk->mTx.mFlags, __ATOMIC_ACQUIRE) &
+      XDP_RING_NEED_WAKEUP) {
+    sendto(aFd, nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+  }
+}
+
+static void
+ReclaimTx(XdpSocket *aXsk)
+{
+  XdpRing &comp = aXsk->mComp;
+  uint32_t producer = __atomic_load_n(comp.mProducer, __ATOMIC_ACQUIRE);
+  if (producer == comp.mIndex) {
+    return;
+  }
+  uint64_t *addrs = (uint64_t*)comp.mDescs;
+  for (; comp.mIndex != producer; comp.mIndex++) {
+    aXsk->mFreeFrames.push_back(addrs[comp.mIndex & (XDP_RING_SIZE - 1)]);
+  }
+  __atomic_store_n(comp.mConsumer, comp.mIndex, __ATOMIC_RELEASE);
+}
+
+static uint16_t
+IpChecksum(const struct iphdr *aIp)
+{
+  const uint16_t *words = (const uint16_t*)aIp;
+  uint32_t sum = 0;
+  for (size_t inx = 0; inx < sizeof(struct iphdr) / 2; inx++) {
+    sum += words[inx];
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return ~sum;
+}
+
+static XdpSocket*
+GetXdpSocket(PRFileDesc *aFd)
+{
+  PRFileDesc *layer = PR_GetIdentitiesLayer(aFd, sXdpIdentity);
+  return layer ? (XdpSocket*)layer->secret : nullptr;
+}
+
+static PRInt32 PR_CALLBACK
+XdpRecvFrom(PRFileDesc *aFd, void *aBuf, PRInt32 aAmount, PRIntn aFlags,
+            PRNetAddr *aAddr, PRIntervalTime aTimeout)
+{
+  XdpSocket *xsk = (XdpSocket*)aFd->secret;
+  XdpRing &rx = xsk->mRx;
+  while (rx.mIndex != __atomic_load_n(rx.mProducer, __ATOMIC_ACQUIRE)) {
+    struct xdp_desc *desc =
+      &((struct xdp_desc*)rx.mDescs)[rx.mIndex & (XDP_RING_SIZE - 1)];
+    uint64_t frameAddr = desc->addr - desc->addr % XDP_FRAME_SIZE;
+    char *frame = xsk->mUmem + desc->addr;
+    uint32_t frameLen = desc->len;
+    rx.mIndex++;
+    __atomic_store_n(rx.mConsumer, rx.mIndex, __ATOMIC_RELEASE);
+
+    int32_t count = -1;
+    struct ethhdr *eth = (struct ethhdr*)frame;
+    struct iphdr *ip = (struct iphdr*)(frame + ETH_HLEN);
+    struct udphdr *udp = (struct udphdr*)(ip + 1);
+    if (frameLen >= XDP_HEADERS_SIZE) {
+      uint32_t udpLen = ntohs(udp->len);
+      if (udpLen >= sizeof(struct udphdr) &&
+          udpLen <= frameLen - ETH_HLEN - sizeof(struct iphdr)) {
+        count = udpLen - sizeof(struct udphdr);
+      }
+    }
+    if (count >= 0) {
+      if (count > aAmount) {
+        count = aAmount;
+      }
+      memcpy(aBuf, udp + 1, count);
+      memset(aAddr, 0, sizeof(*aAddr));
+      aAddr->inet.family = PR_AF_INET;
+      aAddr->inet.ip = ip->saddr;
+      aAddr->inet.port = udp->source;
+
+      uint64_t key = PeerKey(ip->saddr, udp->source);
+      if (xsk->mPeers.size() >= XDP_MAX_PEERS &&
+          !xsk->mPeers.count(key)) {
+        xsk->mPeers.clear();
+      }
+      XdpPeer &peer = xsk->mPeers[key];
+      memcpy(peer.mPeerMac, eth->h_source, ETH_ALEN);
+      memcpy(peer.mLocalMac, eth->h_dest, ETH_ALEN);
+      peer.mLocalIp = ip->daddr;
+      peer.mLocalPort = udp->dest;
+    }
+
+    // Give the frame back to the kernel. The fill ring has room for all
+    // receive frames.
+    XdpRing &fill = xsk->mFill;
+    ((uint64_t*)fill.mDescs)[fill.mIndex & (XDP_RING_SIZE - 1)] = frameAddr;
+    fill.mIndex++;
+    __atomic_store_n(fill.mProducer, fill.mIndex, __ATOMIC_RELEASE);
+    if (count >= 0) {
+      return count;
+    }
+  }
+  PR_SetError(PR_WOULD_BLOCK_ERROR, 0);
+  return -1;
+}
+
+static PRInt32 PR_CALLBACK
+XdpSendTo(PRFileDesc *aFd, const void *aBuf, PRInt32 aAmount, PRIntn aFlags,
+          const PRNetAddr *aAddr, PRIntervalTime aTimeout)
+{
+  XdpSocket *xsk = (XdpSocket*)aFd->secret;
+  if (aAmount < 0 || (uint32_t)aAmount > xsk->mMaxPayloadSize) {
+    PR_SetError(PR_BUFFER_OVERFLOW_ERROR, 0);
+    return -1;
+  }
+  std::unordered_map<uint64_t, XdpPeer>::iterator it =
+    xsk->mPeers.find(PeerKey(aAddr->inet.ip, aAddr->inet.port));
+  if (it == xsk->mPeers.end()) {
+    // We never heard from it (or forgot it); like a loss on the wire.
+    return aAmount;
+  }
+  const XdpPeer &peer = it->second;
+
+  ReclaimTx(xsk);
+  XdpRing &tx = xsk->mTx;
+  if (xsk->mFreeFrames.empty() ||
+      tx.mIndex - __atomic_load_n(tx.mConsumer, __ATOMIC_ACQUIRE) >=
+      XDP_RING_SIZE) {
+    KickTx(xsk, PR_FileDesc2NativeHandle(aFd));
+    PR_SetError(PR_WOULD_BLOCK_ERROR, 0);
+    return -1;
+  }
+  uint64_t frameAddr = xsk->mFreeFrames.back();
+  xsk->mFreeFrames.pop_back();
+
+  char *frame = xsk->mUmem + frameAddr;
+  struct ethhdr *eth = (struct ethhdr*)frame;
+  memcpy(eth->h_dest, peer.mPeerMac, ETH_ALEN);
+  memcpy(eth->h_source, peer.mLocalMac, ETH_ALEN);
+  eth->h_proto = htons(ETH_P_IP);
+
+  struct iphdr *ip = (struct iphdr*)(frame + ETH_HLEN);
+  ip->version = 4;
+  ip->ihl = sizeof(struct iphdr) / 4;
+  ip->tos = xsk->mTos;
+  ip->tot_len = htons(sizeof(struct iphdr) + sizeof(struct udphdr) + aAmount);
+  ip->id = htons(xsk->mIpId++);
+  ip->frag_off = htons(XDP_IP_DF);
+  ip->ttl = 64;
+  ip->protocol = IPPROTO_UDP;
+  ip->check = 0;
+  ip->saddr = peer.mLocalIp;
+  ip->daddr = aAddr->inet.ip;
+  ip->check = IpChecksum(ip);
+
+  // No UDP checksum (allowed for IPv4).
+  struct udphdr *udp = (struct udphdr*)(ip + 1);
+  udp->source = peer.mLocalPort;
+  udp->dest = aAddr->inet.port;
+  udp->len = htons(sizeof(struct udphdr) + aAmount);
+  udp->check = 0;
+  memcpy(udp + 1, aBuf, aAmount);
+
+  struct xdp_desc *desc =
+    &((struct xdp_desc*)tx.mDescs)[tx.mIndex & (XDP_RING_SIZE - 1)];
+  desc->addr = frameAddr;
+  desc->len = XDP_HEADERS_SIZE + aAmount;
+  desc->options = 0;
+  tx.mIndex++;
+  __atomic_store_n(tx.mProducer, tx.mIndex, __ATOMIC_RELEASE);
+  xsk->mTxPending = true;
+  return aAmount;
+}
+
+static PRInt16 PR_CALLBACK
+XdpPoll(PRFileDesc *aFd, PRInt16 aInFlags, PRInt16 *aOutFlags)
+{
+  // The worker polls once per round, so this sends what the round queued.
+  XdpSocket *xsk = (XdpSocket*)aFd->secret;
+  KickTx(xsk, PR_FileDesc2NativeHandle(aFd));
+  ReclaimTx(xsk);
+  *aOutFlags = 0;
+  if ((aInFlags & PR_POLL_READ) &&
+      xsk->mRx.mIndex != __atomic_load_n(xsk->mRx.mProducer,
+                                         __ATOMIC_ACQUIRE)) {
+    *aOutFlags = PR_POLL_READ;
+  }
+  return aInFlags;
+}
+
+static PRStatus PR_CALLBACK
+XdpSetSocketOption(PRFileDesc *aFd, const PRSocketOptionData *aData)
+{
+  if (aData->option == PR_SockOpt_IpTypeOfService) {
+    XdpSocket *xsk = (XdpSocket*)aFd->secret;
+    xsk->mTos = aData->value.tos;
+    return PR_SUCCESS;
+  }
+  return aFd->lower->methods->setsocketoption(aFd->lower, aData);
+}
+
+static PRStatus PR_CALLBACK
+XdpClose(PRFileDesc *aFd)
+{
+  PRFileDesc *layer = PR_PopIOLayer(aFd, sXdpIdentity);
+  DestroyXdpSocket((XdpSocket*)layer->secret);
+  layer->secret = nullptr;
+  layer->dtor(layer);
+  return aFd->methods->close(aFd);
+}
+
+PRFileDesc*
+XdpOpen(const char *aIfName, uint32_t aQueue, int aMode,
+        const uint16_t *aPorts, int aNumPorts)
+{
+  if (sXdpIdentity == PR_INVALID_IO_LAYER) {
+    sXdpIdentity = PR_GetUniqueIdentity("NetworkTest XDP");
+    sXdpMethods = *PR_GetDefaultIOMethods();
+    sXdpMethods.recvfrom = XdpRecvFrom;
+    sXdpMethods.sendto = XdpSendTo;
+    sXdpMethods.poll = XdpPoll;
+    sXdpMethods.setsocketoption = XdpSetSocketOption;
+    sXdpMethods.close = XdpClose;
+  }
+
+  int ifIndex = if_nametoindex(aIfName);
+  if (!ifIndex || aQueue >= XDP_XSKMAP_ENTRIES) {
+    LOG(("NetworkTest XDP: Bad interface %s or queue %u", aIfName, aQueue));
+    return nullptr;
+  }
+
+  XdpSocket *xsk = new XdpSocket();
+  xsk->mPortsMapFd = -1;
+  xsk->mXsksMapFd = -1;
+  xsk->mProgFd = -1;
+  xsk->mLinkFd = -1;
+  xsk->mUmem = nullptr;
+  memset(&xsk->mFill, 0, sizeof(XdpRing));
+  memset(&xsk->mComp, 0, sizeof(XdpRing));
+  memset(&xsk->mRx, 0, sizeof(XdpRing));
+  memset(&xsk->mTx, 0, sizeof(XdpRing));
+  xsk->mTxPending = false;
+  xsk->mIpId = 0;
+  xsk->mTos = 0;
+
+  // The payload must fit a frame and the MTU.
+  xsk->mMaxPayloadSize = XDP_FRAME_SIZE - XDP_HEADERS_SIZE;
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, aIfName, IFNAMSIZ - 1);
+  int ioctlFd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (ioctlFd >= 0 && !ioctl(ioctlFd, SIOCGIFMTU, &ifr) &&
+      ifr.ifr_mtu - UDP_IP_HEADER_SIZE < (int)xsk->mMaxPayloadSize) {
+    xsk->mMaxPayloadSize = ifr.ifr_mtu - UDP_IP_HEADER_SIZE;
+  }
+  if (ioctlFd >= 0) {
+    close(ioctlFd);
+  }
+
+  int fd = socket(AF_XDP, SOCK_RAW, 0);
+  if (fd < 0) {
+    LOG(("NetworkTest XDP: No AF_XDP socket: %d", errno));
+    DestroyXdpSocket(xsk);
+    return nullptr;
+  }
+  if (SetupUmem(xsk, fd)) {
+    LOG(("NetworkTest XDP: UMEM setup failed: %d", errno));
+    close(fd);
+    DestroyXdpSocket(xsk);
+    return nullptr;
+  }
+
+  xsk->mPortsMapFd = CreateMap(BPF_MAP_TYPE_ARRAY, 65536);
+  xsk->mXsksMapFd = CreateMap(BPF_MAP_TYPE_XSKMAP, XDP_XSKMAP_ENTRIES);
+  if (xsk->mPortsMapFd < 0 || xsk->mXsksMapFd < 0 || LoadProgram(xsk)) {
+    LOG(("NetworkTest XDP: BPF setup failed: %d", errno));
+    close(fd);
+    DestroyXdpSocket(xsk);
+    return nullptr;
+  }
+  for (int inx = 0; inx < aNumPorts; inx++) {
+    UpdateMap(xsk->mPortsMapFd, htons(aPorts[inx]), 1);
+  }
+
+  if (Attach(xsk, ifIndex, aMode) < 0) {
+    LOG(("NetworkTest XDP: Attaching to %s failed: %d", aIfName, errno));
+    close(fd);
+    DestroyXdpSocket(xsk);
+    return nullptr;
+  }
+  struct sockaddr_xdp sxdp;
+  memset(&sxdp, 0, sizeof(sxdp));
+  sxdp.sxdp_family = AF_XDP;
+  sxdp.sxdp_ifindex = ifIndex;
+  sxdp.sxdp_queue_id = aQueue;
+  // The kernel picks zero copy if the driver can do it.
+  sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP;
+  if (bind(fd, (struct sockaddr*)&sxdp, sizeof(sxdp))) {
+    LOG(("NetworkTest XDP: Bind to %s queue %u failed: %d", aIfName, aQueue,
+         errno));
+    close(fd);
+    DestroyXdpSocket(xsk);
+    return nullptr;
+  }
+  if (UpdateMap(xsk->mXsksMapFd, aQueue, fd)) {
+    LOG(("NetworkTest XDP: Adding the socket failed: %d", errno));
+    close(fd);
+    DestroyXdpSocket(xsk);
+    return nullptr;
+  }
+
+  PRFileDesc *bottom = PR_ImportUDPSocket(fd);
+  if (!bottom) {
+    close(fd);
+    DestroyXdpSocket(xsk);
+    return nullptr;
+  }
+  PRFileDesc *layer = PR_CreateIOLayerStub(sXdpIdentity, &sXdpMethods);
+  layer->secret = (PRFilePrivate*)xsk;
+  if (PR_PushIOLayer(bottom, PR_TOP_IO_LAYER, layer) != PR_SUCCESS) {
+    layer->dtor(layer);
+    PR_Close(bottom);
+    DestroyXdpSocket(xsk);
+    return nullptr;
+  }
+  LOG(("NetworkTest XDP: %s queue %u, max payload %u", aIfName, aQueue,
+       xsk->mMaxPayloadSize));
+  return bottom;
+}
+
+uint32_t
+XdpMaxPayloadSize(PRFileDesc *aFd)
+{
+  XdpSocket *xsk = GetXdpSocket(aFd);
+  return xsk ? xsk->mMaxPayloadSize : PAYLOADSIZE_MAX;
+}
+
+#else
+
+PRFileDesc*
+XdpOpen(const char *aIfName, uint32_t aQueue, int aMode,
+        const uint16_t *aPorts, int aNumPorts)
+{
+  LOG(("NetworkTest XDP: Not supported on this system"));
+  PR_SetError(PR_NOT_IMPLEMENTED_ERROR, 0);
+  return nullptr;
+}
+
+uint32_t
+XdpMaxPayloadSize(PRFileDesc *aFd)
+{
+  return PAYLOADSIZE_MAX;
+}
+
+#endif
@@ -0,0 +1,54 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set sw=2 ts=2 et ft=cpp : */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NETWORK_TESTS_XDP_SOCKET_H__
+#define NETWORK_TESTS_XDP_SOCKET_H__
+
+#include "prio.h"
+#include <stdint.h>
+
+/**
+ * AF_XDP backend for the UDP tests.
+ *
+ * An XDP program on one receive queue of an interface redirects IPv4 UDP
+ * packets (without IP options or fragmentation) to the test ports into an
+ * AF_XDP socket; all other packets, and packets on other queues, go to the
+ * kernel and reach the normal UDP sockets.
+ *
+ * The socket is an NSPR I/O layer, so the UDP worker loop and the ClientSocket
+ * state machines run on it unchanged:
+ *  PR_RecvFrom takes a frame from the RX ring, copies the UDP payload out and
+ *              gives the frame back to the fill ring.
+ *  PR_SendTo   builds Ethernet, IPv4 and UDP headers in a free UMEM frame,
+ *              copies the payload behind them and puts the frame on the TX
+ *              ring. The MAC and IP addresses are those of the last packet
+ *              received from the peer. Packets to unknown peers are dropped.
+ *              The IPv4 TOS byte is the one set last with
+ *              PR_SockOpt_IpTypeOfService (SendToTos() sets it per packet).
+ *  PR_Poll     kicks the TX ring (once per worker round) and reports readable
+ *              without a system call if the RX ring is not empty.
+ *
+ * Frames are XDP_FRAME_SIZE bytes, so the UDP payload is limited to the frame
+ * and to the MTU of the interface (XdpMaxPayloadSize). Larger packets fail with
+ * PR_BUFFER_OVERFLOW_ERROR, so Test 8 path MTU probing does not work here.
+ *
+ * The program is attached with a BPF link and goes away with the process.
+ * Linux only.
+ */
+
+#define XDP_MODE_AUTO 0
+#define XDP_MODE_NATIVE 1
+#define XDP_MODE_GENERIC 2
+
+#define XDP_FRAME_SIZE 4096
+#define XDP_NUM_FRAMES 4096
+#define XDP_RING_SIZE 2048
+
+PRFileDesc* XdpOpen(const char *aIfName, uint32_t aQueue, int aMode,
+                    const uint16_t *aPorts, int aNumPorts);
+uint32_t XdpMaxPayloadSize(PRFileDesc *aFd);
+
+#endif
@@ -5,12 +5,21 @@
 #define TCP_reachability "Test_2"
 #define TCP_performanceFromServerToClient "Test_3"
 #define TCP_performanceFromClientToServer "Test_4"
+#define TCP_connectionRate "Test_B"
 #define UDP_reachability "Test_1"
 #define UDP_performanceFromServerToClient "Test_5"
 #define UDP_performanceFromClientToServer "Test_6"
+#define UDP_packetTrain "Test_8"
+#define UDP_congestionControlled "Test_9"
+#define UDP_latencyProbes "Test_A"
 #define TEST_prefix "Test_"
 #define FINISH "FINISH"
 #define SENDRESULTS "SndRes"
+#define SENDRESULTS_ENCODED "SndCmp"
+#define BUSY "BUSY__"
+#define PROBE "Probe_"
+#define SYNC "Sync__"
+#define REDIRECT "Redir_"
 
 #define TMP_DIRECTORY "/tmp/moz_test/"
 
@@ -28,9 +37,75 @@
  *  |        TIMESTAM_START = 4
  *  PKT_ID_START = 0
  *
+ *  Older clients send nothing defined after FILE_NAME, so every field below
+ *  that starts at byte 78 or later, and FILE_NAME in Test 6, is only read
+ *  from a first packet that has FIRST_PKT_VERSION in its version byte.
+ *  Without it the server uses the defaults:
+ *  |___ ... ___|__1B__|
+ *  |           | VER  |
+ *  |           FIRST_PKT_VERSION_START = 95
+ *
+ *  Test 5 first packet can optionally carry the limits requested by the
+ *  client (a value of 0 or a shorter packet means use the server default):
+ *  |___ ... ___|_______8B_______|___4B___|
+ *  |           |   MAX_BYTES    |MAX_TIME| (max time in milliseconds)
+ *  |           |                MAX_TIME_START = 86
+ *  |           MAX_BYTES_START = 78
+ *
+ *  Test 9 (congestion controlled) first packet has the same format as Test 5;
+ *  RATE_TO_SEND is the start rate (0 means the server default).
+ *
+ *  Test 8 (packet trains) first packet has the same format as Test 5 up to
+ *  the file name. RATE_TO_SEND is the rate inside a train (0 means back to
+ *  back) or the highest rate of a chirp. It is followed by the probing
+ *  parameters (0 or a shorter packet means use the default):
+ *  |___ ... ___|__1B__|___2B___|___2B___|
+ *  |           | MODE |TRN LEN |TRAINS  | (mode 0 trains, 1 chirps, 2 path
+ *  |           |      |        |        |  MTU probes)
+ *  |           |      |        TRAIN_COUNT_START = 81
+ *  |           |      TRAIN_LEN_START = 79
+ *  |           TRAIN_MODE_START = 78
+ *
+ *  Test 6 first packet can carry FILE_NAME at FILE_NAME_START (RATE_TO_SEND
+ *  is not used). The server writes its summaries there; without a name (0
+ *  or a shorter packet) it names the log after the client address, port and
+ *  PKT_ID.
+ *
+ *  Test 10 (latency probes, type "Test_A") first packet has the same format
+ *  as Test 5; RATE_TO_SEND is the probe rate in probes per second (only a
+ *  hint for the server) and MAX_BYTES is ignored.
+ *
+ *  The first packet of Test 5, 6, 8 and 9 can carry the size of the data
+ *  packets (UDP payload in bytes, 0 or a shorter packet means PAYLOADSIZE).
+ *  The server bounds it to [PAYLOADSIZE_MIN, PAYLOADSIZE_MAX]:
+ *  |___ ... ___|___2B___|
+ *  |           |PKT SIZE|
+ *  |           PAYLOAD_SIZE_START = 90
+ *
+ *  The first packet of Test 5 and 6 can ask for ECN (0 or a shorter packet
+ *  means none). ECN is the codepoint the data packets carry, ECN_ECT1 or
+ *  ECN_ECT0; in Test 5 the server sends them, in Test 6 the client:
+ *  |___ ... ___|__1B__|
+ *  |           | ECN  |
+ *  |           ECN_MODE_START = 92
+ *
+ *  The first packet of Test 5, 6 and 9 can ask for one-way delays (0 or a
+ *  shorter packet means none). The client then answers the clock sync
+ *  requests of the server and puts its clock into its packets (below). All
+ *  these times are 8B in network order:
+ *  |___ ... ___|__1B__|
+ *  |           | SYNC |
+ *  |           SYNC_MODE_START = 93
+ *
+ *  A first packet the client resends after a redirect (below) is marked, so
+ *  it is never redirected again (0 or a shorter packet means not marked):
+ *  |___ ... ___|__1B__|
+ *  |           | MARK |
+ *  |           REDIRECTED_START = 94
+ *
  *
  * UDP packet sender side:
- * (in test 5 from the server and in test 6 from the client)
+ * (in test 5, 8, 9 from the server and in test 6 from the client)
  *  |___4B___|___4B___|
  *  | PKT_ID |   TS   |
  *  |        |
@@ -53,6 +128,44 @@
  *           |
  *        copied from sender packet
  *
+ * In Test 5 with ECN the client adds the codepoint the data packet arrived
+ * with to its ACK, as ECN_ECHO_VALID | codepoint:
+ *  |___ ... ___|___4B___|__1B__|
+ *  |           |TS ACKed| ECN  |
+ *  |           |        ACK_ECN_START = 16
+ *
+ * In Test 5 and 9 with SYNC_MODE the ACK always has the ECN byte (0 without
+ * ECN) and goes on with the client's receive time of the data packet, its
+ * send time of the ACK (client clock, us) and the server send time copied
+ * from the data packet:
+ *  |___ ... ___|__1B__|_3B_|_______8B_______|_______8B_______|
+ *  |           | ECN  |    |   CLIENT RX    |   CLIENT TX    |
+ *  |           |      |    |                ACK_CLIENT_TX_START = 28
+ *  |           |      |    ACK_CLIENT_RX_START = 20
+ *  |___ ... ___|_______8B_______|
+ *  |           |   SERVER TX    |
+ *  |           ACK_SERVER_TX_START = 36
+ *
+ * With SYNC_MODE the data and finish packets carry the time they were sent,
+ * in Test 5 and 9 the server clock (ns), in Test 6 the client clock (us):
+ *  |___4B___|___4B___|_____6B_____|_______8B_______|
+ *  | PKT_ID |   TS   |  0/FINISH  |    SEND TIME   |
+ *  |        |        |            DATA_SEND_TIME_START = 14
+ *
+ * Clock sync request of the server (SYNC_SAMPLES of them at the start and at
+ * the end of a test with SYNC_MODE). The client fills in the time it received
+ * the request and the time it sends it back (its clock, us) and returns it.
+ * It answers until it has the finish packet (Test 5, 9) or the ACK of its own
+ * finish packet (Test 6); the server sends the last burst before those:
+ *  |___4B___|___4B___|_____6B_____|_______8B_______|
+ *  | PKT_ID |   TS   |    SYNC    |   SERVER TX    |
+ *  |        |        |            SYNC_SERVER_TX_START = 14
+ *  |        |        SYNC_START = 8
+ *  |___ ... ___|_______8B_______|_______8B_______|
+ *  |           |   CLIENT RX    |   CLIENT TX    |
+ *  |           |                SYNC_CLIENT_TX_START = 30
+ *  |           SYNC_CLIENT_RX_START = 22
+ *
  * The last UDP packet:
  * (in test 5 from the server and in test 6 from the client)
  *  |___4B___|___4B___|_____6B_____|
@@ -62,6 +175,59 @@
  *  |        TIMESTAM_START = 4
  *  PKT_ID_START = 0
  *
+ * The last UDP packet of Test 8 carries the estimates in bits per second
+ * (0 means not measured):
+ *  |___4B___|___4B___|_____6B_____|_______8B_______|_______8B_______|
+ *  | PKT_ID |   TS   |   FINISH   |    CAPACITY    | AVAILABLE BW   |
+ *  |        |        |            |                TRAIN_AVAIL_BW_START = 22
+ *  |        |        |            TRAIN_CAPACITY_START = 14
+ *
+ * In path MTU probing mode the capacity is 0 and the available bandwidth
+ * field is followed by the largest probe payload (bytes) that was acked and
+ * the smallest larger one that never was (0 if there is none):
+ *  |___ ... ___|___4B___|___4B___|
+ *  |           |  PMTU  |  LOST  |
+ *  |           |        TRAIN_PMTU_LOST_START = 34
+ *  |           TRAIN_PMTU_START = 30
+ *
+ * Test 10 probes (from the client, every few ms after the first packet has
+ * been echoed). The last probe has FINISH instead of PROBE. CLIENT DATA is
+ * not read by the server (the client puts its send time there):
+ *  |___4B___|___4B___|_____6B_____|_______8B_______|_______8B_______|
+ *  | PKT_ID |   TS   |   PROBE    |   RESIDENCE    |  CLIENT DATA   |
+ *  |        |        |            |                PROBE_CLIENT_START = 22
+ *  |        |        |            PROBE_RESIDENCE_START = 14
+ *  |        |        PROBE_START = 8
+ *
+ * The server echoes every probe, and the first packet, unchanged except for
+ * RESIDENCE: the ns (network order) from the kernel receive time of the probe
+ * to the send of the echo (user space receive time if the kernel time is not
+ * available). Probes shorter than PROBE_MIN_SIZE are dropped.
+ *
+ * When a UDP port has no free client slot the first packet of a new test is
+ * answered with a busy reply and the test is not started. RETRY is the time
+ * in ms (network order) after which the client may try again:
+ *  |___4B___|___4B___|_____6B_____|___4B___|
+ *  | PKT_ID |   TS   |    BUSY    | RETRY  |
+ *  |        |        |            BUSY_RETRY_START = 14
+ *  |        |        BUSY_START = 8
+ *  |_________________|
+ *           |
+ *        copied from the first packet
+ *
+ * A server in a cluster (Cluster.h) that is loaded answers the first packet
+ * of a new test with a redirect to a less loaded server instead of starting
+ * it. ADDR is the IPv4 address of that server (network order); the client
+ * sends its first packet again to ADDR on the same port, marked with
+ * REDIRECTED:
+ *  |___4B___|___4B___|_____6B_____|___4B___|
+ *  | PKT_ID |   TS   |  REDIRECT  |  ADDR  |
+ *  |        |        |            REDIRECT_ADDR_START = 14
+ *  |        |        REDIRECT_START = 8
+ *  |_________________|
+ *           |
+ *        copied from the first packet
+ *
  *
  * We do not do htonl for pkt id and timestamp because these values will be only
  * read by this host. They are stored in a packet, sent to the receiver, the
@@ -81,6 +247,26 @@
 #define FINISH_START 8
 #define FINISH_LEN 6
 
+#define BUSY_START 8
+#define BUSY_LEN 6
+#define BUSY_RETRY_START 14
+#define BUSY_RETRY_LEN 4
+#define BUSY_RETRY_MS 1000
+
+#define REDIRECT_START 8
+#define REDIRECT_LEN 6
+#define REDIRECT_ADDR_START 14
+#define REDIRECT_ADDR_LEN 4
+#define REDIRECTED_START 94
+#define REDIRECTED_LEN 1
+
+// Bytes of the first UDP packet every client defines, and the version byte
+// that tells the fields after them are there.
+#define FIRST_PKT_BASE_LEN 78
+#define FIRST_PKT_VERSION_START 95
+#define FIRST_PKT_VERSION_LEN 1
+#define FIRST_PKT_VERSION 1
+
 // To do statistics about variation in trip time for data and ack
 // (the absolut time can't be calculated because clocls may not be sync)
 // the ack delay at receive can be calculated from this
@@ -96,6 +282,64 @@
 // File name [16 random]_test[test number]_itr[iteration number]
 #define FILE_NAME_LEN 56
 
+#define MAX_BYTES_START 78
+#define MAX_BYTES_LEN 8
+#define MAX_TIME_START 86
+#define MAX_TIME_LEN 4
+
+#define TRAIN_MODE_START 78
+#define TRAIN_MODE_LEN 1
+#define TRAIN_LEN_START 79
+#define TRAIN_LEN_LEN 2
+#define TRAIN_COUNT_START 81
+#define TRAIN_COUNT_LEN 2
+#define TRAIN_CAPACITY_START 14
+#define TRAIN_CAPACITY_LEN 8
+#define TRAIN_AVAIL_BW_START 22
+#define TRAIN_AVAIL_BW_LEN 8
+#define TRAIN_PMTU_START 30
+#define TRAIN_PMTU_LEN 4
+#define TRAIN_PMTU_LOST_START 34
+#define TRAIN_PMTU_LOST_LEN 4
+
+#define PAYLOAD_SIZE_START 90
+#define PAYLOAD_SIZE_LEN 2
+
+#define ECN_MODE_START 92
+#define ECN_MODE_LEN 1
+#define ACK_ECN_START 16
+#define ACK_ECN_LEN 1
+// The two low bits of the IP TOS byte.
+#define ECN_NOT_ECT 0
+#define ECN_ECT1 1
+#define ECN_ECT0 2
+#define ECN_CE 3
+#define ECN_ECHO_VALID 0x80
+
+#define SYNC_MODE_START 93
+#define SYNC_MODE_LEN 1
+#define SYNC_START 8
+#define SYNC_LEN 6
+#define SYNC_SERVER_TX_START 14
+#define SYNC_CLIENT_RX_START 22
+#define SYNC_CLIENT_TX_START 30
+#define SYNC_TIME_LEN 8
+#define SYNC_PKT_LEN 38
+#define ACK_CLIENT_RX_START 20
+#define ACK_CLIENT_TX_START 28
+#define ACK_SERVER_TX_START 36
+#define ACK_SYNC_LEN 44
+#define DATA_SEND_TIME_START 14
+#define DATA_SEND_TIME_LEN 8
+
+#define PROBE_START 8
+#define PROBE_LEN 6
+#define PROBE_RESIDENCE_START 14
+#define PROBE_RESIDENCE_LEN 8
+#define PROBE_CLIENT_START 22
+#define PROBE_CLIENT_LEN 8
+#define PROBE_MIN_SIZE 22
+
 /*
  * TCP packet format:
  * The First TCP packet: (always from the client)
@@ -107,6 +351,48 @@
  *  |            TCP_FILE_NAME_START = 6
  *  |
  *  TCP_TYPE_START = 0
+ *
+ * For Test 3 and Test 4 the data length field is not used and the client
+ * can optionally request limits (0 means use the server default). They are
+ * only read if the version byte is TCP_FIRST_PKT_VERSION, older clients do
+ * not define these bytes:
+ *  |_____6B_____|___ max 56B ___|_______8B_______|___4B___|__1B__|
+ *  | test type  |   file name   |   max bytes    |max time| VER  |
+ *  |            |               |                TCP_MAX_TIME_START = 70
+ *  |            |               TCP_MAX_BYTES_START = 62
+ * Max time is in milliseconds, VER at TCP_FIRST_PKT_VERSION_START = 74. The
+ * types below (SndCmp, Test_B) came with the version byte, so their fields
+ * are always read.
+ *
+ * Results can be sent encoded (type "SndCmp"). The data length is then the
+ * length of the encoded data that follows, and the first packet has the
+ * encoding and the length of the decoded data (0 if unknown):
+ *  |_____6B_____|___ max 56B ___|_______8B_______|__1B__|_______8B_______|
+ *  | test type  |   file name   |  data length   | ENC  |  DECODED LEN   |
+ *  |            |               |                TCP_ENCODING_START = 70
+ *  |            |               TCP_DATA_LEN_START = 62
+ * DECODED LEN is at TCP_DECODED_LEN_START = 71 and the encoded data starts
+ * at TCP_ENCODED_DATA_START = 79.
+ *
+ * ENC is one of UPLOAD_ENCODING_*. Deflate is a zlib or gzip stream. The
+ * server stores the decoded log. zstd needs a server built with HAVE_ZSTD
+ * (ZSTD_FLAGS in server/build); otherwise the server closes the connection
+ * after the first packet. The encoded stream has to end exactly at the data
+ * length.
+ *
+ * Test 11 (connection rate, type "Test_B") is a series of short connections
+ * made one after another. Each connection sends only this first packet:
+ *  |_____6B_____|___ max 56B ___|___4B___|___4B___|
+ *  | test type  |   file name   | CONN   | CONNS  |
+ *  |            |               |        TCP_CONN_COUNT_START = 66
+ *  |            |               TCP_CONN_INDEX_START = 62
+ * CONN counts from 0 and CONNS is the number of connections of the test;
+ * the file name is the same for all of them. The server replies with
+ * TCP_CONN_REPLY_LEN bytes and the client closes the connection:
+ *  |___4B___|_______8B_______|_______8B_______|_______8B_______|___8B___|
+ *  | CONN   | accept to reply|  P50           |  P90           |  P99   |
+ * Times are in nanoseconds. The percentiles of the accept to reply times of
+ * the test are only in the reply to the last connection (0 otherwise).
  */
 
 #define TCP_TYPE_START 0
@@ -116,10 +402,48 @@
 #define TCP_DATA_LEN_START 62
 #define TCP_DATA_LEN_LEN 8
 #define TCP_DATA_START 70
+#define TCP_MAX_BYTES_START 62
+#define TCP_MAX_BYTES_LEN 8
+#define TCP_MAX_TIME_START 70
+#define TCP_MAX_TIME_LEN 4
+#define TCP_FIRST_PKT_VERSION_START 74
+#define TCP_FIRST_PKT_VERSION_LEN 1
+#define TCP_FIRST_PKT_VERSION 1
+#define TCP_ENCODING_START 70
+#define TCP_ENCODING_LEN 1
+#define TCP_DECODED_LEN_START 71
+#define TCP_DECODED_LEN_LEN 8
+#define TCP_ENCODED_DATA_START 79
+#define TCP_CONN_INDEX_START 62
+#define TCP_CONN_INDEX_LEN 4
+#define TCP_CONN_COUNT_START 66
+#define TCP_CONN_COUNT_LEN 4
+#define TCP_CONN_FIRST_PKT_LEN 70
+#define TCP_CONN_REPLY_INDEX_START 0
+#define TCP_CONN_REPLY_LATENCY_START 4
+#define TCP_CONN_REPLY_P50_START 12
+#define TCP_CONN_REPLY_P90_START 20
+#define TCP_CONN_REPLY_P99_START 28
+#define TCP_CONN_REPLY_TIME_LEN 8
+#define TCP_CONN_REPLY_LEN 36
+// Bound for the connections of one Test 11.
+#define TCP_CONN_MAX_COUNT 100000
+
+#define UPLOAD_ENCODING_IDENTITY 0
+#define UPLOAD_ENCODING_DEFLATE 1
+#define UPLOAD_ENCODING_ZSTD 2
+// Bound for the decoded size of an encoded upload.
+#define UPLOAD_MAX_DECODED_LEN 268435456ULL
 
+// A test runs until it has transferred max bytes and max time has expired.
+// These are used if a client does not request its own limits.
 #define MAXBYTES  2097152
-//TODO:change this to the 12s
 #define MAXTIME 4
+// Upper bounds for what a client can request; they can be changed at runtime
+// (see TestLimits.h). A running test is stopped when it reaches them.
+#define SERVER_MAXBYTES 4294967296ULL
+// In milliseconds, like -t and the limits file.
+#define SERVER_MAXTIME_MS 12000
 
 #define RETRANSMISSION_TIMEOUT 200
 #define MAX_RETRANSMISSIONS 10
@@ -127,5 +451,11 @@
 #define NOPKTTIMEOUT 2000
 #define PAYLOADSIZE 1450
 #define PAYLOADSIZEF ((double) PAYLOADSIZE)
+// Bounds of the UDP data packet size a client can request. The smallest
+// packet must hold the largest header (the Test 8 finish packet); the
+// largest fills a 9000 byte jumbo frame (minus IPv4 and UDP headers).
+#define PAYLOADSIZE_MIN 40
+#define PAYLOADSIZE_MAX 8972
+#define UDP_IP_HEADER_SIZE 28
 
 #endif